@@ -1,189 +0,0 @@
-/****************************************************************************
-** Meta object code from reading C++ file 'tcpchat.h'
-**
-** Created by: The Qt Meta Object Compiler version 67 (Qt 5.15.3)
-**
-** WARNING! All changes made in this file will be lost!
-*****************************************************************************/
-
-#include <memory>
-#include "tcpchat.h"
-#include <QtCore/qbytearray.h>
-#include <QtCore/qmetatype.h>
-#if !defined(Q_MOC_OUTPUT_REVISION)
-#error "The header file 'tcpchat.h' doesn't include <QObject>."
-#elif Q_MOC_OUTPUT_REVISION != 67
-#error "This file was generated using the moc from 5.15.3. It"
-#error "cannot be used with the include files from this version of Qt."
-#error "(The moc has changed too much.)"
-#endif
-
-QT_BEGIN_MOC_NAMESPACE
-QT_WARNING_PUSH
-QT_WARNING_DISABLE_DEPRECATED
-struct qt_meta_stringdata_TcpChat_t {
-    QByteArrayData data[14];
-    char stringdata0[251];
-};
-#define QT_MOC_LITERAL(idx, ofs, len) \
-    Q_STATIC_BYTE_ARRAY_DATA_HEADER_INITIALIZER_WITH_OFFSET(len, \
-    qptrdiff(offsetof(qt_meta_stringdata_TcpChat_t, stringdata0) + ofs \
-        - idx * sizeof(QByteArrayData)) \
-    )
-static const qt_meta_stringdata_TcpChat_t qt_meta_stringdata_TcpChat = {
-    {
-QT_MOC_LITERAL(0, 0, 7), // "TcpChat"
-QT_MOC_LITERAL(1, 8, 4), // "Bell"
-QT_MOC_LITERAL(2, 13, 0), // ""
-QT_MOC_LITERAL(3, 14, 28), // "on_pushButtonConnect_clicked"
-QT_MOC_LITERAL(4, 43, 25), // "on_pushButtonSend_clicked"
-QT_MOC_LITERAL(5, 69, 25), // "on_pushButtonBell_clicked"
-QT_MOC_LITERAL(6, 95, 12), // "on_connected"
-QT_MOC_LITERAL(7, 108, 12), // "on_readyRead"
-QT_MOC_LITERAL(8, 121, 15), // "on_disconnected"
-QT_MOC_LITERAL(9, 137, 17), // "on_timer1_timeout"
-QT_MOC_LITERAL(10, 155, 7), // "on_Bell"
-QT_MOC_LITERAL(11, 163, 25), // "on_pushButtonExit_clicked"
-QT_MOC_LITERAL(12, 189, 30), // "on_pushButtonClearSend_clicked"
-QT_MOC_LITERAL(13, 220, 30) // "on_pushButtonClearRecv_clicked"
-
-    },
-    "TcpChat\0Bell\0\0on_pushButtonConnect_clicked\0"
-    "on_pushButtonSend_clicked\0"
-    "on_pushButtonBell_clicked\0on_connected\0"
-    "on_readyRead\0on_disconnected\0"
-    "on_timer1_timeout\0on_Bell\0"
-    "on_pushButtonExit_clicked\0"
-    "on_pushButtonClearSend_clicked\0"
-    "on_pushButtonClearRecv_clicked"
-};
-#undef QT_MOC_LITERAL
-
-static const uint qt_meta_data_TcpChat[] = {
-
- // content:
-       8,       // revision
-       0,       // classname
-       0,    0, // classinfo
-      12,   14, // methods
-       0,    0, // properties
-       0,    0, // enums/sets
-       0,    0, // constructors
-       0,       // flags
-       1,       // signalCount
-
- // signals: name, argc, parameters, tag, flags
-       1,    0,   74,    2, 0x06 /* Public */,
-
- // slots: name, argc, parameters, tag, flags
-       3,    0,   75,    2, 0x08 /* Private */,
-       4,    0,   76,    2, 0x08 /* Private */,
-       5,    0,   77,    2, 0x08 /* Private */,
-       6,    0,   78,    2, 0x08 /* Private */,
-       7,    0,   79,    2, 0x08 /* Private */,
-       8,    0,   80,    2, 0x08 /* Private */,
-       9,    0,   81,    2, 0x08 /* Private */,
-      10,    0,   82,    2, 0x08 /* Private */,
-      11,    0,   83,    2, 0x08 /* Private */,
-      12,    0,   84,    2, 0x08 /* Private */,
-      13,    0,   85,    2, 0x08 /* Private */,
-
- // signals: parameters
-    QMetaType::Void,
-
- // slots: parameters
-    QMetaType::Void,
-    QMetaType::Void,
-    QMetaType::Void,
-    QMetaType::Void,
-    QMetaType::Void,
-    QMetaType::Void,
-    QMetaType::Void,
-    QMetaType::Void,
-    QMetaType::Void,
-    QMetaType::Void,
-    QMetaType::Void,
-
-       0        // eod
-};
-
-void TcpChat::qt_static_metacall(QObject *_o, QMetaObject::Call _c, int _id, void **_a)
-{
-    if (_c == QMetaObject::InvokeMetaMethod) {
-        auto *_t = static_cast<TcpChat *>(_o);
-        (void)_t;
-        switch (_id) {
-        case 0: _t->Bell(); break;
-        case 1: _t->on_pushButtonConnect_clicked(); break;
-        case 2: _t->on_pushButtonSend_clicked(); break;
-        case 3: _t->on_pushButtonBell_clicked(); break;
-        case 4: _t->on_connected(); break;
-        case 5: _t->on_readyRead(); break;
-        case 6: _t->on_disconnected(); break;
-        case 7: _t->on_timer1_timeout(); break;
-        case 8: _t->on_Bell(); break;
-        case 9: _t->on_pushButtonExit_clicked(); break;
-        case 10: _t->on_pushButtonClearSend_clicked(); break;
-        case 11: _t->on_pushButtonClearRecv_clicked(); break;
-        default: ;
-        }
-    } else if (_c == QMetaObject::IndexOfMethod) {
-        int *result = reinterpret_cast<int *>(_a[0]);
-        {
-            using _t = void (TcpChat::*)();
-            if (*reinterpret_cast<_t *>(_a[1]) == static_cast<_t>(&TcpChat::Bell)) {
-                *result = 0;
-                return;
-            }
-        }
-    }
-    (void)_a;
-}
-
-QT_INIT_METAOBJECT const QMetaObject TcpChat::staticMetaObject = { {
-    QMetaObject::SuperData::link<QMainWindow::staticMetaObject>(),
-    qt_meta_stringdata_TcpChat.data,
-    qt_meta_data_TcpChat,
-    qt_static_metacall,
-    nullptr,
-    nullptr
-} };
-
-
-const QMetaObject *TcpChat::metaObject() const
-{
-    return QObject::d_ptr->metaObject ? QObject::d_ptr->dynamicMetaObject() : &staticMetaObject;
-}
-
-void *TcpChat::qt_metacast(const char *_clname)
-{
-    if (!_clname) return nullptr;
-    if (!strcmp(_clname, qt_meta_stringdata_TcpChat.stringdata0))
-        return static_cast<void*>(this);
-    return QMainWindow::qt_metacast(_clname);
-}
-
-int TcpChat::qt_metacall(QMetaObject::Call _c, int _id, void **_a)
-{
-    _id = QMainWindow::qt_metacall(_c, _id, _a);
-    if (_id < 0)
-        return _id;
-    if (_c == QMetaObject::InvokeMetaMethod) {
-        if (_id < 12)
-            qt_static_metacall(this, _c, _id, _a);
-        _id -= 12;
-    } else if (_c == QMetaObject::RegisterMethodArgumentMetaType) {
-        if (_id < 12)
-            *reinterpret_cast<int*>(_a[0]) = -1;
-        _id -= 12;
-    }
-    return _id;
-}
-
-// SIGNAL 0
-void TcpChat::Bell()
-{
-    QMetaObject::activate(this, &staticMetaObject, 0, nullptr);
-}
-QT_WARNING_POP
-QT_END_MOC_NAMESPACE
@@ -4,6 +4,43 @@
 #include <QHostAddress>
 #include <QString>
 #include <QDebug>
+#include <QFileDialog>
+#include <QFileInfo>
+#include <QMessageBox>
+
+// 文件分块大小与发送缓冲区上限：缓冲区中待发送的数据超过上限时暂停读取文件，
+// 等 bytesWritten 信号再继续，避免把整个文件读进内存
+static const qint64 FILE_CHUNK_SIZE = 256 * 1024;
+static const qint64 FILE_SEND_WINDOW = 1024 * 1024;
+
+// 每个目标最多同时在途（已发出、未确认）的消息数
+static const int SEQ_WINDOW = 64;
+
+// 分帧协议（见服务器“分帧协议”一节）：连接后先发魔数，服务器回同一个字节确认，此后双向都是
+// 24 字节帧头（正文长度 4 + 类型 1 + 标志 1 + 保留 2 + 目标 8 + 序号 8，大端）+ 正文，消息内容可以包含换行
+static const char FRAME_MAGIC = char(0xFB);
+static const int FRAME_HEADER = 24;
+enum FrameType : quint8 {
+    FRAME_MSG = 1,       // 聊天消息：发出时目标为对方地址、序号非 0 为有序投递；收到时目标为发送方地址
+    FRAME_TEXT = 2,      // 一行文本：发出的命令，收到的回复与控制消息
+    FRAME_FILEDATA = 3,  // 文件数据块：目标为传输 ID
+};
+
+static quint64 readBigEndian(const char *data, int bytes)
+{
+    quint64 value = 0;
+    for (int i = 0; i < bytes; i++)
+        value = value << 8 | quint8(data[i]);
+    return value;
+}
+
+// "IP:PORT" 转成服务器使用的 48 位地址（IPv4 << 16 | 端口）
+static quint64 addr48(const QByteArray &target)
+{
+    int colon = target.lastIndexOf(':');
+    quint32 ip = QHostAddress(QString::fromUtf8(target.left(colon))).toIPv4Address();
+    return quint64(ip) << 16 | target.mid(colon + 1).toUShort();
+}
 
 TcpChat::TcpChat(QWidget *parent) :
     QMainWindow(parent),
@@ -18,12 +55,17 @@ TcpChat::TcpChat(QWidget *parent) :
     timer1->start(50);
     m_X = 0; m_Y = 0;
     m_bBell = false;
+    m_chunkId = 0;
+    m_chunkLeft = 0;
+    m_loginPending = false;
+    m_framed = false;
 
     // 创建与中央服务器保持连接的 QTcpSocket 对象
     m_socket = new QTcpSocket(this);
     connect(m_socket, SIGNAL(connected()), this, SLOT(on_connected()));
     connect(m_socket, SIGNAL(readyRead()), this, SLOT(on_readyRead()));
     connect(m_socket, SIGNAL(disconnected()), this, SLOT(on_disconnected()));
+    connect(m_socket, SIGNAL(bytesWritten(qint64)), this, SLOT(on_bytesWritten()));
 
     // 将本机所有 IP 显示到 listWidget 中供参考（或选择）
     QString str;
@@ -80,12 +122,115 @@ void TcpChat::on_connected()
 {
     ui->statusBar->showMessage("已连接到服务器");
     qDebug() << "Connected to server.";
+
+    // 使用分帧协议，之后的命令和消息紧跟魔数按帧发出，不必等服务器确认
+    m_socket->write(&FRAME_MAGIC, 1);
+
+    // 首次连接开始新的有序投递会话，重连时继续原会话并重发所有未确认的消息
+    QByteArray command = "RESUME ";
+    if (m_userName.isEmpty()) {
+        m_userName = QString("qt-%1-%2").arg(m_socket->localAddress().toString()).arg(m_socket->localPort());
+        m_userName.replace(':', '-');
+        command = "LOGIN ";
+    }
+    sendFrame(FRAME_TEXT, command + m_userName.toUtf8());
+    m_loginPending = true;
+    for (auto it = m_conversations.begin(); it != m_conversations.end(); ++it) {
+        it->sent = 0;
+        sendPending(it.key());
+    }
+}
+
+// 发出一帧
+void TcpChat::sendFrame(quint8 type, const QByteArray &body, quint64 target, quint64 seq)
+{
+    char header[FRAME_HEADER] = {};
+    for (int i = 0; i < 4; i++)
+        header[i] = char(quint32(body.size()) >> (24 - 8 * i));
+    header[4] = char(type);
+    for (int i = 0; i < 8; i++) {
+        header[8 + i] = char(target >> (56 - 8 * i));
+        header[16 + i] = char(seq >> (56 - 8 * i));
+    }
+    m_socket->write(header, FRAME_HEADER);
+    m_socket->write(body);
 }
 
-// 接收服务器转发的消息
+// 接收服务器发来的数据
+// 服务器确认分帧协议之前收到的是文本协议的普通消息（例如别人抢在协商完成前发来的），之后按帧头给出的长度拆分，
+// 文件数据块的正文不等整块到齐，收到多少直接写入文件多少
 void TcpChat::on_readyRead()
 {
-    QByteArray data = m_socket->readAll();
+    m_recvBuf += m_socket->readAll();
+
+    if (!m_framed) {
+        int magic = m_recvBuf.indexOf(FRAME_MAGIC);
+        if (magic < 0) {
+            showMessage(m_recvBuf);
+            m_recvBuf.clear();
+            return;
+        }
+        if (magic > 0)
+            showMessage(m_recvBuf.left(magic));
+        m_recvBuf.remove(0, magic + 1);
+        m_framed = true;
+    }
+
+    while (!m_recvBuf.isEmpty()) {
+        // 正在接收文件分块：数据直接写入文件
+        if (m_chunkLeft > 0) {
+            qint64 n = qMin<qint64>(m_chunkLeft, m_recvBuf.size());
+            auto it = m_downloads.find(m_chunkId);
+            if (it != m_downloads.end()) {
+                it->file->write(m_recvBuf.constData(), n);
+                it->done += n;
+                showProgress(*it);
+            }
+            m_recvBuf.remove(0, n);
+            m_chunkLeft -= n;
+            continue;
+        }
+
+        if (m_recvBuf.size() < FRAME_HEADER)
+            break;
+        const char *header = m_recvBuf.constData();
+        qint64 length = readBigEndian(header, 4);
+        quint8 type = quint8(header[4]);
+        if (type == FRAME_FILEDATA) {
+            m_chunkId = readBigEndian(header + 8, 8);
+            m_chunkLeft = length;
+            m_recvBuf.remove(0, FRAME_HEADER);
+            continue;
+        }
+        if (m_recvBuf.size() < FRAME_HEADER + length)
+            break;  // 正文还没收全
+        QByteArray body = m_recvBuf.mid(FRAME_HEADER, int(length));
+        m_recvBuf.remove(0, FRAME_HEADER + int(length));
+        handleFrame(type, body);
+    }
+}
+
+// 聊天消息直接显示；文本帧是服务器的回复与控制消息：文件传输以 "FILE" 开头，有序投递以 "SEQ-" 开头，搜索结果以 "SEARCH-" 开头
+void TcpChat::handleFrame(quint8 type, const QByteArray &body)
+{
+    if (type != FRAME_TEXT) {
+        showMessage(body);
+    } else if (m_loginPending && body.startsWith("OK ")) {
+        m_loginPending = false;  // 登录回复 "OK ID" 不显示
+    } else if (body.startsWith("SEQ-")) {
+        handleSeqLine(body);
+    } else if (body.startsWith("FILE")) {
+        handleFileLine(body);
+    } else if (body.startsWith("SEARCH-")) {
+        handleSearchLine(body);
+    } else {
+        showMessage(body);
+    }
+}
+
+// 显示一条普通消息
+void TcpChat::showMessage(const QByteArray &data)
+{
     QString str(data);
 
     // 如果收到特殊字符串 "bell"，则触发窗口振铃效果
@@ -97,11 +242,239 @@ void TcpChat::on_readyRead()
     }
 }
 
+// 处理有序投递的控制消息：
+//   SEQ-ACK 目标 N          N 及之前的消息都已送达
+//   SEQ-NACK 目标 N         从 N 开始重发
+//   SEQ-ERROR 目标 N 原因   第 N 条无法投递
+void TcpChat::handleSeqLine(const QByteArray &line)
+{
+    QList<QByteArray> parts = line.split(' ');
+    if (parts.size() < 3)
+        return;
+    auto it = m_conversations.find(parts.at(1));
+    if (it == m_conversations.end())
+        return;
+    const QByteArray &cmd = parts.at(0);
+    quint64 seq = parts.at(2).toULongLong();
+
+    if (cmd == "SEQ-ACK") {
+        while (!it->pending.isEmpty() && it->pending.first().first <= seq) {
+            it->pending.removeFirst();
+            it->sent = qMax(0, it->sent - 1);
+        }
+        ui->statusBar->showMessage("消息已送达");
+    } else if (cmd == "SEQ-NACK") {
+        it->sent = 0;
+        while (it->sent < it->pending.size() && it->pending.at(it->sent).first < seq)
+            it->sent++;
+    } else if (cmd == "SEQ-ERROR") {
+        for (int i = 0; i < it->pending.size(); i++) {
+            if (it->pending.at(i).first != seq)
+                continue;
+            it->pending.removeAt(i);
+            if (i < it->sent)
+                it->sent--;
+            break;
+        }
+        int pos = line.indexOf(' ', cmd.size() + parts.at(1).size() + 2);
+        ui->textEdit_recv->append("发送失败: " + QString::fromUtf8(pos > 0 ? line.mid(pos + 1) : line));
+    }
+    sendPending(it.key());
+}
+
+// 显示搜索结果：
+//   SEARCH-HIT 对方 时间 发送方 片段      一条命中，同一会话的命中相邻，由新到旧
+//   SEARCH-END 命中数[+] 会话数 用时us   结束，"+" 表示还有更多
+//   SEARCH-ERROR 原因
+void TcpChat::handleSearchLine(const QByteArray &line)
+{
+    QList<QByteArray> parts = line.split(' ');
+    const QByteArray &cmd = parts.at(0);
+    if (cmd == "SEARCH-HIT" && parts.size() >= 5) {
+        QString peer = QString::fromUtf8(parts.at(1));
+        if (peer != m_searchPeer) {
+            m_searchPeer = peer;
+            ui->textEdit_recv->append("[搜索] 与 " + peer + " 的会话:");
+        }
+        int pos = parts.at(0).size() + parts.at(1).size() + parts.at(2).size() + parts.at(3).size() + 4;
+        QString when = QString::fromUtf8(parts.at(2)).replace('T', ' ');
+        ui->textEdit_recv->append("    " + when + " " + QString::fromUtf8(parts.at(3)) + ": " + QString::fromUtf8(line.mid(pos)));
+    } else if (cmd == "SEARCH-END" && parts.size() >= 4) {
+        m_searchPeer.clear();
+        QString matched = QString::fromUtf8(parts.at(1));
+        if (matched.endsWith('+'))
+            matched = "至少 " + matched.chopped(1);
+        ui->textEdit_recv->append(QString("[搜索] 共 %1 条命中, %2 个会话").arg(matched, QString::fromUtf8(parts.at(2))));
+        ui->statusBar->showMessage(QString("搜索用时 %1 ms").arg(parts.at(3).toDouble() / 1000, 0, 'f', 1));
+    } else if (cmd == "SEARCH-ERROR") {
+        m_searchPeer.clear();
+        ui->textEdit_recv->append("[搜索] 失败: " + QString::fromUtf8(line.mid(cmd.size() + 1)));
+    }
+}
+
+// 已连接时，在窗口允许的范围内发出排队的消息
+void TcpChat::sendPending(const QByteArray &target)
+{
+    if (m_socket->state() != QAbstractSocket::ConnectedState)
+        return;
+    Conversation &conv = m_conversations[target];
+    while (conv.sent < conv.pending.size() && conv.sent < SEQ_WINDOW) {
+        const QPair<quint64, QByteArray> &msg = conv.pending.at(conv.sent);
+        sendFrame(FRAME_MSG, msg.second, addr48(target), msg.first);
+        conv.sent++;
+    }
+}
+
+// 处理文件传输控制消息：
+//   FILE ID FROM SIZE NAME   对方请求发送文件
+//   FILE-ID ID               服务器为本端刚发出的请求分配的 ID
+//   FILE-ERROR 原因          本端刚发出的请求无效
+//   FILE-SEND ID             对方已接受，开始发送
+//   FILE-REJECT ID           对方拒绝
+//   FILE-DONE ID / FILE-ABORT ID   传输完成 / 中止
+// 文件数据块本身是 FILEDATA 帧，在 on_readyRead 中直接写入文件
+void TcpChat::handleFileLine(const QByteArray &line)
+{
+    QList<QByteArray> parts = line.split(' ');
+    const QByteArray &cmd = parts.at(0);
+    quint64 id = parts.size() > 1 ? parts.at(1).toULongLong() : 0;
+
+    if (cmd == "FILE" && parts.size() >= 5) {
+        QString from = QString::fromUtf8(parts.at(2));
+        qint64 size = parts.at(3).toLongLong();
+        // 文件名可能含空格，取第四个空格之后的全部内容
+        int pos = 0;
+        for (int i = 0; i < 4; i++)
+            pos = line.indexOf(' ', pos) + 1;
+        QString name = QString::fromUtf8(line.mid(pos));
+        // 对话框会进入嵌套事件循环，放到当前数据处理完之后再弹出
+        QTimer::singleShot(0, this, [=]() { askFileOffer(id, from, size, name); });
+    } else if (cmd == "FILE-ID") {
+        if (m_offers.isEmpty())
+            return;
+        m_uploads.insert(id, m_offers.takeFirst());
+        ui->statusBar->showMessage("等待对方接收文件: " + m_uploads[id].name);
+    } else if (cmd == "FILE-ERROR") {
+        if (!m_offers.isEmpty())
+            delete m_offers.takeFirst().file;
+        ui->textEdit_recv->append(QString::fromUtf8(line.mid(cmd.size() + 1)));
+    } else if (cmd == "FILE-SEND") {
+        auto it = m_uploads.find(id);
+        if (it != m_uploads.end()) {
+            it->sending = true;
+            pumpUploads();
+        }
+    } else if (cmd == "FILE-REJECT") {
+        finishTransfer(m_uploads, id, "对方拒绝接收文件", false);
+    } else if (cmd == "FILE-DONE") {
+        finishTransfer(m_uploads, id, "文件发送完成", false);
+        finishTransfer(m_downloads, id, "文件接收完成", false);
+    } else if (cmd == "FILE-ABORT") {
+        finishTransfer(m_uploads, id, "文件发送中止", false);
+        finishTransfer(m_downloads, id, "文件接收中止", true);
+    } else {
+        showMessage(line);
+    }
+}
+
+// 询问用户是否接收文件，接受时选择保存位置
+void TcpChat::askFileOffer(quint64 id, const QString &from, qint64 size, const QString &name)
+{
+    QString question = QString("%1 请求发送文件 %2 (%3 字节)，是否接收？").arg(from, name).arg(size);
+    QString path;
+    if (QMessageBox::question(this, "接收文件", question) == QMessageBox::Yes)
+        path = QFileDialog::getSaveFileName(this, "保存文件", name);
+
+    FileTransfer transfer;
+    if (!path.isEmpty()) {
+        transfer.file = new QFile(path, this);
+        if (!transfer.file->open(QIODevice::WriteOnly)) {
+            ui->textEdit_recv->append("无法写入文件: " + path);
+            delete transfer.file;
+            transfer.file = nullptr;
+        }
+    }
+    if (!transfer.file) {
+        sendFrame(FRAME_TEXT, "REJECT " + QByteArray::number(id));
+        return;
+    }
+    transfer.name = name;
+    transfer.size = size;
+    m_downloads.insert(id, transfer);
+    sendFrame(FRAME_TEXT, "ACCEPT " + QByteArray::number(id));
+}
+
+// 发送缓冲区低于上限时，轮流为每个已被接受的文件发送一个分块
+void TcpChat::pumpUploads()
+{
+    bool progress = true;
+    while (progress && m_socket->bytesToWrite() < FILE_SEND_WINDOW) {
+        progress = false;
+        for (auto it = m_uploads.begin(); it != m_uploads.end(); ++it) {
+            if (!it->sending || it->done >= it->size)
+                continue;
+            QByteArray data = it->file->read(qMin(FILE_CHUNK_SIZE, it->size - it->done));
+            if (data.isEmpty()) {
+                // 文件在发送过程中被截断：服务器等不到剩余数据，只能断开重连
+                ui->textEdit_recv->append("读取文件失败: " + it->name);
+                it->sending = false;
+                continue;
+            }
+            sendFrame(FRAME_FILEDATA, data, it.key());
+            it->done += data.size();
+            showProgress(*it);
+            progress = true;
+        }
+    }
+}
+
+void TcpChat::on_bytesWritten()
+{
+    pumpUploads();
+}
+
+// 结束一个文件传输：提示结果并关闭文件，中止的下载删除不完整的文件
+void TcpChat::finishTransfer(QMap<quint64, FileTransfer> &transfers, quint64 id, const QString &message, bool removeFile)
+{
+    auto it = transfers.find(id);
+    if (it == transfers.end())
+        return;
+    ui->textEdit_recv->append(message + ": " + it->name);
+    ui->statusBar->showMessage(message + ": " + it->name);
+    if (it->file) {
+        it->file->close();
+        if (removeFile)
+            it->file->remove();
+        delete it->file;
+    }
+    transfers.erase(it);
+}
+
+// 进度条显示最近有进展的那个传输
+void TcpChat::showProgress(const FileTransfer &transfer)
+{
+    ui->progressBarFile->setValue(transfer.size > 0 ? int(transfer.done * 100 / transfer.size) : 100);
+}
+
 // 连接断开后（可选的处理）
 void TcpChat::on_disconnected()
 {
     ui->statusBar->showMessage("服务器连接断开");
     qDebug() << "Disconnected from server.";
+
+    // 连接断开后服务器会丢弃所有未完成的传输
+    for (quint64 id : m_uploads.keys())
+        finishTransfer(m_uploads, id, "文件发送中止", false);
+    for (quint64 id : m_downloads.keys())
+        finishTransfer(m_downloads, id, "文件接收中止", true);
+    for (FileTransfer &transfer : m_offers)
+        delete transfer.file;
+    m_offers.clear();
+    m_recvBuf.clear();
+    m_framed = false;
+    m_chunkLeft = 0;
+    m_loginPending = false;
+    // 未确认的有序消息保留，重连后重发
 }
 
 // 点击“发送”按钮后执行
@@ -112,22 +485,29 @@ void TcpChat::on_pushButtonSend_clicked()
     QString targetPort = ui->lineEdit_targetPort->text();
     QString msgContent = ui->textEdit_msgContent->toPlainText();
 
-    QString sendMsg;
-    if(m_bBell)
-        sendMsg = targetIP + ":" + targetPort + ":" +"bell";
-    else
-        // 构造发送格式： 目标IP:目标端口:消息内容
-        sendMsg = targetIP + ":" + targetPort + ":" + msgContent;
+    // 以 "/search " 开头时不发给目标，改为在自己收发过的消息里搜索其后的关键词，结果显示在接收区
+    if (msgContent.startsWith("/search ")) {
+        if (m_socket->state() == QAbstractSocket::ConnectedState)
+            sendFrame(FRAME_TEXT, "SEARCH " + msgContent.mid(8).simplified().toUtf8());
+        else
+            ui->statusBar->showMessage("未连接服务器，无法搜索");
+        return;
+    }
 
-    m_bBell = false;
+    QByteArray target = (targetIP + ":" + targetPort).toUtf8();
+    if(m_bBell) {
+        // 振铃不走有序投递：直接发普通消息，服务器把它放进对方的优先通道，不排在大段消息后面；断线时丢弃
+        m_bBell = false;
+        if (m_socket->state() == QAbstractSocket::ConnectedState)
+            sendFrame(FRAME_MSG, "bell", addr48(target));
+        return;
+    }
 
-    // 发送时附加字符串结束符（如果服务器端要求）
-    QByteArray outData = sendMsg.toUtf8();
-    // 注意：是否要发送 \0 可以与服务器协商，本例直接发送文本即可
-    m_socket->write(outData);
-    bool b = m_socket->waitForBytesWritten(200);
-    if(!b)
-        qDebug() << "Write timeout or error.";
+    // 用有序投递发送（带序号的 MSG 帧，内容可以有多行）：消息先进入目标的队列，窗口内的立即发出，
+    // 服务器确认送达后出队；不阻塞界面等待写出，断线期间发送的消息在重连后发出
+    Conversation &conv = m_conversations[target];
+    conv.pending.append(qMakePair(conv.nextSeq++, msgContent.toUtf8()));
+    sendPending(target);
 }
 
 // 点击“振铃”按钮时的槽函数
@@ -139,6 +519,29 @@ void TcpChat::on_pushButtonBell_clicked()
     on_pushButtonSend_clicked();
 }
 
+// 点击“发送文件”按钮：选择文件后向目标发出 FILE 请求，对方接受后再开始发送
+void TcpChat::on_pushButtonSendFile_clicked()
+{
+    QString path = QFileDialog::getOpenFileName(this, "选择要发送的文件");
+    if (path.isEmpty())
+        return;
+
+    FileTransfer transfer;
+    transfer.file = new QFile(path, this);
+    if (!transfer.file->open(QIODevice::ReadOnly)) {
+        ui->textEdit_recv->append("无法打开文件: " + path);
+        delete transfer.file;
+        return;
+    }
+    transfer.name = QFileInfo(path).fileName();
+    transfer.size = transfer.file->size();
+    m_offers.append(transfer);
+
+    QString target = ui->lineEdit_targetIP->text() + ":" + ui->lineEdit_targetPort->text();
+    sendFrame(FRAME_TEXT, ("FILE " + target + " " + QString::number(transfer.size) + " " + transfer.name).toUtf8());
+    ui->progressBarFile->setValue(0);
+}
+
 // 振铃信号（Bell）处理槽，与之前保持一致，用于窗口晃动效果
 void TcpChat::on_Bell()
 {
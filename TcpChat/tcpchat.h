@@ -4,6 +4,10 @@
 #include <QMainWindow>
 #include <QTcpSocket>
 #include <QTimer>
+#include <QFile>
+#include <QMap>
+#include <QList>
+#include <QPair>
 
 namespace Ui {
 class TcpChat;
@@ -28,6 +32,8 @@ private slots:
     void on_pushButtonSend_clicked();
     // 振铃按钮的槽函数
     void on_pushButtonBell_clicked();
+    // 发送文件按钮的槽函数
+    void on_pushButtonSendFile_clicked();
 
     // 当与服务器的连接成功时触发
     void on_connected();
@@ -35,6 +41,8 @@ private slots:
     void on_readyRead();
     // 当服务器断开连接时触发
     void on_disconnected();
+    // socket 发送缓冲区有数据写出后触发，用于继续发送文件分块
+    void on_bytesWritten();
 
     // 定时器超时槽，用于实现窗口晃动效果
     void on_timer1_timeout();
@@ -49,6 +57,38 @@ private slots:
     void on_pushButtonClearRecv_clicked();
 
 private:
+    // 一个正在发送或接收的文件
+    struct FileTransfer {
+        QFile *file = nullptr;
+        QString name;
+        qint64 size = 0;
+        qint64 done = 0;          // 已发送/已接收的字节数
+        bool sending = false;     // 发送方：对方已接受，可以开始发送分块
+    };
+
+    // 发出一帧（分帧协议：24 字节大端帧头 + 正文）
+    void sendFrame(quint8 type, const QByteArray &body, quint64 target = 0, quint64 seq = 0);
+    // 处理服务器发来的一个完整的 MSG/TEXT 帧
+    void handleFrame(quint8 type, const QByteArray &body);
+    // 处理服务器发来的一行文件传输控制消息
+    void handleFileLine(const QByteArray &line);
+    // 询问用户是否接收对方发来的文件
+    void askFileOffer(quint64 id, const QString &from, qint64 size, const QString &name);
+    // 在发送缓冲区未满时继续发送已接受的文件
+    void pumpUploads();
+    // 结束一个文件传输并释放其文件对象
+    void finishTransfer(QMap<quint64, FileTransfer> &transfers, quint64 id, const QString &message, bool removeFile);
+    // 更新进度条
+    void showProgress(const FileTransfer &transfer);
+    // 显示收到的普通消息
+    void showMessage(const QByteArray &data);
+    // 处理有序投递的确认/重发/错误消息
+    void handleSeqLine(const QByteArray &line);
+    // 在窗口允许的范围内发出一个目标的排队消息
+    void sendPending(const QByteArray &target);
+    // 显示服务器返回的搜索结果
+    void handleSearchLine(const QByteArray &line);
+
     Ui::TcpChat *ui;
 
     // 与服务器通信的 socket 对象
@@ -63,6 +103,33 @@ private:
     int m_X, m_Y;
     // 标记是否发送“振铃”消息
     bool m_bBell;
+
+    // 尚未拆分的接收数据（普通消息与文件分块共用一条连接）；服务器回了分帧协议的魔数后按帧拆分
+    QByteArray m_recvBuf;
+    bool m_framed;
+    // 当前正在接收的文件分块：所属传输 ID 与剩余字节数
+    quint64 m_chunkId;
+    qint64 m_chunkLeft;
+    // 已发出 FILE 请求、等待服务器分配 ID 的文件（按发出顺序）
+    QList<FileTransfer> m_offers;
+    // 本端发送中的文件与接收中的文件，按传输 ID 索引
+    QMap<quint64, FileTransfer> m_uploads;
+    QMap<quint64, FileTransfer> m_downloads;
+
+    // 有序投递：发往一个目标的消息按序号排队，前 sent 条已发出、等待服务器确认送达，
+    // 断线期间继续排队，重连后从第一条未确认的消息开始重发
+    struct Conversation {
+        quint64 nextSeq = 1;
+        QList<QPair<quint64, QByteArray>> pending;  // 序号与消息内容
+        int sent = 0;
+    };
+    QMap<QByteArray, Conversation> m_conversations;
+    // 有序投递要求登录：首次连接时用本地地址生成用户名，之后重连用 RESUME 继续同一会话
+    QString m_userName;
+    // 已发出 LOGIN/RESUME、还没收到 "OK ID"
+    bool m_loginPending;
+    // 正在显示的搜索结果中上一条命中所属的会话，换会话时先显示会话标题
+    QString m_searchPeer;
 };
 
 #endif // TCPTCHAT_H
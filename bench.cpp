@@ -0,0 +1,2176 @@
+// 压测工具：g++ -O2 bench.cpp -o bench -pthread
+// 用法：./bench <模式> [--host=127.0.0.1] [--port=8888] [其它参数]
+//       --host=unix:路径 经服务器的 --unix-socket 连接（同机），与回环 TCP 对比延迟和吞吐
+//       --query-addr     用 ADDR 命令向服务器查询本端地址（经 proxy 等中间层连接时需要）
+//   bulk      两个客户端之间的大块数据传输吞吐，--bytes=总字节数 --chunk=每次发送字节数 --pair 使用直连(splice)模式，
+//             --framed 使用分帧协议（定长帧头，服务器不扫描换行），--line 把全部内容作为一条超长行发出（直通转发），
+//             --server-pid 指定时报告传输期间服务器 RSS 的峰值
+//   pingpong  A 发消息给 B，B 原样回给 A，统计单程、往返延迟与吞吐。--count=往返次数 --size=消息字节数
+//             --window=同时在途的消息数（1 为纯延迟测试）--host2/--port2 让 B 连接另一台服务器（集群跨节点）
+//   file      A 向 B 发送一个 --bytes 字节的文件（FILE/ACCEPT/FILEDATA），服务器暂存后用 sendfile 送给 B，
+//             --chunk=上传块大小
+//   fair      --flooders 个客户端各自以最快速度向一个接收端灌消息，同时 --light 个轻量客户端每隔 --interval-us
+//             给自己发一条消息，统计轻量客户端的往返延迟分布与灌入方吞吐（--flooders=0 作为对照）
+//   churn     --threads 个线程在 --seconds 秒内反复 连接 -> 给自己发 --msgs 条 --size 字节的消息 -> 关闭，统计每秒连接数；
+//             同时保持 --idle 个收发过一条消息后转为空闲的连接。--server-pid 指定时报告服务器在压测前、空闲连接建立后、
+//             压测刚结束、安静 --quiet-ms 毫秒后的 RSS，用来观察空闲连接缓冲区的回收
+//   seq       A 向 B 连续发送 --count 条 --size 字节的消息，统计 B 的接收吞吐。--acks 使用有序投递(SEQ)，
+//             最多 --window 条未确认的消息同时在途；--reconnect-every=N 让 A 每收到 N 条确认后断线重连(RESUME)
+//             并重发未确认的消息。B 检查收到的序号连续、没有重复
+//   bell      A 持续给 B 灌 --line 字节的长消息，B 限速 --drain-mibps 读取，服务器里给 B 的积压保持在 --backlog 字节左右，
+//             同时 C 每隔 --interval-ms
+//             给 B 发一条 "bell"，统计振铃从发出到 B 收到的延迟（服务器加 --no-priority 作为对照）
+//   capacity  每级新建 --step 个连接（轮流从 --source-ips 个回环源地址发起），直到 --max 个或出错为止，
+//             同时 --active 个连接每隔 --interval-ms 给自己发一条消息作为背景负载。每级报告建立速率、
+//             接入延迟（抽样 --samples 个连接，从 connect 到第一条消息转发回来）、背景消息延迟，
+//             以及 --server-pid 指定时服务器的 RSS、平均每连接内存和打开的 fd 数
+//   multicast 一个客户端把 --count 条 --size 字节的消息发给 --recipients 个接收端：--list 用多目标消息每条只发一行，
+//             否则每条逐个目标发 N 行，对比发送方上行字节、投递速率以及 --server-pid 指定时服务器消耗的 CPU 时间
+//   topics    --subscribers 个连接各订阅 --subs-per 个主题（每个连接一个 bench.G.* 通配订阅，其余为随机的精确主题，
+//             G 共 --groups 组），一个发布端向 --topics 个不同主题随机发布 --count 条 --size 字节的消息，
+//             报告发布速率、投递速率、服务器订阅索引的缓存命中以及 --server-pid 指定时每条发布的服务器 CPU 时间
+//   rate      --pairs 对连接共以 --rate 条/秒的固定速率发送 --size 字节的消息，持续 --seconds 秒，报告实际发送与投递速率、
+//             未送达条数、投递延迟分布（每 --sample 条抽样一条）以及 --server-pid 指定时服务器每条消息的 CPU 时间
+//   replay    重放服务器 --capture-file 录下的流量：--file=录制文件，--speed=1 按原节奏、N 为 N 倍速、0 为尽快发送；
+//             报告投递延迟分布、吞吐和丢失数，--save=路径 保存结果，--baseline=路径 与之前保存的结果逐项对比
+//   proxy     用户态网络损伤代理：--listen-port 上接受客户端，转发到 --host/--port 的服务器，注入 --delay-ms 单向延迟、
+//             --rate-kbps 带宽上限、每 --stall-every-ms 停读 --stall-ms（接收窗口停滞）、--reset-ms 后复位连接，
+//             --rcvbuf 为代理连向服务器的接收缓冲区
+//   impair    损伤场景：--impaired 个接收端经内置代理连接、按 --scenario 受损（none/latency/slow/stall/reset，
+//             代理参数可覆盖场景的默认值），一个发送端以每个 --flood-kbps 向它们灌消息，报告 --healthy 个直连
+//             健康客户端的往返延迟，以及 --server-pid 指定时服务器 RSS 的增长与回落
+//   hold      建立 --conns 个空闲连接并保持 --seconds 秒（期间可对服务器做热升级），结束时检查有多少连接被断开，
+//             并让第一个连接给最后一个连接发一条消息，确认服务器仍能转发
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <system_error>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <iterator>
+#include <csignal>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+// --- 命令行参数 ---
+struct BenchOptions {
+    std::string mode;
+    std::map<std::string, std::string> values;
+
+    std::string get(const std::string& key, const std::string& def) const {
+        auto it = values.find(key);
+        return it == values.end() ? def : it->second;
+    }
+    long long get_int(const std::string& key, long long def) const {
+        auto it = values.find(key);
+        return it == values.end() ? def : std::stoll(it->second);
+    }
+    bool has(const std::string& key) const { return values.count(key) > 0; }
+};
+
+BenchOptions parse_options(int argc, char* argv[]) {
+    BenchOptions opts;
+    if (argc > 1) opts.mode = argv[1];
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) continue;
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            opts.values[arg.substr(2)] = "1";
+        } else {
+            opts.values[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+        }
+    }
+    return opts;
+}
+
+// --- socket 工具函数 ---
+using Clock = std::chrono::steady_clock;
+
+// host 为 "unix:路径" 时经服务器的 --unix-socket 连接，忽略 port
+int connect_to_server(const std::string& host, int port) {
+    if (host.compare(0, 5, "unix:") == 0) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::string path = host.substr(5);
+        if (path.size() >= sizeof(addr.sun_path)) throw std::invalid_argument("Unix socket 路径过长: " + path);
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), "socket(AF_UNIX)");
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            int err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(), "connect " + path);
+        }
+        return fd;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "socket");
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "connect");
+    }
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return fd;
+}
+
+void write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "write");
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// --query-addr：经代理等中间层连接时服务器看到的是中间层的地址，本端地址一律向服务器查询
+bool query_address = false;
+
+// 用 ADDR 命令向服务器查询本端地址（须在连接上还没有其它数据到达时调用）。
+// 收到回复也说明服务器已经登记了这个连接，之后别的连接发给它的消息不会因为还没 accept 而找不到目标
+std::string query_server_address(int fd) {
+    write_all(fd, "ADDR\n", 5);
+    std::string reply;
+    char c;
+    while (read(fd, &c, 1) == 1 && c != '\n') reply += c;
+    if (reply.compare(0, 5, "ADDR ") != 0) throw std::runtime_error("查询地址失败: " + reply);
+    return reply.substr(5);
+}
+
+// 服务器看到的本端地址 "IP:PORT"，用作消息目标。Unix socket 连接没有 IP:PORT，向服务器查询它分配的地址
+std::string local_address(int fd) {
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &len);
+    if (addr.sin_family == AF_UNIX || query_address) return query_server_address(fd);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    return std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
+// "IP:PORT" 按服务器的 Addr48 编码（IPv4 << 16 | 端口），用作分帧消息的目标
+uint64_t addr48(const std::string& addr) {
+    size_t colon = addr.rfind(':');
+    in_addr ip{};
+    inet_pton(AF_INET, addr.substr(0, colon).c_str(), &ip);
+    return (uint64_t)ntohl(ip.s_addr) << 16 | std::stoul(addr.substr(colon + 1));
+}
+
+// 分帧协议（见服务器“分帧协议”一节）：连接后先发魔数，此后每帧为 24 字节大端帧头 + 正文
+static const char FRAME_MAGIC = (char)0xFB;
+static const size_t FRAME_HEADER = 24;
+static const uint8_t FRAME_MSG = 1;
+
+std::string frame_header(uint8_t type, uint32_t length, uint64_t target, uint64_t seq = 0) {
+    std::string header(FRAME_HEADER, '\0');
+    for (int i = 0; i < 4; ++i) header[i] = (char)(length >> (24 - 8 * i));
+    header[4] = (char)type;
+    for (int i = 0; i < 8; ++i) {
+        header[8 + i] = (char)(target >> (56 - 8 * i));
+        header[16 + i] = (char)(seq >> (56 - 8 * i));
+    }
+    return header;
+}
+
+// 读取直到收到包含 token 的数据
+void read_until(int fd, const std::string& token) {
+    std::string seen;
+    char buffer[4096];
+    while (seen.find(token) == std::string::npos) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0) throw std::runtime_error("等待 \"" + token + "\" 时连接关闭");
+        seen.append(buffer, n);
+    }
+}
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// 服务器转发时去掉了消息末尾的换行，压测消息以 '#' 结尾以便接收端重新切分
+class MessageSplitter {
+public:
+    template <typename F>
+    void feed(const char* data, size_t len, F&& on_message) {
+        buf_.append(data, len);
+        size_t start = 0, pos;
+        while ((pos = buf_.find('#', start)) != std::string::npos) {
+            on_message(buf_.substr(start, pos - start));
+            start = pos + 1;
+        }
+        buf_.erase(0, start);
+    }
+private:
+    std::string buf_;
+};
+
+// 打印延迟分布（微秒）
+void report_latency(const std::string& title, std::vector<double>& samples_us) {
+    if (samples_us.empty()) {
+        std::cout << title << ": 无样本" << std::endl;
+        return;
+    }
+    std::sort(samples_us.begin(), samples_us.end());
+    auto pct = [&](double p) { return samples_us[std::min(samples_us.size() - 1, (size_t)(p * samples_us.size()))]; };
+    std::cout << title << ": n=" << samples_us.size() << " p50=" << pct(0.50) << "us p90=" << pct(0.90)
+              << "us p99=" << pct(0.99) << "us max=" << samples_us.back() << "us" << std::endl;
+}
+
+// --- pingpong：往返延迟/吞吐 ---
+int run_pingpong(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    std::string host2 = opts.get("host2", host);
+    int port2 = opts.get_int("port2", port);
+    long long count = opts.get_int("count", 100000);
+    size_t size = opts.get_int("size", 64);
+    long long window = std::max(1LL, opts.get_int("window", 1));
+
+    int a = connect_to_server(host, port);
+    int b = connect_to_server(host2, port2);
+    std::string a_addr = local_address(a);
+    std::string b_addr = local_address(b);
+    // 等待跨节点的上线通告传播到 A 所在节点
+    std::this_thread::sleep_for(std::chrono::milliseconds(opts.get_int("settle-ms", 200)));
+
+    // B：把收到的每条消息回给 A，同时按消息里的发送时间记录单程（A -> 服务器 -> B）延迟
+    auto start = Clock::now();
+    std::vector<double> hop_us;
+    hop_us.reserve(count);
+    std::thread echo([&] {
+        MessageSplitter splitter;
+        std::vector<char> buffer(64 * 1024);
+        std::string out;
+        long long echoed = 0;
+        while (echoed < count) {
+            ssize_t n = read(b, buffer.data(), buffer.size());
+            if (n <= 0) break;
+            double now_us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+            out.clear();
+            splitter.feed(buffer.data(), n, [&](const std::string& msg) {
+                size_t comma = msg.find(',');
+                if (comma != std::string::npos) hop_us.push_back(now_us - std::atof(msg.c_str() + comma + 1) / 1000);
+                out += a_addr + ":" + msg + "#\n";
+                ++echoed;
+            });
+            if (!out.empty()) write_all(b, out.data(), out.size());
+        }
+    });
+
+    // A：消息内容为 "序号,发送时间(纳秒)," + 填充，按序号记录发送时间
+    std::vector<Clock::time_point> sent_at(count);
+    auto make_message = [&](long long seq) {
+        long long sent_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(sent_at[seq] - start).count();
+        std::string msg = b_addr + ":" + std::to_string(seq) + "," + std::to_string(sent_ns) + ",";
+        if (msg.size() < b_addr.size() + 1 + size) msg.append(b_addr.size() + 1 + size - msg.size(), 'x');
+        return msg + "#\n";
+    };
+    std::vector<double> rtt_us;
+    rtt_us.reserve(count);
+    long long next = 0, received = 0;
+    std::string out;
+    for (; next < std::min(window, count); ++next) {
+        sent_at[next] = Clock::now();
+        out += make_message(next);
+    }
+    write_all(a, out.data(), out.size());
+    MessageSplitter splitter;
+    std::vector<char> buffer(64 * 1024);
+    while (received < count) {
+        ssize_t n = read(a, buffer.data(), buffer.size());
+        if (n <= 0) {
+            std::cerr << "A 连接关闭" << std::endl;
+            break;
+        }
+        out.clear();
+        splitter.feed(buffer.data(), n, [&](const std::string& msg) {
+            long long seq = std::atoll(msg.c_str());
+            if (seq < 0 || seq >= count) return;
+            rtt_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent_at[seq]).count());
+            ++received;
+            if (next < count) {
+                sent_at[next] = Clock::now();
+                out += make_message(next++);
+            }
+        });
+        if (!out.empty()) write_all(a, out.data(), out.size());
+    }
+    double elapsed = seconds_since(start);
+    shutdown(b, SHUT_RDWR);
+    echo.join();
+    close(a);
+    close(b);
+
+    report_latency("单程延迟(A->B)", hop_us);
+    report_latency("往返延迟", rtt_us);
+    std::cout << "吞吐: " << received / elapsed << " 往返/秒 (" << 2 * received / elapsed << " 条消息/秒), 窗口 "
+              << window << ", 消息 " << size << " 字节" << std::endl;
+    return received == count ? 0 : 1;
+}
+
+// --- fair：高速发送方旁边轻量客户端的延迟 ---
+int run_fair(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    int flooders = opts.get_int("flooders", 1);
+    int light = std::max(1LL, opts.get_int("light", 8));
+    long long count = opts.get_int("count", 2000);
+    long long interval_us = opts.get_int("interval-us", 1000);
+    size_t flood_size = opts.get_int("flood-size", 64);
+
+    // 灌入方：每个发送端对应一个只管读空的接收端，避免接收端成为瓶颈
+    std::atomic<bool> stop{false};
+    std::atomic<long long> sunk{0};
+    std::vector<std::thread> threads;
+    std::vector<int> flood_fds;
+    for (int i = 0; i < flooders; ++i) {
+        int sender = connect_to_server(host, port);
+        int sink = connect_to_server(host, port);
+        flood_fds.push_back(sender);
+        flood_fds.push_back(sink);
+        std::string msg = local_address(sink) + ":" + std::string(flood_size, 'f') + "#\n";
+        std::string batch;
+        while (batch.size() < 64 * 1024) batch += msg;
+        threads.emplace_back([&, sender, batch] {
+            while (!stop.load(std::memory_order_relaxed)) {
+                ssize_t n = write(sender, batch.data(), batch.size());
+                if (n < 0 && errno != EINTR) break;
+            }
+        });
+        threads.emplace_back([&, sink] {
+            std::vector<char> buffer(256 * 1024);
+            while (true) {
+                ssize_t n = read(sink, buffer.data(), buffer.size());
+                if (n <= 0) break;
+                sunk.fetch_add(n, std::memory_order_relaxed);
+            }
+        });
+    }
+    // 让灌入方先把服务器压满
+    std::this_thread::sleep_for(std::chrono::milliseconds(opts.get_int("warmup-ms", 300)));
+
+    // 轻量客户端：给自己发消息，收到后记录往返时间，间隔固定时间再发下一条
+    std::vector<std::vector<double>> samples(light);
+    auto start = Clock::now();
+    long long sunk_start = sunk.load();
+    std::vector<std::thread> lights;
+    for (int i = 0; i < light; ++i) {
+        lights.emplace_back([&, i] {
+            int fd = connect_to_server(host, port);
+            std::string self = local_address(fd);
+            MessageSplitter splitter;
+            char buffer[4096];
+            for (long long seq = 0; seq < count; ++seq) {
+                std::string msg = self + ":" + std::to_string(seq) + "#\n";
+                auto sent = Clock::now();
+                write_all(fd, msg.data(), msg.size());
+                bool got = false;
+                while (!got) {
+                    ssize_t n = read(fd, buffer, sizeof(buffer));
+                    if (n <= 0) {
+                        close(fd);
+                        return;
+                    }
+                    splitter.feed(buffer, n, [&](const std::string&) { got = true; });
+                }
+                samples[i].push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+                std::this_thread::sleep_for(std::chrono::microseconds(interval_us));
+            }
+            close(fd);
+        });
+    }
+    for (auto& t : lights) t.join();
+    double elapsed = seconds_since(start);
+    long long flooded = sunk.load() - sunk_start;
+    stop = true;
+    for (int fd : flood_fds) shutdown(fd, SHUT_RDWR);
+    for (auto& t : threads) t.join();
+    for (int fd : flood_fds) close(fd);
+
+    std::vector<double> all;
+    for (auto& v : samples) all.insert(all.end(), v.begin(), v.end());
+    report_latency("轻量客户端往返延迟", all);
+    std::cout << "灌入方: " << flooders << " 个, 接收吞吐 " << flooded / elapsed / (1 << 20) << " MiB/s" << std::endl;
+    return all.size() == (size_t)(light * count) ? 0 : 1;
+}
+
+// --- churn：连接反复创建/销毁 ---
+// 进程 pid 的常驻内存(VmRSS)，单位 KiB，读取失败返回 0
+long long process_rss_kb(long long pid) {
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) return std::stoll(line.substr(6));
+    }
+    return 0;
+}
+
+// 给自己发一条消息并等它转发回来
+void echo_self(int fd, const std::string& self, const std::string& body) {
+    std::string msg = self + ":" + body + "#\n";
+    write_all(fd, msg.data(), msg.size());
+    read_until(fd, body + "#");
+}
+
+int run_churn(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    int nthreads = std::max(1LL, opts.get_int("threads", 4));
+    double seconds = opts.get_int("seconds", 5);
+    int msgs = opts.get_int("msgs", 4);
+    size_t size = opts.get_int("size", 1024);
+    long long idle = opts.get_int("idle", 1000);
+    long long pid = opts.get_int("server-pid", 0);
+    long long quiet_ms = opts.get_int("quiet-ms", 3000);
+
+    long long rss_before = pid != 0 ? process_rss_kb(pid) : 0;
+    std::vector<int> idle_fds;
+    for (long long i = 0; i < idle; ++i) {
+        int fd = connect_to_server(host, port);
+        echo_self(fd, local_address(fd), std::string(size, 'i'));
+        idle_fds.push_back(fd);
+    }
+    long long rss_idle = pid != 0 ? process_rss_kb(pid) : 0;
+
+    std::atomic<long long> done{0};
+    std::atomic<bool> failed{false};
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; ++t) {
+        threads.emplace_back([&] {
+            std::string body(size, 'c');
+            try {
+                while (seconds_since(start) < seconds) {
+                    int fd = connect_to_server(host, port);
+                    std::string self = local_address(fd);
+                    for (int m = 0; m < msgs; ++m) echo_self(fd, self, body);
+                    // 半关闭后等服务器关闭连接，确认服务器已清理完这个连接再开始下一个
+                    shutdown(fd, SHUT_WR);
+                    char buffer[256];
+                    while (read(fd, buffer, sizeof(buffer)) > 0) {
+                    }
+                    close(fd);
+                    done.fetch_add(1, std::memory_order_relaxed);
+                }
+            } catch (const std::exception& e) {
+                std::cerr << "churn 线程失败: " << e.what() << std::endl;
+                failed = true;
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    double elapsed = seconds_since(start);
+    std::cout << "连接创建/销毁: " << done.load() << " 次, " << done.load() / elapsed << " 连接/s（每个连接 "
+              << msgs << " 条 " << size << " 字节消息，另有 " << idle << " 个空闲连接）" << std::endl;
+    if (pid != 0) {
+        long long rss_churn = process_rss_kb(pid);
+        std::this_thread::sleep_for(std::chrono::milliseconds(quiet_ms));
+        long long rss_quiet = process_rss_kb(pid);
+        std::cout << "服务器 RSS: 压测前 " << rss_before << " KiB, 空闲连接建立后 " << rss_idle << " KiB, 压测刚结束 "
+                  << rss_churn << " KiB, 安静 " << quiet_ms
+                  << " ms 后 " << rss_quiet << " KiB" << std::endl;
+    }
+    // 空闲连接仍然能收发
+    if (!idle_fds.empty()) echo_self(idle_fds.front(), local_address(idle_fds.front()), "still-here");
+    for (int fd : idle_fds) close(fd);
+    return failed ? 1 : 0;
+}
+
+// --- hold：保持大量空闲连接 ---
+int run_hold(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    long long conns = std::max(2LL, opts.get_int("conns", 10000));
+    long long seconds = opts.get_int("seconds", 10);
+
+    std::vector<int> fds;
+    fds.reserve(conns);
+    for (long long i = 0; i < conns; ++i) {
+        fds.push_back(connect_to_server(host, port));
+    }
+    std::cout << "已建立 " << conns << " 个连接，保持 " << seconds << " 秒" << std::endl;
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+    long long closed = 0;
+    char probe;
+    for (int fd : fds) {
+        if (recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) == 0) ++closed;
+    }
+    std::string msg = local_address(fds.back()) + ":still-here#\n";
+    write_all(fds.front(), msg.data(), msg.size());
+    read_until(fds.back(), "still-here#");
+    std::cout << "被断开的连接: " << closed << " / " << conns << "，转发正常" << std::endl;
+    for (int fd : fds) close(fd);
+    return closed == 0 ? 0 : 1;
+}
+
+// --- capacity：逐级增加连接数，记录每一级的资源占用与延迟 ---
+// 把本进程打开文件数的软上限提到硬上限，返回提升后的软上限
+long long raise_fd_limit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) return 0;
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    return limit.rlim_cur;
+}
+
+// 进程 pid 打开的 fd 数，读取失败返回 0
+long long process_fd_count(long long pid) {
+    DIR* dir = opendir(("/proc/" + std::to_string(pid) + "/fd").c_str());
+    if (dir == nullptr) return 0;
+    long long count = 0;
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') ++count;
+    }
+    closedir(dir);
+    return count;
+}
+
+// 从本机地址 source 连接服务器：每个源地址有自己的一套临时端口，多个回环源地址可以突破单个地址约 2.8 万个端口的限制
+int connect_from(const std::string& source, const std::string& host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "socket");
+    sockaddr_in local{};
+    local.sin_family = AF_INET;
+    inet_pton(AF_INET, source.c_str(), &local.sin_addr);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if (bind(fd, (struct sockaddr*)&local, sizeof(local)) < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "connect from " + source);
+    }
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return fd;
+}
+
+// 排序后取百分位
+double percentile(std::vector<double>& samples, double p) {
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+}
+
+int run_capacity(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    long long max_conns = opts.get_int("max", 100000);
+    long long step = std::max(1LL, opts.get_int("step", 10000));
+    int source_ips = std::max(1LL, opts.get_int("source-ips", 16));
+    int active = opts.get_int("active", 16);
+    long long interval_ms = std::max(1LL, opts.get_int("interval-ms", 10));
+    long long samples = std::max(1LL, opts.get_int("samples", 200));
+    long long pid = opts.get_int("server-pid", 0);
+
+    // 读取服务器的 /proc 信息也要用 fd，留出余量
+    long long fd_limit = raise_fd_limit();
+    if (max_conns > fd_limit - active - 64) {
+        max_conns = std::max(0LL, fd_limit - active - 64);
+        std::cout << "受本进程文件描述符上限 " << fd_limit << " 限制，最多建立 " << max_conns << " 个连接" << std::endl;
+    }
+    // 源地址 127.0.1.1 起，避开 127.0.0.1 上其它压测占用的端口
+    std::vector<std::string> sources;
+    for (int i = 0; i < source_ips; ++i) {
+        sources.push_back("127.0." + std::to_string(1 + i / 254) + "." + std::to_string(1 + i % 254));
+    }
+
+    // 背景负载：active 个连接每隔 interval_ms 各给自己发一条带发送时间的消息，记录从发出到转发回来的延迟
+    std::vector<int> active_fds;
+    for (int i = 0; i < active; ++i) active_fds.push_back(connect_to_server(host, port));
+    std::atomic<bool> stop{false};
+    std::mutex latency_mutex;
+    std::vector<double> message_us;
+    auto start = Clock::now();
+    std::thread load([&] {
+        std::vector<std::string> selves;
+        for (int fd : active_fds) selves.push_back(local_address(fd));
+        std::vector<MessageSplitter> splitters(active_fds.size());
+        std::vector<pollfd> pfds;
+        for (int fd : active_fds) pfds.push_back({fd, POLLIN, 0});
+        std::vector<char> buffer(64 * 1024);
+        auto next_send = Clock::now();
+        while (!stop.load()) {
+            if (Clock::now() >= next_send) {
+                long long sent_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+                for (size_t i = 0; i < active_fds.size(); ++i) {
+                    std::string msg = selves[i] + ":" + std::to_string(sent_ns) + "#\n";
+                    if (send(active_fds[i], msg.data(), msg.size(), MSG_NOSIGNAL) < 0) return;
+                }
+                next_send += std::chrono::milliseconds(interval_ms);
+            }
+            int wait_ms = std::max(0LL, (long long)std::chrono::duration_cast<std::chrono::milliseconds>(next_send - Clock::now()).count());
+            if (poll(pfds.data(), pfds.size(), std::min(wait_ms, 100)) <= 0) continue;
+            for (size_t i = 0; i < pfds.size(); ++i) {
+                if (!(pfds[i].revents & POLLIN)) continue;
+                ssize_t n = read(pfds[i].fd, buffer.data(), buffer.size());
+                if (n <= 0) return;
+                double now_us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+                std::lock_guard<std::mutex> lock(latency_mutex);
+                splitters[i].feed(buffer.data(), n, [&](const std::string& msg) {
+                    message_us.push_back(now_us - std::atof(msg.c_str()) / 1000);
+                });
+            }
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    long long rss_base = pid != 0 ? process_rss_kb(pid) : 0;
+    std::vector<int> fds;
+    fds.reserve(max_conns);
+    std::string failure;
+    std::cout << "连接数 | 建立速率(个/s) | 接入延迟 p50/p99(us) | 消息延迟 p50/p99(us) | 服务器 RSS(KiB) | 每连接内存(B) | 服务器 fd 数"
+              << std::endl;
+    while ((long long)fds.size() < max_conns && failure.empty()) {
+        long long target = std::min(max_conns, (long long)fds.size() + step);
+        long long stride = std::max(1LL, (target - (long long)fds.size()) / samples);
+        std::vector<double> accept_us;
+        size_t before = fds.size();
+        auto step_start = Clock::now();
+        try {
+            while ((long long)fds.size() < target) {
+                auto connect_start = Clock::now();
+                int fd = connect_from(sources[fds.size() % sources.size()], host, port);
+                fds.push_back(fd);
+                // 抽样：连接建立后给自己发一条消息，转发回来说明服务器已接受并登记了这个连接
+                if ((fds.size() - before) % stride == 0) {
+                    echo_self(fd, local_address(fd), "capacity");
+                    accept_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - connect_start).count());
+                }
+            }
+        } catch (const std::exception& e) {
+            failure = e.what();
+        }
+        double rate = (fds.size() - before) / seconds_since(step_start);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        std::vector<double> step_message_us;
+        {
+            std::lock_guard<std::mutex> lock(latency_mutex);
+            step_message_us.swap(message_us);
+        }
+        std::cout << fds.size() << " | " << (long long)rate << " | " << percentile(accept_us, 0.5) << "/"
+                  << percentile(accept_us, 0.99) << " | " << percentile(step_message_us, 0.5) << "/"
+                  << percentile(step_message_us, 0.99);
+        if (pid != 0) {
+            long long rss = process_rss_kb(pid);
+            std::cout << " | " << rss << " | " << (fds.empty() ? 0 : (rss - rss_base) * 1024 / (long long)fds.size())
+                      << " | " << process_fd_count(pid);
+        }
+        std::cout << std::endl;
+    }
+    stop = true;
+    load.join();
+    for (int fd : fds) close(fd);
+    for (int fd : active_fds) close(fd);
+    if (!failure.empty()) {
+        std::cout << "在 " << fds.size() << " 个连接处停止: " << failure << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// --- bulk：大块数据吞吐 ---
+int run_bulk(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    long long total = opts.get_int("bytes", 1LL << 30);
+    size_t chunk = opts.get_int("chunk", 64 * 1024);
+    bool pair = opts.has("pair");
+    bool framed = opts.has("framed") && !pair;
+    bool line = opts.has("line") && !pair && !framed;
+    long long pid = opts.get_int("server-pid", 0);
+
+    int sender = connect_to_server(host, port);
+    int receiver = connect_to_server(host, port);
+    std::string sender_addr = local_address(sender);
+    std::string receiver_addr = local_address(receiver);
+    if (framed) {
+        // 两端都协商分帧协议，等服务器回魔数确认
+        for (int fd : {sender, receiver}) {
+            write_all(fd, &FRAME_MAGIC, 1);
+            read_until(fd, std::string(1, FRAME_MAGIC));
+        }
+    }
+
+    if (pair) {
+        std::string req = "PAIR " + receiver_addr + "\n";
+        write_all(sender, req.data(), req.size());
+        read_until(receiver, "请求直连");
+        req = "PAIR " + sender_addr + "\n";
+        write_all(receiver, req.data(), req.size());
+        read_until(sender, "建立直连\n");
+        read_until(receiver, "建立直连\n");
+    }
+
+    // 普通模式每行带 "IP:PORT:" 头和换行，分帧模式每块带 24 字节帧头，只统计消息内容字节
+    std::string frame;
+    if (framed) {
+        frame = frame_header(FRAME_MSG, chunk, addr48(receiver_addr));
+    } else if (!pair) {
+        frame = receiver_addr + ":";
+    }
+    size_t header = frame.size();
+    frame.append(chunk, 'x');
+    if (!pair && !framed && !line) frame += '\n';
+
+    long long rss_base = pid != 0 ? process_rss_kb(pid) : 0;
+    auto start = Clock::now();
+    std::thread writer([&] {
+        long long sent = 0;
+        if (line) {
+            // 全部内容作为一行发出：行头只发一次，之后是不带换行的数据块，最后一个换行
+            write_all(sender, frame.data(), header);
+            while (sent < total) {
+                size_t payload = std::min<long long>(chunk, total - sent);
+                write_all(sender, frame.data() + header, payload);
+                sent += payload;
+            }
+            write_all(sender, "\n", 1);
+            return;
+        }
+        while (sent < total) {
+            size_t payload = std::min<long long>(chunk, total - sent);
+            if (payload == chunk) {
+                write_all(sender, frame.data(), frame.size());
+            } else {
+                std::string last = frame.substr(0, header + payload);
+                if (framed) last.replace(0, header, frame_header(FRAME_MSG, payload, addr48(receiver_addr)));
+                if (!pair && !framed) last += '\n';
+                write_all(sender, last.data(), last.size());
+            }
+            sent += payload;
+        }
+    });
+
+    // 分帧模式下接收端收到的每块同样带帧头
+    long long chunks = (total + chunk - 1) / chunk;
+    long long expected = framed ? total + chunks * (long long)FRAME_HEADER : total;
+    std::vector<char> buffer(256 * 1024);
+    long long received = 0;
+    long long rss_peak = rss_base;
+    auto sampled = start;
+    while (received < expected) {
+        ssize_t n = read(receiver, buffer.data(), buffer.size());
+        if (n <= 0) {
+            std::cerr << "接收端连接关闭, 已收到 " << received << " 字节" << std::endl;
+            break;
+        }
+        received += n;
+        if (pid != 0 && Clock::now() - sampled >= std::chrono::milliseconds(20)) {
+            sampled = Clock::now();
+            rss_peak = std::max(rss_peak, process_rss_kb(pid));
+        }
+    }
+    double elapsed = seconds_since(start);
+    writer.join();
+
+    if (framed) received -= chunks * FRAME_HEADER;
+    std::cout << (pair ? "直连(splice)" : framed ? "分帧" : line ? "单行" : "按行解析") << " 模式: " << received << " 字节, "
+              << elapsed << " 秒, " << (received / elapsed / (1 << 20)) << " MiB/s" << std::endl;
+    if (pid != 0) {
+        std::cout << "服务器 RSS: 开始 " << rss_base << " KiB, 传输期间峰值 " << rss_peak << " KiB (增长 "
+                  << rss_peak - rss_base << " KiB)" << std::endl;
+    }
+    close(sender);
+    close(receiver);
+    return received == total ? 0 : 1;
+}
+
+// --- seq：有序投递的吞吐与重连重发 ---
+// 登录并等待 "OK"；用户名仍被上一个连接占着（服务器还没处理完断开）时返回 false
+bool login(int fd, const std::string& command) {
+    write_all(fd, command.data(), command.size());
+    std::string reply;
+    char c;
+    while (read(fd, &c, 1) == 1 && c != '\n') reply += c;
+    if (reply.compare(0, 3, "OK ") == 0) return true;
+    if (reply.find("已被占用") != std::string::npos) return false;
+    throw std::runtime_error("登录失败: " + reply);
+}
+
+int run_seq(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    long long count = opts.get_int("count", 1000000);
+    size_t size = opts.get_int("size", 64);
+    bool acks = opts.has("acks");
+    long long window = std::max(1LL, opts.get_int("window", 256));
+    long long reconnect_every = acks ? opts.get_int("reconnect-every", 0) : 0;
+    std::string a_name = "seq-a-" + std::to_string(getpid());
+    std::string b_name = "seq-b-" + std::to_string(getpid());
+
+    int a = connect_to_server(host, port);
+    int b = connect_to_server(host, port);
+    login(a, "LOGIN " + a_name + "\n");
+    login(b, "LOGIN " + b_name + "\n");
+    std::string target = "@" + b_name;
+    auto make_message = [&](long long seq) {
+        std::string msg = (acks ? "SEQ " + std::to_string(seq) + " " : std::string()) + target + ":" + std::to_string(seq) + ",";
+        msg.append(size > msg.size() ? size - msg.size() : 0, 'x');
+        return msg + "#\n";
+    };
+
+    // B：检查序号从 1 开始连续，统计重复和缺失
+    long long received = 0, duplicates = 0, gaps = 0;
+    double elapsed = 0;
+    auto start = Clock::now();
+    std::thread reader([&] {
+        MessageSplitter splitter;
+        std::vector<char> buffer(256 * 1024);
+        long long expected = 1;
+        while (expected <= count) {
+            ssize_t n = read(b, buffer.data(), buffer.size());
+            if (n <= 0) break;
+            splitter.feed(buffer.data(), n, [&](const std::string& msg) {
+                long long seq = std::atoll(msg.c_str());
+                if (seq < expected) {
+                    ++duplicates;
+                    return;
+                }
+                if (seq > expected) ++gaps;
+                expected = seq + 1;
+                ++received;
+            });
+        }
+        elapsed = seconds_since(start);
+    });
+
+    long long retransmitted = 0, reconnects = 0;
+    if (!acks) {
+        std::string out;
+        for (long long seq = 1; seq <= count; ++seq) {
+            out += make_message(seq);
+            if (out.size() >= 64 * 1024 || seq == count) {
+                write_all(a, out.data(), out.size());
+                out.clear();
+            }
+        }
+    } else {
+        // A：非阻塞地边发边读确认，未确认的消息不超过窗口；收到 SEQ-NACK 或重连后从指定序号重发
+        long long next = 1, acked = 0, sent_max = 0;
+        long long reconnect_at = reconnect_every > 0 ? reconnect_every : count + 1;
+        std::string out, in;
+        size_t out_pos = 0;
+        fcntl(a, F_SETFL, O_NONBLOCK);
+        std::vector<char> buffer(64 * 1024);
+        while (acked < count) {
+            if (acked >= reconnect_at) {
+                // 直接关闭：未读的确认会让内核发 RST，服务器来不及读的消息随之丢失，全靠重发补回
+                close(a);
+                a = connect_to_server(host, port);
+                while (!login(a, "RESUME " + a_name + "\n")) {
+                    close(a);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    a = connect_to_server(host, port);
+                }
+                fcntl(a, F_SETFL, O_NONBLOCK);
+                out.clear();
+                out_pos = 0;
+                in.clear();
+                next = acked + 1;
+                reconnect_at += reconnect_every;
+                ++reconnects;
+            }
+            while (out.size() - out_pos < 64 * 1024 && next <= count && next - acked <= window) {
+                if (next <= sent_max) ++retransmitted;
+                sent_max = std::max(sent_max, next);
+                out += make_message(next++);
+            }
+            pollfd pfd{a, POLLIN, 0};
+            if (out_pos < out.size()) pfd.events |= POLLOUT;
+            if (poll(&pfd, 1, 1000) < 0 && errno != EINTR) throw std::system_error(errno, std::generic_category(), "poll");
+            if (pfd.revents & POLLOUT) {
+                ssize_t n = write(a, out.data() + out_pos, out.size() - out_pos);
+                if (n > 0) out_pos += n;
+                if (out_pos == out.size()) {
+                    out.clear();
+                    out_pos = 0;
+                }
+            }
+            if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t n = read(a, buffer.data(), buffer.size());
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) throw std::runtime_error("A 连接关闭");
+                if (n > 0) in.append(buffer.data(), n);
+                size_t line_start = 0, pos;
+                while ((pos = in.find('\n', line_start)) != std::string::npos) {
+                    std::string line = in.substr(line_start, pos - line_start);
+                    line_start = pos + 1;
+                    long long seq = std::atoll(line.c_str() + line.rfind(' ') + 1);
+                    if (line.compare(0, 8, "SEQ-ACK ") == 0) {
+                        acked = std::max(acked, seq);
+                    } else if (line.compare(0, 9, "SEQ-NACK ") == 0) {
+                        next = std::min(next, seq);
+                    } else {
+                        throw std::runtime_error("意外的回复: " + line);
+                    }
+                }
+                in.erase(0, line_start);
+            }
+        }
+    }
+    reader.join();
+    close(a);
+    close(b);
+
+    std::cout << (acks ? "有序投递(SEQ)" : "普通消息") << ": " << received << " 条, " << elapsed << " 秒, "
+              << received / elapsed << " 条/秒, " << received * (size + 1) / elapsed / (1 << 20) << " MiB/s";
+    if (acks) std::cout << ", 窗口 " << window << ", 重连 " << reconnects << " 次, 重发 " << retransmitted << " 条";
+    std::cout << std::endl;
+    std::cout << "重复 " << duplicates << " 条, 缺失 " << gaps << " 处" << std::endl;
+    return received == count && duplicates == 0 && gaps == 0 ? 0 : 1;
+}
+
+// --- bell：大流量下振铃的延迟 ---
+int run_bell(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    size_t line = opts.get_int("line", 4096);
+    long long backlog = opts.get_int("backlog", 32 << 20);
+    long long count = opts.get_int("count", 50);
+    long long interval_ms = opts.get_int("interval-ms", 20);
+    double drain_bytes_per_us = opts.get_int("drain-mibps", 100) * 1048576.0 / 1e6;
+
+    int a = connect_to_server(host, port);
+    int b = connect_to_server(host, port);
+    int c = connect_to_server(host, port);
+    std::string b_addr = local_address(b);
+
+    // A：发送量领先 B 的接收量不超过 backlog，积压留在服务器给 B 的写缓冲区里
+    std::atomic<bool> stop{false};
+    std::atomic<long long> sent{0}, received{0};
+    std::thread flooder([&] {
+        std::string msg = b_addr + ":" + std::string(line, 'x') + "#\n";
+        std::string batch;
+        while (batch.size() < 64 * 1024) batch += msg;
+        long long payload = batch.size() / msg.size() * (line + 1);
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (sent.load() - received.load() > backlog) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            // 结束时主线程 shutdown 这个连接，写失败即退出（不能触发 SIGPIPE）
+            size_t off = 0;
+            while (off < batch.size()) {
+                ssize_t n = send(a, batch.data() + off, batch.size() - off, MSG_NOSIGNAL);
+                if (n <= 0 && errno != EINTR) return;
+                if (n > 0) off += n;
+            }
+            sent += payload;
+        }
+    });
+
+    // B：限速读取，让积压留在服务器上；在数据流中找 "bell"（灌入的内容只有 'x' 和 '#'）
+    std::vector<Clock::time_point> bell_sent(count);
+    std::atomic<long long> bells_sent{0};
+    std::vector<double> latency_us;
+    std::thread reader([&] {
+        std::vector<char> buffer(256 * 1024);
+        std::string tail;
+        long long seen = 0;
+        auto drain_start = Clock::now();
+        while (seen < count) {
+            ssize_t n = read(b, buffer.data(), 64 * 1024);
+            if (n <= 0) break;
+            received += n;
+            auto due = drain_start + std::chrono::microseconds((long long)(received.load() / drain_bytes_per_us));
+            if (due > Clock::now()) std::this_thread::sleep_until(due);
+            std::string chunk = tail + std::string(buffer.data(), n);
+            for (size_t pos = chunk.find("bell"); pos != std::string::npos; pos = chunk.find("bell", pos + 4)) {
+                if (seen < bells_sent.load()) {
+                    latency_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - bell_sent[seen]).count());
+                }
+                ++seen;
+            }
+            tail = chunk.substr(chunk.size() - std::min<size_t>(3, chunk.size()));
+        }
+    });
+
+    // 先让积压建立起来
+    std::this_thread::sleep_for(std::chrono::milliseconds(opts.get_int("warmup-ms", 500)));
+    auto start = Clock::now();
+    long long received_start = received.load();
+    std::string bell = b_addr + ":bell\n";
+    for (long long i = 0; i < count; ++i) {
+        bell_sent[i] = Clock::now();
+        bells_sent = i + 1;
+        write_all(c, bell.data(), bell.size());
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    }
+    reader.join();
+    double elapsed = seconds_since(start);
+    long long bulk = received.load() - received_start;
+    stop = true;
+    shutdown(a, SHUT_RDWR);
+    flooder.join();
+    close(a);
+    close(b);
+    close(c);
+
+    report_latency("振铃延迟", latency_us);
+    std::cout << "同时 B 接收吞吐 " << bulk / elapsed / (1 << 20) << " MiB/s, 积压 " << (sent.load() - received.load()) / (1 << 20)
+              << " MiB (上限 " << (backlog >> 20) << " MiB), 长消息 "
+              << line << " 字节" << std::endl;
+    return latency_us.size() == (size_t)count ? 0 : 1;
+}
+
+// --- multicast：多目标消息与逐个发送的对比 ---
+// 进程 pid 已用的 CPU 时间（用户态 + 内核态，秒），读取失败返回 0
+double process_cpu_seconds(long long pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    std::getline(stat, line);
+    size_t pos = line.rfind(')');
+    if (pos == std::string::npos) return 0;
+    // ')' 之后依次是 state(3) ... utime(14) stime(15)
+    std::istringstream fields(line.substr(pos + 2));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; ++i) {
+        if (i == 14) utime = std::stoull(field);
+        if (i == 15) stime = std::stoull(field);
+    }
+    return double(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+int run_multicast(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    int recipients = std::max(1LL, opts.get_int("recipients", 50));
+    long long count = opts.get_int("count", 20000);
+    size_t size = opts.get_int("size", 256);
+    bool list = opts.has("list");
+    long long pid = opts.get_int("server-pid", 0);
+
+    int sender = connect_to_server(host, port);
+    std::vector<int> receivers;
+    std::string targets;
+    for (int i = 0; i < recipients; ++i) {
+        receivers.push_back(connect_to_server(host, port));
+        if (i > 0) targets += ',';
+        targets += local_address(receivers.back());
+    }
+
+    // 每条消息一次 write：多目标模式是一行 "目标1,目标2,...:内容"，对照模式是 N 行 "目标i:内容"
+    std::string payload(size, 'x');
+    std::string batch;
+    if (list) {
+        batch = targets + ":" + payload + "\n";
+    } else {
+        for (int fd : receivers) batch += local_address(fd) + ":" + payload + "\n";
+    }
+
+    double cpu_before = pid != 0 ? process_cpu_seconds(pid) : 0;
+    auto start = Clock::now();
+    std::thread writer([&] {
+        for (long long i = 0; i < count; ++i) write_all(sender, batch.data(), batch.size());
+    });
+
+    // 服务器转发时去掉了换行，每个接收端应收到 count * size 字节
+    long long expected = count * (long long)size;
+    std::vector<long long> received(recipients, 0);
+    std::vector<pollfd> fds;
+    for (int fd : receivers) fds.push_back({fd, POLLIN, 0});
+    std::vector<char> buffer(256 * 1024);
+    int done = 0;
+    while (done < recipients) {
+        if (poll(fds.data(), fds.size(), 5000) <= 0) {
+            std::cerr << "接收超时, 已完成 " << done << " 个接收端" << std::endl;
+            break;
+        }
+        for (int i = 0; i < recipients; ++i) {
+            if (!(fds[i].revents & POLLIN)) continue;
+            ssize_t n = read(fds[i].fd, buffer.data(), buffer.size());
+            if (n <= 0) throw std::runtime_error("接收端连接关闭");
+            received[i] += n;
+            if (received[i] >= expected) {
+                fds[i].events = 0;
+                ++done;
+            }
+        }
+    }
+    double elapsed = seconds_since(start);
+    writer.join();
+    double cpu = pid != 0 ? process_cpu_seconds(pid) - cpu_before : 0;
+
+    long long deliveries = count * recipients;
+    std::cout << (list ? "多目标消息" : "逐个发送") << ": " << recipients << " 个目标 x " << count << " 条, "
+              << elapsed << " 秒, " << deliveries / elapsed << " 次投递/秒, 发送方上行 "
+              << batch.size() * count / (1 << 20) << " MiB (每条 " << batch.size() << " 字节)";
+    if (pid != 0) std::cout << ", 服务器 CPU " << cpu << " 秒 (" << cpu * 1e9 / deliveries << " ns/投递)";
+    std::cout << std::endl;
+    close(sender);
+    for (int fd : receivers) close(fd);
+    return done == recipients ? 0 : 1;
+}
+
+// --- topics：主题订阅的发布吞吐 ---
+// 读到 n 个换行为止（丢弃内容），超时返回 false
+static bool wait_lines(const std::vector<int>& fds, const std::vector<long long>& want) {
+    std::vector<long long> seen(fds.size(), 0);
+    std::vector<pollfd> polls;
+    for (int fd : fds) polls.push_back({fd, POLLIN, 0});
+    std::vector<char> buffer(64 * 1024);
+    size_t done = 0;
+    for (size_t i = 0; i < fds.size(); ++i) {
+        if (want[i] == 0) {
+            polls[i].events = 0;
+            ++done;
+        }
+    }
+    while (done < fds.size()) {
+        if (poll(polls.data(), polls.size(), 5000) <= 0) return false;
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (!(polls[i].revents & POLLIN)) continue;
+            ssize_t n = read(fds[i], buffer.data(), buffer.size());
+            if (n <= 0) throw std::runtime_error("订阅端连接关闭");
+            seen[i] += std::count(buffer.data(), buffer.data() + n, '\n');
+            if (seen[i] >= want[i]) {
+                polls[i].events = 0;
+                ++done;
+            }
+        }
+    }
+    return true;
+}
+
+int run_topics(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    int subscribers = std::max(1LL, opts.get_int("subscribers", 1000));
+    int per = std::max(1LL, opts.get_int("subs-per", 100));
+    int groups = std::max(1LL, opts.get_int("groups", 100));
+    long long topics = std::max(1LL, opts.get_int("topics", 1000));
+    long long count = opts.get_int("count", 100000);
+    size_t size = opts.get_int("size", 64);
+    long long pid = opts.get_int("server-pid", 0);
+
+    // 主题 r 为 bench.<r % groups>.<r>。第 i 个订阅端订阅 bench.<i % groups>.*，另外 per-1 个精确主题从 [0, 2*topics) 中随机取，
+    // 约一半会被发布到。按同样的规则算出每个主题应投递给多少个订阅端（一个订阅端有多个模式匹配时只收到一次）
+    uint64_t seed = 88172645463325252ULL;
+    auto next_random = [&] {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return seed;
+    };
+    auto topic_of = [&](long long r) { return "bench." + std::to_string(r % groups) + "." + std::to_string(r); };
+    std::vector<std::vector<int>> exact(topics);
+    std::vector<int> fds;
+    std::vector<long long> replies;
+    auto setup_start = Clock::now();
+    for (int i = 0; i < subscribers; ++i) {
+        int fd = connect_to_server(host, port);
+        std::string batch = "SUB bench." + std::to_string(i % groups) + ".*\n";
+        for (int k = 1; k < per; ++k) {
+            long long r = next_random() % (2 * topics);
+            batch += "SUB " + topic_of(r) + "\n";
+            if (r < topics) exact[r].push_back(i);
+        }
+        write_all(fd, batch.data(), batch.size());
+        fds.push_back(fd);
+        replies.push_back(per);
+    }
+    if (!wait_lines(fds, replies)) throw std::runtime_error("等待订阅确认超时");
+    double setup = seconds_since(setup_start);
+    std::vector<long long> fanout(topics);
+    for (long long r = 0; r < topics; ++r) {
+        std::vector<int>& list = exact[r];
+        std::sort(list.begin(), list.end());
+        list.erase(std::unique(list.begin(), list.end()), list.end());
+        long long group = subscribers / groups + (r % groups < subscribers % groups ? 1 : 0);
+        fanout[r] = group + std::count_if(list.begin(), list.end(), [&](int i) { return i % groups != r % groups; });
+    }
+
+    // 发布序列和每个订阅端应收到的条数
+    std::vector<long long> expected(subscribers, 0);
+    std::vector<long long> sequence(count);
+    long long deliveries = 0;
+    for (long long n = 0; n < count; ++n) {
+        long long r = next_random() % topics;
+        sequence[n] = r;
+        deliveries += fanout[r];
+        for (int i = r % groups; i < subscribers; i += groups) ++expected[i];
+        for (int i : exact[r]) {
+            if (i % groups != r % groups) ++expected[i];
+        }
+    }
+
+    int publisher = connect_to_server(host, port);
+    std::string payload(size, 'x');
+    double cpu_before = pid != 0 ? process_cpu_seconds(pid) : 0;
+    auto start = Clock::now();
+    double publish_seconds = 0;
+    std::thread writer([&] {
+        std::string batch;
+        for (long long n = 0; n < count; ++n) {
+            batch += "PUB " + topic_of(sequence[n]) + " " + payload + "\n";
+            if (batch.size() >= 64 * 1024 || n + 1 == count) {
+                write_all(publisher, batch.data(), batch.size());
+                batch.clear();
+            }
+        }
+        publish_seconds = seconds_since(start);
+    });
+    bool complete = wait_lines(fds, expected);
+    double elapsed = seconds_since(start);
+    writer.join();
+    double cpu = pid != 0 ? process_cpu_seconds(pid) - cpu_before : 0;
+
+    write_all(publisher, "TOPICS\n", 7);
+    std::string stats;
+    char c;
+    while (read(publisher, &c, 1) == 1 && c != '\n') stats += c;
+
+    std::cout << "主题订阅: " << (long long)subscribers * per << " 个订阅 (" << subscribers << " 个连接), 订阅耗时 " << setup
+              << " 秒; 发布 " << count << " 条到 " << topics << " 个主题, 平均每条投递 " << (double)deliveries / count
+              << " 个订阅端" << std::endl;
+    std::cout << "发布 " << count / publish_seconds << " 条/秒, 投递 " << deliveries << " 次, " << elapsed << " 秒, "
+              << deliveries / elapsed << " 次投递/秒";
+    if (pid != 0) std::cout << ", 服务器 CPU " << cpu << " 秒 (" << cpu * 1e9 / count << " ns/发布)";
+    std::cout << std::endl << stats << std::endl;
+    if (!complete) std::cerr << "接收超时, 部分订阅端没有收齐" << std::endl;
+    close(publisher);
+    for (int fd : fds) close(fd);
+    return complete ? 0 : 1;
+}
+
+// --- rate：固定速率下的投递率与延迟 ---
+// 每条消息的内容定长 size 字节：16 位十六进制的发送时刻（纳秒）+ 填充 + '#'，接收端按定长切分，不必扫描
+int run_rate(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    long long rate = std::max(1LL, opts.get_int("rate", 1000000));
+    int pairs = std::max(1LL, opts.get_int("pairs", 8));
+    size_t size = std::max(18LL, opts.get_int("size", 64));
+    double seconds = std::max(1LL, opts.get_int("seconds", 5));
+    int sample = std::max(1LL, opts.get_int("sample", 16));
+    long long pid = opts.get_int("server-pid", 0);
+
+    std::vector<int> senders, receivers;
+    std::vector<std::string> prefixes;
+    for (int i = 0; i < pairs; ++i) {
+        senders.push_back(connect_to_server(host, port));
+        receivers.push_back(connect_to_server(host, port));
+        // 流水线模式下连接的上线对路由线程是异步的，接收端先等到服务器的回复再开始发送
+        prefixes.push_back(query_server_address(receivers.back()) + ":");
+    }
+
+    double cpu_before = pid != 0 ? process_cpu_seconds(pid) : 0;
+    auto start = Clock::now();
+    auto stamp_ns = [&] {
+        return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    };
+    std::atomic<bool> stop{false}, writer_done{false};
+    std::atomic<long long> sent{0};
+    std::thread writer([&] {
+        std::string pad(size - 17, '.');
+        std::vector<std::string> batches(pairs);
+        char stamp[17];
+        while (!stop.load()) {
+            // 按经过的时间补齐应发的条数，同一轮的消息共用一个发送时刻；服务器读不动时 write 阻塞，实际速率随之下降
+            long long due = (long long)(seconds_since(start) * rate) - sent.load();
+            if (due <= 0) {
+                usleep(100);
+                continue;
+            }
+            snprintf(stamp, sizeof(stamp), "%016llx", stamp_ns());
+            long long per_pair = (due + pairs - 1) / pairs;
+            for (int i = 0; i < pairs; ++i) {
+                std::string& batch = batches[i];
+                batch.clear();
+                for (long long k = 0; k < per_pair; ++k) {
+                    batch += prefixes[i];
+                    batch.append(stamp, 16);
+                    batch += pad;
+                    batch += "#\n";
+                }
+                write_all(senders[i], batch.data(), batch.size());
+            }
+            sent += per_pair * pairs;
+        }
+        writer_done = true;
+    });
+
+    struct Receiver {
+        size_t phase = 0;  // 当前消息已收到的字节数
+        char stamp[17] = {};
+        long long count = 0;
+    };
+    std::vector<Receiver> state(pairs);
+    std::vector<double> latencies_us;
+    std::vector<pollfd> fds;
+    for (int fd : receivers) fds.push_back({fd, POLLIN, 0});
+    std::vector<char> buffer(256 * 1024);
+    long long received = 0;
+    Clock::time_point last_receive = start;
+    Clock::time_point stop_at = start + std::chrono::milliseconds((long long)(seconds * 1000));
+    Clock::time_point deadline = stop_at + std::chrono::seconds(5);
+    while (Clock::now() < deadline) {
+        if (!stop.load() && Clock::now() >= stop_at) stop = true;
+        // 写线程可能正写着最后一轮，等它退出后 sent 才是最终值
+        if (writer_done.load() && received >= sent.load()) break;
+        if (poll(fds.data(), fds.size(), 100) < 0) throw std::system_error(errno, std::generic_category(), "poll");
+        for (int i = 0; i < pairs; ++i) {
+            if (!(fds[i].revents & POLLIN)) continue;
+            ssize_t n = read(fds[i].fd, buffer.data(), buffer.size());
+            if (n <= 0) throw std::runtime_error("接收端连接关闭");
+            last_receive = Clock::now();
+            Receiver& r = state[i];
+            for (ssize_t pos = 0; pos < n;) {
+                size_t take = std::min((size_t)(n - pos), size - r.phase);
+                if (r.phase < 16) memcpy(r.stamp + r.phase, buffer.data() + pos, std::min(take, 16 - r.phase));
+                r.phase += take;
+                pos += take;
+                if (r.phase < size) continue;
+                r.phase = 0;
+                ++received;
+                if (++r.count % sample == 0) {
+                    latencies_us.push_back((stamp_ns() - strtoull(r.stamp, nullptr, 16)) / 1000.0);
+                }
+            }
+        }
+    }
+    stop = true;
+    writer.join();
+    double elapsed = std::chrono::duration<double>(last_receive - start).count();
+    double cpu = pid != 0 ? process_cpu_seconds(pid) - cpu_before : 0;
+
+    std::cout << "固定速率: 目标 " << rate << " 条/秒, " << pairs << " 对连接, 消息 " << size << " 字节, 实际发送 "
+              << (long long)(sent.load() / seconds) << " 条/秒, 投递 " << (long long)(received / elapsed) << " 条/秒, 未送达 "
+              << sent.load() - received << " 条";
+    if (pid != 0) std::cout << ", 服务器 CPU " << cpu << " 秒 (" << cpu * 1e9 / std::max(1LL, received) << " ns/条)";
+    std::cout << std::endl;
+    report_latency("投递延迟(抽样 1/" + std::to_string(sample) + ")", latencies_us);
+    for (int fd : senders) close(fd);
+    for (int fd : receivers) close(fd);
+    return received == sent.load() ? 0 : 1;
+}
+
+// --- replay：按录制的节奏重放服务器 --capture-file 录下的流量 ---
+// 录制文件格式见服务器的 Capture 类
+struct CaptureRecord {
+    uint8_t type;  // 1 上线, 2 下线, 3 消息
+    uint64_t at_us;  // 距录制开始的微秒数
+    uint64_t conn;   // 上线/下线的连接号，消息的发送方
+    uint64_t target;
+    uint64_t len;
+};
+
+std::vector<CaptureRecord> load_capture(const std::string& path, uint64_t& max_conn) {
+    std::ifstream in(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.compare(0, 5, std::string("TCAP\x01", 5)) != 0) throw std::runtime_error("不是录制文件: " + path);
+    size_t pos = 5;
+    // 写出线程可能正好写到一半被杀，末尾不完整的记录丢弃
+    auto varint = [&](uint64_t& value) {
+        value = 0;
+        for (int shift = 0; pos < data.size() && shift < 64; shift += 7) {
+            uint8_t byte = data[pos++];
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    };
+    std::vector<CaptureRecord> records;
+    uint64_t now = 0, delta;
+    max_conn = 0;
+    while (pos < data.size()) {
+        CaptureRecord rec{};
+        rec.type = data[pos++];
+        if (rec.type < 1 || rec.type > 3) throw std::runtime_error("录制文件损坏，偏移 " + std::to_string(pos - 1));
+        if (!varint(delta) || !varint(rec.conn)) break;
+        if (rec.type == 3 && (!varint(rec.target) || !varint(rec.len))) break;
+        now += delta;
+        rec.at_us = now;
+        max_conn = std::max(max_conn, rec.conn);
+        records.push_back(rec);
+    }
+    return records;
+}
+
+// 重放结果，--save 写成 "名称 值" 的行，--baseline 读回来对比
+using ReplayStats = std::vector<std::pair<std::string, double>>;
+
+ReplayStats load_replay_stats(const std::string& path) {
+    ReplayStats stats;
+    std::ifstream in(path);
+    std::string name;
+    double value;
+    while (in >> name >> value) stats.emplace_back(name, value);
+    if (stats.empty()) throw std::runtime_error("读取对比基准失败: " + path);
+    return stats;
+}
+
+int run_replay(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    std::string file = opts.get("file", "");
+    double speed = std::stod(opts.get("speed", "1"));  // 0 表示不等待，尽快重放
+    long long drain_ms = opts.get_int("drain-ms", 2000);
+    if (file.empty()) throw std::invalid_argument("需要 --file=录制文件");
+    signal(SIGPIPE, SIG_IGN);
+
+    uint64_t max_conn = 0;
+    std::vector<CaptureRecord> records = load_capture(file, max_conn);
+    long long captured_msgs = std::count_if(records.begin(), records.end(), [](const CaptureRecord& r) { return r.type == 3; });
+    double captured_span = records.empty() ? 0 : records.back().at_us / 1e6;
+    std::cout << "录制: " << records.size() << " 条记录, " << max_conn << " 个连接, " << captured_msgs << " 条消息, 时长 "
+              << captured_span << " 秒" << std::endl;
+    raise_fd_limit();
+
+    // 每个录制连接对应一个重放连接：发送线程建立、写入、关闭（shutdown，fd 留到结束时才 close，
+    // 避免接收线程读到被复用的 fd），接收线程经 epoll 读取，按消息里的发送时间记录投递延迟
+    struct ReplayConn {
+        int fd = -1;
+        std::string addr;
+        bool open = false;
+        long long expected = 0;             // 发给它的消息数，只由发送线程访问
+        std::atomic<long long> received{0};
+        MessageSplitter splitter;
+    };
+    std::vector<ReplayConn> conns(max_conn + 1);
+    int epfd = epoll_create1(0);
+    if (epfd < 0) throw std::system_error(errno, std::generic_category(), "epoll_create1");
+    std::atomic<bool> stop{false};
+    std::atomic<long long> received{0};
+    std::atomic<double> last_received{0};  // 最后一条消息送达的时间（秒）
+    auto start = Clock::now();
+    std::vector<double> latency_us;
+    std::thread reader([&] {
+        std::vector<epoll_event> events(256);
+        std::vector<char> buffer(256 * 1024);
+        while (!stop.load()) {
+            int n = epoll_wait(epfd, events.data(), events.size(), 100);
+            for (int i = 0; i < n; ++i) {
+                ReplayConn& conn = conns[events[i].data.u64];
+                ssize_t got = read(conn.fd, buffer.data(), buffer.size());
+                if (got <= 0) {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+                    continue;
+                }
+                double now_us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+                conn.splitter.feed(buffer.data(), got, [&](const std::string& msg) {
+                    latency_us.push_back(now_us - std::atof(msg.c_str()) / 1000);
+                    received.fetch_add(1, std::memory_order_relaxed);
+                    conn.received.fetch_add(1, std::memory_order_relaxed);
+                });
+                last_received.store(now_us / 1e6, std::memory_order_relaxed);
+            }
+        }
+    });
+
+    // 发送线程（本线程）：按录制时间 / speed 排程。消息内容为 "发送时间(纳秒)," + 填充到录制的长度 + "#"；
+    // 发送方或目标在重放中不存在（其它节点的客户端、录制开始前就在线的连接）的消息跳过
+    long long sent = 0, skipped = 0, failed = 0;
+    std::vector<double> behind_us;
+    std::string line;
+    for (const CaptureRecord& rec : records) {
+        if (speed > 0) {
+            auto due = start + std::chrono::microseconds((long long)(rec.at_us / speed));
+            std::this_thread::sleep_until(due);
+            behind_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - due).count());
+        }
+        ReplayConn& conn = conns[rec.conn];
+        if (rec.type == 1) {
+            try {
+                conn.fd = connect_to_server(host, port);
+            } catch (const std::exception& e) {
+                if (failed++ == 0) std::cerr << "连接失败: " << e.what() << std::endl;
+                continue;
+            }
+            conn.addr = local_address(conn.fd);
+            conn.open = true;
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = rec.conn;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+        } else if (rec.type == 2) {
+            // 录制中下线发生在服务器把消息交给它之后，重放时也先等发给它的消息到达（最多 --drain-ms），
+            // 否则尽快重放时在途消息会随连接关闭丢失
+            auto deadline = Clock::now() + std::chrono::milliseconds(drain_ms);
+            while (conn.open && conn.received.load() < conn.expected && Clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            if (conn.open) shutdown(conn.fd, SHUT_RDWR);
+            conn.open = false;
+        } else {
+            ReplayConn& target = conns[rec.target];
+            if (rec.conn == 0 || !conn.open || !target.open) {
+                ++skipped;
+                continue;
+            }
+            long long sent_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+            line = target.addr + ":" + std::to_string(sent_ns) + ",";
+            size_t body = line.size() - target.addr.size() - 1;
+            if (body + 1 < rec.len) line.append(rec.len - body - 1, 'x');
+            line += "#\n";
+            try {
+                write_all(conn.fd, line.data(), line.size());
+                ++sent;
+                ++target.expected;
+            } catch (const std::exception& e) {
+                // 服务器断开了这个连接（如被当作慢连接关闭），之后发给它和由它发出的消息都跳过
+                if (failed++ == 0) std::cerr << "发送失败: " << e.what() << std::endl;
+                conn.open = false;
+            }
+        }
+    }
+    double send_elapsed = seconds_since(start);
+    // 等在途消息送达：全部收到，或 --drain-ms 内没有新消息
+    long long last = -1;
+    while (received.load() < sent && received.load() != last) {
+        last = received.load();
+        std::this_thread::sleep_for(std::chrono::milliseconds(drain_ms));
+    }
+    double elapsed = std::max(send_elapsed, last_received.load());
+    stop = true;
+    reader.join();
+    for (ReplayConn& conn : conns) {
+        if (conn.fd != -1) close(conn.fd);
+    }
+    close(epfd);
+
+    long long got = received.load();
+    std::cout << "重放(" << (speed > 0 ? opts.get("speed", "1") + "x" : std::string("尽快")) << "): 发送 " << sent
+              << " 条, 收到 " << got << " 条, 跳过 " << skipped << " 条, 连接/发送失败 " << failed << " 次, 用时 " << elapsed
+              << " 秒, " << got / elapsed << " 条/秒（录制中 " << (captured_span > 0 ? captured_msgs / captured_span : 0)
+              << " 条/秒）" << std::endl;
+    if (speed > 0) std::cout << "发送排程滞后: p99=" << percentile(behind_us, 0.99) << "us（过大说明压测端跟不上该倍速）" << std::endl;
+    ReplayStats stats = {{"throughput", got / elapsed},
+                         {"p50_us", percentile(latency_us, 0.50)},
+                         {"p90_us", percentile(latency_us, 0.90)},
+                         {"p99_us", percentile(latency_us, 0.99)},
+                         {"max_us", latency_us.empty() ? 0 : latency_us.back()},
+                         {"lost", double(sent - got)}};
+    report_latency("投递延迟", latency_us);
+
+    if (opts.has("baseline")) {
+        ReplayStats base = load_replay_stats(opts.get("baseline", ""));
+        std::cout << "与基准对比:" << std::endl;
+        for (const auto& [name, value] : stats) {
+            for (const auto& [base_name, base_value] : base) {
+                if (base_name != name) continue;
+                std::cout << "  " << name << ": " << base_value << " -> " << value;
+                if (base_value != 0) std::cout << " (" << (value - base_value) / base_value * 100 << "%)";
+                std::cout << std::endl;
+            }
+        }
+    }
+    if (opts.has("save")) {
+        std::ofstream out(opts.get("save", ""));
+        for (const auto& [name, value] : stats) out << name << " " << value << "\n";
+    }
+    return got == sent && failed == 0 ? 0 : 1;
+}
+
+// --- proxy / impair：用户态网络损伤代理 ---
+// 代理在客户端与服务器之间转发字节流，注入：
+//   delay_ms        每个数据块额外的单向延迟（两个方向）
+//   rate_kbps       每个方向的带宽上限（KiB/s），0 表示不限
+//   stall_ms        每 stall_every_ms 毫秒中有 stall_ms 毫秒不从服务器一侧读取：服务器到代理的接收窗口被填满，
+//                   服务器的写操作返回 EAGAIN，数据积压在它的写缓冲区里，模拟收得很慢的客户端
+//   reset_ms        每个连接存活 reset_ms 到 2*reset_ms 毫秒（随机）后向两端发 RST
+//   rcvbuf          代理连向服务器的 socket 的接收缓冲区，越小服务器越早感到反压，0 表示内核默认
+struct ImpairConfig {
+    int delay_ms = 0;
+    long long rate_kbps = 0;
+    int stall_ms = 0;
+    int stall_every_ms = 0;
+    int reset_ms = 0;
+    int rcvbuf = 0;
+};
+
+ImpairConfig impair_config(const BenchOptions& opts, ImpairConfig config) {
+    config.delay_ms = opts.get_int("delay-ms", config.delay_ms);
+    config.rate_kbps = opts.get_int("rate-kbps", config.rate_kbps);
+    config.stall_ms = opts.get_int("stall-ms", config.stall_ms);
+    config.stall_every_ms = opts.get_int("stall-every-ms", config.stall_every_ms);
+    config.reset_ms = opts.get_int("reset-ms", config.reset_ms);
+    config.rcvbuf = opts.get_int("rcvbuf", config.rcvbuf);
+    if (config.stall_ms > 0 && config.stall_every_ms <= config.stall_ms) config.stall_every_ms = config.stall_ms * 2;
+    return config;
+}
+
+// 单线程事件循环：每个方向一个按到期时间排队的数据块队列，到期且令牌足够时写出。队列超过 QUEUE_LIMIT 时不再读取来源，
+// 反压原样传回发送方
+class ImpairProxy {
+public:
+    ImpairProxy(const ImpairConfig& config, const std::string& host, int port, int listen_port)
+        : config_(config), host_(host), port_(port) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) throw std::system_error(errno, std::generic_category(), "socket");
+        int opt = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(listen_port);
+        socklen_t len = sizeof(addr);
+        if (bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 1024) < 0 ||
+            getsockname(listen_fd_, (struct sockaddr*)&addr, &len) < 0) {
+            throw std::system_error(errno, std::generic_category(), "代理监听");
+        }
+        listen_port_ = ntohs(addr.sin_port);
+        fcntl(listen_fd_, F_SETFL, O_NONBLOCK);
+    }
+    ~ImpairProxy() {
+        for (Link& link : links_) close_link(link, false);
+        close(listen_fd_);
+    }
+    ImpairProxy(const ImpairProxy&) = delete;
+    ImpairProxy& operator=(const ImpairProxy&) = delete;
+
+    int port() const { return listen_port_; }
+    long long resets() const { return resets_.load(); }
+    void stop() { stop_ = true; }
+    void run();
+
+private:
+    static const size_t QUEUE_LIMIT = 1 << 20;
+    struct Chunk {
+        Clock::time_point due;
+        std::string data;
+        size_t off = 0;
+    };
+    struct Direction {
+        int from = -1, to = -1;
+        std::deque<Chunk> queue;
+        size_t queued = 0;
+        double tokens = 0;
+        Clock::time_point refilled;
+        bool eof = false, shut = false, blocked = false;
+    };
+    struct Link {
+        int client = -1, server = -1;
+        Direction up, down;  // up: 客户端 -> 服务器，down: 服务器 -> 客户端
+        Clock::time_point created, reset_at;
+        bool dead = false;
+    };
+
+    void accept_links(Clock::time_point now);
+    bool stalled(const Link& link, Clock::time_point now) const;
+    void read_into(Link& link, Direction& dir, Clock::time_point now);
+    void flush(Link& link, Direction& dir, Clock::time_point now, Clock::time_point& wake);
+    void close_link(Link& link, bool reset);
+
+    ImpairConfig config_;
+    std::string host_;
+    int port_;
+    int listen_fd_ = -1;
+    int listen_port_ = 0;
+    std::atomic<bool> stop_{false};
+    std::atomic<long long> resets_{0};
+    std::deque<Link> links_;
+};
+
+void ImpairProxy::accept_links(Clock::time_point now) {
+    while (true) {
+        int client = accept(listen_fd_, nullptr, nullptr);
+        if (client < 0) return;
+        int server = socket(AF_INET, SOCK_STREAM, 0);
+        if (config_.rcvbuf > 0) setsockopt(server, SOL_SOCKET, SO_RCVBUF, &config_.rcvbuf, sizeof(config_.rcvbuf));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port_);
+        inet_pton(AF_INET, host_.c_str(), &addr.sin_addr);
+        if (connect(server, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(server);
+            close(client);
+            continue;
+        }
+        int opt = 1;
+        for (int fd : {client, server}) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+        }
+        Link& link = links_.emplace_back();
+        link.client = client;
+        link.server = server;
+        link.up.from = link.down.to = client;
+        link.up.to = link.down.from = server;
+        link.up.refilled = link.down.refilled = link.created = now;
+        if (config_.reset_ms > 0) {
+            link.reset_at = now + std::chrono::milliseconds(config_.reset_ms + rand() % config_.reset_ms);
+        }
+    }
+}
+
+bool ImpairProxy::stalled(const Link& link, Clock::time_point now) const {
+    if (config_.stall_ms <= 0) return false;
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - link.created).count();
+    return ms % config_.stall_every_ms >= config_.stall_every_ms - config_.stall_ms;
+}
+
+void ImpairProxy::read_into(Link& link, Direction& dir, Clock::time_point now) {
+    char buffer[64 * 1024];
+    while (dir.queued < QUEUE_LIMIT) {
+        ssize_t n = read(dir.from, buffer, sizeof(buffer));
+        if (n == 0) {
+            dir.eof = true;
+            return;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) link.dead = true;
+            return;
+        }
+        dir.queue.push_back(Chunk{now + std::chrono::milliseconds(config_.delay_ms), std::string(buffer, n)});
+        dir.queued += n;
+    }
+}
+
+// 写出已到期、令牌允许的数据；wake 收紧为下一次需要再来看的时间
+void ImpairProxy::flush(Link& link, Direction& dir, Clock::time_point now, Clock::time_point& wake) {
+    double rate = config_.rate_kbps * 1024.0;
+    if (rate > 0) {
+        // 令牌桶最多攒 10 毫秒的量，限速后仍有小突发但不会一次冲出一大块
+        dir.tokens = std::min(rate / 100, dir.tokens + rate * std::chrono::duration<double>(now - dir.refilled).count());
+        dir.refilled = now;
+    }
+    dir.blocked = false;
+    while (!dir.queue.empty()) {
+        Chunk& chunk = dir.queue.front();
+        if (chunk.due > now) {
+            wake = std::min(wake, chunk.due);
+            break;
+        }
+        size_t len = chunk.data.size() - chunk.off;
+        if (rate > 0) {
+            if (dir.tokens < 1) {
+                wake = std::min(wake, now + std::chrono::milliseconds(1));
+                break;
+            }
+            len = std::min<size_t>(len, dir.tokens);
+        }
+        ssize_t n = write(dir.to, chunk.data.data() + chunk.off, len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                dir.blocked = true;
+            } else {
+                link.dead = true;
+            }
+            break;
+        }
+        if (rate > 0) dir.tokens -= n;
+        chunk.off += n;
+        dir.queued -= n;
+        if (chunk.off == chunk.data.size()) dir.queue.pop_front();
+    }
+    if (dir.eof && dir.queue.empty() && !dir.shut) {
+        shutdown(dir.to, SHUT_WR);
+        dir.shut = true;
+    }
+}
+
+void ImpairProxy::close_link(Link& link, bool reset) {
+    if (reset) {
+        // SO_LINGER 超时为 0 时 close 发 RST 而不是 FIN
+        linger lg{1, 0};
+        setsockopt(link.client, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        setsockopt(link.server, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        resets_.fetch_add(1);
+    }
+    close(link.client);
+    close(link.server);
+    link.client = link.server = -1;
+}
+
+void ImpairProxy::run() {
+    std::vector<pollfd> fds;
+    while (!stop_.load()) {
+        auto now = Clock::now();
+        auto wake = now + std::chrono::milliseconds(50);
+        fds.assign(1, pollfd{listen_fd_, POLLIN, 0});
+        for (Link& link : links_) {
+            if (config_.reset_ms > 0 && now >= link.reset_at) {
+                close_link(link, true);
+                link.dead = true;
+                continue;
+            }
+            flush(link, link.up, now, wake);
+            flush(link, link.down, now, wake);
+            if (link.dead || (link.up.shut && link.down.shut)) {
+                close_link(link, false);
+                link.dead = true;
+                continue;
+            }
+            if (config_.reset_ms > 0) wake = std::min(wake, link.reset_at);
+            bool stall = stalled(link, now);
+            if (config_.stall_ms > 0) wake = std::min(wake, now + std::chrono::milliseconds(5));
+            short client_events = 0, server_events = 0;
+            if (!link.up.eof && link.up.queued < QUEUE_LIMIT) client_events |= POLLIN;
+            if (!link.down.eof && link.down.queued < QUEUE_LIMIT && !stall) server_events |= POLLIN;
+            if (link.up.blocked) server_events |= POLLOUT;
+            if (link.down.blocked) client_events |= POLLOUT;
+            fds.push_back(pollfd{link.client, client_events, 0});
+            fds.push_back(pollfd{link.server, server_events, 0});
+        }
+        links_.erase(std::remove_if(links_.begin(), links_.end(), [](const Link& link) { return link.dead; }), links_.end());
+        int timeout = std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count());
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) throw std::system_error(errno, std::generic_category(), "poll");
+        now = Clock::now();
+        if (fds[0].revents & POLLIN) accept_links(now);
+        // fds 从下标 1 开始每个存活连接两项，与 links_ 中前面的存活连接一一对应（新接入的排在末尾）
+        for (size_t i = 0; 1 + 2 * i + 1 < fds.size(); ++i) {
+            Link& link = links_[i];
+            if (fds[1 + 2 * i].revents & (POLLIN | POLLHUP | POLLERR)) read_into(link, link.up, now);
+            if (fds[2 + 2 * i].revents & (POLLIN | POLLHUP | POLLERR)) read_into(link, link.down, now);
+        }
+    }
+}
+
+// 独立运行的代理：客户端连 --listen-port，代理转发到 --host/--port 上的服务器，直到进程被杀
+int run_proxy(const BenchOptions& opts) {
+    ImpairConfig config = impair_config(opts, ImpairConfig());
+    ImpairProxy proxy(config, opts.get("host", "127.0.0.1"), opts.get_int("port", 8888), opts.get_int("listen-port", 9888));
+    std::cout << "损伤代理: 127.0.0.1:" << proxy.port() << " -> " << opts.get("host", "127.0.0.1") << ":"
+              << opts.get_int("port", 8888) << ", 延迟 " << config.delay_ms << "ms, 限速 " << config.rate_kbps
+              << "KiB/s, 每 " << config.stall_every_ms << "ms 停读 " << config.stall_ms << "ms, 复位 " << config.reset_ms
+              << "ms, rcvbuf " << config.rcvbuf << std::endl;
+    proxy.run();
+    return 0;
+}
+
+// 场景：--impaired 个接收端经代理连接服务器，以用户名登录（被复位后重连并重新登录），一个发送端直连服务器，
+// 以每个接收端 --flood-kbps 的速率向它们灌 --size 字节的消息；同时 --healthy 个直连的健康客户端每隔 --interval-ms
+// 给自己发一条消息，统计它们的往返延迟。--server-pid 指定时报告服务器 RSS 在压测前、压测中的峰值、结束时，
+// 以及连接断开、安静 --quiet-ms 毫秒后的值
+ImpairConfig impair_scenario(const std::string& name) {
+    ImpairConfig config;
+    if (name == "latency") {
+        config.delay_ms = 200;
+    } else if (name == "slow") {
+        config.rate_kbps = 64;
+        config.rcvbuf = 64 * 1024;
+    } else if (name == "stall") {
+        config.stall_ms = 2000;
+        config.stall_every_ms = 2500;
+        config.rcvbuf = 64 * 1024;
+    } else if (name == "reset") {
+        config.reset_ms = 1000;
+    } else if (name != "none") {
+        throw std::invalid_argument("未知场景: " + name + "（none / latency / slow / stall / reset）");
+    }
+    return config;
+}
+
+int run_impair(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    std::string scenario = opts.get("scenario", "slow");
+    double seconds = std::stod(opts.get("seconds", "10"));
+    int impaired = std::max(1LL, opts.get_int("impaired", 4));
+    int healthy = std::max(1LL, opts.get_int("healthy", 8));
+    long long flood_kbps = opts.get_int("flood-kbps", 1024);
+    size_t size = std::max(16LL, opts.get_int("size", 1024));
+    long long interval_ms = std::max(1LL, opts.get_int("interval-ms", 10));
+    long long pid = opts.get_int("server-pid", 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    ImpairConfig config = impair_config(opts, impair_scenario(scenario));
+    ImpairProxy proxy(config, host, port, 0);
+    std::thread proxy_thread([&] { proxy.run(); });
+    long long rss_before = pid != 0 ? process_rss_kb(pid) : 0;
+
+    // 经代理的接收端：读空即可，连接被复位后重连
+    std::atomic<bool> stop{false};
+    std::atomic<long long> delivered{0}, reconnects{0};
+    std::vector<std::thread> threads;
+    std::mutex fds_mutex;
+    std::vector<int> impaired_fds(impaired, -1);
+    for (int i = 0; i < impaired; ++i) {
+        threads.emplace_back([&, i] {
+            std::vector<char> buffer(64 * 1024);
+            for (bool first = true; !stop.load(); first = false) {
+                int fd;
+                try {
+                    fd = connect_to_server("127.0.0.1", proxy.port());
+                } catch (const std::exception&) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    continue;
+                }
+                if (!first) {
+                    // 等服务器处理完被复位的旧连接，否则用户名还被它占着
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                    reconnects.fetch_add(1);
+                }
+                std::string login = "LOGIN impaired" + std::to_string(i) + "\n";
+                if (write(fd, login.data(), login.size()) < 0) {
+                    close(fd);
+                    continue;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(fds_mutex);
+                    impaired_fds[i] = fd;
+                }
+                while (true) {
+                    ssize_t n = read(fd, buffer.data(), buffer.size());
+                    if (n <= 0) break;
+                    delivered.fetch_add(n, std::memory_order_relaxed);
+                }
+                std::lock_guard<std::mutex> lock(fds_mutex);
+                impaired_fds[i] = -1;
+                close(fd);
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    // 发送端：每 10 毫秒按速率补一批，接收端离线时服务器回的错误由另一个线程读掉
+    int sender = connect_to_server(host, port);
+    std::atomic<long long> offered{0};
+    threads.emplace_back([&] {
+        std::vector<char> buffer(64 * 1024);
+        while (read(sender, buffer.data(), buffer.size()) > 0) {}
+    });
+    threads.emplace_back([&] {
+        std::string payload(size, 'z');
+        double per_tick = flood_kbps * 1024.0 / 100 / size;  // 每个接收端每 10 毫秒的消息数
+        double owed = 0;
+        auto next = Clock::now();
+        std::string batch;
+        while (!stop.load()) {
+            next += std::chrono::milliseconds(10);
+            std::this_thread::sleep_until(next);
+            owed += per_tick;
+            batch.clear();
+            for (; owed >= 1; owed -= 1) {
+                for (int i = 0; i < impaired; ++i) batch += "@impaired" + std::to_string(i) + ":" + payload + "\n";
+            }
+            if (batch.empty()) continue;
+            if (write(sender, batch.data(), batch.size()) < 0) break;
+            offered.fetch_add(batch.size(), std::memory_order_relaxed);
+        }
+    });
+
+    // 健康客户端
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    std::vector<std::vector<double>> samples(healthy);
+    std::vector<std::thread> lights;
+    for (int i = 0; i < healthy; ++i) {
+        lights.emplace_back([&, i] {
+            int fd = connect_to_server(host, port);
+            std::string self = local_address(fd);
+            MessageSplitter splitter;
+            char buffer[4096];
+            for (long long seq = 0; Clock::now() < deadline; ++seq) {
+                std::string msg = self + ":" + std::to_string(seq) + "#\n";
+                auto sent = Clock::now();
+                write_all(fd, msg.data(), msg.size());
+                bool got = false;
+                while (!got) {
+                    ssize_t n = read(fd, buffer, sizeof(buffer));
+                    if (n <= 0) {
+                        close(fd);
+                        return;
+                    }
+                    splitter.feed(buffer, n, [&](const std::string&) { got = true; });
+                }
+                samples[i].push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+                std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+            }
+            close(fd);
+        });
+    }
+    long long rss_peak = rss_before;
+    while (Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        if (pid != 0) rss_peak = std::max(rss_peak, process_rss_kb(pid));
+    }
+    for (auto& t : lights) t.join();
+    long long rss_end = pid != 0 ? process_rss_kb(pid) : 0;
+    double elapsed = seconds_since(start);
+
+    stop = true;
+    shutdown(sender, SHUT_RDWR);
+    {
+        std::lock_guard<std::mutex> lock(fds_mutex);
+        for (int fd : impaired_fds) {
+            if (fd != -1) shutdown(fd, SHUT_RDWR);
+        }
+    }
+    for (auto& t : threads) t.join();
+    close(sender);
+    proxy.stop();
+    proxy_thread.join();
+    long long rss_after = 0;
+    if (pid != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(opts.get_int("quiet-ms", 3000)));
+        rss_after = process_rss_kb(pid);
+    }
+
+    std::vector<double> all;
+    for (auto& v : samples) all.insert(all.end(), v.begin(), v.end());
+    std::cout << "场景 " << scenario << ": 延迟 " << config.delay_ms << "ms, 限速 " << config.rate_kbps << "KiB/s, 每 "
+              << config.stall_every_ms << "ms 停读 " << config.stall_ms << "ms, 复位 " << config.reset_ms << "ms" << std::endl;
+    report_latency("健康客户端往返延迟", all);
+    std::cout << "受损接收端: " << impaired << " 个, 发出 " << offered.load() / elapsed / 1024 << " KiB/s, 收到 "
+              << delivered.load() / elapsed / 1024 << " KiB/s, 重连 " << reconnects.load() << " 次, 代理复位 "
+              << proxy.resets() << " 次" << std::endl;
+    if (pid != 0) {
+        std::cout << "服务器 RSS: 压测前 " << rss_before / 1024 << " MiB, 峰值 " << rss_peak / 1024 << " MiB, 结束时 "
+                  << rss_end / 1024 << " MiB, 断开后 " << rss_after / 1024 << " MiB" << std::endl;
+    }
+    return all.empty() ? 1 : 0;
+}
+
+// --- file：文件传输吞吐 ---
+
+// 按行读取服务器消息，行之后的原始字节留给调用者
+class StreamReader {
+public:
+    explicit StreamReader(int fd) : fd_(fd) {}
+    std::string line() {
+        size_t pos;
+        while ((pos = buf_.find('\n')) == std::string::npos) fill();
+        std::string result = buf_.substr(0, pos);
+        buf_.erase(0, pos + 1);
+        return result;
+    }
+    // 跳过 len 字节原始数据
+    void skip(long long len) {
+        while (len > 0) {
+            if (buf_.empty()) fill();
+            size_t n = std::min<long long>(len, buf_.size());
+            buf_.erase(0, n);
+            len -= n;
+        }
+    }
+
+private:
+    void fill() {
+        char buffer[256 * 1024];
+        ssize_t n = read(fd_, buffer, sizeof(buffer));
+        if (n <= 0) throw std::runtime_error("读取时连接关闭");
+        buf_.append(buffer, n);
+    }
+    int fd_;
+    std::string buf_;
+};
+
+int run_file(const BenchOptions& opts) {
+    std::string host = opts.get("host", "127.0.0.1");
+    int port = opts.get_int("port", 8888);
+    long long total = opts.get_int("bytes", 1LL << 30);
+    size_t chunk = opts.get_int("chunk", 1 << 20);
+
+    int sender = connect_to_server(host, port);
+    int receiver = connect_to_server(host, port);
+    StreamReader from_server(sender);
+    StreamReader to_receiver(receiver);
+    std::string offer = "FILE " + local_address(receiver) + " " + std::to_string(total) + " bench.bin\n";
+    write_all(sender, offer.data(), offer.size());
+    std::string line = to_receiver.line();
+    if (line.compare(0, 5, "FILE ") != 0) throw std::runtime_error("接收端收到意外消息: " + line);
+    std::string id = line.substr(5, line.find(' ', 5) - 5);
+    std::string accept = "ACCEPT " + id + "\n";
+    write_all(receiver, accept.data(), accept.size());
+    while (from_server.line() != "FILE-SEND " + id) {
+    }
+
+    auto start = Clock::now();
+    std::thread writer([&] {
+        std::string data(chunk, 'x');
+        for (long long sent = 0; sent < total;) {
+            size_t len = std::min<long long>(chunk, total - sent);
+            std::string header = "FILEDATA " + id + " " + std::to_string(len) + "\n";
+            write_all(sender, header.data(), header.size());
+            write_all(sender, data.data(), len);
+            sent += len;
+        }
+    });
+
+    long long received = 0;
+    size_t chunks = 0;
+    while (true) {
+        line = to_receiver.line();
+        if (line == "FILE-DONE " + id) break;
+        if (line.compare(0, 9, "FILEDATA ") != 0) throw std::runtime_error("接收端收到意外消息: " + line);
+        long long len = std::stoll(line.substr(line.rfind(' ') + 1));
+        to_receiver.skip(len);
+        received += len;
+        ++chunks;
+    }
+    double elapsed = seconds_since(start);
+    writer.join();
+
+    std::cout << "文件传输(暂存+sendfile): " << received << " 字节, " << chunks << " 块, " << elapsed << " 秒, "
+              << (received / elapsed / (1 << 20)) << " MiB/s" << std::endl;
+    close(sender);
+    close(receiver);
+    return received == total ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions opts = parse_options(argc, argv);
+    query_address = opts.has("query-addr");
+    try {
+        if (opts.mode == "bulk") return run_bulk(opts);
+        if (opts.mode == "pingpong") return run_pingpong(opts);
+        if (opts.mode == "hold") return run_hold(opts);
+        if (opts.mode == "file") return run_file(opts);
+        if (opts.mode == "fair") return run_fair(opts);
+        if (opts.mode == "churn") return run_churn(opts);
+        if (opts.mode == "seq") return run_seq(opts);
+        if (opts.mode == "bell") return run_bell(opts);
+        if (opts.mode == "capacity") return run_capacity(opts);
+        if (opts.mode == "multicast") return run_multicast(opts);
+        if (opts.mode == "topics") return run_topics(opts);
+        if (opts.mode == "rate") return run_rate(opts);
+        if (opts.mode == "replay") return run_replay(opts);
+        if (opts.mode == "proxy") return run_proxy(opts);
+        if (opts.mode == "impair") return run_impair(opts);
+    } catch (const std::exception& e) {
+        std::cerr << "压测失败: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cerr << "用法: " << argv[0] << " bulk [--host=IP] [--port=PORT] [--bytes=N] [--chunk=N] [--pair] [--framed] [--line] [--server-pid=PID]" << std::endl;
+    std::cerr << "      " << argv[0] << " pingpong [--host=IP] [--port=PORT] [--host2=IP] [--port2=PORT] [--count=N] [--size=N] [--window=N]" << std::endl;
+    std::cerr << "      " << argv[0] << " hold [--host=IP] [--port=PORT] [--conns=N] [--seconds=N]" << std::endl;
+    std::cerr << "      " << argv[0] << " file [--host=IP] [--port=PORT] [--bytes=N] [--chunk=N]" << std::endl;
+    std::cerr << "      " << argv[0] << " fair [--host=IP] [--port=PORT] [--flooders=N] [--light=N] [--count=N] [--interval-us=N] [--flood-size=N]" << std::endl;
+    std::cerr << "      " << argv[0] << " churn [--host=IP] [--port=PORT] [--threads=N] [--seconds=N] [--msgs=N] [--size=N] [--idle=N] [--server-pid=PID] [--quiet-ms=N]" << std::endl;
+    std::cerr << "      " << argv[0] << " bell [--host=IP] [--port=PORT] [--line=N] [--backlog=N] [--drain-mibps=N] [--count=N] [--interval-ms=N]" << std::endl;
+    std::cerr << "      " << argv[0] << " capacity [--host=IP] [--port=PORT] [--max=N] [--step=N] [--source-ips=N] [--active=N] [--interval-ms=N] [--samples=N] [--server-pid=PID]" << std::endl;
+    std::cerr << "      " << argv[0] << " multicast [--host=IP] [--port=PORT] [--recipients=N] [--count=N] [--size=N] [--list] [--server-pid=PID]" << std::endl;
+    std::cerr << "      " << argv[0] << " topics [--host=IP] [--port=PORT] [--subscribers=N] [--subs-per=N] [--groups=N] [--topics=N] [--count=N] [--size=N] [--server-pid=PID]" << std::endl;
+    std::cerr << "      " << argv[0] << " rate [--host=IP] [--port=PORT] [--rate=N] [--pairs=N] [--size=N] [--seconds=N] [--sample=N] [--server-pid=PID]" << std::endl;
+    std::cerr << "      " << argv[0] << " replay --file=PATH [--host=IP] [--port=PORT] [--speed=N] [--drain-ms=N] [--save=PATH] [--baseline=PATH]" << std::endl;
+    std::cerr << "      " << argv[0] << " proxy [--host=IP] [--port=PORT] [--listen-port=N] [--delay-ms=N] [--rate-kbps=N] [--stall-ms=N] [--stall-every-ms=N] [--reset-ms=N] [--rcvbuf=N]" << std::endl;
+    std::cerr << "      " << argv[0] << " impair [--host=IP] [--port=PORT] [--scenario=none|latency|slow|stall|reset] [--seconds=N] [--impaired=N] [--healthy=N] [--flood-kbps=N] [--size=N] [--interval-ms=N] [--server-pid=PID] [--quiet-ms=N] [代理参数]" << std::endl;
+    std::cerr << "      " << argv[0] << " seq [--host=IP] [--port=PORT] [--count=N] [--size=N] [--acks] [--window=N] [--reconnect-every=N]" << std::endl;
+    return 1;
+}
@@ -2,20 +2,43 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <coroutine>
+#include <queue>
+#include <utility>
 #include <unordered_map>
 #include <system_error>
 #include <cerrno>
 #include <cstring>
 #include <memory> // For std::unique_ptr and std::make_unique
+#include <cstdint>
+#include <csignal>
+#include <algorithm>
+#include <cmath>
+#include <functional>
 
 // C headers
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <malloc.h>
 
 // --- 前向声明 ---
 struct ServerContext;
@@ -28,40 +51,1107 @@ public:
 };
 
 // --- 线程池类  ---
+/**
+ * @brief 弹性线程池：线程数在 [min, max] 之间随负载伸缩。调节线程每 SAMPLE_MS 采样一次本周期任务的平均排队时间
+ * （队首任务已等待的时间也计入，突增时大部分任务还没出队）、线程利用率（执行任务的时间 / (线程数 × 周期)），
+ * 并按 到达速率 × 平均执行时间 × TARGET_HEADROOM + 在 BACKLOG_DRAIN_MS 内消化积压所需 估算需要的线程数：
+ *   连续 GROW_SAMPLES 个周期排队超过 grow_wait_us 且利用率高于 GROW_UTIL 时直接扩到估算值（至少加一个）；
+ *   连续 SHRINK_SAMPLES 个周期利用率低于 SHRINK_UTIL 且几乎不排队时，缩掉多出估算值部分的一半（至少一个），
+ *   扩容后 SHRINK_COOLDOWN_MS 内不缩容。
+ * 扩得快、缩得慢，中间留出滞回区间，负载抖动时线程数不会来回震荡。min == max 时只采样不伸缩
+ */
 class ThreadPool {
 public:
-    ThreadPool(size_t size);
+    // 最近一个采样周期的状态与累计计数，POOL 命令回复这些值
+    struct Stats {
+        size_t threads = 0, min_threads = 0, max_threads = 0;
+        size_t queued = 0, active = 0;
+        double wait_us = 0;       // 平均排队时间
+        double utilization = 0;   // 0-1
+        uint64_t tasks = 0, grows = 0, shrinks = 0;
+    };
+
+    // max_threads 为 0 表示与 min_threads 相同（固定大小）
+    ThreadPool(size_t min_threads, size_t max_threads = 0, uint32_t grow_wait_us = 500);
     ~ThreadPool();
     ThreadPool(const ThreadPool&) = delete;
     ThreadPool& operator=(const ThreadPool&) = delete;
     void add_task(std::unique_ptr<Task> task);
+    // 阻塞直到队列为空且没有任务在执行；调用期间不能再添加任务
+    void wait_idle();
+    Stats stats();
 
 private:
+    static const int SAMPLE_MS = 50;
+    static const int GROW_SAMPLES = 2;
+    static const int SHRINK_SAMPLES = 20;
+    static const int SHRINK_COOLDOWN_MS = 2000;
+    static constexpr double GROW_UTIL = 0.5;
+    static constexpr double SHRINK_UTIL = 0.25;
+    static constexpr double TARGET_HEADROOM = 1.25;
+    static const int BACKLOG_DRAIN_MS = 500;
+
+    struct Queued {
+        std::unique_ptr<Task> task;
+        uint64_t queued_ns;
+    };
+
+    void spawn(size_t n);  // 调用者需持有 queue_mutex_
     static void* worker_entry(void* arg);
     void worker_loop();
+    static void* controller_entry(void* arg);
+    void controller_loop();
+    void adjust();
 
     bool stop_ = false;
     pthread_mutex_t queue_mutex_;
     pthread_cond_t queue_cond_;
-    std::list<std::unique_ptr<Task>> task_queue_;
-    std::vector<pthread_t> threads_;
+    pthread_cond_t idle_cond_;
+    size_t active_ = 0;  // 正在执行的任务数
+    std::list<Queued> task_queue_;
+    std::vector<pthread_t> threads_;  // 存活的工作线程
+    std::vector<pthread_t> exited_;   // 已退出、等待 join 的工作线程
+    size_t retire_ = 0;               // 待退出的线程数，空闲的工作线程看到后退出
+
+    // 调节：以下成员由 queue_mutex_ 保护
+    size_t min_threads_, max_threads_;
+    uint64_t grow_wait_ns_;
+    uint64_t sample_start_ns_ = 0;
+    uint64_t wait_ns_ = 0, waits_ = 0;                // 本周期出队任务的排队时间
+    uint64_t busy_ns_ = 0, done_ = 0, arrivals_ = 0;  // 本周期完成任务的执行时间、完成数、入队数
+    int over_ = 0, under_ = 0;                        // 连续过载/空闲的周期数
+    uint64_t last_grow_ns_ = 0;
+    Stats stats_;
+    bool controller_stop_ = false;
+    bool controller_started_ = false;
+    pthread_t controller_;
+};
+
+// --- 协程执行模型 ---
+/*--coroutines 模式：每个连接由一对协程驱动，读协程读取并处理消息，写协程送出写缓冲区和直连管道中的数据。
+协程全部运行在主线程上，fd 就绪时由事件循环直接恢复，不经过线程池的任务队列；
+连接以 EPOLLIN | EPOLLOUT | EPOLLET 注册一次，不再按有无待写数据翻转关注的事件，可写事件只是唤醒写协程。
+协程模式下连接表只被主线程访问，复用的业务函数照旧加锁，锁总是无竞争的。*/
+
+// 协程帧内存池：按 64 字节分档的空闲链表。同一协程函数的帧大小固定，释放后原样复用。只在主线程使用
+class FramePool {
+public:
+    void* allocate(size_t n);
+    void deallocate(void* p, size_t n);
+
+private:
+    static const size_t GRANULE = 64;
+    static const size_t MAX_POOLED = 8192;  // 更大的帧直接交给 operator new
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    std::vector<FreeBlock*> free_ = std::vector<FreeBlock*>(MAX_POOLED / GRANULE + 1, nullptr);
+};
+extern FramePool frame_pool;
+
+// 分离执行的协程：创建后立即运行，结束时自行销毁帧
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+        static void* operator new(size_t n) { return frame_pool.allocate(n); }
+        static void operator delete(void* p, size_t n) { frame_pool.deallocate(p, n); }
+    };
+};
+
+// 可等待的子协程：co_await 时才开始运行，结束后直接切回等待者（对称转移，不经过调度器）
+template <typename T>
+class Co {
+public:
+    struct promise_type {
+        T value{};
+        std::coroutine_handle<> continuation;
+
+        Co get_return_object() { return Co(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                return h.promise().continuation;
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = v; }
+        void unhandled_exception() { std::terminate(); }
+        static void* operator new(size_t n) { return frame_pool.allocate(n); }
+        static void operator delete(void* p, size_t n) { frame_pool.deallocate(p, n); }
+    };
+
+    explicit Co(std::coroutine_handle<promise_type> h) : handle_(h) {}
+    Co(Co&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Co(const Co&) = delete;
+    ~Co() {
+        if (handle_) handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+    T await_resume() { return handle_.promise().value; }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// 一个连接的两个协程共享的状态，最后一个退出的协程负责释放
+struct CoConn {
+    int fd;
+    bool closed = false;        // 连接已关闭，协程恢复后应立即退出
+    bool write_wanted = false;  // 有新数据待写或 fd 变为可写，写协程下次等待时不挂起
+    std::coroutine_handle<> reader;  // 挂起中等待可读的读协程
+    std::coroutine_handle<> writer;  // 挂起中等待可写/新数据的写协程
+    int refs = 2;
+};
+
+/**
+ * @brief 协程调度器：按 fd 找到挂起的协程并恢复，维护延迟恢复队列和定时器。
+ * 所有方法只在主线程调用。
+ */
+class CoScheduler {
+public:
+    CoConn* attach(int fd);
+    CoConn* find(int fd) const { return fd >= 0 && (size_t)fd < conns_.size() ? conns_[fd] : nullptr; }
+    // fd 已关闭：解除登记并让挂起的协程恢复后退出
+    void close(int fd);
+    void release(CoConn* conn);
+    // 事件循环收到 fd 的事件后直接恢复对应协程
+    void on_event(int fd, uint32_t events);
+    // 在其它协程运行期间产生的唤醒（如 queue_output）推迟到当前协程挂起后执行，避免嵌套恢复
+    void wake_writer(int fd);
+    void schedule(std::coroutine_handle<> h) { ready_.push_back(h); }
+    void run_ready();
+    void add_timer(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<> h);
+    void run_timers();
+    // epoll_wait 的超时：有就绪协程时为 0，无定时器时为 -1
+    int next_timeout_ms() const;
+
+private:
+    struct Timer {
+        std::chrono::steady_clock::time_point deadline;
+        std::coroutine_handle<> handle;
+        bool operator>(const Timer& other) const { return deadline > other.deadline; }
+    };
+    std::vector<CoConn*> conns_;  // 按 fd 下标
+    std::vector<std::coroutine_handle<>> ready_;
+    std::vector<std::coroutine_handle<>> running_;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+};
+
+// --- 内存池 ---
+/**
+ * @brief 按 2 的幂分档的内存池，供连接记录(ClientInfo)和读写缓冲区使用。
+ * 每个线程有自己的空闲块缓存，分配/释放通常不加锁；缓存满了把一半还给全局仓库，空了从仓库批量取回。
+ * 不超过 SLAB_MAX_CARVED 的块从按 64 KiB 对齐的 slab 中切出，更大的块单独向堆申请；
+ * trim() 把仓库中空闲的大块和块全部空闲的 slab 还给堆，突发流量过后连接记录和缓冲区占用的内存都能回落。
+ */
+class SlabPool {
+public:
+    static void* allocate(size_t n);
+    static void deallocate(void* p, size_t n);
+    // 归还仓库中单独申请的空闲大块和全部空闲的 slab，返回归还的字节数。
+    // 同时让各线程在下一次释放时把缓存的块还给仓库，缓存里的块由之后的 trim() 回收
+    static size_t trim();
+
+    static const size_t MIN_BLOCK = 64;
+    static const size_t MAX_BLOCK = 256 * 1024;  // 更大的请求直接交给 operator new
+    static const size_t SLAB_MAX_CARVED = 4096;
+    static const size_t SLAB_SIZE = 64 * 1024;
+    static const size_t CLASSES = 13;             // 64 B .. 256 KiB
+    static const size_t CACHE_BYTES = 256 * 1024; // 每个线程每档最多缓存的字节数（至少 2 块）
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    struct ThreadCache;
+
+private:
+    static size_t class_of(size_t n) {
+        size_t cls = 0;
+        while ((MIN_BLOCK << cls) < n) ++cls;
+        return cls;
+    }
+    static size_t cache_limit(size_t cls) { return std::max<size_t>(2, CACHE_BYTES / (MIN_BLOCK << cls)); }
+    static uintptr_t slab_of(const void* block) { return reinterpret_cast<uintptr_t>(block) & ~(uintptr_t)(SLAB_SIZE - 1); }
+    static void refill(ThreadCache& cache, size_t cls);
+    static void spill(ThreadCache& cache, size_t cls, size_t keep);
+};
+
+// 分配器适配：让标准容器从 SlabPool 取内存
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+    PoolAllocator() = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+    T* allocate(size_t n) { return static_cast<T*>(SlabPool::allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) { SlabPool::deallocate(p, n * sizeof(T)); }
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const { return true; }
+};
+
+// 连接读写缓冲区：接口与 std::string 相同，内存来自 SlabPool
+using Buffer = std::basic_string<char, std::char_traits<char>, PoolAllocator<char>>;
+
+// --- 消息追踪 ---
+struct ClientInfo;
+
+/**
+ * @brief 按采样率追踪单条消息经过的各个阶段，导出为 Chrome trace JSON（chrome://tracing 或 Perfetto 打开）：
+ *   queue  事件分发后排队等待执行（线程池模式从入队到任务开始，协程模式从 epoll_wait 返回到读协程恢复）
+ *   recv   本轮最近一次 read 调用
+ *   lock   处理消息前等待 clients_mutex
+ *   parse  从取出消息到找到目标
+ *   route  追加到目标写缓冲区并请求写
+ *   write  从进入目标写缓冲区到写出 socket
+ * 同一条消息的各阶段带相同的消息编号(args.msg)。每个线程把事件写进自己的环形缓冲区，不加锁；
+ * 关闭时每条消息、每次 read 只多一次判断，不读时钟。
+ */
+struct TraceEvent {
+    const char* name;
+    uint32_t msg;
+    int fd;
+    uint64_t start_ns;
+    uint64_t end_ns;
+};
+
+class Tracer {
+public:
+    // 每 sample 条消息追踪一条，0 表示关闭；只在启动时调用
+    void configure(uint32_t sample, const std::string& path) {
+        sample_ = sample;
+        path_ = path;
+    }
+    bool enabled() const { return sample_ != 0; }
+    const std::string& path() const { return path_; }
+    static uint64_t clock_ns();
+    // 关闭时返回 0，不读时钟
+    uint64_t now() const { return enabled() ? clock_ns() : 0; }
+
+    // 本轮处理的上下文，由后续被采样的消息引用：queued_ns 为排队开始时间
+    void start_turn(uint64_t queued_ns) {
+        if (enabled()) record_turn(queued_ns);
+    }
+    // 协程模式：epoll_wait 返回的时间，作为本批事件的排队开始时间
+    void mark_poll() {
+        if (enabled()) record_poll();
+    }
+    uint64_t last_poll() const;
+    void note_read(uint64_t start_ns) {
+        if (enabled()) record_read(start_ns);
+    }
+    void note_lock(uint64_t start_ns) {
+        if (enabled()) record_lock(start_ns);
+    }
+
+    // 开始/结束处理一条消息，按采样率决定是否追踪
+    void begin_message(int fd);
+    void end_message();
+    // 当前消息被追踪且尚未送出：queue_output 需要调用 on_route
+    bool routing() const { return enabled() && routing_traced(); }
+    // 记录当前消息的 parse/route 阶段，并在目标连接上挂写完成标记，调用者需持有 clients_mutex
+    void on_route(ClientInfo& target, int target_fd, uint64_t start_ns);
+    // 写缓冲区头部 n 字节已写出，调用者需持有 clients_mutex（协程模式在主线程）
+    void on_written(ClientInfo& info, int fd, size_t n);
+
+    // 把所有线程缓冲区中的事件写成 Chrome trace JSON，返回事件数，失败返回 -1。
+    // 文件 I/O 较多，调用者不能持有 clients_mutex；同时只有一个线程在导出
+    long dump();
+
+    struct Ring;
+
+private:
+    Ring& ring();
+    long write_trace();
+    void record_turn(uint64_t queued_ns);
+    void record_poll();
+    void record_read(uint64_t start_ns);
+    void record_lock(uint64_t start_ns);
+    bool routing_traced() const;
+    void emit(const char* name, uint32_t msg, int fd, uint64_t start_ns, uint64_t end_ns);
+
+    uint32_t sample_ = 0;
+    std::string path_;
+    std::atomic<uint32_t> next_msg_{0};
+    pthread_mutex_t rings_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_t dump_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<Ring*> rings_;       // 线程退出后其缓冲区保留，事件仍可导出
+    std::vector<Ring*> free_rings_;  // 所属线程已退出的缓冲区，新线程优先复用，缓冲区数不超过同时存活的线程数
+
+    friend struct TraceThreadState;
+};
+extern Tracer tracer;
+
+// 处理一条消息期间的追踪范围
+class TraceMessage {
+public:
+    explicit TraceMessage(int fd) : active_(tracer.enabled()) {
+        if (active_) tracer.begin_message(fd);
+    }
+    ~TraceMessage() {
+        if (active_) tracer.end_message();
+    }
+    TraceMessage(const TraceMessage&) = delete;
+    TraceMessage& operator=(const TraceMessage&) = delete;
+private:
+    bool active_;
 };
 
 // --- 服务器状态与业务逻辑函数 ---
 
-// 客户端信息
+// 连接类型
+enum class ConnKind : uint8_t {
+    None = 0,  // 空槽
+    Client,    // 普通聊天客户端
+    NodeLink,  // 集群中与其它服务器节点之间的链路
+};
+
+// 客户端地址：IPv4(主机字节序) << 16 | 端口，共 48 位，0 表示无地址
+using Addr48 = uint64_t;
+
+inline Addr48 make_addr48(uint32_t ip, uint16_t port) {
+    return (Addr48)ip << 16 | port;
+}
+std::string format_addr48(Addr48 addr);
+bool parse_addr48(const char* str, size_t len, Addr48& addr);
+
+/**
+ * @brief 一次文件传输。发送方上传的数据块经管道 splice 进暂存文件，再按块用 sendfile 送给接收方。
+ * 由 clients_mutex 保护；进行中的 splice/sendfile 持有 shared_ptr，传输被取消后暂存文件在最后一个持有者释放时才关闭
+ */
+struct FileTransfer {
+    uint64_t id = 0;
+    int src_fd = -1;  // 发送方；上传完成后发送方断开不影响送达，此时为 -1
+    int dst_fd = -1;
+    uint64_t size = 0;
+    std::string name;
+    bool accepted = false;
+    int spool_fd = -1;             // 已 unlink 的暂存文件
+    int pipe[2] = {-1, -1};        // socket -> 暂存文件的中转管道
+    size_t pipe_capacity = 0;
+    uint64_t spooled = 0;          // 已写入暂存文件的字节数
+    uint64_t queued = 0;           // 已划入发给接收方的数据块的字节数
+    uint64_t delivered = 0;        // 已送达接收方的字节数
+    uint64_t released = 0;         // 暂存文件开头已打洞归还的字节数
+    bool upload_stalled = false;   // 暂存领先送达太多，发送方暂停读取
+
+    FileTransfer() = default;
+    FileTransfer(const FileTransfer&) = delete;
+    FileTransfer& operator=(const FileTransfer&) = delete;
+    ~FileTransfer() {
+        for (int fd : {spool_fd, pipe[0], pipe[1]}) {
+            if (fd != -1) close(fd);
+        }
+    }
+};
+
+/**
+ * @brief 有序投递的一个会话：已登录的发送方发往一个目标的 SEQ 消息。
+ * 序号由发送方从 1 开始连续编号，服务器只按序接收；写进目标 socket 后把累计确认发回发送方。
+ * 由 clients_mutex 保护，进行中的投递记录（SeqMark）直接持有指针，没有投递记录引用时才能回收（见 new_seq_conversation()）
+ */
+struct SeqConversation {
+    uint32_t sender = 0;     // 发送方用户 ID
+    std::string target;      // 发送方写的目标，原样出现在确认中
+    uint32_t session = 0;    // 发送方的会话号，重新 LOGIN 后旧会话的状态作废
+    bool started = false;    // 本会话号下是否已收到过消息
+    bool ack_due = false;    // 本次写完成中已有消息送达，等待发出确认
+    uint64_t accepted = 0;   // 已按序接收并转发的最大序号
+    uint64_t delivered = 0;  // 已写入目标 socket 的最大序号
+    uint64_t nacked = 0;     // 最近一次要求重发的起始序号，同一个空缺只要求一次
+    uint32_t marks = 0;      // 引用本会话的 SeqMark 数
+    uint64_t used = 0;       // 最近一次收到消息时的 ServerContext::seq_ticks
+};
+
+// 目标连接上一条待送达的有序消息：总写出字节数到达 end 时送达
+struct SeqMark {
+    uint64_t end;
+    SeqConversation* conv;
+    uint64_t seq;
+    uint32_t session;
+};
+
+/**
+ * @brief 直连一个方向的中转管道。进行中的 splice 各持有一份 shared_ptr，直连结束后管道在最后一个持有者释放时才关闭，
+ * 解锁期间的 splice 不会用到已关闭、又被其它文件复用的 fd 号
+ */
+struct RelayPipe {
+    int fds[2] = {-1, -1};  // 读端、写端
+
+    RelayPipe() = default;
+    RelayPipe(const RelayPipe&) = delete;
+    RelayPipe& operator=(const RelayPipe&) = delete;
+    ~RelayPipe() {
+        if (fds[0] != -1) close(fds[0]);
+        if (fds[1] != -1) close(fds[1]);
+    }
+};
+
+// 线程池模式下写任务每次从写缓冲区拷出写出的最大字节数
+static const size_t WRITE_SLICE = 256 * 1024;
+
+// 普通通道中至少每隔这么多字节记录一个消息边界，优先通道的数据最多等这么多字节（或当前这条消息写完）
+static const size_t OUTPUT_CUT_SPACING = 16 * 1024;
+// WHO 回复中最多列出的在线客户端数，总数照常给出
+static const size_t WHO_MAX_ENTRIES = 1000;
+
+// 客户端信息（冷数据）：缓冲区与直连状态，只在连接有数据收发时才分配，安静一段时间后释放
 struct ClientInfo {
-    std::string ip;
-    int port;
-    std::string read_buf;  // 用于处理半包/粘包的读缓冲区
-    std::string write_buf;
+    Buffer read_buf;  // 用于处理半包/粘包的读缓冲区
+    Buffer write_buf;   // 普通通道，头部 write_pos 字节已写出、尚未移除（攒够一半再整体前移，避免每次写出都搬动整个积压）
+    size_t write_pos = 0;
+    Buffer urgent_buf;  // 优先通道：振铃、确认、上下线通告等短控制消息，在普通通道的下一个消息边界插队送出
+
+    // 普通通道中已记录的消息边界（按 out_written 计的绝对偏移，cut_done 之前的已写过），
+    // 以及普通通道是否停在一条消息的中间（此时优先通道要等它写到下一个边界）
+    std::vector<uint64_t> cuts;
+    size_t cut_done = 0;
+    bool mid_message = false;
+
+    // 直连(PAIR)模式：两端互相确认后，数据经管道用 splice 在内核内转发，不再进入用户态
+    int pair_fd = -1;              // 配对的对端 fd，-1 表示未配对
+    Addr48 pair_request = 0;       // 本端发出、等待对方确认的配对目标
+    std::shared_ptr<RelayPipe> relay_pipe;  // 本端 -> 对端方向的中转管道
+    size_t relay_pending = 0;      // 管道中尚未送达对端的字节数
+    size_t relay_capacity = 0;     // 管道容量
+    bool relay_stalled = false;    // 管道已满，本端暂停读取，等待对端可写后恢复
+    bool relay_flushing = false;   // 正有线程在把管道数据送往对端
+    bool relay_rerun = false;      // 送出期间又有新数据进入管道
+
+    // 文件传输：作为发送方时正在上传的数据块（upload_id 为 0 表示丢弃这一块），
+    // 作为接收方时待送出的传输（轮流各送一块）和正在送出的数据块
+    uint64_t upload_id = 0;
+    uint64_t upload_left = 0;
+    std::deque<uint64_t> downloads;
+    std::shared_ptr<FileTransfer> chunk;  // 正在送出的块所属的传输，空表示没有
+    std::string chunk_header;             // 块头部中尚未写出的部分
+    uint64_t chunk_offset = 0;            // 块内容在暂存文件中的下一个偏移
+    uint64_t chunk_left = 0;              // 块内容中尚未写出的字节数
+
+    // 消息追踪：写缓冲区头部 trace_end 字节写出时，编号 trace_msg 的消息写完成，0 表示没有
+    uint32_t trace_msg = 0;
+    size_t trace_end = 0;
+    uint64_t trace_routed_ns = 0;
+
+    // 有序投递：写缓冲区累计写出的字节数，以及写缓冲区中的有序消息（seq_done 之前的已送达）
+    uint64_t out_written = 0;
+    std::vector<SeqMark> seq_marks;
+    size_t seq_done = 0;
+
+    size_t deficit = 0;  // 公平调度：本连接尚未用完的处理额度（字节），连接读空后清零
+
+    // 超长行直通转发：作为发送方时正在转发的目标（-1 表示没有）、是否因目标积压暂停读取、目标已断开时丢弃到行尾，
+    // 已转发的字节数和上一次转发的时间；作为目标时正在送来超长行的发送方，和期间暂缓追加的其它输出及其中的有序消息
+    // （送达位置相对 stream_hold）
+    int stream_to = -1;
+    bool stream_stalled = false;
+    bool stream_discard = false;
+    uint64_t stream_sent = 0;
+    uint64_t stream_active_ns = 0;
+    int stream_from = -1;
+    Buffer stream_hold;
+    std::vector<SeqMark> stream_marks;
+
+    size_t write_pending() const { return write_buf.size() - write_pos; }  // 普通通道中尚未写出的字节数
+    bool has_output() const { return !write_buf.empty() || !urgent_buf.empty(); }
+};
+
+// Addr48 -> fd 的开放寻址哈希索引（线性探测，删除时回移），每个槽 12 字节，负载不超过 1/2
+class AddrIndex {
+public:
+    int find(Addr48 key) const;
+    void insert(Addr48 key, int fd);
+    void erase(Addr48 key, int fd);  // 仅当 key 仍映射到 fd 时删除
+    size_t memory_usage() const { return keys_.capacity() * sizeof(Addr48) + fds_.capacity() * sizeof(int); }
+
+private:
+    size_t slot_of(Addr48 key) const { return (key * 0x9E3779B97F4A7C15ULL) >> shift_; }
+    void grow();
+
+    std::vector<Addr48> keys_;  // 0 表示空槽
+    std::vector<int> fds_;
+    size_t size_ = 0;
+    int shift_ = 64;
+};
+
+/**
+ * @brief 按 fd 下标的连接表。
+ * 每个连接的热数据（类型、状态位、地址、用户 ID）按字段分别存放在以 fd 为下标的数组中，
+ * 空闲连接只占这几个数组里的 22 字节和地址索引中的一个槽；读写缓冲区等冷数据按需从 SlabPool 分配，
+ * 连接安静一段时间后由 sweep_idle() 释放。
+ * 所有操作都需要调用者持有 clients_mutex。
+ */
+class ClientTable {
+public:
+    // 状态位：边沿触发下同一 fd 的新事件可能在上一个任务执行期间到达，保证同一连接的读/写各自只由一个线程串行处理
+    enum : uint8_t {
+        READING = 1,
+        READ_AGAIN = 2,
+        WRITING = 4,
+        WRITE_AGAIN = 8,
+        FRAMED = 16,  // 连接已协商为分帧协议，见“分帧协议”一节
+        MAGIC_ALLOWED = 32,  // 客户端连接还没有任何字节被处理过，第一个字节可以是 FRAME_MAGIC
+        LOCAL = 64,          // Unix socket 上的客户端，没有 TCP 选项
+        BUSY = READING | READ_AGAIN | WRITING | WRITE_AGAIN,
+    };
+
+    bool count(int fd) const { return kind(fd) != ConnKind::None; }
+    ConnKind kind(int fd) const {
+        return fd >= 0 && (size_t)fd < kind_.size() ? kind_[fd] : ConnKind::None;
+    }
+    Addr48 addr(int fd) const { return addr_[fd]; }
+    uint32_t user_id(int fd) const { return user_id_[fd]; }
+    void set_user_id(int fd, uint32_t id) { user_id_[fd] = id; }
+    uint8_t& flags(int fd) { return flags_[fd]; }
+    bool framed(int fd) const { return flags_[fd] & FRAMED; }
+    size_t size() const { return size_; }
+
+    void insert(int fd, Addr48 addr, ConnKind kind);
+    void erase(int fd);
+    // 按地址查找，-1 表示不存在
+    int find(Addr48 addr) const { return index_.find(addr); }
+
+    // 冷数据：info() 按需分配并记为活跃，info_if_present() 不分配
+    ClientInfo& info(int fd) {
+        ColdEntry* entry = info_[fd].get();
+        if (entry == nullptr) entry = attach_info(fd);
+        entry->touched = epoch_;
+        return entry->info;
+    }
+    ClientInfo* info_if_present(int fd) { return count(fd) && info_[fd] ? &info_[fd]->info : nullptr; }
+    // 冷数据的分配序号，0 表示没有冷数据。fd 被新连接复用后序号一定不同，用来识别过期的任务
+    uint64_t info_serial(int fd) const { return count(fd) && info_[fd] ? info_[fd]->serial : 0; }
+    /**
+     * @brief 开始新的清理周期，处理上一个完整周期内都没有被 info() 访问过的连接：
+     * 没有待处理数据、不在直连模式或文件传输中、也没有线程在处理的释放冷数据，
+     * 其余的只把已清空的读写缓冲区的内存还给内存池。返回释放冷数据的连接数
+     */
+    size_t sweep_idle();
+
+    template <typename F>
+    void for_each(F&& f) const {
+        for (size_t fd = 0; fd < kind_.size(); ++fd) {
+            if (kind_[fd] != ConnKind::None) f((int)fd);
+        }
+    }
+    size_t memory_usage() const;
+
+private:
+    // 冷数据连同清理用的记录一起从 SlabPool 分配
+    struct ColdEntry {
+        ClientInfo info;
+        uint32_t touched = 0;  // 最近一次被访问时的清理周期号
+        uint32_t slot = 0;     // 在 cold_fds_ 中的下标
+        uint64_t serial = 0;   // 分配序号，见 info_serial()
+
+        static void* operator new(size_t n) { return SlabPool::allocate(n); }
+        static void operator delete(void* p, size_t n) { SlabPool::deallocate(p, n); }
+    };
+    ColdEntry* attach_info(int fd);
+    void drop_info(int fd);
+
+    std::vector<ConnKind> kind_;
+    std::vector<uint8_t> flags_;
+    std::vector<Addr48> addr_;
+    std::vector<uint32_t> user_id_;
+    std::vector<std::unique_ptr<ColdEntry>> info_;
+    std::vector<int> cold_fds_;  // 有冷数据的连接，清理时只遍历这些
+    uint32_t epoch_ = 0;
+    uint64_t serial_ = 0;
+    AddrIndex index_;
+    size_t size_ = 0;
+};
+
+// 启动参数
+struct ServerConfig {
+    bool memory_report = false;  // 打印空闲连接内存占用报告后退出
+    int port = 8888;
+    int node_port = 0;               // 集群节点间链路的监听端口，0 表示不启用集群
+    std::vector<std::string> peers;  // 其它节点的 "IP:NODE_PORT"
+    std::string upgrade_socket;      // 热升级用的 Unix socket 路径，空表示不启用
+    std::string unix_socket;         // 同机客户端使用的 Unix socket 监听路径，空表示只监听 TCP
+    bool takeover = false;           // 启动时从 upgrade_socket 上正在运行的旧进程接管监听 socket 和全部连接
+    bool coroutines = false;         // 用主线程上的协程代替线程池驱动连接
+    bool switch_bench = false;       // 对比任务模型与协程模型的切换开销后退出
+    std::string spool_dir = "/tmp";  // 文件传输的暂存目录
+    size_t read_quantum = 64 * 1024; // 每个连接每轮最多读入/处理的字节数，0 表示不限
+    size_t message_quantum = 64;     // 每个连接每轮最多处理的消息数，0 表示不限
+    uint32_t trace_sample = 0;       // 每 N 条消息追踪一条，0 表示关闭
+    std::string trace_file = "/tmp/tcpchat-trace.json";  // TRACE 命令导出的文件
+    std::string capture_file;        // 流量录制文件，空表示不录制
+    int idle_release_ms = 1000;      // 连接安静多久后释放其缓冲区，0 表示不释放
+    bool alloc_bench = false;        // 对比内存池与默认堆在连接创建/销毁下的开销后退出
+    bool directory_bench = false;    // 对比在线目录快照与加锁查询在连接抖动下的查询吞吐后退出
+    bool priority_lanes = true;      // 控制消息走优先通道，--no-priority 关闭（对照用）
+    int notsent_lowat = 128 * 1024;  // 内核发送队列中未发出数据的上限，0 表示使用内核默认（不限）
+    bool low_latency = false;        // 低延迟模式：事件在主线程上直接处理，空闲时先自旋再休眠
+    int spin_us = 100;               // 低延迟模式下 epoll_wait 阻塞前先轮询的微秒数
+    int busy_poll_us = 50;           // 低延迟模式下 socket 与 epoll 的内核忙轮询时长(SO_BUSY_POLL)，0 表示不设置
+    int listen_backlog = 4096;       // listen 的全连接队列长度（受 net.core.somaxconn 限制）
+    int event_batch = 128;           // 每次 epoll_wait 最多取回的事件数
+    size_t min_workers = 4;          // 线程池最少线程数
+    size_t max_workers = 0;          // 线程池最多线程数，0 表示 max(16, 2 * CPU 数)
+    uint32_t pool_wait_us = 500;     // 任务平均排队超过这个时长（且线程忙）时线程池扩容
+    bool pool_bench = false;         // 阶跃负载下对比固定线程池与弹性线程池后退出
+    bool pipeline = false;           // 分级流水线模式：I/O 线程、路由线程、写线程经 SPSC 环整批传递
+    int pipeline_io = 2;             // 流水线模式的 I/O 线程数
+    int pipeline_writers = 2;        // 流水线模式的写线程数
+    std::string search_dir;          // 消息搜索的索引目录，空表示不启用
+    uint64_t search_bench = 0;       // 非 0 时向搜索索引灌入这么多条合成消息、测量查询延迟后退出
+};
+
+// 用户名注册表：名字驻留为稳定的整数 ID（从 1 开始，不回收），按 ID 直接下标找到在线连接。
+// ID 不回收，名字总数设上限，不能靠不断 LOGIN 新名字把注册表撑大
+struct UserRegistry {
+    static const size_t MAX_NAMES = 1 << 20;
+
+    std::unordered_map<std::string, uint32_t> ids;  // 名字 -> ID
+    std::vector<std::string> names{""};             // ID -> 名字，下标 0 保留
+    std::vector<int> online_fd{-1};                 // ID -> 当前绑定的 fd，-1 表示离线
+    std::vector<uint32_t> session{0};               // ID -> 有序投递的会话号，每次 LOGIN 加一，RESUME 不变
+    std::vector<std::vector<SeqConversation*>> conversations{{}};  // ID -> 作为发送方的有序投递会话
+
+    // 名字数已达上限时返回 0
+    uint32_t intern(const std::string& name) {
+        auto it = ids.find(name);
+        if (it != ids.end()) return it->second;
+        if (names.size() > MAX_NAMES) return 0;
+        uint32_t id = names.size();
+        ids.emplace(name, id);
+        names.push_back(name);
+        online_fd.push_back(-1);
+        session.push_back(0);
+        conversations.emplace_back();
+        return id;
+    }
+    // 不存在或离线时返回 -1
+    int fd_of(uint32_t id) const {
+        return id < online_fd.size() ? online_fd[id] : -1;
+    }
+};
+
+/**
+ * @brief 主题订阅索引：主题是以 '.' 分隔的单词序列（如 ops.db.primary），订阅模式中 '*' 匹配恰好一个单词，
+ * '#' 匹配零个或多个单词（相邻的多个 '#' 与一个等价，订阅时合并）。模式按单词存进前缀树，通配符各占一个专门的子节点；
+ * 发布时按主题的单词逐个推进当前可能所在的节点集合，每一步同时走精确单词、'*' 和 '#' 三路，集合中的节点不重复。
+ * 每个主题匹配到的订阅者（去重、按 fd 排序）缓存起来，订阅变化时只作废被该模式匹配到的缓存项（连接断开时整体清空），
+ * 反复发布到同一批主题时不必每次走树。由 clients_mutex 保护
+ */
+class TopicIndex {
+public:
+    static const size_t MAX_TOPIC = 255;           // 主题和模式的最大长度
+    static const size_t MAX_PER_CONN = 4096;       // 每个连接最多的订阅数
+    static const size_t MAX_CACHED = 4096;         // 缓存的主题数上限，满了整体清空
+
+    TopicIndex() : nodes_(1) {}
+    // 主题不能含通配符，模式中的通配符必须独占一个单词；单词非空，不含空白
+    static bool valid(std::string_view text, bool pattern);
+    // 把有效模式中相邻的 '#' 合并为一个
+    static std::string normalize(std::string_view pattern);
+    // 返回 false 表示已经订阅过（subscribe）或没有订阅过（unsubscribe）
+    bool subscribe(int fd, const std::string& pattern);
+    bool unsubscribe(int fd, const std::string& pattern);
+    void remove_fd(int fd);  // 连接断开时取消它的全部订阅
+    size_t count(int fd) const;
+    // 匹配 topic 的订阅者 fd，引用在下一次订阅变化前有效
+    const std::vector<int>& match(const std::string& topic);
+    const std::unordered_map<int, std::vector<std::string>>& patterns() const { return by_fd_; }
+    std::string stats() const;
+
+private:
+    struct Node {
+        std::unordered_map<std::string, uint32_t> children;  // 精确单词 -> 子节点
+        uint32_t star = 0, hash = 0;                         // '*' / '#' 子节点，0 表示没有（根节点不会是子节点）
+        uint32_t parent = 0;
+        std::string word;
+        std::vector<int> fds;                                // 在此结束的模式的订阅者
+    };
+    static void split(std::string_view text, std::vector<std::string_view>& words);
+    void collect(const std::vector<std::string_view>& words, std::vector<int>& out);
+    void add_state(uint32_t node, std::vector<uint32_t>& states);
+    uint32_t child(uint32_t node, std::string_view word, bool create);
+    void prune(uint32_t node);
+    void detach(int fd, const std::string& pattern, bool invalidate_cache);
+    void invalidate(std::string_view pattern);
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> free_;
+    std::unordered_map<int, std::vector<std::string>> by_fd_;  // fd -> 订阅的模式
+    size_t subscriptions_ = 0;
+    std::unordered_map<std::string, std::vector<int>> cache_;   // 主题 -> 订阅者
+    uint64_t hits_ = 0, misses_ = 0;
+    // collect 的工作区：当前/下一步的节点集合，节点最近一次加入集合的步号
+    std::vector<uint32_t> states_, next_states_;
+    std::vector<uint32_t> mark_;
+    uint32_t step_ = 0;
+};
+
+// 在线目录的一项：本节点的客户端（可能已登录）或经集群链路可达的远端客户端
+struct DirectoryEntry {
+    Addr48 addr;
+    uint32_t user_id;  // 0 表示未登录（远端客户端总是 0）
+    bool remote;
+    std::string name;
+};
+
+// 不可变的目录快照：按地址排序的列表，外加发布时建好的开放寻址索引（槽中存下标 + 1，0 表示空槽）
+struct DirectorySnapshot {
+    uint64_t version = 0;
+    std::vector<DirectoryEntry> entries;
+    std::vector<uint32_t> index;
+    int shift = 64;
+
+    void build_index();
+    const DirectoryEntry* find(Addr48 addr) const;
+};
+
+/**
+ * @brief 在线目录（读多写少）：连接、断开、登录和集群通告只把增量记进待发布队列，发布线程攒 PUBLISH_DELAY_MS 后
+ * 把增量合并进当前快照生成新快照，原子替换后发布。读者不加任何锁：进入读区间时登记当前纪元，离开时清除；
+ * 被替换的快照要等所有登记了不晚于其退役纪元的读者离开后才释放（基于纪元的回收，RCU 风格）。
+ * 快照最多落后 PUBLISH_DELAY_MS 加一次合并的时间
+ */
+class Directory {
+public:
+    Directory();
+    ~Directory();
+    Directory(const Directory&) = delete;
+    Directory& operator=(const Directory&) = delete;
+    void start();  // 启动发布线程，之前记下的增量在第一次发布时生效
+    void set(Addr48 addr, uint32_t user_id, const std::string& name, bool remote);
+    void remove(Addr48 addr);
+    uint64_t publishes() const { return publishes_.load(std::memory_order_relaxed); }
+
+    // 读区间：存活期间快照不会被释放。同一线程不能嵌套
+    class ReadGuard {
+    public:
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+        ~ReadGuard() {
+            slot_.store(0, std::memory_order_release);
+            if (lock_ != nullptr) pthread_mutex_unlock(lock_);
+        }
+        const DirectorySnapshot& operator*() const { return *snapshot_; }
+        const DirectorySnapshot* operator->() const { return snapshot_; }
+
+    private:
+        friend class Directory;
+        ReadGuard(std::atomic<uint64_t>& slot, const DirectorySnapshot* snapshot, pthread_mutex_t* lock)
+            : slot_(slot), snapshot_(snapshot), lock_(lock) {}
+        std::atomic<uint64_t>& slot_;
+        const DirectorySnapshot* snapshot_;
+        pthread_mutex_t* lock_;  // 没分到登记槽时持有的共用槽锁
+    };
+    ReadGuard read() const;
+
+private:
+    struct Delta {
+        Addr48 addr;
+        bool online;
+        bool remote;
+        uint32_t user_id;
+        std::string name;
+    };
+    // 同时存活的读者线程各占一个登记槽，线程退出时归还；槽用完后其余线程轮流用一个加锁的共用槽
+    static const size_t MAX_READERS = 1024;
+    static const int PUBLISH_DELAY_MS = 10;
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> epoch{0};  // 0 表示不在读区间
+    };
+
+    void push(Delta delta);
+    static void* publisher_entry(void* arg);
+    void publisher_loop();
+    void publish(std::vector<Delta>& deltas);
+    void reclaim();
+
+    std::atomic<const DirectorySnapshot*> current_;
+    std::atomic<uint64_t> epoch_{1};
+    std::atomic<uint64_t> publishes_{0};
+    mutable ReaderSlot slots_[MAX_READERS];
+    mutable ReaderSlot shared_slot_;
+    mutable pthread_mutex_t shared_slot_mutex_;
+    std::vector<std::pair<const DirectorySnapshot*, uint64_t>> retired_;  // (快照, 退役纪元)，只由发布线程访问
+
+    pthread_mutex_t mutex_;  // 保护 pending_ 和 stop_
+    pthread_cond_t cond_;
+    std::vector<Delta> pending_;
+    bool stop_ = false;
+    bool started_ = false;
+    pthread_t thread_;
+};
+
+// 紧凑二进制消息：0x01 + 目标用户 ID(4 字节, 大端) + 内容长度(4 字节, 大端) + 内容
+// 服务器按 ID 直接路由，无需任何字符串解析；内容可包含换行等任意字节
+static const char COMPACT_MSG_MAGIC = 0x01;
+static const size_t COMPACT_MSG_HEADER = 9;
+
+// 分帧协议：连接的第一个字节为 FRAME_MAGIC 时，此后双向都按 24 字节定长帧头 + 正文收发，见“分帧协议”一节
+static const char FRAME_MAGIC = (char)0xFB;  // 在 UTF-8 文本中不会出现
+static const size_t FRAME_HEADER = 24;
+static const uint32_t FRAME_MAX_BODY = 16 << 20;  // 聊天消息/文本帧正文（以及紧凑二进制消息内容）的上限，文件数据块不受限（不进读缓冲区）
+
+enum FrameType : uint8_t {
+    FRAME_MSG = 1,       // 聊天消息：target 为目标地址或用户 ID（收到时为发送方地址），seq 非 0 表示有序投递
+    FRAME_TEXT = 2,      // 一行文本：客户端发来的命令或文本消息、服务器的回复和通知，正文不含换行符
+    FRAME_FILEDATA = 3,  // 文件数据块：target 为传输 ID
+};
+
+// 帧头标志位
+static const uint8_t FRAME_TO_USER = 1;  // MSG 帧的 target 是用户 ID 而不是 IP:PORT
+static const uint8_t FRAME_MULTI = 2;    // MSG 帧发给多个目标：正文开头为目标数(4) + 每个目标 8 字节，其后才是内容，忽略 target
+
+// 帧头（大端）：正文长度(4) + 类型(1) + 标志(1) + 保留(2) + 目标(8) + 序号(8)
+struct FrameHeader {
+    uint32_t length = 0;
+    uint8_t type = 0;
+    uint8_t flags = 0;
+    uint64_t target = 0;
+    uint64_t seq = 0;
+};
+
+/**
+ * @brief 流量录制：把客户端的上线、下线和每一次消息投递连同时间戳记进一个紧凑的二进制文件，用 bench replay
+ * 对任意版本的服务器按原节奏（或按倍速）重放。文件格式（整数均为 LEB128 变长编码）：
+ *   文件头  "TCAP" + 版本(1 字节)
+ *   记录    类型(1 字节) + 距上一条记录的微秒数 + 字段
+ *           CONNECT    连接号
+ *           DISCONNECT 连接号
+ *           MESSAGE    发送方连接号 + 目标连接号 + 内容长度（来自其它节点的消息发送方为 0）
+ * 连接号从 1 开始按上线顺序分配，不记录地址和消息内容。记录先追加到内存缓冲区，写出线程每 WRITE_INTERVAL_MS
+ * 写一次文件，进程被杀时最多丢失这段时间的记录。关闭时每个记录点只多一次判断
+ */
+class Capture {
+public:
+    enum Record : uint8_t { CONNECT = 1, DISCONNECT = 2, MESSAGE = 3 };
+
+    Capture();
+    ~Capture();
+    Capture(const Capture&) = delete;
+    Capture& operator=(const Capture&) = delete;
+    // 创建文件、写入文件头并启动写出线程，失败抛异常；只在启动时调用
+    void start(const std::string& path);
+    // 停止写出线程，把剩余记录写进文件
+    void stop();
+    bool enabled() const { return file_ != nullptr; }
+
+    void connect(Addr48 addr) {
+        if (enabled()) record(CONNECT, addr, 0, 0);
+    }
+    void disconnect(Addr48 addr) {
+        if (enabled()) record(DISCONNECT, addr, 0, 0);
+    }
+    void message(Addr48 from, Addr48 to, size_t len) {
+        if (enabled()) record(MESSAGE, from, to, len);
+    }
+
+private:
+    static const int WRITE_INTERVAL_MS = 100;
+
+    void record(Record type, Addr48 a, Addr48 b, size_t len);
+    void put_varint(uint64_t value);
+    static void* writer_entry(void* arg);
+    void writer_loop();
+
+    FILE* file_ = nullptr;
+    pthread_mutex_t mutex_;  // 保护以下成员（file_ 除外，只由写出线程和 stop 使用）
+    std::string pending_;
+    std::unordered_map<Addr48, uint64_t> ids_;  // 在线客户端地址 -> 连接号
+    uint64_t next_id_ = 1;
+    uint64_t last_us_ = 0;
+    bool stop_ = false;
+    bool started_ = false;
+    pthread_t thread_;
+};
+extern Capture capture;
+
+/**
+ * @brief 消息全文搜索：每条投递出去的聊天消息（发送方、接收方、时间、内容）在路由路径上只做一次内存拷贝，追加进待索引队列；
+ * 索引线程每 INDEX_INTERVAL_MS 取走一批分词，建进内存段，内存段攒满 SEGMENT_DOCS 条或最早一条已等了 FLUSH_SECONDS 秒时
+ * 写成 --search-dir 下的一个只读段文件（先写 .tmp 再改名）并 mmap 回来。段文件按 LSM 的方式分级合并：相邻 MERGE_FANIN 个
+ * 同级的段由合并线程合成一个上一级的段，一亿条消息也只有二十个左右的段。查询同样由索引线程处理（先索引完队列中的消息，
+ * 保证查得到此前投递的每一条），只在发起者参与的消息里找，按会话分组，结果经 notify_fd() 交给主线程回复。
+ * 每个连接同时只能有一个查询未取回结果，全部连接合计最多 MAX_QUERIES 个，索引线程每轮的查询工作量因此有上限。
+ * 收发双方以标签记录：已登录用户为 "@用户名"（重启、换连接后不变），否则为 IP:PORT；只有 "@" 开头的标签能发起查询。
+ * 段文件格式见“消息搜索实现”一节，分词规则见 search_tokens()
+ */
+class SearchIndex {
+public:
+    struct Hit {
+        std::string peer;   // 会话的另一方
+        std::string sender;
+        int64_t time_ms;    // 投递时的系统时间
+        std::string text;   // 命中位置附近的片段
+    };
+    // 一次查询的结果。回复前主线程核对 fd 仍是发起查询的那个连接
+    struct Result {
+        int fd = -1;
+        Addr48 addr = 0;
+        std::string error;
+        std::vector<Hit> hits;     // 按会话分组，会话按最近一条命中排序，组内由新到旧
+        size_t matched = 0;        // 命中的消息数，truncated 时只是下限
+        size_t conversations = 0;
+        bool truncated = false;
+        uint64_t micros = 0;       // 从收到查询到得出结果
+    };
+    struct Stats {
+        uint64_t docs = 0;         // 已建进索引的消息数（含内存段）
+        size_t segments = 0;
+        uint64_t disk_bytes = 0;
+        size_t backlog = 0;        // 待索引（含正在索引）的消息字节数
+        uint64_t dropped = 0;      // 队列超过 MAX_BACKLOG 时丢弃的消息数
+        uint64_t merges = 0;
+        bool merging = false;
+    };
+
+    SearchIndex();
+    ~SearchIndex();
+    SearchIndex(const SearchIndex&) = delete;
+    SearchIndex& operator=(const SearchIndex&) = delete;
+    // 指定索引目录，此后 add() 开始排队；start() 之前不访问磁盘
+    void configure(const std::string& dir) { dir_ = dir; }
+    bool enabled() const { return !dir_.empty(); }
+    // 加载目录中的段并启动索引线程和合并线程，失败抛异常
+    void start();
+    // 索引完队列中的消息、答完已收到的查询、写出内存段后停止；进行中的合并放弃，下次启动时重做
+    void stop();
+
+    void add(std::string_view sender, std::string_view recipient, const char* data, size_t len);
+    // 该连接上一个查询的结果还没取走、或未完成的查询已达 MAX_QUERIES 个时不受理，返回 false
+    bool query(int fd, Addr48 addr, const std::string& who, const std::string& words);
+    // 取走已完成的查询，主线程在 notify_fd() 可读时调用
+    std::vector<Result> take_results();
+    int notify_fd() const { return event_fd_; }
+    Stats stats();
+
+private:
+    static const int INDEX_INTERVAL_MS = 20;
+    static const uint32_t SEGMENT_DOCS = 65536;
+    static const int FLUSH_SECONDS = 10;
+    static const int MERGE_FANIN = 4;
+    static const size_t MAX_TEXT = 4096;            // 每条消息只索引、保存前 MAX_TEXT 字节
+    static const size_t MAX_LABEL = 64;             // 收发方标签的最大长度
+    static const size_t MAX_BACKLOG = 64 << 20;
+    static const size_t PER_CONVERSATION = 3;       // 每个会话最多返回的命中数
+    static const size_t MAX_CONVERSATIONS = 10;
+    static const size_t MAX_MATCHES = 5000;         // 一次查询最多检查的命中数
+    static const size_t MAX_QUERY_TOKENS = 16;      // 一次查询最多的词数（含中文二元词）
+    static const size_t MAX_QUERIES = 64;           // 排队、执行中和结果未取走的查询总数上限
+
+    struct FileHeader;
+    struct DocMeta;
+    struct TermEntry;
+    struct Segment;
+    struct MemSegment;
+    struct Writer;
+    struct Collector;
+    struct Query {
+        int fd;
+        Addr48 addr;
+        std::string who;
+        std::string words;
+        uint64_t start_ns;
+    };
+
+    static void* indexer_entry(void* arg);
+    static void* merger_entry(void* arg);
+    void indexer_loop();
+    void merger_loop();
+    void index_batch(const std::string& batch);
+    void flush_memory();
+    Result run_query(const Query& q);
+    std::shared_ptr<Segment> merge(const std::vector<std::shared_ptr<Segment>>& run);
+    void load_segments();
+    static int level_of(uint64_t docs);
+
+    std::string dir_;
+    pthread_mutex_t mutex_;  // 保护以下到 merges_ 为止的成员
+    pthread_cond_t cond_;        // 有查询或要停止时唤醒索引线程
+    pthread_cond_t merge_cond_;  // 有新段或要停止时唤醒合并线程
+    std::string pending_;
+    size_t indexing_ = 0;  // 索引线程取走、还没建完的字节数
+    uint64_t dropped_ = 0;
+    std::vector<Query> queries_;
+    std::vector<Result> results_;
+    std::vector<Addr48> querying_;  // 查询未取回结果的连接，最多 MAX_QUERIES 个
+    std::vector<std::shared_ptr<Segment>> segments_;  // 由旧到新，文档号区间首尾相接（可能有跳过损坏段留下的空洞）
+    uint64_t indexed_ = 0;
+    uint64_t merges_ = 0;
+    bool merging_ = false;
+    bool stop_ = false;
+    std::atomic<bool> stopping_{false};      // 合并线程不持锁检查
+    std::unique_ptr<MemSegment> memory_;     // 以下两项只由索引线程访问
+    uint64_t next_doc_ = 0;
+    bool started_ = false;
+    int event_fd_ = -1;
+    pthread_t indexer_;
+    pthread_t merger_;
 };
 
 // 服务器上下文/状态集合
 struct ServerContext {
     int epoll_fd;
-    std::unordered_map<int, ClientInfo> clients;
-    pthread_mutex_t clients_mutex; // 用于保护 clients map 的互斥锁
+    ClientTable clients;
+    pthread_mutex_t clients_mutex; // 用于保护 clients 连接表的互斥锁
+
+    UserRegistry users;  // 由 clients_mutex 保护
+    TopicIndex topics;   // 主题订阅，同样由 clients_mutex 保护
+    Directory directory;  // 在线目录快照，读取不需要任何锁；更新在持有 clients_mutex 时与连接表同步记下
+    SearchIndex search;   // 消息搜索，未指定 --search-dir 时不启用
+
+    // 集群：节点链路 fd 列表，以及连接在其它节点上的客户端地址 -> 通往该节点的链路 fd，同样由 clients_mutex 保护
+    std::vector<int> node_links;
+    std::unordered_map<Addr48, int> remote_clients;
+
+    // 文件传输：ID -> 传输，同样由 clients_mutex 保护
+    std::unordered_map<uint64_t, std::shared_ptr<FileTransfer>> transfers;
+    uint64_t next_transfer_id = 1;
+    std::string spool_dir;
+
+    // 有序投递：4 字节发送方 ID + 目标 -> 会话，同样由 clients_mutex 保护
+    std::unordered_map<std::string, SeqConversation> conversations;
+    uint64_t seq_ticks = 0;  // 每收到一条有序消息加一，用来找出最久未用的会话
+
+    CoScheduler* scheduler = nullptr;  // 非空表示 --coroutines 模式
+    ThreadPool* pool = nullptr;        // 线程池模式下额度用完的连接把后续处理重新排入线程池
+
+    // 公平调度的每轮额度，见 ServerConfig
+    size_t read_quantum = SIZE_MAX;
+    size_t message_quantum = SIZE_MAX;
+
+    bool priority_lanes = true;  // 控制消息走优先通道，false 时全部按到达顺序排队（对照用）
+    int notsent_lowat = 0;       // 新连接的 TCP_NOTSENT_LOWAT，0 表示不设置
+
+    // 低延迟模式：读写事件在主线程上直接处理，不经线程池；额度用完的连接排进 resume_queue（只由主线程访问），
+    // 新连接设置 TCP_NODELAY、SO_BUSY_POLL，每次读空后重新打开 TCP_QUICKACK
+    bool low_latency = false;
+    int busy_poll_us = 0;
+    std::deque<int> resume_queue;
+
+    // 热升级交接期间置位：读循环不再读空 socket，尽快结束当前任务，剩余数据留给新进程
+    std::atomic<bool> pausing{false};
+
+    // 预留的 fd：文件描述符用尽时关掉它腾出一个位置，接受并立即关闭排队的连接，否则边沿触发的监听 socket 不会再通知
+    int spare_fd = -1;
+};
+
+/**
+ * @brief 一个连接一轮（一次调度）的剩余额度。用完后连接让出线程或主线程，排到队尾等下一轮，
+ * 其它连接依次轮到后才继续，见“公平调度”一节
+ */
+struct TurnBudget {
+    size_t bytes = SIZE_MAX;     // 本轮还能从 socket 读入的字节数
+    size_t messages = SIZE_MAX;  // 本轮还能处理的消息数
 };
 
 // --- 全局业务逻辑函数 ---
@@ -70,21 +1160,112 @@ void add_fd_to_epoll(int epoll_fd, int fd, uint32_t events);
 void modify_fd_in_epoll(int epoll_fd, int fd, uint32_t events);
 void remove_fd_from_epoll(int epoll_fd, int fd);
 void disconnect_client(ServerContext& context, int fd);
-bool parse_message(const std::string& raw_buf, std::string& target_ip, int& target_port, std::string& msg_content);
-void handle_new_connection(int listen_fd, ServerContext& context);
+bool parse_message(const std::string& raw_buf, Addr48& target_addr, size_t& content_pos);
+bool parse_recipients(const char* data, size_t len, std::vector<Addr48>& targets, size_t& content_pos);
+int find_client_fd(ServerContext& context, Addr48 addr);
+void queue_output(ServerContext& context, int fd, const std::string& data);
+void queue_output(ServerContext& context, int fd, const char* data, size_t len);
+void queue_urgent(ServerContext& context, int fd, const std::string& data);
+void queue_urgent(ServerContext& context, int fd, const char* data, size_t len);
+void queue_message(ServerContext& context, int fd, Addr48 from, const char* data, size_t len);
+void queue_content(ServerContext& context, int fd, Addr48 from, uint64_t seq, const char* data, size_t len, bool urgent = false);
+void encode_frame_header(char* out, const FrameHeader& header);
+FrameHeader decode_frame_header(const char* in);
+void handle_frame(ServerContext& context, int fd, const FrameHeader& header, const char* body);
+void handle_client_line(ServerContext& context, int fd, const std::string& message);
+size_t next_output(ClientInfo& info, bool& urgent);
+void output_written(ClientInfo& info, bool urgent, size_t n);
+void request_write(ServerContext& context, int fd);
+bool handle_command(ServerContext& context, int fd, const std::string& message);
+void handle_login(ServerContext& context, int fd, const std::string& name, bool resume);
+void handle_seq(ServerContext& context, int fd, std::string_view args);
+void deliver_seq(ServerContext& context, int fd, uint64_t seq, std::string_view target, const char* content, size_t len);
+void seq_written(ServerContext& context, ClientInfo& info);
+void seq_rollback(ServerContext& context, ClientInfo& info);
+void route_to_user(ServerContext& context, int fd, uint32_t user_id, const char* data, size_t len);
+void route_to_addr(ServerContext& context, int fd, Addr48 target_addr, const char* data, size_t len);
+void route_to_many(ServerContext& context, int fd, const std::vector<uint64_t>& targets, bool to_user, const char* data, size_t len);
+std::string who_reply(const Directory& directory, const DirectoryEntry& self);
+void handle_subscribe(ServerContext& context, int fd, const std::string& text, bool subscribe);
+void handle_publish(ServerContext& context, int fd, std::string_view args);
+void index_delivery(ServerContext& context, int fd, Addr48 from, const char* data, size_t len);
+void handle_search(ServerContext& context, int fd, const std::string& words);
+void deliver_search_results(ServerContext& context);
+bool route_by_name(ServerContext& context, int fd, const std::string& message);
+void establish_pair(ServerContext& context, int fd, int peer_fd);
+void release_pair(ServerContext& context, int fd, bool deliver_pending);
+bool relay_read_event(ServerContext& context, int fd, size_t budget = SIZE_MAX, bool* budget_spent = nullptr);
+void flush_relay_pipe(ServerContext& context, int src_fd, int dst_fd);
+void finish_stream(ServerContext& context, int fd);
+void cancel_stream(ServerContext& context, ClientInfo& target, const char* reason);
+void interrupt_stream(ServerContext& context, int src_fd, const char* reason);
+bool stream_stalled(ServerContext& context, int fd);
+void stream_written(ServerContext& context, ClientInfo& info);
+void abort_streams(ServerContext& context);
+void handle_file_offer(ServerContext& context, int fd, const std::string& args);
+void handle_file_reply(ServerContext& context, int fd, const std::string& args, bool accept);
+void handle_file_data(ServerContext& context, int fd, const std::string& args);
+void start_upload(ServerContext& context, int fd, uint64_t id, uint64_t len);
+bool spool_buffered(ServerContext& context, int fd);
+void drop_transfers(ServerContext& context, int fd);
+bool upload_read_event(ServerContext& context, int fd, size_t budget = SIZE_MAX, bool* budget_spent = nullptr);
+int send_file_chunk(ServerContext& context, int fd);
+bool start_file_chunk(ServerContext& context, int fd);
+void handle_new_connection(int listen_fd, ServerContext& context, ConnKind kind);
+Addr48 unix_peer_addr(ServerContext& context, int fd);
+void tune_socket(const ServerContext& context, int fd);
+void rearm_quickack(ServerContext& context, int fd);
+void parse_args(int argc, char* argv[], ServerConfig& config);
+void connect_to_peers(ServerContext& context, const ServerConfig& config);
+void broadcast_to_nodes(ServerContext& context, const std::string& line);
+void announce_local_clients(ServerContext& context, int link_fd);
+void handle_node_line(ServerContext& context, int link_fd, const std::string& line);
 void handle_read_event(ServerContext& context, int fd);
 void handle_write_event(ServerContext& context, int fd);
+bool process_read_event(ServerContext& context, int fd);
+void continue_read(ServerContext& context, int fd);
+void process_write_event(ServerContext& context, int fd);
+bool enter_handler(ServerContext& context, int fd, uint8_t busy, uint8_t again);
+bool leave_handler(ServerContext& context, int fd, uint8_t busy, uint8_t again);
+void report_idle_memory();
+bool process_messages(ServerContext& context, int fd, TurnBudget* turn = nullptr);
+TurnBudget start_turn(ServerContext& context, int fd);
+void end_turn(ServerContext& context, int fd);
+uint32_t conn_events(const ServerContext& context);
+void watch_fd(ServerContext& context, int fd, uint32_t events);
+void start_sessions(ServerContext& context, int fd);
+void run_switch_bench();
+void run_alloc_bench();
+void run_directory_bench();
+void run_pool_bench();
+void run_search_bench(const std::string& dir, uint64_t messages);
+int create_sweep_timer(int interval_ms);
+void sweep_idle_connections(ServerContext& context, int sweep_fd);
+void expire_streams(ServerContext& context, int timer_fd);
+int create_upgrade_socket(const std::string& path);
+bool hand_off_state(ServerContext& context, ThreadPool& pool, int upgrade_fd, int listen_fd, int node_listen_fd, int unix_listen_fd);
+void take_over_state(ServerContext& context, ThreadPool& pool, const std::string& path, int& listen_fd, int& node_listen_fd,
+                     int& unix_listen_fd);
 
 // --- 具体任务类 ---
 class ReadTask : public Task {
 public:
-    ReadTask(ServerContext& context, int fd) : context_(context), fd_(fd) {}
+    // resume 为 true 表示上一轮额度用完后排队的后续处理，连接仍处于 READING 状态
+    ReadTask(ServerContext& context, int fd, bool resume = false)
+        : context_(context), fd_(fd), resume_(resume), queued_ns_(tracer.now()) {}
     void execute() override {
-        handle_read_event(context_, fd_);
+        tracer.start_turn(queued_ns_);
+        if (resume_) {
+            continue_read(context_, fd_);
+        } else {
+            handle_read_event(context_, fd_);
+        }
     }
 private:
     ServerContext& context_;
     int fd_;
+    bool resume_;
+    uint64_t queued_ns_;  // 入队时间，只在开启消息追踪时记录
 };
 
 class WriteTask : public Task {
@@ -99,35 +1280,82 @@ private:
 };
 
 // --- ThreadPool 类实现 ---
-ThreadPool::ThreadPool(size_t size) {
+ThreadPool::ThreadPool(size_t min_threads, size_t max_threads, uint32_t grow_wait_us)
+    : min_threads_(std::max<size_t>(1, min_threads)),
+      max_threads_(std::max(min_threads_, max_threads)),
+      grow_wait_ns_(grow_wait_us * 1000ULL) {
     pthread_mutex_init(&queue_mutex_, nullptr);
     pthread_cond_init(&queue_cond_, nullptr);
-    threads_.resize(size);
-    for (size_t i = 0; i < size; ++i) {
-        if (pthread_create(&threads_[i], nullptr, worker_entry, this) != 0) {
-            throw std::runtime_error("无法创建线程");
-        }
+    pthread_cond_init(&idle_cond_, nullptr);
+    stats_.min_threads = min_threads_;
+    stats_.max_threads = max_threads_;
+    pthread_mutex_lock(&queue_mutex_);
+    spawn(min_threads_);
+    sample_start_ns_ = Tracer::clock_ns();
+    pthread_mutex_unlock(&queue_mutex_);
+    if (pthread_create(&controller_, nullptr, controller_entry, this) != 0) {
+        throw std::runtime_error("无法创建线程池调节线程");
     }
+    controller_started_ = true;
 }
 ThreadPool::~ThreadPool() {
-    {
+    if (controller_started_) {
         pthread_mutex_lock(&queue_mutex_);
-        stop_ = true;
+        controller_stop_ = true;
         pthread_mutex_unlock(&queue_mutex_);
+        pthread_join(controller_, nullptr);
     }
+    // 调节线程已停止，此后线程列表不再变化
+    pthread_mutex_lock(&queue_mutex_);
+    stop_ = true;
+    retire_ = 0;
+    pthread_mutex_unlock(&queue_mutex_);
     pthread_cond_broadcast(&queue_cond_);
     for (pthread_t& thread : threads_) {
         pthread_join(thread, nullptr);
     }
+    for (pthread_t& thread : exited_) {
+        pthread_join(thread, nullptr);
+    }
     pthread_mutex_destroy(&queue_mutex_);
     pthread_cond_destroy(&queue_cond_);
+    pthread_cond_destroy(&idle_cond_);
+}
+void ThreadPool::spawn(size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, worker_entry, this) != 0) {
+            if (threads_.empty()) throw std::runtime_error("无法创建线程");
+            std::cerr << "线程池扩容失败: " << strerror(errno) << std::endl;
+            return;
+        }
+        threads_.push_back(thread);
+    }
 }
 void ThreadPool::add_task(std::unique_ptr<Task> task) {
+    uint64_t now = Tracer::clock_ns();
     pthread_mutex_lock(&queue_mutex_);
-    task_queue_.push_back(std::move(task));
+    task_queue_.push_back(Queued{std::move(task), now});
+    ++arrivals_;
     pthread_mutex_unlock(&queue_mutex_);
     pthread_cond_signal(&queue_cond_);
 }
+void ThreadPool::wait_idle() {
+    pthread_mutex_lock(&queue_mutex_);
+    while (!task_queue_.empty() || active_ > 0) {
+        pthread_cond_wait(&idle_cond_, &queue_mutex_);
+    }
+    pthread_mutex_unlock(&queue_mutex_);
+}
+ThreadPool::Stats ThreadPool::stats() {
+    pthread_mutex_lock(&queue_mutex_);
+    Stats stats = stats_;
+    stats.threads = threads_.size() - std::min(retire_, threads_.size());
+    stats.queued = task_queue_.size();
+    stats.active = active_;
+    pthread_mutex_unlock(&queue_mutex_);
+    return stats;
+}
 void* ThreadPool::worker_entry(void* arg) {
     static_cast<ThreadPool*>(arg)->worker_loop();
     return nullptr;
@@ -137,210 +1365,6862 @@ void ThreadPool::worker_loop() {
         std::unique_ptr<Task> task;
         {
             pthread_mutex_lock(&queue_mutex_);
-            while (!stop_ && task_queue_.empty()) {
+            while (!stop_ && task_queue_.empty() && retire_ == 0) {
                 pthread_cond_wait(&queue_cond_, &queue_mutex_);
             }
             if (stop_ && task_queue_.empty()) {
                 pthread_mutex_unlock(&queue_mutex_);
                 return;
             }
-            task = std::move(task_queue_.front());
+            // 缩容：先看到退出请求的线程退出，队列中的任务留给其余线程
+            if (retire_ > 0) {
+                --retire_;
+                pthread_t self = pthread_self();
+                threads_.erase(std::find_if(threads_.begin(), threads_.end(),
+                                            [&](pthread_t t) { return pthread_equal(t, self); }));
+                exited_.push_back(self);
+                pthread_mutex_unlock(&queue_mutex_);
+                return;
+            }
+            uint64_t now = Tracer::clock_ns();
+            wait_ns_ += now - task_queue_.front().queued_ns;
+            ++waits_;
+            task = std::move(task_queue_.front().task);
             task_queue_.pop_front();
+            ++active_;
             pthread_mutex_unlock(&queue_mutex_);
         }
+        uint64_t start = Tracer::clock_ns();
         if (task) {
             task->execute();
         }
+        uint64_t busy = Tracer::clock_ns() - start;
+        pthread_mutex_lock(&queue_mutex_);
+        busy_ns_ += busy;
+        ++done_;
+        ++stats_.tasks;
+        if (--active_ == 0 && task_queue_.empty()) {
+            pthread_cond_broadcast(&idle_cond_);
+        }
+        pthread_mutex_unlock(&queue_mutex_);
     }
 }
-
-// --- 全局函数实现 ---
-void set_non_blocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags == -1) throw std::system_error(errno, std::generic_category(), "fcntl F_GETFL");
-    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) throw std::system_error(errno, std::generic_category(), "fcntl F_SETFL");
+void* ThreadPool::controller_entry(void* arg) {
+    static_cast<ThreadPool*>(arg)->controller_loop();
+    return nullptr;
 }
-void add_fd_to_epoll(int epoll_fd, int fd, uint32_t events) {
-    epoll_event ev{};
-    ev.data.fd = fd;
-    ev.events = events;
+void ThreadPool::controller_loop() {
+    std::vector<pthread_t> exited;
+    while (true) {
+        usleep(SAMPLE_MS * 1000);
+        pthread_mutex_lock(&queue_mutex_);
+        if (controller_stop_) {
+            pthread_mutex_unlock(&queue_mutex_);
+            return;
+        }
+        size_t before = threads_.size() - std::min(retire_, threads_.size());
+        adjust();
+        size_t after = threads_.size() - std::min(retire_, threads_.size());
+        Stats stats = stats_;
+        exited.swap(exited_);
+        pthread_mutex_unlock(&queue_mutex_);
+        for (pthread_t& thread : exited) pthread_join(thread, nullptr);
+        exited.clear();
+        if (after != before) {
+            std::cout << (after > before ? "线程池扩容: " : "线程池缩容: ") << before << " -> " << after << " (排队 "
+                      << stats.wait_us << " us, 利用率 " << (int)(stats.utilization * 100) << "%)" << std::endl;
+        }
+    }
+}
+// 结束一个采样周期并按需伸缩，调用者需持有 queue_mutex_
+void ThreadPool::adjust() {
+    uint64_t now = Tracer::clock_ns();
+    uint64_t period = std::max<uint64_t>(1, now - sample_start_ns_);
+    size_t threads = threads_.size() - std::min(retire_, threads_.size());
+    uint64_t wait = waits_ != 0 ? wait_ns_ / waits_ : 0;
+    if (!task_queue_.empty()) wait = std::max(wait, now - task_queue_.front().queued_ns);
+    double utilization = std::min(1.0, (double)busy_ns_ / ((double)period * std::max<size_t>(1, threads)));
+    // 需要的线程数：按到达速率维持当前负载，外加在 BACKLOG_DRAIN_MS 内消化已积压的任务
+    double service = done_ != 0 ? (double)busy_ns_ / done_ : 0;
+    double demand = arrivals_ * service / period * TARGET_HEADROOM + task_queue_.size() * service / (BACKLOG_DRAIN_MS * 1e6);
+    size_t target = std::min<size_t>(max_threads_, std::max<size_t>(min_threads_, (size_t)std::ceil(demand)));
+    stats_.wait_us = wait / 1000.0;
+    stats_.utilization = utilization;
+    sample_start_ns_ = now;
+    wait_ns_ = waits_ = busy_ns_ = done_ = arrivals_ = 0;
+
+    over_ = wait > grow_wait_ns_ && utilization > GROW_UTIL ? over_ + 1 : 0;
+    under_ = wait < grow_wait_ns_ / 4 && utilization < SHRINK_UTIL ? under_ + 1 : 0;
+    if (over_ >= GROW_SAMPLES && threads < max_threads_) {
+        size_t n = std::max<size_t>(1, target > threads ? target - threads : 0);
+        // 还有待退出的线程时先撤销退出请求
+        size_t revoked = std::min(retire_, n);
+        retire_ -= revoked;
+        spawn(n - revoked);
+        ++stats_.grows;
+        over_ = 0;
+        last_grow_ns_ = now;
+    } else if (under_ >= SHRINK_SAMPLES && threads > min_threads_ &&
+               now - last_grow_ns_ >= SHRINK_COOLDOWN_MS * 1000000ULL) {
+        retire_ += std::max<size_t>(1, (threads - std::max(target, min_threads_)) / 2);
+        pthread_cond_broadcast(&queue_cond_);
+        ++stats_.shrinks;
+        under_ = 0;
+    }
+}
+
+// --- 内存池实现 ---
+struct SlabPool::ThreadCache {
+    FreeBlock* head[CLASSES] = {};
+    size_t count[CLASSES] = {};
+    uint32_t trim_gen = 0;  // 上次把缓存全部还给仓库时的 slab_trim_gen
+    // 线程退出时把缓存的块全部还给仓库
+    ~ThreadCache() {
+        for (size_t cls = 0; cls < CLASSES; ++cls) spill(*this, cls, 0);
+    }
+};
+
+// 全局仓库：各线程缓存之间周转空闲块
+struct SlabDepot {
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    SlabPool::FreeBlock* head[SlabPool::CLASSES] = {};
+};
+static SlabDepot slab_depot;
+static thread_local SlabPool::ThreadCache slab_cache;
+static std::atomic<uint32_t> slab_trim_gen{0};  // 每次 trim() 加一
+
+void* SlabPool::allocate(size_t n) {
+    if (n > MAX_BLOCK) return ::operator new(n);
+    size_t cls = class_of(n);
+    ThreadCache& cache = slab_cache;
+    if (cache.head[cls] == nullptr) refill(cache, cls);
+    FreeBlock* block = cache.head[cls];
+    cache.head[cls] = block->next;
+    --cache.count[cls];
+    return block;
+}
+void SlabPool::deallocate(void* p, size_t n) {
+    if (n > MAX_BLOCK) {
+        ::operator delete(p);
+        return;
+    }
+    size_t cls = class_of(n);
+    ThreadCache& cache = slab_cache;
+    FreeBlock* block = static_cast<FreeBlock*>(p);
+    block->next = cache.head[cls];
+    cache.head[cls] = block;
+    if (++cache.count[cls] > cache_limit(cls)) spill(cache, cls, cache_limit(cls) / 2);
+    // 上次 trim() 之后第一次释放：缓存的块全部还给仓库，它们所在的 slab 才可能整个空闲
+    uint32_t gen = slab_trim_gen.load(std::memory_order_relaxed);
+    if (cache.trim_gen != gen) {
+        cache.trim_gen = gen;
+        for (size_t c = 0; c < CLASSES; ++c) spill(cache, c, 0);
+    }
+}
+// 从仓库取回至多半个缓存上限的块；仓库也空了就新切一个 slab（小块）或单独申请一块（大块）
+void SlabPool::refill(ThreadCache& cache, size_t cls) {
+    size_t want = std::max<size_t>(1, cache_limit(cls) / 2);
+    pthread_mutex_lock(&slab_depot.mutex);
+    for (; want > 0 && slab_depot.head[cls] != nullptr; --want) {
+        FreeBlock* block = slab_depot.head[cls];
+        slab_depot.head[cls] = block->next;
+        block->next = cache.head[cls];
+        cache.head[cls] = block;
+        ++cache.count[cls];
+    }
+    pthread_mutex_unlock(&slab_depot.mutex);
+    if (cache.head[cls] != nullptr) return;
+
+    size_t size = MIN_BLOCK << cls;
+    size_t blocks = size <= SLAB_MAX_CARVED ? SLAB_SIZE / size : 1;
+    // slab 按自身大小对齐，块地址取整就是所在的 slab，trim() 据此找出全部空闲的 slab
+    char* memory = static_cast<char*>(size <= SLAB_MAX_CARVED ? ::operator new(SLAB_SIZE, std::align_val_t(SLAB_SIZE))
+                                                              : ::operator new(size));
+    for (size_t i = 0; i < blocks; ++i) {
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(memory + i * size);
+        block->next = cache.head[cls];
+        cache.head[cls] = block;
+    }
+    cache.count[cls] += blocks;
+}
+// 把缓存中超出 keep 的块还给仓库
+void SlabPool::spill(ThreadCache& cache, size_t cls, size_t keep) {
+    if (cache.count[cls] <= keep) return;
+    FreeBlock* first = cache.head[cls];
+    FreeBlock* last = first;
+    for (size_t i = keep + 1; i < cache.count[cls]; ++i) last = last->next;
+    cache.head[cls] = last->next;
+    pthread_mutex_lock(&slab_depot.mutex);
+    last->next = slab_depot.head[cls];
+    slab_depot.head[cls] = first;
+    pthread_mutex_unlock(&slab_depot.mutex);
+    cache.count[cls] = keep;
+}
+size_t SlabPool::trim() {
+    slab_trim_gen.fetch_add(1, std::memory_order_relaxed);
+    // 先把仓库整个取出来，统计和释放时不占着仓库的锁；期间 refill() 看到仓库为空会切新的 slab
+    FreeBlock* taken[CLASSES];
+    pthread_mutex_lock(&slab_depot.mutex);
+    for (size_t cls = 0; cls < CLASSES; ++cls) taken[cls] = std::exchange(slab_depot.head[cls], nullptr);
+    pthread_mutex_unlock(&slab_depot.mutex);
+
+    size_t freed = 0;
+    std::unordered_map<uintptr_t, size_t> free_blocks;  // slab -> 其中在仓库里的块数
+    for (size_t cls = 0; cls < CLASSES; ++cls) {
+        size_t size = MIN_BLOCK << cls;
+        if (size > SLAB_MAX_CARVED) {
+            while (taken[cls] != nullptr) {
+                ::operator delete(std::exchange(taken[cls], taken[cls]->next));
+                freed += size;
+            }
+            continue;
+        }
+        free_blocks.clear();
+        for (FreeBlock* block = taken[cls]; block != nullptr; block = block->next) ++free_blocks[slab_of(block)];
+        // 其余 slab 的块留在仓库：块全部空闲的 slab 才能还给堆
+        size_t per_slab = SLAB_SIZE / size;
+        FreeBlock* kept = nullptr;
+        FreeBlock* kept_tail = nullptr;
+        for (FreeBlock* block = taken[cls]; block != nullptr;) {
+            FreeBlock* next = block->next;
+            if (free_blocks[slab_of(block)] != per_slab) {
+                block->next = kept;
+                kept = block;
+                if (kept_tail == nullptr) kept_tail = block;
+            }
+            block = next;
+        }
+        for (const auto& [slab, count] : free_blocks) {
+            if (count != per_slab) continue;
+            ::operator delete(reinterpret_cast<void*>(slab), std::align_val_t(SLAB_SIZE));
+            freed += SLAB_SIZE;
+        }
+        if (kept == nullptr) continue;
+        pthread_mutex_lock(&slab_depot.mutex);
+        kept_tail->next = slab_depot.head[cls];
+        slab_depot.head[cls] = kept;
+        pthread_mutex_unlock(&slab_depot.mutex);
+    }
+    return freed;
+}
+
+// --- 消息追踪实现 ---
+Tracer tracer;
+
+struct Tracer::Ring {
+    static const size_t CAPACITY = 1 << 15;
+    TraceEvent events[CAPACITY];
+    std::atomic<uint64_t> head{0};  // 已写入的事件总数
+    int tid = 0;
+};
+
+// 每个线程当前一轮和当前消息的追踪状态；线程退出时把缓冲区放回空闲表
+struct TraceThreadState {
+    ~TraceThreadState();
+    Tracer::Ring* ring = nullptr;
+    uint64_t poll_ns = 0;
+    uint64_t queued_ns = 0, started_ns = 0;
+    uint64_t read_start = 0, read_end = 0;
+    uint64_t lock_start = 0, lock_end = 0;
+    uint32_t counter = 0;
+    uint32_t msg = 0;  // 正在处理的被追踪消息，0 表示没有
+    int fd = -1;
+    uint64_t parse_start = 0;
+    bool routed = false;
+};
+static thread_local TraceThreadState trace_state;
+
+TraceThreadState::~TraceThreadState() {
+    if (ring == nullptr) return;
+    pthread_mutex_lock(&tracer.rings_mutex_);
+    tracer.free_rings_.push_back(ring);
+    pthread_mutex_unlock(&tracer.rings_mutex_);
+}
+
+uint64_t Tracer::clock_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+Tracer::Ring& Tracer::ring() {
+    if (trace_state.ring == nullptr) {
+        pthread_mutex_lock(&rings_mutex_);
+        if (!free_rings_.empty()) {
+            // 复用已退出线程的缓冲区：之前的事件不再导出，免得记到新线程名下
+            trace_state.ring = free_rings_.back();
+            free_rings_.pop_back();
+            trace_state.ring->head.store(0, std::memory_order_release);
+        } else {
+            trace_state.ring = new Ring;
+            rings_.push_back(trace_state.ring);
+        }
+        trace_state.ring->tid = gettid();
+        pthread_mutex_unlock(&rings_mutex_);
+    }
+    return *trace_state.ring;
+}
+void Tracer::emit(const char* name, uint32_t msg, int fd, uint64_t start_ns, uint64_t end_ns) {
+    Ring& r = ring();
+    uint64_t head = r.head.load(std::memory_order_relaxed);
+    r.events[head % Ring::CAPACITY] = TraceEvent{name, msg, fd, start_ns, end_ns};
+    r.head.store(head + 1, std::memory_order_release);
+}
+
+void Tracer::record_turn(uint64_t queued_ns) {
+    TraceThreadState& st = trace_state;
+    st.queued_ns = queued_ns;
+    st.started_ns = clock_ns();
+    st.read_start = st.read_end = 0;
+    st.lock_start = st.lock_end = 0;
+}
+void Tracer::record_poll() {
+    trace_state.poll_ns = clock_ns();
+}
+uint64_t Tracer::last_poll() const {
+    return trace_state.poll_ns;
+}
+void Tracer::record_read(uint64_t start_ns) {
+    trace_state.read_start = start_ns;
+    trace_state.read_end = clock_ns();
+}
+void Tracer::record_lock(uint64_t start_ns) {
+    trace_state.lock_start = start_ns;
+    trace_state.lock_end = clock_ns();
+}
+
+void Tracer::begin_message(int fd) {
+    TraceThreadState& st = trace_state;
+    if (++st.counter < sample_) return;
+    st.counter = 0;
+    st.msg = next_msg_.fetch_add(1, std::memory_order_relaxed) + 1;
+    st.fd = fd;
+    st.routed = false;
+    st.parse_start = clock_ns();
+    // 本轮的排队、读取、加锁阶段归到这条消息名下
+    if (st.queued_ns != 0 && st.started_ns >= st.queued_ns) emit("queue", st.msg, fd, st.queued_ns, st.started_ns);
+    if (st.read_end != 0) emit("recv", st.msg, fd, st.read_start, st.read_end);
+    if (st.lock_end != 0) emit("lock", st.msg, fd, st.lock_start, st.lock_end);
+}
+void Tracer::end_message() {
+    TraceThreadState& st = trace_state;
+    if (st.msg == 0) return;
+    // 没有送出任何数据的消息（如命令被忽略）只记录解析阶段
+    if (!st.routed) emit("parse", st.msg, st.fd, st.parse_start, clock_ns());
+    st.msg = 0;
+}
+bool Tracer::routing_traced() const {
+    return trace_state.msg != 0 && !trace_state.routed;
+}
+void Tracer::on_route(ClientInfo& target, int target_fd, uint64_t start_ns) {
+    TraceThreadState& st = trace_state;
+    uint64_t end = clock_ns();
+    emit("parse", st.msg, st.fd, st.parse_start, start_ns);
+    emit("route", st.msg, target_fd, start_ns, end);
+    st.routed = true;
+    // 目标连接上一次被追踪的消息还没写完时不覆盖它
+    if (target.trace_msg == 0) {
+        target.trace_msg = st.msg;
+        target.trace_end = target.write_pending();
+        target.trace_routed_ns = end;
+    }
+}
+void Tracer::on_written(ClientInfo& info, int fd, size_t n) {
+    if (info.trace_end > n) {
+        info.trace_end -= n;
+        return;
+    }
+    emit("write", info.trace_msg, fd, info.trace_routed_ns, clock_ns());
+    info.trace_msg = 0;
+}
+
+long Tracer::dump() {
+    pthread_mutex_lock(&dump_mutex_);
+    long count = write_trace();
+    pthread_mutex_unlock(&dump_mutex_);
+    return count;
+}
+long Tracer::write_trace() {
+    FILE* f = fopen(path_.c_str(), "w");
+    if (f == nullptr) return -1;
+    std::vector<TraceEvent> events;
+    pthread_mutex_lock(&rings_mutex_);
+    std::vector<Ring*> rings = rings_;
+    pthread_mutex_unlock(&rings_mutex_);
+    int pid = getpid();
+    long count = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (Ring* r : rings) {
+        // 拷贝期间所属线程可能继续写入，拷贝完再读一次写入位置，丢掉可能已被覆盖的部分
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        uint64_t first = head > Ring::CAPACITY ? head - Ring::CAPACITY : 0;
+        events.clear();
+        for (uint64_t i = first; i < head; ++i) events.push_back(r->events[i % Ring::CAPACITY]);
+        uint64_t after = r->head.load(std::memory_order_acquire);
+        size_t skip = after > Ring::CAPACITY + first ? std::min<uint64_t>(after - Ring::CAPACITY - first, events.size()) : 0;
+        for (size_t i = skip; i < events.size(); ++i) {
+            const TraceEvent& ev = events[i];
+            fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"msg\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                       "\"dur\":%.3f,\"args\":{\"msg\":%u,\"fd\":%d}}",
+                    count == 0 ? "" : ",\n", ev.name, pid, r->tid, ev.start_ns / 1000.0,
+                    (ev.end_ns - ev.start_ns) / 1000.0, ev.msg, ev.fd);
+            ++count;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) return -1;
+    return count;
+}
+
+// --- 流量录制实现 ---
+Capture capture;
+
+Capture::Capture() {
+    pthread_mutex_init(&mutex_, nullptr);
+}
+
+Capture::~Capture() {
+    stop();
+    pthread_mutex_destroy(&mutex_);
+}
+
+void Capture::start(const std::string& path) {
+    file_ = fopen(path.c_str(), "w");
+    if (file_ == nullptr) throw std::system_error(errno, std::generic_category(), "打开录制文件 " + path);
+    pending_.assign("TCAP\x01", 5);
+    last_us_ = Tracer::clock_ns() / 1000;
+    if (pthread_create(&thread_, nullptr, writer_entry, this) != 0) {
+        throw std::runtime_error("创建录制写出线程失败");
+    }
+    started_ = true;
+}
+
+void Capture::stop() {
+    if (!started_) return;
+    pthread_mutex_lock(&mutex_);
+    stop_ = true;
+    pthread_mutex_unlock(&mutex_);
+    pthread_join(thread_, nullptr);
+    started_ = false;
+    fwrite(pending_.data(), 1, pending_.size(), file_);
+    fclose(file_);
+}
+
+void Capture::put_varint(uint64_t value) {
+    while (value >= 0x80) {
+        pending_ += (char)(value | 0x80);
+        value >>= 7;
+    }
+    pending_ += (char)value;
+}
+
+// 三种记录都由 a 查出连接号：CONNECT 为 a 分配新号，DISCONNECT 之后 a 的号作废，MESSAGE 再查目标 b
+void Capture::record(Record type, Addr48 a, Addr48 b, size_t len) {
+    uint64_t now_us = Tracer::clock_ns() / 1000;
+    pthread_mutex_lock(&mutex_);
+    if (stop_) {
+        pthread_mutex_unlock(&mutex_);
+        return;
+    }
+    uint64_t id = 0;
+    if (type == CONNECT) {
+        id = ids_[a] = next_id_++;
+    } else {
+        auto it = ids_.find(a);
+        if (it != ids_.end()) id = it->second;
+        if (type == DISCONNECT && it != ids_.end()) ids_.erase(it);
+    }
+    uint64_t to = 0;
+    if (type == MESSAGE) {
+        auto it = ids_.find(b);
+        if (it != ids_.end()) to = it->second;
+    }
+    // 多个线程的时间戳在拿锁之前读取，可能略有倒序，按 0 记
+    pending_ += (char)type;
+    put_varint(now_us > last_us_ ? now_us - last_us_ : 0);
+    last_us_ = std::max(last_us_, now_us);
+    put_varint(id);
+    if (type == MESSAGE) {
+        put_varint(to);
+        put_varint(len);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+void* Capture::writer_entry(void* arg) {
+    static_cast<Capture*>(arg)->writer_loop();
+    return nullptr;
+}
+
+void Capture::writer_loop() {
+    std::string chunk;
+    while (true) {
+        usleep(WRITE_INTERVAL_MS * 1000);
+        pthread_mutex_lock(&mutex_);
+        bool stopping = stop_;
+        chunk.swap(pending_);
+        pthread_mutex_unlock(&mutex_);
+        if (!chunk.empty()) {
+            fwrite(chunk.data(), 1, chunk.size(), file_);
+            fflush(file_);
+            chunk.clear();
+        }
+        if (stopping) break;
+    }
+}
+
+// --- 消息搜索实现 ---
+/*
+ * 段文件（整数均为本机字节序，各区按 8 字节对齐）：
+ *   文件头   FileHeader，魔数 "TCS2"
+ *   元数据   DocMeta[docs]，第 i 项是文档号 first_doc + i 的消息
+ *   文本区   各条消息的发送方标签、接收方标签和内容（最多 MAX_TEXT 字节）首尾相接
+ *   倒排表区 每个词项一段升序的 uint32 段内文档号
+ *   词项区   各词项的字节首尾相接
+ *   词典     TermEntry[terms]，按词项的字节序排序，查询时直接在 mmap 上二分查找
+ * 文件名为 seg-起始文档号-文档数.idx（十六进制）。文档号全局递增，段与段的文档号区间首尾相接（启动时跳过了损坏的段文件
+ * 才会留下空洞，空洞两侧的段不合并），段内文档号越大消息越新
+ */
+struct SearchIndex::FileHeader {
+    char magic[4];
+    uint32_t docs;
+    uint64_t first_doc;
+    uint64_t terms;
+    uint64_t meta_off;
+    uint64_t text_off;
+    uint64_t post_off;
+    uint64_t blob_off;
+    uint64_t dict_off;
+    uint64_t size;
+};
+
+struct SearchIndex::DocMeta {
+    int64_t time_ms;
+    uint64_t text_off;  // 相对文本区
+    uint32_t text_len;  // 两个标签加内容
+    uint8_t sender_len;
+    uint8_t recipient_len;
+    uint16_t reserved;
+
+    // entry 为文本区中 [text_off, text_off + text_len) 这一段
+    std::string_view sender(std::string_view entry) const { return entry.substr(0, sender_len); }
+    std::string_view recipient(std::string_view entry) const { return entry.substr(sender_len, recipient_len); }
+    std::string_view content(std::string_view entry) const { return entry.substr(sender_len + recipient_len); }
+};
+
+struct SearchIndex::TermEntry {
+    uint64_t blob_off;  // 相对词项区
+    uint64_t post_off;  // 相对倒排表区，以 uint32 计
+    uint32_t len;
+    uint32_t count;
+};
+
+// 一个 mmap 进来的只读段。查询和合并各持有一份 shared_ptr，段被合并、文件删除后由最后一个持有者 munmap
+struct SearchIndex::Segment {
+    std::string path;
+    const char* base = nullptr;
+    size_t size = 0;
+    const FileHeader* header = nullptr;
+    const DocMeta* meta = nullptr;
+    const char* text = nullptr;
+    const uint32_t* post = nullptr;
+    const char* blob = nullptr;
+    const TermEntry* dict = nullptr;
+
+    ~Segment() {
+        if (base != nullptr) munmap(const_cast<char*>(base), size);
+    }
+    uint64_t first_doc() const { return header->first_doc; }
+    uint64_t end_doc() const { return header->first_doc + header->docs; }
+    uint64_t text_size() const {
+        return header->docs == 0 ? 0 : meta[header->docs - 1].text_off + meta[header->docs - 1].text_len;
+    }
+    std::string_view term(size_t i) const { return std::string_view(blob + dict[i].blob_off, dict[i].len); }
+    std::string_view text_of(uint32_t doc) const { return std::string_view(text + meta[doc].text_off, meta[doc].text_len); }
+    // 词项的倒排表，不存在时 count 为 0
+    const uint32_t* postings(std::string_view word, uint32_t& count) const {
+        size_t lo = 0, hi = header->terms;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (term(mid) < word) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == header->terms || term(lo) != word) {
+            count = 0;
+            return nullptr;
+        }
+        count = dict[lo].count;
+        return post + dict[lo].post_off;
+    }
+    // 打开并校验段文件，不是完整的段文件或有越界的项时返回 nullptr
+    static std::shared_ptr<Segment> open(const std::string& path);
+    bool entries_valid() const;
+};
+
+// 索引线程正在填充的内存段，文档号从 first_doc 起连续
+struct SearchIndex::MemSegment {
+    uint64_t first_doc = 0;
+    uint64_t created_ns = 0;
+    std::vector<DocMeta> meta;
+    std::string text;
+    std::unordered_map<std::string, std::vector<uint32_t>> postings;
+};
+
+// 顺序写一个段文件：先写元数据和文本区，再逐个词项写倒排表，finish() 补上词项区、词典和文件头，落盘后改名为正式文件
+struct SearchIndex::Writer {
+    std::string path;
+    std::string tmp;
+    FILE* file = nullptr;
+    FileHeader header{};
+    uint64_t offset = 0;
+    std::vector<TermEntry> dict;
+    std::string blob;
+    bool ok = true;
+
+    bool open(const std::string& dir, uint64_t first_doc, uint32_t docs) {
+        char name[64];
+        snprintf(name, sizeof(name), "/seg-%016llx-%08x.idx", (unsigned long long)first_doc, docs);
+        path = dir + name;
+        tmp = path + ".tmp";
+        file = fopen(tmp.c_str(), "w");
+        if (file == nullptr) return false;
+        memcpy(header.magic, "TCS2", 4);
+        header.docs = docs;
+        header.first_doc = first_doc;
+        write(&header, sizeof(header));  // 占位，finish() 时重写
+        header.meta_off = offset;
+        return ok;
+    }
+    void write(const void* data, size_t len) {
+        if (len != 0 && fwrite(data, 1, len, file) != len) ok = false;
+        offset += len;
+    }
+    void align() {
+        static const char zeros[8] = {};
+        write(zeros, (8 - offset % 8) % 8);
+    }
+    void begin_text() {
+        align();
+        header.text_off = offset;
+    }
+    void begin_postings() {
+        align();
+        header.post_off = offset;
+    }
+    // 开始一个词项（须按字节序递增），随后写入它的 count 个文档号
+    void add_term(std::string_view term, uint32_t count) {
+        TermEntry entry{};
+        entry.blob_off = blob.size();
+        entry.post_off = (offset - header.post_off) / sizeof(uint32_t);
+        entry.len = term.size();
+        entry.count = count;
+        dict.push_back(entry);
+        blob.append(term);
+    }
+    std::shared_ptr<Segment> finish() {
+        header.blob_off = offset;
+        write(blob.data(), blob.size());
+        align();
+        header.dict_off = offset;
+        write(dict.data(), dict.size() * sizeof(TermEntry));
+        header.terms = dict.size();
+        header.size = offset;
+        ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && fflush(file) == 0 &&
+             fdatasync(fileno(file)) == 0;
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) return nullptr;
+        return Segment::open(path);
+    }
+    void abort() {
+        if (file != nullptr) fclose(file);
+        file = nullptr;
+        unlink(tmp.c_str());
+    }
+};
+
+// 路由路径追加进待索引队列的一条消息，后跟发送方标签、接收方标签和 len 字节内容
+struct SearchPending {
+    int64_t time_ms;
+    uint64_t len;
+    uint8_t sender_len;
+    uint8_t recipient_len;
+};
+
+/**
+ * @brief 分词：ASCII 字母数字连成的词转成小写（超过 32 字节的部分截断）；其它字符按 UTF-8 解码，连续的文字
+ * （中日韩文字等）建索引时每个字单独成词、相邻两字再组成二元词，查询时连续两个以上的字只取二元词、一个字取单字，
+ * 所有词都出现的消息才算命中。ASCII 标点与空白、通用标点、CJK 标点与全角标点都是分隔符，不合法的 UTF-8 字节跳过
+ */
+static void search_tokens(std::string_view text, bool query, std::vector<std::string>& out) {
+    const size_t MAX_WORD = 32;
+    size_t i = 0;
+    size_t run = 0;         // 当前连续的文字数
+    std::string_view prev;  // 其中最后一个字
+    auto end_run = [&]() {
+        if (query && run == 1) out.emplace_back(prev);
+        run = 0;
+    };
+    while (i < text.size()) {
+        unsigned char c = text[i];
+        if (c < 0x80) {
+            end_run();
+            if (!isalnum(c)) {
+                ++i;
+                continue;
+            }
+            size_t start = i;
+            while (i < text.size() && (unsigned char)text[i] < 0x80 && isalnum((unsigned char)text[i])) ++i;
+            std::string word(text.substr(start, std::min(i - start, MAX_WORD)));
+            for (char& ch : word) ch = tolower((unsigned char)ch);
+            out.push_back(std::move(word));
+            continue;
+        }
+        size_t len = c >= 0xF8 ? 0 : c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 0;
+        uint32_t cp = len == 4 ? c & 0x07 : len == 3 ? c & 0x0F : c & 0x1F;
+        bool valid = len != 0 && i + len <= text.size();
+        for (size_t k = 1; valid && k < len; ++k) {
+            unsigned char cc = text[i + k];
+            valid = (cc & 0xC0) == 0x80;
+            cp = cp << 6 | (cc & 0x3F);
+        }
+        if (!valid) {
+            end_run();
+            ++i;
+            continue;
+        }
+        bool punct = (cp >= 0x2000 && cp <= 0x206F) || (cp >= 0x3000 && cp <= 0x303F) || (cp >= 0xFE30 && cp <= 0xFE4F) ||
+                     (cp >= 0xFF00 && cp <= 0xFF0F) || (cp >= 0xFF1A && cp <= 0xFF20) || (cp >= 0xFF3B && cp <= 0xFF40) ||
+                     (cp >= 0xFF5B && cp <= 0xFF65);
+        if (punct) {
+            end_run();
+            i += len;
+            continue;
+        }
+        std::string_view ch = text.substr(i, len);
+        if (!query) out.emplace_back(ch);
+        if (run > 0) {
+            std::string bigram(prev);
+            bigram.append(ch);
+            out.push_back(std::move(bigram));
+        }
+        prev = ch;
+        ++run;
+        i += len;
+    }
+    end_run();
+}
+
+// 参与者词项：'\x01' + "@用户名"。每条消息带上已登录的收发方的参与者词项，查询时总与发起者的求交，只能查到自己收发的消息
+static std::string participant_term(std::string_view who) {
+    std::string term(1, '\x01');
+    term += who;
+    return term;
+}
+
+// 截取命中位置附近最多 160 字节作为片段：从第一个查询词（ASCII 大小写不敏感）出现处往前留 40 字节，
+// 两端对齐到 UTF-8 字符边界，换行换成空格
+static std::string search_snippet(std::string_view text, const std::string& first_token) {
+    const size_t SNIPPET_BYTES = 160;
+    const size_t CONTEXT_BYTES = 40;
+    size_t pos = 0;
+    if (text.size() > SNIPPET_BYTES) {
+        std::string lower(text);
+        for (char& ch : lower) ch = tolower((unsigned char)ch);
+        size_t at = lower.find(first_token);
+        if (at != std::string::npos && at > CONTEXT_BYTES) pos = std::min(at - CONTEXT_BYTES, text.size() - SNIPPET_BYTES);
+    }
+    while (pos > 0 && ((unsigned char)text[pos] & 0xC0) == 0x80) --pos;
+    size_t end = std::min(text.size(), pos + SNIPPET_BYTES);
+    while (end < text.size() && end > pos && ((unsigned char)text[end] & 0xC0) == 0x80) --end;
+    std::string out;
+    if (pos > 0) out += "...";
+    out.append(text.substr(pos, end - pos));
+    if (end < text.size()) out += "...";
+    for (char& ch : out) {
+        if (ch == '\n' || ch == '\r') ch = ' ';
+    }
+    return out;
+}
+
+/**
+ * @brief 倒排表求交：沿最短的表由后往前（由新到旧）遍历，其余各表按倍增步长往前找到不大于当前文档号的位置，
+ * 查找位置只会单调前移，总代价与最短表的长度成正比。visit 返回 false 时停止，此时返回 false
+ */
+template <typename F>
+static bool intersect_backward(std::vector<std::pair<const uint32_t*, size_t>>& lists, F&& visit) {
+    std::sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+    std::vector<size_t> hi(lists.size());
+    for (size_t k = 0; k < lists.size(); ++k) hi[k] = lists[k].second;
+    const uint32_t* shortest = lists[0].first;
+    for (size_t i = lists[0].second; i-- > 0;) {
+        uint32_t doc = shortest[i];
+        bool all = true;
+        for (size_t k = 1; k < lists.size() && all; ++k) {
+            const uint32_t* list = lists[k].first;
+            size_t h = hi[k];
+            for (size_t step = 1; h > 0 && list[h - 1] > doc; step *= 2) {
+                size_t next = h > step ? h - step : 0;
+                if (list[next] > doc) {
+                    h = next;
+                } else {
+                    h = std::upper_bound(list + next, list + h, doc) - list;
+                }
+            }
+            hi[k] = h;
+            if (h == 0) return true;  // 这张表里已没有更早的文档
+            all = list[h - 1] == doc;
+        }
+        if (all && !visit(doc)) return false;
+    }
+    return true;
+}
+
+// 按会话收集命中：会话按第一次遇到（即最近一条命中）排序，最多 MAX_CONVERSATIONS 个，每个最多 PER_CONVERSATION 条
+struct SearchIndex::Collector {
+    std::string who;
+    std::string first_token;
+    Result& result;
+    std::vector<std::pair<std::string, std::vector<Hit>>> convs;
+    size_t full = 0;  // 已收满的会话数
+
+    // entry 为这条消息在文本区中的一段。返回 false 表示不必再找
+    bool offer(const DocMeta& meta, std::string_view entry) {
+        ++result.matched;
+        std::string_view sender = meta.sender(entry);
+        std::string_view peer = sender == who ? meta.recipient(entry) : sender;
+        auto it = std::find_if(convs.begin(), convs.end(), [&](const auto& c) { return c.first == peer; });
+        if (it == convs.end() && convs.size() < MAX_CONVERSATIONS) {
+            convs.emplace_back(std::string(peer), std::vector<Hit>());
+            it = convs.end() - 1;
+        }
+        if (it != convs.end() && it->second.size() < PER_CONVERSATION) {
+            it->second.push_back(
+                Hit{it->first, std::string(sender), meta.time_ms, search_snippet(meta.content(entry), first_token)});
+            if (it->second.size() == PER_CONVERSATION) ++full;
+        }
+        result.truncated = full == MAX_CONVERSATIONS || result.matched >= MAX_MATCHES;
+        return !result.truncated;
+    }
+};
+
+SearchIndex::SearchIndex() {
+    pthread_mutex_init(&mutex_, nullptr);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond_, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&merge_cond_, nullptr);
+}
+
+SearchIndex::~SearchIndex() {
+    stop();
+    if (event_fd_ != -1) close(event_fd_);
+    pthread_cond_destroy(&merge_cond_);
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+std::shared_ptr<SearchIndex::Segment> SearchIndex::Segment::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(FileHeader)) {
+        close(fd);
+        return nullptr;
+    }
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return nullptr;
+    auto seg = std::make_shared<Segment>();
+    seg->path = path;
+    seg->base = static_cast<const char*>(base);
+    seg->size = st.st_size;
+    const FileHeader* h = static_cast<const FileHeader*>(base);
+    bool valid = memcmp(h->magic, "TCS2", 4) == 0 && h->size == seg->size && sizeof(FileHeader) <= h->meta_off &&
+                 h->meta_off <= h->text_off && h->text_off <= h->post_off && h->post_off <= h->blob_off &&
+                 h->blob_off <= h->dict_off && h->dict_off <= seg->size && h->meta_off % alignof(DocMeta) == 0 &&
+                 h->post_off % alignof(uint32_t) == 0 && h->dict_off % alignof(TermEntry) == 0 &&
+                 h->docs <= (h->text_off - h->meta_off) / sizeof(DocMeta) &&
+                 h->terms <= (seg->size - h->dict_off) / sizeof(TermEntry);
+    if (!valid) return nullptr;
+    seg->header = h;
+    seg->meta = reinterpret_cast<const DocMeta*>(seg->base + h->meta_off);
+    seg->text = seg->base + h->text_off;
+    seg->post = reinterpret_cast<const uint32_t*>(seg->base + h->post_off);
+    seg->blob = seg->base + h->blob_off;
+    seg->dict = reinterpret_cast<const TermEntry*>(seg->base + h->dict_off);
+    if (!seg->entries_valid()) return nullptr;
+    return seg;
+}
+
+// 逐项检查元数据、词典和倒排表：引用的范围都落在各自的区内，文档号都小于 docs，查询和合并直接使用这些值而不再检查
+bool SearchIndex::Segment::entries_valid() const {
+    uint64_t text_bytes = header->post_off - header->text_off;
+    for (uint32_t i = 0; i < header->docs; ++i) {
+        const DocMeta& m = meta[i];
+        if (m.text_off > text_bytes || m.text_len > text_bytes - m.text_off ||
+            (uint32_t)m.sender_len + m.recipient_len > m.text_len) {
+            return false;
+        }
+    }
+    uint64_t blob_bytes = header->dict_off - header->blob_off;
+    uint64_t post_count = (header->blob_off - header->post_off) / sizeof(uint32_t);
+    for (uint64_t i = 0; i < header->terms; ++i) {
+        const TermEntry& e = dict[i];
+        if (e.blob_off > blob_bytes || e.len > blob_bytes - e.blob_off || e.post_off > post_count ||
+            e.count > post_count - e.post_off) {
+            return false;
+        }
+        const uint32_t* list = post + e.post_off;
+        for (uint32_t j = 0; j < e.count; ++j) {
+            if (list[j] >= header->docs) return false;
+        }
+    }
+    return true;
+}
+
+void SearchIndex::start() {
+    if (mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+        throw std::system_error(errno, std::generic_category(), "创建搜索索引目录 " + dir_);
+    }
+    if (event_fd_ == -1) {
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd_ < 0) throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+    load_segments();
+    stop_ = false;
+    stopping_ = false;
+    if (pthread_create(&indexer_, nullptr, indexer_entry, this) != 0 ||
+        pthread_create(&merger_, nullptr, merger_entry, this) != 0) {
+        throw std::runtime_error("创建搜索索引线程失败");
+    }
+    started_ = true;
+}
+
+void SearchIndex::stop() {
+    if (!started_) return;
+    pthread_mutex_lock(&mutex_);
+    stop_ = true;
+    stopping_ = true;
+    pthread_cond_signal(&cond_);
+    pthread_cond_signal(&merge_cond_);
+    pthread_mutex_unlock(&mutex_);
+    pthread_join(indexer_, nullptr);
+    pthread_join(merger_, nullptr);
+    started_ = false;
+    segments_.clear();
+}
+
+// 加载目录中的段文件：删掉没写完的 .tmp，以及合并完成后、删除旧段之前进程退出而残留的、已被合并段覆盖的旧段
+void SearchIndex::load_segments() {
+    DIR* dir = opendir(dir_.c_str());
+    if (dir == nullptr) throw std::system_error(errno, std::generic_category(), "打开搜索索引目录 " + dir_);
+    std::vector<std::shared_ptr<Segment>> found;
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, 4, "seg-") != 0) continue;
+        std::string path = dir_ + "/" + name;
+        if (name.ends_with(".tmp")) {
+            unlink(path.c_str());
+        } else if (name.ends_with(".idx")) {
+            std::shared_ptr<Segment> seg = Segment::open(path);
+            if (seg != nullptr) {
+                found.push_back(std::move(seg));
+            } else {
+                std::cerr << "搜索索引: 忽略损坏的段文件 " << path << std::endl;
+            }
+        }
+    }
+    closedir(dir);
+    std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) {
+        return a->first_doc() != b->first_doc() ? a->first_doc() < b->first_doc() : a->end_doc() > b->end_doc();
+    });
+    segments_.clear();
+    indexed_ = 0;
+    next_doc_ = 0;
+    for (auto& seg : found) {
+        if (!segments_.empty() && seg->first_doc() < segments_.back()->end_doc()) {
+            if (seg->end_doc() <= segments_.back()->end_doc()) unlink(seg->path.c_str());
+            continue;
+        }
+        indexed_ += seg->header->docs;
+        next_doc_ = seg->end_doc();
+        segments_.push_back(std::move(seg));
+    }
+}
+
+// 路由路径上调用（持有 clients_mutex），只把消息拷进队列
+void SearchIndex::add(std::string_view sender, std::string_view recipient, const char* data, size_t len) {
+    sender = sender.substr(0, MAX_LABEL);
+    recipient = recipient.substr(0, MAX_LABEL);
+    SearchPending head{};
+    head.sender_len = sender.size();
+    head.recipient_len = recipient.size();
+    head.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now().time_since_epoch()).count();
+    head.len = len < MAX_TEXT ? len : MAX_TEXT;
+    pthread_mutex_lock(&mutex_);
+    if (stop_) {
+        pthread_mutex_unlock(&mutex_);
+        return;
+    }
+    if (pending_.size() + sizeof(head) + sender.size() + recipient.size() + head.len > MAX_BACKLOG) {
+        ++dropped_;
+    } else {
+        pending_.append(reinterpret_cast<const char*>(&head), sizeof(head));
+        pending_.append(sender);
+        pending_.append(recipient);
+        pending_.append(data, head.len);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+bool SearchIndex::query(int fd, Addr48 addr, const std::string& who, const std::string& words) {
+    pthread_mutex_lock(&mutex_);
+    bool accepted = querying_.size() < MAX_QUERIES && std::find(querying_.begin(), querying_.end(), addr) == querying_.end();
+    if (accepted) {
+        querying_.push_back(addr);
+        queries_.push_back(Query{fd, addr, who, words, Tracer::clock_ns()});
+        pthread_cond_signal(&cond_);
+    }
+    pthread_mutex_unlock(&mutex_);
+    return accepted;
+}
+
+std::vector<SearchIndex::Result> SearchIndex::take_results() {
+    uint64_t value;
+    ssize_t r = read(event_fd_, &value, sizeof(value));
+    (void)r;
+    std::vector<Result> results;
+    pthread_mutex_lock(&mutex_);
+    results.swap(results_);
+    for (const Result& result : results) {
+        auto it = std::find(querying_.begin(), querying_.end(), result.addr);
+        if (it != querying_.end()) querying_.erase(it);
+    }
+    pthread_mutex_unlock(&mutex_);
+    return results;
+}
+
+SearchIndex::Stats SearchIndex::stats() {
+    Stats stats;
+    pthread_mutex_lock(&mutex_);
+    stats.docs = indexed_;
+    stats.segments = segments_.size();
+    for (const auto& seg : segments_) stats.disk_bytes += seg->size;
+    stats.backlog = pending_.size() + indexing_;
+    stats.dropped = dropped_;
+    stats.merges = merges_;
+    stats.merging = merging_;
+    pthread_mutex_unlock(&mutex_);
+    return stats;
+}
+
+void* SearchIndex::indexer_entry(void* arg) {
+    static_cast<SearchIndex*>(arg)->indexer_loop();
+    return nullptr;
+}
+
+void* SearchIndex::merger_entry(void* arg) {
+    static_cast<SearchIndex*>(arg)->merger_loop();
+    return nullptr;
+}
+
+// 每 INDEX_INTERVAL_MS（有查询时立即）取走队列：先把消息建进内存段，再回答查询，停止时最后写出内存段
+void SearchIndex::indexer_loop() {
+    std::string batch;
+    std::vector<Query> queries;
+    std::vector<Result> done;
+    while (true) {
+        pthread_mutex_lock(&mutex_);
+        if (!stop_ && queries_.empty()) {
+            timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += INDEX_INTERVAL_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&cond_, &mutex_, &deadline);
+        }
+        batch.swap(pending_);
+        indexing_ = batch.size();
+        queries.swap(queries_);
+        bool stopping = stop_;
+        pthread_mutex_unlock(&mutex_);
+
+        index_batch(batch);
+        batch.clear();
+        for (const Query& q : queries) done.push_back(run_query(q));
+        queries.clear();
+        if (memory_ != nullptr && (stopping || Tracer::clock_ns() - memory_->created_ns >= FLUSH_SECONDS * 1000000000ULL)) {
+            flush_memory();
+        }
+        if (!done.empty()) {
+            pthread_mutex_lock(&mutex_);
+            for (Result& result : done) results_.push_back(std::move(result));
+            pthread_mutex_unlock(&mutex_);
+            done.clear();
+            uint64_t one = 1;
+            ssize_t r = write(event_fd_, &one, sizeof(one));
+            (void)r;
+        }
+        if (stopping) break;
+    }
+}
+
+void SearchIndex::index_batch(const std::string& batch) {
+    std::vector<std::string> tokens;
+    size_t pos = 0;
+    uint64_t count = 0;
+    while (pos < batch.size()) {
+        SearchPending head;
+        memcpy(&head, batch.data() + pos, sizeof(head));
+        size_t entry_len = head.sender_len + head.recipient_len + head.len;
+        std::string_view entry(batch.data() + pos + sizeof(head), entry_len);
+        pos += sizeof(head) + entry_len;
+        if (memory_ == nullptr) {
+            memory_ = std::make_unique<MemSegment>();
+            memory_->first_doc = next_doc_;
+            memory_->created_ns = Tracer::clock_ns();
+        }
+        MemSegment& mem = *memory_;
+        uint32_t doc = mem.meta.size();
+        DocMeta meta{};
+        meta.time_ms = head.time_ms;
+        meta.text_off = mem.text.size();
+        meta.text_len = entry_len;
+        meta.sender_len = head.sender_len;
+        meta.recipient_len = head.recipient_len;
+        mem.meta.push_back(meta);
+        mem.text.append(entry);
+        tokens.clear();
+        search_tokens(meta.content(entry), false, tokens);
+        for (std::string_view who : {meta.sender(entry), meta.recipient(entry)}) {
+            if (!who.empty() && who[0] == '@') tokens.push_back(participant_term(who));
+        }
+        std::sort(tokens.begin(), tokens.end());
+        tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+        for (const std::string& token : tokens) mem.postings[token].push_back(doc);
+        ++next_doc_;
+        ++count;
+        if (mem.meta.size() >= SEGMENT_DOCS) flush_memory();
+    }
+    pthread_mutex_lock(&mutex_);
+    indexed_ += count;
+    indexing_ = 0;
+    pthread_mutex_unlock(&mutex_);
+}
+
+// 把内存段写成段文件并换成 mmap 的只读段。写入失败（如磁盘满）时丢弃这一段，索引继续
+void SearchIndex::flush_memory() {
+    std::unique_ptr<MemSegment> mem = std::move(memory_);
+    if (mem == nullptr || mem->meta.empty()) return;
+    std::vector<const std::pair<const std::string, std::vector<uint32_t>>*> terms;
+    terms.reserve(mem->postings.size());
+    for (const auto& entry : mem->postings) terms.push_back(&entry);
+    std::sort(terms.begin(), terms.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+    Writer writer;
+    std::shared_ptr<Segment> seg;
+    if (writer.open(dir_, mem->first_doc, mem->meta.size())) {
+        writer.write(mem->meta.data(), mem->meta.size() * sizeof(DocMeta));
+        writer.begin_text();
+        writer.write(mem->text.data(), mem->text.size());
+        writer.begin_postings();
+        for (const auto* entry : terms) {
+            writer.add_term(entry->first, entry->second.size());
+            writer.write(entry->second.data(), entry->second.size() * sizeof(uint32_t));
+        }
+        seg = writer.finish();
+    }
+    if (seg == nullptr) {
+        std::cerr << "搜索索引: 写入段文件失败: " << strerror(errno) << ", 丢弃 " << mem->meta.size() << " 条消息的索引"
+                  << std::endl;
+        writer.abort();
+        next_doc_ = mem->first_doc;  // 收回这一段的文档号，段与段的文档号区间仍首尾相接
+        pthread_mutex_lock(&mutex_);
+        indexed_ -= mem->meta.size();
+        pthread_mutex_unlock(&mutex_);
+        return;
+    }
+    pthread_mutex_lock(&mutex_);
+    segments_.push_back(std::move(seg));
+    pthread_cond_signal(&merge_cond_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+/**
+ * @brief 一次查询：查询词与发起者的参与者词项在每个段里求交，从内存段开始由新到旧逐段查找，
+ * 收满 MAX_CONVERSATIONS 个会话各 PER_CONVERSATION 条、或检查过 MAX_MATCHES 条命中后停止
+ */
+SearchIndex::Result SearchIndex::run_query(const Query& q) {
+    Result result;
+    result.fd = q.fd;
+    result.addr = q.addr;
+    std::vector<std::string> tokens;
+    search_tokens(q.words, true, tokens);
+    if (tokens.empty()) {
+        result.error = "没有可搜索的词（字母数字组成的词或文字）";
+        return result;
+    }
+    if (tokens.size() > MAX_QUERY_TOKENS) {
+        result.error = "关键词太多, 最多 " + std::to_string(MAX_QUERY_TOKENS) + " 个词（连续的文字每两个字算一个词）";
+        return result;
+    }
+    Collector collector{q.who, tokens[0], result, {}};
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+    tokens.push_back(participant_term(q.who));
+
+    std::vector<std::pair<const uint32_t*, size_t>> lists;
+    bool more = true;
+    if (memory_ != nullptr) {
+        const MemSegment& mem = *memory_;
+        lists.clear();
+        for (const std::string& token : tokens) {
+            auto it = mem.postings.find(token);
+            if (it == mem.postings.end()) break;
+            lists.emplace_back(it->second.data(), it->second.size());
+        }
+        if (lists.size() == tokens.size()) {
+            more = intersect_backward(lists, [&](uint32_t doc) {
+                const DocMeta& meta = mem.meta[doc];
+                return collector.offer(meta, std::string_view(mem.text).substr(meta.text_off, meta.text_len));
+            });
+        }
+    }
+    pthread_mutex_lock(&mutex_);
+    std::vector<std::shared_ptr<Segment>> segments = segments_;
+    pthread_mutex_unlock(&mutex_);
+    for (size_t i = segments.size(); more && i-- > 0;) {
+        const Segment& seg = *segments[i];
+        lists.clear();
+        for (const std::string& token : tokens) {
+            uint32_t count;
+            const uint32_t* list = seg.postings(token, count);
+            if (list == nullptr) break;
+            lists.emplace_back(list, count);
+        }
+        if (lists.size() != tokens.size()) continue;
+        more = intersect_backward(lists, [&](uint32_t doc) { return collector.offer(seg.meta[doc], seg.text_of(doc)); });
+    }
+    result.conversations = collector.convs.size();
+    for (auto& conv : collector.convs) {
+        for (Hit& hit : conv.second) result.hits.push_back(std::move(hit));
+    }
+    result.micros = (Tracer::clock_ns() - q.start_ns) / 1000;
+    return result;
+}
+
+// 段的级别：不足 MERGE_FANIN 个标准段大小的为 0 级，此后每大 MERGE_FANIN 倍升一级
+int SearchIndex::level_of(uint64_t docs) {
+    int level = 0;
+    for (uint64_t n = docs / SEGMENT_DOCS; n >= (uint64_t)MERGE_FANIN; n /= MERGE_FANIN) ++level;
+    return level;
+}
+
+// 反复找出最早的一组相邻 MERGE_FANIN 个同级、文档号首尾相接的段合并，没有可合并的段时等待新段写出
+void SearchIndex::merger_loop() {
+    pthread_mutex_lock(&mutex_);
+    while (!stop_) {
+        std::vector<std::shared_ptr<Segment>> run;
+        for (size_t i = 0; i + MERGE_FANIN <= segments_.size() && run.empty(); ++i) {
+            int level = level_of(segments_[i]->header->docs);
+            uint64_t docs = 0;
+            size_t j = i;
+            for (; j < i + MERGE_FANIN && level_of(segments_[j]->header->docs) == level &&
+                   (j == i || segments_[j]->first_doc() == segments_[j - 1]->end_doc());
+                 ++j) {
+                docs += segments_[j]->header->docs;
+            }
+            if (j == i + MERGE_FANIN && docs <= UINT32_MAX) run.assign(segments_.begin() + i, segments_.begin() + j);
+        }
+        if (run.empty()) {
+            pthread_cond_wait(&merge_cond_, &mutex_);
+            continue;
+        }
+        merging_ = true;
+        pthread_mutex_unlock(&mutex_);
+        std::shared_ptr<Segment> merged = merge(run);
+        pthread_mutex_lock(&mutex_);
+        merging_ = false;
+        if (merged == nullptr) {
+            // 放弃（正在停止）或写入失败，后者等下一个新段写出时再试
+            if (!stop_) {
+                std::cerr << "搜索索引: 合并段失败: " << strerror(errno) << std::endl;
+                pthread_cond_wait(&merge_cond_, &mutex_);
+            }
+            continue;
+        }
+        auto it = std::find(segments_.begin(), segments_.end(), run.front());
+        it = segments_.erase(it, it + run.size());
+        segments_.insert(it, merged);
+        ++merges_;
+        pthread_mutex_unlock(&mutex_);
+        for (const auto& seg : run) unlink(seg->path.c_str());
+        pthread_mutex_lock(&mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+/**
+ * @brief 把相邻的几个段合成一个：元数据和文本区依次拼接，词典按字节序多路归并，倒排表加上各段的文档号偏移。
+ * 正在停止时放弃并删除临时文件，返回 nullptr
+ */
+std::shared_ptr<SearchIndex::Segment> SearchIndex::merge(const std::vector<std::shared_ptr<Segment>>& run) {
+    const size_t CHUNK = 65536;
+    uint64_t docs = 0;
+    for (const auto& seg : run) docs += seg->header->docs;
+    Writer writer;
+    if (!writer.open(dir_, run.front()->first_doc(), docs)) {
+        writer.abort();
+        return nullptr;
+    }
+    std::vector<DocMeta> metas;
+    std::vector<uint32_t> bases;
+    uint64_t doc_base = 0;
+    uint64_t text_base = 0;
+    for (const auto& seg : run) {
+        bases.push_back(doc_base);
+        doc_base += seg->header->docs;
+        for (uint32_t i = 0; i < seg->header->docs; i += CHUNK) {
+            uint32_t n = std::min<uint64_t>(CHUNK, seg->header->docs - i);
+            metas.assign(seg->meta + i, seg->meta + i + n);
+            for (DocMeta& meta : metas) meta.text_off += text_base;
+            writer.write(metas.data(), n * sizeof(DocMeta));
+        }
+        text_base += seg->text_size();
+    }
+    writer.begin_text();
+    for (const auto& seg : run) writer.write(seg->text, seg->text_size());
+    writer.begin_postings();
+    std::vector<size_t> cursor(run.size(), 0);
+    std::vector<uint32_t> out;
+    for (size_t steps = 1;; ++steps) {
+        std::string_view term;
+        bool any = false;
+        for (size_t k = 0; k < run.size(); ++k) {
+            if (cursor[k] == run[k]->header->terms) continue;
+            std::string_view t = run[k]->term(cursor[k]);
+            if (!any || t < term) term = t;
+            any = true;
+        }
+        if (!any) break;
+        uint64_t count = 0;
+        for (size_t k = 0; k < run.size(); ++k) {
+            if (cursor[k] < run[k]->header->terms && run[k]->term(cursor[k]) == term) count += run[k]->dict[cursor[k]].count;
+        }
+        writer.add_term(term, count);
+        for (size_t k = 0; k < run.size(); ++k) {
+            if (cursor[k] == run[k]->header->terms || run[k]->term(cursor[k]) != term) continue;
+            const TermEntry& entry = run[k]->dict[cursor[k]++];
+            const uint32_t* list = run[k]->post + entry.post_off;
+            for (uint32_t i = 0; i < entry.count; i += CHUNK) {
+                uint32_t n = std::min<uint32_t>(CHUNK, entry.count - i);
+                out.resize(n);
+                for (uint32_t j = 0; j < n; ++j) out[j] = list[i + j] + bases[k];
+                writer.write(out.data(), n * sizeof(uint32_t));
+            }
+        }
+        if (steps % 4096 == 0 && stopping_) {
+            writer.abort();
+            return nullptr;
+        }
+    }
+    std::shared_ptr<Segment> merged = writer.finish();
+    if (merged == nullptr) writer.abort();
+    return merged;
+}
+
+// --- 连接表实现 ---
+int AddrIndex::find(Addr48 key) const {
+    if (size_ == 0 || key == 0) return -1;
+    size_t mask = keys_.size() - 1;
+    for (size_t i = slot_of(key);; i = (i + 1) & mask) {
+        if (keys_[i] == key) return fds_[i];
+        if (keys_[i] == 0) return -1;
+    }
+}
+void AddrIndex::insert(Addr48 key, int fd) {
+    if (key == 0) return;
+    if ((size_ + 1) * 2 > keys_.size()) grow();
+    size_t mask = keys_.size() - 1;
+    size_t i = slot_of(key);
+    while (keys_[i] != 0 && keys_[i] != key) i = (i + 1) & mask;
+    if (keys_[i] == 0) ++size_;
+    keys_[i] = key;
+    fds_[i] = fd;
+}
+void AddrIndex::erase(Addr48 key, int fd) {
+    if (size_ == 0 || key == 0) return;
+    size_t mask = keys_.size() - 1;
+    size_t i = slot_of(key);
+    while (keys_[i] != key) {
+        if (keys_[i] == 0) return;
+        i = (i + 1) & mask;
+    }
+    if (fds_[i] != fd) return;
+    // 回移删除：把后续同一探测链上的元素前移，保持查找不被空槽截断
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; keys_[j] != 0; j = (j + 1) & mask) {
+        size_t home = slot_of(keys_[j]);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            keys_[hole] = keys_[j];
+            fds_[hole] = fds_[j];
+            hole = j;
+        }
+    }
+    keys_[hole] = 0;
+    --size_;
+}
+void AddrIndex::grow() {
+    std::vector<Addr48> old_keys = std::move(keys_);
+    std::vector<int> old_fds = std::move(fds_);
+    size_t capacity = old_keys.empty() ? 64 : old_keys.size() * 2;
+    keys_.assign(capacity, 0);
+    fds_.assign(capacity, -1);
+    shift_ = 64 - __builtin_ctzll(capacity);
+    size_ = 0;
+    for (size_t i = 0; i < old_keys.size(); ++i) {
+        if (old_keys[i] != 0) insert(old_keys[i], old_fds[i]);
+    }
+}
+
+void ClientTable::insert(int fd, Addr48 addr, ConnKind kind) {
+    if ((size_t)fd >= kind_.size()) {
+        size_t n = std::max<size_t>(fd + 1, kind_.size() * 2);
+        kind_.resize(n, ConnKind::None);
+        flags_.resize(n, 0);
+        addr_.resize(n, 0);
+        user_id_.resize(n, 0);
+        info_.resize(n);
+    }
+    if (kind_[fd] == ConnKind::None) ++size_;
+    kind_[fd] = kind;
+    flags_[fd] = kind == ConnKind::Client ? MAGIC_ALLOWED : 0;
+    addr_[fd] = addr;
+    user_id_[fd] = 0;
+    drop_info(fd);
+    index_.insert(addr, fd);
+}
+void ClientTable::erase(int fd) {
+    if (!count(fd)) return;
+    index_.erase(addr_[fd], fd);
+    kind_[fd] = ConnKind::None;
+    flags_[fd] = 0;
+    addr_[fd] = 0;
+    user_id_[fd] = 0;
+    drop_info(fd);
+    --size_;
+}
+ClientTable::ColdEntry* ClientTable::attach_info(int fd) {
+    info_[fd].reset(new ColdEntry);
+    info_[fd]->slot = cold_fds_.size();
+    info_[fd]->serial = ++serial_;
+    cold_fds_.push_back(fd);
+    return info_[fd].get();
+}
+void ClientTable::drop_info(int fd) {
+    if (!info_[fd]) return;
+    uint32_t slot = info_[fd]->slot;
+    int last = cold_fds_.back();
+    cold_fds_[slot] = last;
+    info_[last]->slot = slot;
+    cold_fds_.pop_back();
+    info_[fd].reset();
+}
+size_t ClientTable::sweep_idle() {
+    ++epoch_;
+    size_t released = 0;
+    // 倒序遍历：drop_info 用末尾元素填补空位，不会跳过未检查的连接
+    for (size_t i = cold_fds_.size(); i-- > 0;) {
+        int fd = cold_fds_[i];
+        ColdEntry& entry = *info_[fd];
+        // 周期号在本轮开始时已加一，差值不超过 1 说明上一个周期内被访问过
+        if (epoch_ - entry.touched <= 1 || (flags_[fd] & BUSY) != 0) continue;
+        ClientInfo& info = entry.info;
+        if (info.read_buf.empty() && !info.has_output() && info.pair_fd == -1 && info.pair_request == 0 &&
+            info.upload_left == 0 && info.downloads.empty() && !info.chunk && info.stream_to == -1 &&
+            info.stream_from == -1 && !info.stream_discard) {
+            drop_info(fd);
+            ++released;
+            continue;
+        }
+        if (info.read_buf.empty()) Buffer().swap(info.read_buf);
+        if (info.write_buf.empty()) Buffer().swap(info.write_buf);
+        if (info.urgent_buf.empty()) Buffer().swap(info.urgent_buf);
+        if (info.cuts.empty()) std::vector<uint64_t>().swap(info.cuts);
+        if (info.seq_marks.empty()) std::vector<SeqMark>().swap(info.seq_marks);
+    }
+    return released;
+}
+size_t ClientTable::memory_usage() const {
+    size_t bytes = kind_.capacity() * sizeof(ConnKind) + flags_.capacity() * sizeof(uint8_t) +
+                   addr_.capacity() * sizeof(Addr48) + user_id_.capacity() * sizeof(uint32_t) +
+                   info_.capacity() * sizeof(std::unique_ptr<ColdEntry>) + cold_fds_.capacity() * sizeof(int) +
+                   index_.memory_usage();
+    for (const auto& entry : info_) {
+        if (entry) {
+            bytes += sizeof(ColdEntry) + entry->info.read_buf.capacity() + entry->info.write_buf.capacity() +
+                     entry->info.urgent_buf.capacity();
+        }
+    }
+    return bytes;
+}
+
+std::string format_addr48(Addr48 addr) {
+    uint32_t ip = addr >> 16;
+    return std::to_string(ip >> 24) + "." + std::to_string((ip >> 16) & 0xff) + "." + std::to_string((ip >> 8) & 0xff) +
+           "." + std::to_string(ip & 0xff) + ":" + std::to_string(addr & 0xffff);
+}
+
+// 解析 "A.B.C.D:PORT"，逐字符计算，不产生临时字符串
+bool parse_addr48(const char* str, size_t len, Addr48& addr) {
+    uint32_t ip = 0, part = 0, port = 0;
+    int dots = 0, digits = 0;
+    size_t i = 0;
+    for (; i < len && str[i] != ':'; ++i) {
+        char c = str[i];
+        if (c == '.') {
+            if (digits == 0 || ++dots > 3) return false;
+            ip = ip << 8 | part;
+            part = 0;
+            digits = 0;
+        } else if (c >= '0' && c <= '9' && digits < 3) {
+            part = part * 10 + (c - '0');
+            if (part > 255) return false;
+            ++digits;
+        } else {
+            return false;
+        }
+    }
+    if (dots != 3 || digits == 0 || i == len) return false;
+    ip = ip << 8 | part;
+    if (++i == len) return false;
+    for (; i < len; ++i) {
+        if (str[i] < '0' || str[i] > '9') return false;
+        port = port * 10 + (str[i] - '0');
+        if (port > 65535) return false;
+    }
+    addr = make_addr48(ip, port);
+    return true;
+}
+
+// --- 全局函数实现 ---
+void set_non_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) throw std::system_error(errno, std::generic_category(), "fcntl F_GETFL");
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) throw std::system_error(errno, std::generic_category(), "fcntl F_SETFL");
+}
+void add_fd_to_epoll(int epoll_fd, int fd, uint32_t events) {
+    epoll_event ev{};
+    ev.data.fd = fd;
+    ev.events = events;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) std::cerr << "添加 fd 到 epoll 失败: " << strerror(errno) << std::endl;
 }
-void modify_fd_in_epoll(int epoll_fd, int fd, uint32_t events) {
-    epoll_event ev{};
-    ev.data.fd = fd;
-    ev.events = events;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) std::cerr << "修改 epoll 中的 fd 失败: " << strerror(errno) << std::endl;
+void modify_fd_in_epoll(int epoll_fd, int fd, uint32_t events) {
+    epoll_event ev{};
+    ev.data.fd = fd;
+    ev.events = events;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) std::cerr << "修改 epoll 中的 fd 失败: " << strerror(errno) << std::endl;
+}
+void remove_fd_from_epoll(int epoll_fd, int fd) {
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr) == -1) {
+        if (errno != EBADF) std::cerr << "从 epoll 移除 fd 失败: " << strerror(errno) << std::endl;
+    }
+}
+void disconnect_client(ServerContext& context, int fd) {
+    pthread_mutex_lock(&context.clients_mutex);
+    if (context.clients.count(fd)) {
+        std::string addr = format_addr48(context.clients.addr(fd));
+        if (context.clients.kind(fd) == ConnKind::NodeLink) {
+            std::cout << "节点链路断开: " << addr << " (fd: " << fd << ")" << std::endl;
+            // 经由该链路可达的远端客户端全部失效
+            for (auto it = context.remote_clients.begin(); it != context.remote_clients.end();) {
+                if (it->second == fd) {
+                    context.directory.remove(it->first);
+                    it = context.remote_clients.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            context.node_links.erase(std::find(context.node_links.begin(), context.node_links.end(), fd));
+        } else {
+            std::cout << "客户端断开: " << addr << " (fd: " << fd << ")" << std::endl;
+            broadcast_to_nodes(context, "-" + addr + "\n");
+            capture.disconnect(context.clients.addr(fd));
+            context.directory.remove(context.clients.addr(fd));
+        }
+        uint32_t user_id = context.clients.user_id(fd);
+        if (user_id != 0 && context.users.fd_of(user_id) == fd) {
+            context.users.online_fd[user_id] = -1;
+        }
+        ClientInfo* info = context.clients.info_if_present(fd);
+        if (info != nullptr && info->pair_fd != -1) {
+            release_pair(context, fd, false);
+        }
+        if (info != nullptr && info->stream_to != -1) {
+            finish_stream(context, fd);
+        }
+        if (info != nullptr && info->stream_from != -1) {
+            cancel_stream(context, *info, "目标客户端已断开");
+        }
+        if (info != nullptr && !info->seq_marks.empty()) {
+            seq_rollback(context, *info);
+        }
+        drop_transfers(context, fd);
+        context.topics.remove_fd(fd);
+        remove_fd_from_epoll(context.epoll_fd, fd);
+        if (context.scheduler != nullptr) context.scheduler->close(fd);
+        close(fd);
+        context.clients.erase(fd);
+    }
+    pthread_mutex_unlock(&context.clients_mutex);
+}
+// 解析 IP:PORT:MESSAGE，content_pos 为消息内容在 raw_buf 中的起始位置
+bool parse_message(const std::string& raw_buf, Addr48& target_addr, size_t& content_pos) {
+    size_t first_colon = raw_buf.find(':');
+    if (first_colon == std::string::npos) return false;
+    size_t second_colon = raw_buf.find(':', first_colon + 1);
+    if (second_colon == std::string::npos) return false;
+    if (!parse_addr48(raw_buf.data(), second_colon, target_addr)) return false;
+    content_pos = second_colon + 1;
+    return true;
+}
+
+/**
+ * @brief 解析多目标消息 IP1:PORT1,IP2:PORT2,...:MESSAGE，目标按出现顺序放进 targets（调用者复用同一个 vector），
+ * content_pos 为消息内容的起始位置。整行只扫描一遍
+ */
+bool parse_recipients(const char* data, size_t len, std::vector<Addr48>& targets, size_t& content_pos) {
+    targets.clear();
+    size_t pos = 0;
+    while (true) {
+        const char* colon = static_cast<const char*>(memchr(data + pos, ':', len - pos));
+        if (colon == nullptr) return false;
+        size_t end = colon - data + 1;
+        while (end < len && data[end] >= '0' && data[end] <= '9') ++end;
+        Addr48 addr;
+        if (end == len || !parse_addr48(data + pos, end - pos, addr)) return false;
+        targets.push_back(addr);
+        if (data[end] == ':') {
+            content_pos = end + 1;
+            return true;
+        }
+        if (data[end] != ',') return false;
+        pos = end + 1;
+    }
+}
+
+// 调用者需持有 clients_mutex
+int find_client_fd(ServerContext& context, Addr48 addr) {
+    int fd = context.clients.find(addr);
+    return fd != -1 && context.clients.kind(fd) == ConnKind::Client ? fd : -1;
+}
+
+// 接收超长行期间暂缓的其它输出的上限，超过时提前结束这条超长行
+static const size_t STREAM_HOLD_MAX = 1024 * 1024;
+
+// 向 fd 的普通通道/优先通道追加 head + data（分帧连接的帧头与正文连在一起，中间不会插进别的数据）
+static void append_output(ServerContext& context, int fd, const char* head, size_t head_len, const char* data, size_t len) {
+    ClientInfo& info = context.clients.info(fd);
+    if (info.stream_from != -1) {
+        // 正在接收一条超长行：其它输出不能插进它的中间，等它送完再接着追加
+        if (info.stream_hold.size() + head_len + len <= STREAM_HOLD_MAX) {
+            info.stream_hold.append(head, head_len);
+            info.stream_hold.append(data, len);
+            return;
+        }
+        interrupt_stream(context, info.stream_from, "目标的其它消息积压过多");
+    }
+    uint64_t trace_start = tracer.routing() ? Tracer::clock_ns() : 0;
+    // 记录这条消息之前的边界：离上一个边界够远，或这条消息本身很长时
+    if (!info.write_buf.empty()) {
+        uint64_t start = info.out_written + info.write_pending();
+        uint64_t prev = info.cut_done < info.cuts.size() ? info.cuts.back() : info.out_written;
+        if (start - prev >= OUTPUT_CUT_SPACING || head_len + len >= OUTPUT_CUT_SPACING) info.cuts.push_back(start);
+    }
+    info.write_buf.append(head, head_len);
+    info.write_buf.append(data, len);
+    request_write(context, fd);
+    if (trace_start != 0) tracer.on_route(info, fd, trace_start);
+}
+static void append_urgent(ServerContext& context, int fd, const char* head, size_t head_len, const char* data, size_t len) {
+    if (!context.priority_lanes || context.clients.info(fd).stream_from != -1) {
+        append_output(context, fd, head, head_len, data, len);
+        return;
+    }
+    Buffer& urgent = context.clients.info(fd).urgent_buf;
+    urgent.append(head, head_len);
+    urgent.append(data, len);
+    request_write(context, fd);
+}
+
+// 文本行对分帧连接包装成 TEXT 帧（去掉行尾换行），返回帧头长度，文本连接返回 0 表示原样发送
+static size_t text_frame(ServerContext& context, int fd, char* header, const std::string& line, size_t& len) {
+    len = line.size();
+    if (!context.clients.framed(fd)) return 0;
+    if (len > 0 && line[len - 1] == '\n') --len;
+    FrameHeader frame;
+    frame.length = len;
+    frame.type = FRAME_TEXT;
+    encode_frame_header(header, frame);
+    return FRAME_HEADER;
+}
+
+// 向 fd 的写缓冲区追加数据并关注 EPOLLOUT，调用者需持有 clients_mutex。
+// std::string 版本用于以换行结尾的文本回复/通知，对分帧连接包装成 TEXT 帧；指针版本原样追加（直连模式转发的数据）
+void queue_output(ServerContext& context, int fd, const std::string& data) {
+    char header[FRAME_HEADER];
+    size_t len;
+    size_t head_len = text_frame(context, fd, header, data, len);
+    append_output(context, fd, header, head_len, data.data(), len);
+}
+void queue_output(ServerContext& context, int fd, const char* data, size_t len) {
+    append_output(context, fd, nullptr, 0, data, len);
+}
+
+// 向 fd 的优先通道追加一条控制消息，调用者需持有 clients_mutex
+void queue_urgent(ServerContext& context, int fd, const std::string& data) {
+    char header[FRAME_HEADER];
+    size_t len;
+    size_t head_len = text_frame(context, fd, header, data, len);
+    append_urgent(context, fd, header, head_len, data.data(), len);
+}
+void queue_urgent(ServerContext& context, int fd, const char* data, size_t len) {
+    append_urgent(context, fd, nullptr, 0, data, len);
+}
+
+// 转发一条聊天消息：振铃 "bell" 走优先通道，不排在大段文字后面，其余走普通通道。调用者需持有 clients_mutex
+void queue_message(ServerContext& context, int fd, Addr48 from, const char* data, size_t len) {
+    queue_content(context, fd, from, 0, data, len, len == 4 && memcmp(data, "bell", 4) == 0);
+}
+
+/**
+ * @brief 把一条聊天内容交给目标连接：分帧连接收到 MSG 帧（target 为发送方地址，未知时为 0；seq 为有序投递的序号），
+ * 文本连接原样收到内容。调用者需持有 clients_mutex
+ */
+void queue_content(ServerContext& context, int fd, Addr48 from, uint64_t seq, const char* data, size_t len, bool urgent) {
+    capture.message(from, context.clients.addr(fd), len);
+    if (context.search.enabled() && !urgent) index_delivery(context, fd, from, data, len);
+    char header[FRAME_HEADER];
+    size_t head_len = 0;
+    if (context.clients.framed(fd)) {
+        FrameHeader frame;
+        frame.length = len;
+        frame.type = FRAME_MSG;
+        frame.target = from;
+        frame.seq = seq;
+        encode_frame_header(header, frame);
+        head_len = FRAME_HEADER;
+    }
+    if (urgent) {
+        append_urgent(context, fd, header, head_len, data, len);
+    } else {
+        append_output(context, fd, header, head_len, data, len);
+    }
+}
+
+/**
+ * @brief 选出下一次写出的数据：优先通道有数据且普通通道停在消息边界上时写优先通道（严格优先），
+ * 否则写普通通道——优先通道为空时写完整个缓冲区，不为空时只写到下一个边界。
+ * 返回长度，urgent 表示取自哪个通道。调用者需持有 clients_mutex（协程模式下在主线程上）
+ */
+size_t next_output(ClientInfo& info, bool& urgent) {
+    urgent = !info.urgent_buf.empty() && (info.write_buf.empty() || !info.mid_message);
+    if (urgent) return info.urgent_buf.size();
+    if (info.urgent_buf.empty() || info.cut_done == info.cuts.size()) return info.write_pending();
+    return info.cuts[info.cut_done] - info.out_written;
+}
+
+// 从 next_output() 选出的通道头部移除写出的 n 字节，调用者同上
+void output_written(ClientInfo& info, bool urgent, size_t n) {
+    if (urgent) {
+        info.urgent_buf.erase(0, n);
+        return;
+    }
+    info.write_pos += n;
+    info.out_written += n;
+    if (info.write_pos == info.write_buf.size()) {
+        info.write_buf.clear();
+        info.write_pos = 0;
+    } else if (info.write_pos >= WRITE_SLICE && info.write_pos * 2 >= info.write_buf.size()) {
+        info.write_buf.erase(0, info.write_pos);
+        info.write_pos = 0;
+    }
+    info.mid_message = !info.write_buf.empty();
+    while (info.cut_done < info.cuts.size() && info.cuts[info.cut_done] <= info.out_written) {
+        if (info.cuts[info.cut_done++] == info.out_written) info.mid_message = false;
+    }
+    if (info.cut_done == info.cuts.size()) {
+        info.cuts.clear();
+        info.cut_done = 0;
+    }
+}
+
+// fd 有新数据待送出（写缓冲区或文件数据块）：关注 EPOLLOUT 或唤醒写协程，调用者需持有 clients_mutex
+void request_write(ServerContext& context, int fd) {
+    if (context.scheduler != nullptr) {
+        context.scheduler->wake_writer(fd);
+    } else {
+        modify_fd_in_epoll(context.epoll_fd, fd, EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLET);
+    }
+}
+
+// 新连接注册到 epoll 时关注的事件；EPOLLPRI 报告直连模式下用来退出的带外字节
+uint32_t conn_events(const ServerContext& context) {
+    return context.scheduler != nullptr ? EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLET : EPOLLIN | EPOLLPRI | EPOLLET;
+}
+
+// 修改关注的事件，同时借 EPOLL_CTL_MOD 让边沿触发重新报告当前状态；协程模式下始终同时关注读写，带外字节始终关注
+void watch_fd(ServerContext& context, int fd, uint32_t events) {
+    modify_fd_in_epoll(context.epoll_fd, fd, context.scheduler != nullptr ? EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLET : events | EPOLLPRI);
+}
+
+/**
+ * @brief 处理控制命令，返回 false 表示不是命令，应按 IP:PORT:MESSAGE 解析
+ *   LOGIN NAME    把用户名绑定到当前连接，回复 "OK ID"，并开始新的有序投递会话
+ *   RESUME NAME   同 LOGIN，但继续上一次的有序投递会话（断线重连后使用）
+ *   SEQ N TARGET:MESSAGE  有序投递，TARGET 为 IP:PORT、@NAME 或 #ID，见“有序投递”一节
+ *   PAIR IP:PORT  请求与目标直连，双方互相发送后生效
+ *   UNPAIR        未处于直连模式时回复提示；直连期间数据不再解析，退出直连须发送一个带外字节（MSG_OOB）
+ *   FILE IP:PORT SIZE NAME / ACCEPT ID / REJECT ID / FILEDATA ID LEN  文件传输，见“文件传输”一节
+ *   TRACE         把消息追踪记录导出到 --trace-file，回复 "TRACE 事件数 路径"；同 WHO，由 process_messages() 在锁外处理
+ *   ADDR          查询本连接在服务器上的地址，回复 "ADDR IP:PORT"（Unix socket 客户端的地址见 unix_peer_addr()）
+ *   POOL          线程池状态，回复 "POOL threads=N min=N max=N queued=N active=N wait_us=X util=N% tasks=N grows=N shrinks=N"
+ *   WHO / LIST    在线列表，回复 "WHO 总数 IP:PORT[@用户名][*] ..."（* 表示在其它节点上，最多列出 WHO_MAX_ENTRIES 项）；
+ *                 不经过这里，由 process_messages() 放开 clients_mutex 后处理，见 answer_unlocked()
+ *   SUB 模式 / UNSUB 模式 / PUB 主题 内容  主题订阅与发布，见“主题订阅”一节
+ *   TOPICS        订阅索引状态，回复 "TOPICS subscriptions=N connections=N nodes=N cached=N hits=N misses=N"
+ *   SEARCH 关键词...  在自己收发过的消息里全文搜索，见“消息搜索”一节
+ * 调用者需持有 clients_mutex
+ */
+bool handle_command(ServerContext& context, int fd, const std::string& message) {
+    if (message.compare(0, 6, "LOGIN ") == 0) {
+        handle_login(context, fd, message.substr(6), false);
+        return true;
+    }
+    if (message.compare(0, 7, "RESUME ") == 0) {
+        handle_login(context, fd, message.substr(7), true);
+        return true;
+    }
+    if (message.compare(0, 4, "SEQ ") == 0) {
+        handle_seq(context, fd, std::string_view(message).substr(4));
+        return true;
+    }
+    if (message.compare(0, 4, "PUB ") == 0) {
+        handle_publish(context, fd, std::string_view(message).substr(4));
+        return true;
+    }
+    if (message.compare(0, 4, "SUB ") == 0 || message.compare(0, 6, "UNSUB ") == 0) {
+        handle_subscribe(context, fd, message.substr(message[0] == 'S' ? 4 : 6), message[0] == 'S');
+        return true;
+    }
+    if (message.compare(0, 7, "SEARCH ") == 0 || message == "SEARCH") {
+        handle_search(context, fd, message.size() > 7 ? message.substr(7) : std::string());
+        return true;
+    }
+    if (message == "TOPICS") {
+        queue_output(context, fd, "TOPICS " + context.topics.stats() + "\n");
+        return true;
+    }
+    if (message == "ADDR") {
+        queue_output(context, fd, "ADDR " + format_addr48(context.clients.addr(fd)) + "\n");
+        return true;
+    }
+    if (message == "POOL" && context.pool != nullptr) {
+        ThreadPool::Stats stats = context.pool->stats();
+        char reply[256];
+        snprintf(reply, sizeof(reply),
+                 "POOL threads=%zu min=%zu max=%zu queued=%zu active=%zu wait_us=%.1f util=%d%% tasks=%llu grows=%llu shrinks=%llu\n",
+                 stats.threads, stats.min_threads, stats.max_threads, stats.queued, stats.active, stats.wait_us,
+                 (int)(stats.utilization * 100), (unsigned long long)stats.tasks, (unsigned long long)stats.grows,
+                 (unsigned long long)stats.shrinks);
+        queue_output(context, fd, reply);
+        return true;
+    }
+    if (message.compare(0, 9, "FILEDATA ") == 0) {
+        handle_file_data(context, fd, message.substr(9));
+        return true;
+    }
+    if (message.compare(0, 5, "FILE ") == 0) {
+        handle_file_offer(context, fd, message.substr(5));
+        return true;
+    }
+    if (message.compare(0, 7, "ACCEPT ") == 0 || message.compare(0, 7, "REJECT ") == 0) {
+        handle_file_reply(context, fd, message.substr(7), message[0] == 'A');
+        return true;
+    }
+    if (message == "UNPAIR") {
+        if (context.clients.info(fd).pair_fd == -1) {
+            queue_output(context, fd, "当前未处于直连模式\n");
+        } else {
+            release_pair(context, fd, true);
+        }
+        return true;
+    }
+    if (message.compare(0, 5, "PAIR ") != 0) return false;
+
+    Addr48 target_addr;
+    if (!parse_addr48(message.data() + 5, message.size() - 5, target_addr)) {
+        queue_output(context, fd, "无效的命令格式. 请使用: PAIR IP:PORT\n");
+        return true;
+    }
+    ClientInfo& self = context.clients.info(fd);
+    if (self.pair_fd != -1) {
+        queue_output(context, fd, "已处于直连模式\n");
+        return true;
+    }
+    int target_fd = find_client_fd(context, target_addr);
+    if (target_fd == -1 || target_fd == fd) {
+        queue_output(context, fd, "目标客户端未找到\n");
+        return true;
+    }
+    ClientInfo& peer = context.clients.info(target_fd);
+    Addr48 self_addr = context.clients.addr(fd);
+    if (peer.pair_fd == -1 && peer.pair_request == self_addr) {
+        establish_pair(context, fd, target_fd);
+    } else {
+        self.pair_request = target_addr;
+        std::string self_str = format_addr48(self_addr);
+        queue_output(context, target_fd, self_str + " 请求直连, 发送 PAIR " + self_str + " 确认\n");
+    }
+    return true;
+}
+
+// 处理客户端发来的一行文本（文本协议的一行，或分帧协议的 TEXT 帧）：控制命令、@NAME/#ID 寻址或 IP:PORT:MESSAGE。
+// 调用者需持有 clients_mutex
+void handle_client_line(ServerContext& context, int fd, const std::string& message) {
+    if (handle_command(context, fd, message) || route_by_name(context, fd, message)) return;
+    Addr48 target_addr;
+    size_t content_pos;
+    if (parse_message(message, target_addr, content_pos)) {
+        route_to_addr(context, fd, target_addr, message.data() + content_pos, message.size() - content_pos);
+        return;
+    }
+    static thread_local std::vector<Addr48> targets;
+    if (!parse_recipients(message.data(), message.size(), targets, content_pos)) {
+        queue_output(context, fd, "无效的消息格式. 请使用: IP:PORT:MESSAGE 或 IP1:PORT1,IP2:PORT2,...:MESSAGE\n");
+        return;
+    }
+    route_to_many(context, fd, targets, false, message.data() + content_pos, message.size() - content_pos);
+}
+
+// --- 主题订阅 ---
+/* SUB 模式 / UNSUB 模式 订阅或取消订阅，回复 "SUB-OK 模式" / "UNSUB-OK 模式"，出错时回复 "SUB-ERROR 模式 原因" 等；
+ * PUB 主题 内容 发布一条消息，每个匹配的订阅者（有多个模式匹配时也只收到一次）收到一行 "TOPIC 主题 发布方IP:PORT 内容"，
+ * 分帧连接收到同样内容的 TEXT 帧；发布成功不回复，主题无效时回复 "PUB-ERROR 原因"。
+ * 这一行只格式化一次，逐个追加到订阅者的写缓冲区。订阅只在本节点内匹配，不经集群链路转发；断开时自动取消，随热升级交接 */
+
+bool TopicIndex::valid(std::string_view text, bool pattern) {
+    if (text.empty() || text.size() > MAX_TOPIC) return false;
+    size_t start = 0;
+    for (size_t i = 0; i <= text.size(); ++i) {
+        if (i < text.size() && text[i] != '.') {
+            if ((unsigned char)text[i] <= ' ') return false;
+            continue;
+        }
+        std::string_view word = text.substr(start, i - start);
+        if (word.empty()) return false;
+        if (word.find_first_of("*#") != std::string_view::npos && (!pattern || word.size() != 1)) return false;
+        start = i + 1;
+    }
+    return true;
+}
+
+std::string TopicIndex::normalize(std::string_view pattern) {
+    std::string out;
+    out.reserve(pattern.size());
+    size_t start = 0;
+    bool last_hash = false;
+    while (start <= pattern.size()) {
+        size_t dot = pattern.find('.', start);
+        if (dot == std::string_view::npos) dot = pattern.size();
+        std::string_view word = pattern.substr(start, dot - start);
+        bool hash = word == "#";
+        if (!(hash && last_hash)) {
+            if (!out.empty()) out += '.';
+            out.append(word);
+        }
+        last_hash = hash;
+        start = dot + 1;
+    }
+    return out;
+}
+
+void TopicIndex::split(std::string_view text, std::vector<std::string_view>& words) {
+    words.clear();
+    size_t start = 0;
+    for (size_t dot; (dot = text.find('.', start)) != std::string_view::npos; start = dot + 1) {
+        words.push_back(text.substr(start, dot - start));
+    }
+    words.push_back(text.substr(start));
+}
+
+// 模式的单词 p[0..pn) 是否匹配主题的单词 t[0..tn)：逐个模式单词更新 reach[j]（模式已处理的部分能否恰好匹配
+// 主题的前 j 个单词），代价为 pn * tn，与 '#' 的个数无关。主题最长 MAX_TOPIC 字节，最多 MAX_TOPIC / 2 + 1 个单词
+static bool match_words(const std::string_view* p, size_t pn, const std::string_view* t, size_t tn) {
+    bool reach[TopicIndex::MAX_TOPIC / 2 + 2] = {};
+    reach[0] = true;
+    for (size_t i = 0; i < pn; ++i) {
+        if (p[i] == "#") {
+            for (size_t j = 1; j <= tn; ++j) reach[j] = reach[j] || reach[j - 1];
+        } else {
+            for (size_t j = tn; j > 0; --j) reach[j] = reach[j - 1] && (p[i] == "*" || p[i] == t[j - 1]);
+            reach[0] = false;
+        }
+    }
+    return reach[tn];
+}
+
+uint32_t TopicIndex::child(uint32_t node, std::string_view word, bool create) {
+    uint32_t* slot = word == "*" ? &nodes_[node].star : word == "#" ? &nodes_[node].hash : nullptr;
+    if (slot == nullptr) {
+        auto it = nodes_[node].children.find(std::string(word));
+        if (it != nodes_[node].children.end()) return it->second;
+    } else if (*slot != 0) {
+        return *slot;
+    }
+    if (!create) return 0;
+    uint32_t id;
+    if (!free_.empty()) {
+        id = free_.back();
+        free_.pop_back();
+    } else {
+        id = nodes_.size();
+        nodes_.emplace_back();  // 之后 nodes_ 中的引用失效，下面重新取
+    }
+    nodes_[id].parent = node;
+    nodes_[id].word = word;
+    if (word == "*") {
+        nodes_[node].star = id;
+    } else if (word == "#") {
+        nodes_[node].hash = id;
+    } else {
+        nodes_[node].children.emplace(std::string(word), id);
+    }
+    return id;
+}
+
+// 没有订阅者也没有子节点的节点从树上摘下，逐级向上
+void TopicIndex::prune(uint32_t node) {
+    while (node != 0) {
+        Node& n = nodes_[node];
+        if (!n.fds.empty() || !n.children.empty() || n.star != 0 || n.hash != 0) return;
+        uint32_t parent = n.parent;
+        if (n.word == "*") {
+            nodes_[parent].star = 0;
+        } else if (n.word == "#") {
+            nodes_[parent].hash = 0;
+        } else {
+            nodes_[parent].children.erase(n.word);
+        }
+        n = Node();
+        free_.push_back(node);
+        node = parent;
+    }
+}
+
+// 作废被 pattern 匹配到的缓存项。模式只拆分一次，逐项匹配时不分配内存
+void TopicIndex::invalidate(std::string_view pattern) {
+    if (pattern == "#") {
+        cache_.clear();
+        return;
+    }
+    static thread_local std::vector<std::string_view> p, t;
+    split(pattern, p);
+    for (auto it = cache_.begin(); it != cache_.end();) {
+        split(it->first, t);
+        if (match_words(p.data(), p.size(), t.data(), t.size())) {
+            it = cache_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool TopicIndex::subscribe(int fd, const std::string& pattern) {
+    std::vector<std::string>& list = by_fd_[fd];
+    if (std::find(list.begin(), list.end(), pattern) != list.end()) return false;
+    std::vector<std::string_view> words;
+    split(pattern, words);
+    uint32_t node = 0;
+    for (std::string_view word : words) node = child(node, word, true);
+    nodes_[node].fds.push_back(fd);
+    list.push_back(pattern);
+    ++subscriptions_;
+    invalidate(pattern);
+    return true;
+}
+
+bool TopicIndex::unsubscribe(int fd, const std::string& pattern) {
+    auto entry = by_fd_.find(fd);
+    if (entry == by_fd_.end()) return false;
+    std::vector<std::string>& list = entry->second;
+    auto it = std::find(list.begin(), list.end(), pattern);
+    if (it == list.end()) return false;
+    list.erase(it);
+    if (list.empty()) by_fd_.erase(entry);
+    detach(fd, pattern, true);
+    return true;
+}
+
+// 连接可能有上千个订阅，逐个作废缓存的代价是订阅数乘以缓存项数，这里摘完后整体清空一次
+void TopicIndex::remove_fd(int fd) {
+    auto entry = by_fd_.find(fd);
+    if (entry == by_fd_.end()) return;
+    std::vector<std::string> list = std::move(entry->second);
+    by_fd_.erase(entry);
+    for (const std::string& pattern : list) detach(fd, pattern, false);
+    cache_.clear();
+}
+
+// 从树上摘掉 fd 对 pattern 的订阅（by_fd_ 由调用者维护），invalidate 为 false 时由调用者处理缓存
+void TopicIndex::detach(int fd, const std::string& pattern, bool invalidate_cache) {
+    std::vector<std::string_view> words;
+    split(pattern, words);
+    uint32_t node = 0;
+    for (std::string_view word : words) node = child(node, word, false);
+    std::vector<int>& fds = nodes_[node].fds;
+    fds.erase(std::find(fds.begin(), fds.end(), fd));
+    prune(node);
+    --subscriptions_;
+    if (invalidate_cache) invalidate(pattern);
+}
+
+size_t TopicIndex::count(int fd) const {
+    auto entry = by_fd_.find(fd);
+    return entry != by_fd_.end() ? entry->second.size() : 0;
+}
+
+// 把 node 加入本步的节点集合；进入 '#' 子节点不消耗单词，一并加入
+void TopicIndex::add_state(uint32_t node, std::vector<uint32_t>& states) {
+    do {
+        if (mark_[node] == step_) return;
+        mark_[node] = step_;
+        states.push_back(node);
+        node = nodes_[node].hash;
+    } while (node != 0);
+}
+
+// 匹配主题的全部单词，订阅者追加到 out。每一步每个节点最多处理一次，代价不超过单词数乘以节点数
+void TopicIndex::collect(const std::vector<std::string_view>& words, std::vector<int>& out) {
+    if (mark_.size() < nodes_.size()) mark_.resize(nodes_.size(), 0);
+    if (step_ > UINT32_MAX - words.size() - 2) {
+        std::fill(mark_.begin(), mark_.end(), 0);
+        step_ = 0;
+    }
+    states_.clear();
+    ++step_;
+    add_state(0, states_);
+    static thread_local std::string key;
+    for (std::string_view word : words) {
+        next_states_.clear();
+        ++step_;
+        key.assign(word);
+        for (uint32_t state : states_) {
+            const Node& n = nodes_[state];
+            if (n.word == "#") add_state(state, next_states_);  // '#' 再吞掉一个单词
+            if (n.star != 0) add_state(n.star, next_states_);
+            if (!n.children.empty()) {
+                auto it = n.children.find(key);
+                if (it != n.children.end()) add_state(it->second, next_states_);
+            }
+        }
+        states_.swap(next_states_);
+        if (states_.empty()) return;
+    }
+    for (uint32_t state : states_) out.insert(out.end(), nodes_[state].fds.begin(), nodes_[state].fds.end());
+}
+
+const std::vector<int>& TopicIndex::match(const std::string& topic) {
+    auto cached = cache_.find(topic);
+    if (cached != cache_.end()) {
+        ++hits_;
+        return cached->second;
+    }
+    ++misses_;
+    if (cache_.size() >= MAX_CACHED) cache_.clear();
+    static thread_local std::vector<std::string_view> words;
+    split(topic, words);
+    std::vector<int> fds;
+    collect(words, fds);
+    std::sort(fds.begin(), fds.end());
+    fds.erase(std::unique(fds.begin(), fds.end()), fds.end());
+    return cache_.emplace(topic, std::move(fds)).first->second;
+}
+
+std::string TopicIndex::stats() const {
+    return "subscriptions=" + std::to_string(subscriptions_) + " connections=" + std::to_string(by_fd_.size()) +
+           " nodes=" + std::to_string(nodes_.size() - free_.size()) + " cached=" + std::to_string(cache_.size()) +
+           " hits=" + std::to_string(hits_) + " misses=" + std::to_string(misses_);
+}
+
+// SUB / UNSUB 模式，相邻的 '#' 合并后再订阅，回复中也是合并后的模式。调用者需持有 clients_mutex
+void handle_subscribe(ServerContext& context, int fd, const std::string& text, bool subscribe) {
+    const char* command = subscribe ? "SUB" : "UNSUB";
+    if (!TopicIndex::valid(text, true)) {
+        queue_output(context, fd, std::string(command) + "-ERROR " + text +
+                                      " 无效的模式, 单词以 . 分隔, * 匹配一个单词, # 匹配零个或多个单词\n");
+        return;
+    }
+    std::string pattern = TopicIndex::normalize(text);
+    const char* error = nullptr;
+    if (!subscribe) {
+        if (!context.topics.unsubscribe(fd, pattern)) error = "未订阅";
+    } else if (context.topics.count(fd) >= TopicIndex::MAX_PER_CONN) {
+        error = "订阅数已达上限";
+    } else if (!context.topics.subscribe(fd, pattern)) {
+        error = "已订阅";
+    }
+    if (error != nullptr) {
+        queue_output(context, fd, std::string(command) + "-ERROR " + pattern + " " + error + "\n");
+    } else {
+        queue_output(context, fd, std::string(command) + "-OK " + pattern + "\n");
+    }
+}
+
+// PUB 主题 内容：格式化一次，逐个追加给匹配的订阅者。调用者需持有 clients_mutex
+void handle_publish(ServerContext& context, int fd, std::string_view args) {
+    size_t space = args.find(' ');
+    std::string_view topic = args.substr(0, space);
+    if (space == std::string_view::npos || !TopicIndex::valid(topic, false)) {
+        queue_output(context, fd, "PUB-ERROR 无效的主题. 请使用: PUB 主题 内容, 主题为以 . 分隔的单词\n");
+        return;
+    }
+    static thread_local std::string key;
+    static thread_local std::string line;
+    key.assign(topic);
+    const std::vector<int>& fds = context.topics.match(key);
+    if (fds.empty()) return;
+    line.assign("TOPIC ");
+    line.append(topic);
+    line += ' ';
+    line += format_addr48(context.clients.addr(fd));
+    line += ' ';
+    line.append(args.substr(space + 1));
+    line += '\n';
+    for (int target_fd : fds) queue_output(context, target_fd, line);
+}
+
+// --- 消息搜索 ---
+/*
+ * SEARCH 关键词...  在发起者收发过的消息里查找同时包含全部关键词的消息（分词规则见 search_tokens()）。
+ * 只有已登录的连接能查，按用户名查找，换连接、断线重连、服务器重启后仍查得到；收发双方都未登录的消息不建索引。回复：
+ *   SEARCH-HIT 对方 时间 发送方 片段       每个会话最多 3 条，由新到旧；会话按最近一条命中排序，最多 10 个
+ *   SEARCH-END 命中数[+] 会话数 用时(微秒)  "+" 表示命中的更多，查够结果后就停止了
+ *   SEARCH-ERROR 原因                       包括本连接上一次查询还没回复、或全部连接同时进行的查询已满时
+ * 对方和发送方为 @用户名 或 IP:PORT，时间为服务器本地时间 YYYY-MM-DDTHH:MM:SS。
+ * 查询在索引线程上执行，主线程在 SearchIndex::notify_fd() 可读时取回结果写给发起者
+ */
+
+// 本节点连接的用户标签 "@用户名"，未登录时为空。调用者需持有 clients_mutex
+static std::string search_user(ServerContext& context, int fd) {
+    uint32_t user_id = context.clients.user_id(fd);
+    return user_id != 0 && user_id < context.users.names.size() ? "@" + context.users.names[user_id] : std::string();
+}
+
+// 把一条刚投递给 fd 的消息交给搜索索引（只拷进队列），双方都未登录时不索引。调用者需持有 clients_mutex
+void index_delivery(ServerContext& context, int fd, Addr48 from, const char* data, size_t len) {
+    int from_fd = from != 0 ? context.clients.find(from) : -1;
+    std::string sender = from_fd != -1 ? search_user(context, from_fd) : std::string();
+    std::string recipient = search_user(context, fd);
+    if (sender.empty() && recipient.empty()) return;
+    if (sender.empty()) sender = from != 0 ? format_addr48(from) : "?";
+    if (recipient.empty()) recipient = format_addr48(context.clients.addr(fd));
+    context.search.add(sender, recipient, data, len);
+}
+
+// 调用者需持有 clients_mutex
+void handle_search(ServerContext& context, int fd, const std::string& words) {
+    if (!context.search.enabled()) {
+        queue_output(context, fd, "SEARCH-ERROR 未开启消息搜索, 启动时使用 --search-dir=DIR\n");
+        return;
+    }
+    if (words.find_first_not_of(' ') == std::string::npos) {
+        queue_output(context, fd, "SEARCH-ERROR 请使用: SEARCH 关键词...\n");
+        return;
+    }
+    std::string who = search_user(context, fd);
+    if (who.empty()) {
+        queue_output(context, fd, "SEARCH-ERROR 请先 LOGIN 用户名, 只能搜索已登录用户收发的消息\n");
+        return;
+    }
+    if (!context.search.query(fd, context.clients.addr(fd), who, words)) {
+        queue_output(context, fd, "SEARCH-ERROR 查询繁忙: 上一次查询还没完成或同时进行的查询太多, 请稍后再试\n");
+    }
+}
+
+// 把索引线程完成的查询结果写给仍在线的发起者，调用者需持有 clients_mutex
+void deliver_search_results(ServerContext& context) {
+    for (const SearchIndex::Result& result : context.search.take_results()) {
+        if (context.clients.kind(result.fd) != ConnKind::Client || context.clients.addr(result.fd) != result.addr) continue;
+        if (!result.error.empty()) {
+            queue_output(context, result.fd, "SEARCH-ERROR " + result.error + "\n");
+            continue;
+        }
+        for (const SearchIndex::Hit& hit : result.hits) {
+            time_t seconds = hit.time_ms / 1000;
+            tm local;
+            localtime_r(&seconds, &local);
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &local);
+            queue_output(context, result.fd, "SEARCH-HIT " + hit.peer + " " + when + " " + hit.sender + " " + hit.text + "\n");
+        }
+        queue_output(context, result.fd, "SEARCH-END " + std::to_string(result.matched) + (result.truncated ? "+ " : " ") +
+                                             std::to_string(result.conversations) + " " + std::to_string(result.micros) + "\n");
+    }
+}
+
+// --- 在线目录 ---
+void DirectorySnapshot::build_index() {
+    size_t capacity = 16;
+    shift = 60;
+    while (capacity < entries.size() * 2) {
+        capacity *= 2;
+        --shift;
+    }
+    index.assign(capacity, 0);
+    for (uint32_t i = 0; i < entries.size(); ++i) {
+        size_t slot = (entries[i].addr * 0x9E3779B97F4A7C15ULL) >> shift;
+        while (index[slot] != 0) slot = (slot + 1) & (capacity - 1);
+        index[slot] = i + 1;
+    }
+}
+
+const DirectoryEntry* DirectorySnapshot::find(Addr48 addr) const {
+    if (index.empty()) return nullptr;
+    size_t slot = (addr * 0x9E3779B97F4A7C15ULL) >> shift;
+    while (index[slot] != 0) {
+        const DirectoryEntry& entry = entries[index[slot] - 1];
+        if (entry.addr == addr) return &entry;
+        slot = (slot + 1) & (index.size() - 1);
+    }
+    return nullptr;
+}
+
+// 每个线程第一次读目录时分到一个登记槽下标，线程退出时放回空闲表，供之后创建的线程复用。
+// 线程只在读区间之外退出，归还时槽已清零
+struct DirectoryReaderSlot {
+    size_t index = SIZE_MAX;
+    ~DirectoryReaderSlot();
+};
+static pthread_mutex_t directory_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<size_t> directory_free_slots;
+static size_t directory_reader_count = 0;
+static thread_local DirectoryReaderSlot directory_reader_slot;
+
+DirectoryReaderSlot::~DirectoryReaderSlot() {
+    if (index == SIZE_MAX) return;
+    pthread_mutex_lock(&directory_slots_mutex);
+    directory_free_slots.push_back(index);
+    pthread_mutex_unlock(&directory_slots_mutex);
+}
+
+Directory::Directory() : current_(new DirectorySnapshot()) {
+    pthread_mutex_init(&mutex_, nullptr);
+    pthread_mutex_init(&shared_slot_mutex_, nullptr);
+    pthread_cond_init(&cond_, nullptr);
+}
+
+Directory::~Directory() {
+    if (started_) {
+        pthread_mutex_lock(&mutex_);
+        stop_ = true;
+        pthread_cond_signal(&cond_);
+        pthread_mutex_unlock(&mutex_);
+        pthread_join(thread_, nullptr);
+    }
+    // 此时已没有读者
+    for (auto& retired : retired_) delete retired.first;
+    delete current_.load();
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&shared_slot_mutex_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void Directory::start() {
+    if (pthread_create(&thread_, nullptr, publisher_entry, this) != 0) {
+        throw std::runtime_error("创建目录发布线程失败");
+    }
+    started_ = true;
+}
+
+void Directory::set(Addr48 addr, uint32_t user_id, const std::string& name, bool remote) {
+    push({addr, true, remote, user_id, name});
+}
+
+void Directory::remove(Addr48 addr) {
+    push({addr, false, false, 0, std::string()});
+}
+
+void Directory::push(Delta delta) {
+    pthread_mutex_lock(&mutex_);
+    pending_.push_back(std::move(delta));
+    if (pending_.size() == 1) pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+Directory::ReadGuard Directory::read() const {
+    size_t& index = directory_reader_slot.index;
+    if (index == SIZE_MAX) {
+        pthread_mutex_lock(&directory_slots_mutex);
+        if (!directory_free_slots.empty()) {
+            index = directory_free_slots.back();
+            directory_free_slots.pop_back();
+        } else if (directory_reader_count < MAX_READERS) {
+            index = directory_reader_count++;
+        }
+        pthread_mutex_unlock(&directory_slots_mutex);
+    }
+    pthread_mutex_t* lock = nullptr;
+    std::atomic<uint64_t>* slot;
+    if (index != SIZE_MAX) {
+        slot = &slots_[index].epoch;
+    } else {
+        // 登记槽已被其它存活线程占满：退化为加锁读，在读区间结束时释放
+        lock = &shared_slot_mutex_;
+        pthread_mutex_lock(lock);
+        slot = &shared_slot_.epoch;
+    }
+    // 先登记纪元再取快照（都是顺序一致的操作）：取到的快照退役时，发布线程一定能看到这次登记
+    slot->store(epoch_.load());
+    return ReadGuard(*slot, current_.load(), lock);
+}
+
+void* Directory::publisher_entry(void* arg) {
+    static_cast<Directory*>(arg)->publisher_loop();
+    return nullptr;
+}
+
+void Directory::publisher_loop() {
+    std::vector<Delta> deltas;
+    pthread_mutex_lock(&mutex_);
+    while (!stop_) {
+        if (pending_.empty()) {
+            if (retired_.empty()) {
+                pthread_cond_wait(&cond_, &mutex_);
+            } else {
+                // 还有没释放的旧快照：隔一会儿再看读者是否都已离开
+                timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += PUBLISH_DELAY_MS * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec += 1;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&cond_, &mutex_, &deadline);
+                pthread_mutex_unlock(&mutex_);
+                reclaim();
+                pthread_mutex_lock(&mutex_);
+            }
+            continue;
+        }
+        // 攒一小段时间，一次合并多条增量
+        pthread_mutex_unlock(&mutex_);
+        usleep(PUBLISH_DELAY_MS * 1000);
+        pthread_mutex_lock(&mutex_);
+        deltas.swap(pending_);
+        pthread_mutex_unlock(&mutex_);
+        publish(deltas);
+        deltas.clear();
+        reclaim();
+        pthread_mutex_lock(&mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+// 把按到达顺序排列的增量合并进当前快照：同一地址只有最后一条生效
+void Directory::publish(std::vector<Delta>& deltas) {
+    std::stable_sort(deltas.begin(), deltas.end(), [](const Delta& a, const Delta& b) { return a.addr < b.addr; });
+    const DirectorySnapshot* old = current_.load();
+    DirectorySnapshot* next = new DirectorySnapshot();
+    next->version = old->version + 1;
+    next->entries.reserve(old->entries.size() + deltas.size());
+    auto it = old->entries.begin();
+    for (size_t i = 0; i < deltas.size(); ++i) {
+        if (i + 1 < deltas.size() && deltas[i + 1].addr == deltas[i].addr) continue;
+        const Delta& d = deltas[i];
+        while (it != old->entries.end() && it->addr < d.addr) next->entries.push_back(*it++);
+        if (it != old->entries.end() && it->addr == d.addr) ++it;
+        if (d.online) next->entries.push_back({d.addr, d.user_id, d.remote, d.name});
+    }
+    next->entries.insert(next->entries.end(), it, old->entries.end());
+    next->build_index();
+    current_.store(next);
+    // 此后登记的读者只会取到新快照，旧快照按替换前的纪元退役
+    retired_.emplace_back(old, epoch_.fetch_add(1));
+    publishes_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Directory::reclaim() {
+    uint64_t oldest = UINT64_MAX;
+    for (const ReaderSlot& slot : slots_) {
+        uint64_t epoch = slot.epoch.load();
+        if (epoch != 0) oldest = std::min(oldest, epoch);
+    }
+    uint64_t shared = shared_slot_.epoch.load();
+    if (shared != 0) oldest = std::min(oldest, shared);
+    size_t kept = 0;
+    for (auto& retired : retired_) {
+        if (retired.second < oldest) {
+            delete retired.first;
+        } else {
+            retired_[kept++] = retired;
+        }
+    }
+    retired_.resize(kept);
+}
+
+static void append_who_entry(std::string& reply, const DirectoryEntry& entry) {
+    reply += ' ';
+    reply += format_addr48(entry.addr);
+    if (!entry.name.empty()) reply += "@" + entry.name;
+    if (entry.remote) reply += '*';
+}
+
+/**
+ * @brief WHO / LIST 的回复：从目录快照读出在线列表，不经过连接表，也不需要 clients_mutex。
+ * 快照最多落后 PUBLISH_DELAY_MS，请求者自己的一项按调用者从连接表取到的现状 self 给出（刚 LOGIN 就查询也能看到自己），
+ * 其他客户端的上下线和登录要等下一次发布才出现在回复里
+ */
+std::string who_reply(const Directory& directory, const DirectoryEntry& self) {
+    Directory::ReadGuard snapshot = directory.read();
+    const std::vector<DirectoryEntry>& entries = snapshot->entries;
+    size_t total = entries.size() + (snapshot->find(self.addr) == nullptr ? 1 : 0);
+    std::string reply = "WHO " + std::to_string(total);
+    size_t shown = 0;
+    bool self_done = false;
+    for (size_t i = 0; i < entries.size() && shown < WHO_MAX_ENTRIES; ++i) {
+        if (!self_done && !(entries[i].addr < self.addr)) {
+            append_who_entry(reply, self);
+            self_done = true;
+            ++shown;
+            if (entries[i].addr == self.addr) continue;
+            if (shown == WHO_MAX_ENTRIES) break;
+        }
+        append_who_entry(reply, entries[i]);
+        ++shown;
+    }
+    if (!self_done && shown < WHO_MAX_ENTRIES) append_who_entry(reply, self);
+    reply += '\n';
+    return reply;
+}
+
+// --- 用户名寻址 ---
+
+// 回复和有序投递的确认一样走优先通道，RESUME 之后的确认不会跑到 OK 前面。调用者需持有 clients_mutex
+void handle_login(ServerContext& context, int fd, const std::string& name, bool resume) {
+    if (name.empty() || name.size() > 32 || name.find_first_of(": \t") != std::string::npos) {
+        queue_urgent(context, fd, "无效的用户名: 长度 1-32，不能包含冒号或空白\n");
+        return;
+    }
+    uint32_t id = context.users.intern(name);
+    if (id == 0) {
+        queue_urgent(context, fd, "注册的用户名已达上限\n");
+        return;
+    }
+    int owner = context.users.fd_of(id);
+    if (owner != -1 && owner != fd) {
+        queue_urgent(context, fd, "用户名已被占用\n");
+        return;
+    }
+    uint32_t old_id = context.clients.user_id(fd);
+    if (old_id != 0 && old_id != id) {
+        context.users.online_fd[old_id] = -1;
+    }
+    context.clients.set_user_id(fd, id);
+    context.users.online_fd[id] = fd;
+    context.directory.set(context.clients.addr(fd), id, name, false);
+    if (!resume) ++context.users.session[id];
+    std::cout << (resume ? "用户重连: " : "用户登录: ") << name << " (ID: " << id << ", fd: " << fd << ")" << std::endl;
+    queue_urgent(context, fd, "OK " + std::to_string(id) + "\n");
+}
+
+// 调用者需持有 clients_mutex
+void route_to_user(ServerContext& context, int fd, uint32_t user_id, const char* data, size_t len) {
+    int target_fd = context.users.fd_of(user_id);
+    if (target_fd != -1) {
+        queue_message(context, target_fd, context.clients.addr(fd), data, len);
+    } else {
+        queue_output(context, fd, "目标客户端未找到\n");
+    }
+}
+
+// 按 IP:PORT 投递：本节点的客户端直接转发，其它节点上的客户端查集群路由表经节点链路转发。调用者需持有 clients_mutex
+void route_to_addr(ServerContext& context, int fd, Addr48 target_addr, const char* data, size_t len) {
+    int target_fd = find_client_fd(context, target_addr);
+    if (target_fd != -1) {
+        queue_message(context, target_fd, context.clients.addr(fd), data, len);
+        return;
+    }
+    auto remote = context.remote_clients.find(target_addr);
+    if (remote == context.remote_clients.end()) {
+        queue_output(context, fd, "目标客户端未找到\n");
+        return;
+    }
+    // 节点链路按行分隔，分帧连接发来的多行内容无法转发
+    if (memchr(data, '\n', len) != nullptr) {
+        queue_output(context, fd, "多行消息不能发给其它节点上的客户端\n");
+        return;
+    }
+    std::string relay = ">" + format_addr48(target_addr) + ":" + std::string(data, len) + "\n";
+    if (len == 4 && memcmp(data, "bell", 4) == 0) {
+        queue_urgent(context, remote->second, relay);
+    } else {
+        queue_output(context, remote->second, relay);
+    }
+}
+
+/**
+ * @brief 一条内容发给多个目标（IP:PORT 列表，to_user 时为用户 ID 列表）：在一次持锁中查完全部目标，
+ * 本节点的目标去重后各自收到同一份内容，其它节点上的目标按链路归组、每条链路只转发一行多目标消息，
+ * 找不到的目标汇总成一条回复。调用者需持有 clients_mutex
+ */
+void route_to_many(ServerContext& context, int fd, const std::vector<uint64_t>& targets, bool to_user, const char* data, size_t len) {
+    static thread_local std::vector<int> local;
+    static thread_local std::vector<std::pair<int, Addr48>> relays;  // (节点链路 fd, 目标)
+    std::string missing;
+    for (uint64_t target : targets) {
+        int target_fd = -1;
+        if (to_user) {
+            if (target <= UINT32_MAX) target_fd = context.users.fd_of(target);
+        } else {
+            target_fd = find_client_fd(context, target);
+            if (target_fd == -1) {
+                auto remote = context.remote_clients.find(target);
+                if (remote != context.remote_clients.end()) {
+                    relays.emplace_back(remote->second, target);
+                    continue;
+                }
+            }
+        }
+        if (target_fd != -1) {
+            local.push_back(target_fd);
+        } else {
+            if (!missing.empty()) missing += ',';
+            missing += to_user ? "#" + std::to_string(target) : format_addr48(target);
+        }
+    }
+
+    std::sort(local.begin(), local.end());
+    local.erase(std::unique(local.begin(), local.end()), local.end());
+    Addr48 from = context.clients.addr(fd);
+    bool bell = len == 4 && memcmp(data, "bell", 4) == 0;
+    for (int target_fd : local) queue_content(context, target_fd, from, 0, data, len, bell);
+
+    // 节点链路按行分隔，分帧连接发来的多行内容无法转发
+    if (!relays.empty() && memchr(data, '\n', len) != nullptr) {
+        queue_output(context, fd, "多行消息不能发给其它节点上的客户端\n");
+        relays.clear();
+    }
+    std::sort(relays.begin(), relays.end());
+    relays.erase(std::unique(relays.begin(), relays.end()), relays.end());
+    for (size_t i = 0; i < relays.size();) {
+        int link_fd = relays[i].first;
+        std::string relay = ">";
+        for (; i < relays.size() && relays[i].first == link_fd; ++i) {
+            if (relay.size() > 1) relay += ',';
+            relay += format_addr48(relays[i].second);
+        }
+        relay += ':';
+        relay.append(data, len);
+        relay += '\n';
+        if (bell) {
+            queue_urgent(context, link_fd, relay);
+        } else {
+            queue_output(context, link_fd, relay);
+        }
+    }
+    if (!missing.empty()) queue_output(context, fd, "目标客户端未找到: " + missing + "\n");
+    local.clear();
+    relays.clear();
+}
+
+// 解析 #ID 中的用户 ID，必须全是数字且不超过 UINT32_MAX；不合法时返回 0（没有用户的 ID 是 0）
+static uint32_t parse_user_id(std::string_view digits) {
+    if (digits.empty() || digits.size() > 10 || digits.find_first_not_of("0123456789") != std::string_view::npos) return 0;
+    uint64_t value = 0;
+    for (char c : digits) value = value * 10 + (c - '0');
+    return value <= UINT32_MAX ? static_cast<uint32_t>(value) : 0;
+}
+
+/**
+ * @brief 按名字或 ID 寻址的文本消息：@NAME:MESSAGE 或 #ID:MESSAGE
+ * @return false 表示不是这两种格式
+ * 调用者需持有 clients_mutex
+ */
+bool route_by_name(ServerContext& context, int fd, const std::string& message) {
+    if (message[0] != '@' && message[0] != '#') return false;
+    size_t colon = message.find(':');
+    if (colon == std::string::npos) {
+        queue_output(context, fd, "无效的消息格式. 请使用: @NAME:MESSAGE 或 #ID:MESSAGE\n");
+        return true;
+    }
+    uint32_t user_id = 0;
+    if (message[0] == '@') {
+        auto it = context.users.ids.find(message.substr(1, colon - 1));
+        if (it != context.users.ids.end()) user_id = it->second;
+    } else {
+        user_id = parse_user_id(std::string_view(message).substr(1, colon - 1));
+    }
+    route_to_user(context, fd, user_id, message.data() + colon + 1, message.size() - colon - 1);
+    return true;
+}
+
+// --- 有序投递 ---
+/* 已登录的客户端用 SEQ N TARGET:MESSAGE 发送带序号的消息，每个(发送方, 目标)是一个会话，序号从 1 开始连续编号。
+ * 服务器回给发送方的控制行：
+ *   SEQ-ACK TARGET N          累计确认：N 及之前的消息都已写进目标 socket
+ *   SEQ-NACK TARGET N         从 N 开始重发（前面有消息没被接收，或目标断开时还有消息没送达）
+ *   SEQ-ERROR TARGET N 原因   第 N 条无法投递（目标不存在等），视为已处理，后续序号照常继续
+ * 服务器只接收 N = 已接收 + 1 的消息；N 不大于已接收的是重发的重复消息，直接丢弃，
+ * 已送达的立即再确认一次，这样重连后重发全部未确认消息既不会重复投递，也能补回断线期间丢失的确认。
+ * 确认在写完成时发出：一次 write 写完多条消息只发一条确认，发送方可以让一个窗口的消息同时在途。
+ * 目标在其它节点时，写进节点链路即算送达（逐跳确认）。
+ */
+static const size_t MAX_SEQ_CONVERSATIONS = 256;  // 每个发送方最多保有的有序投递会话数
+
+// 会话的键，复用线程内的字符串，查找已有会话时不分配内存
+static const std::string& seq_key(uint32_t sender, std::string_view target) {
+    static thread_local std::string key;
+    key.assign(reinterpret_cast<const char*>(&sender), sizeof(sender));
+    key += target;
+    return key;
+}
+
+/**
+ * @brief 新建 (sender, target) 的会话。每个发送方最多 MAX_SEQ_CONVERSATIONS 个会话，满了就回收其中最久未用、
+ * 没有消息在途的一个（再往那个目标发时从收到的序号重新开始）；全都有消息在途时返回 nullptr。调用者需持有 clients_mutex
+ */
+static SeqConversation* new_seq_conversation(ServerContext& context, uint32_t sender, std::string_view target) {
+    std::vector<SeqConversation*>& owned = context.users.conversations[sender];
+    if (owned.size() >= MAX_SEQ_CONVERSATIONS) {
+        auto victim = owned.end();
+        for (auto it = owned.begin(); it != owned.end(); ++it) {
+            if ((*it)->marks == 0 && (victim == owned.end() || (*it)->used < (*victim)->used)) victim = it;
+        }
+        if (victim == owned.end()) return nullptr;
+        context.conversations.erase(seq_key(sender, (*victim)->target));
+        *victim = owned.back();
+        owned.pop_back();
+    }
+    SeqConversation& conv = context.conversations[seq_key(sender, target)];
+    conv.sender = sender;
+    conv.target = target;
+    owned.push_back(&conv);
+    return &conv;
+}
+
+// 向会话的发送方当前绑定的连接发一行控制消息，发送方离线时丢弃（重连后重发会补回）。调用者需持有 clients_mutex
+static void seq_reply(ServerContext& context, const SeqConversation& conv, const char* kind, uint64_t seq) {
+    int fd = context.users.fd_of(conv.sender);
+    if (fd != -1) queue_urgent(context, fd, std::string(kind) + " " + conv.target + " " + std::to_string(seq) + "\n");
+}
+
+// 调用者需持有 clients_mutex
+void handle_seq(ServerContext& context, int fd, std::string_view args) {
+    uint64_t seq = 0;
+    size_t start = 0;
+    while (start < args.size() && args[start] >= '0' && args[start] <= '9') ++start;
+    // 与 parse_u64 一样最多 19 位，不会溢出
+    if (start <= 19) {
+        for (size_t i = 0; i < start; ++i) seq = seq * 10 + (args[i] - '0');
+    }
+    bool spaced = start < args.size() && args[start] == ' ';
+    ++start;
+    // 目标到第一个冒号（@NAME / #ID）或第二个冒号（IP:PORT）为止
+    size_t colon = spaced ? args.find(':', start) : std::string::npos;
+    if (colon != std::string::npos && args[start] != '@' && args[start] != '#') colon = args.find(':', colon + 1);
+    if (seq == 0 || colon == std::string::npos) {
+        queue_output(context, fd, "无效的命令格式. 请使用: SEQ N IP:PORT:MESSAGE、SEQ N @NAME:MESSAGE 或 SEQ N #ID:MESSAGE\n");
+        return;
+    }
+    deliver_seq(context, fd, seq, args.substr(start, colon - start), args.data() + colon + 1, args.size() - colon - 1);
+}
+
+/**
+ * @brief 按序接收一条有序消息并转发给目标，文本协议的 SEQ 命令和分帧协议带序号的 MSG 帧共用。
+ * target 为发送方写的目标（IP:PORT、@NAME 或 #ID），同时作为会话的键。调用者需持有 clients_mutex
+ */
+void deliver_seq(ServerContext& context, int fd, uint64_t seq, std::string_view target, const char* content, size_t len) {
+    uint32_t sender = context.clients.user_id(fd);
+    if (sender == 0) {
+        queue_urgent(context, fd, "SEQ-ERROR " + std::string(target) + " " + std::to_string(seq) + " 请先 LOGIN\n");
+        return;
+    }
+    // 先解析目标：目标不存在时不为它新建会话，不能靠发往随机目标把会话表撑大
+    int target_fd = -1;
+    bool remote = false;
+    if (target[0] == '@' || target[0] == '#') {
+        uint32_t user_id = 0;
+        if (target[0] == '@') {
+            auto user = context.users.ids.find(std::string(target.substr(1)));
+            if (user != context.users.ids.end()) user_id = user->second;
+        } else {
+            user_id = parse_user_id(target.substr(1));
+        }
+        target_fd = context.users.fd_of(user_id);
+    } else {
+        Addr48 target_addr;
+        if (parse_addr48(target.data(), target.size(), target_addr)) {
+            target_fd = find_client_fd(context, target_addr);
+            auto relay_link = context.remote_clients.find(target_addr);
+            if (target_fd == -1 && relay_link != context.remote_clients.end()) {
+                target_fd = relay_link->second;
+                remote = true;
+            }
+        }
+    }
+    auto it = context.conversations.find(seq_key(sender, target));
+    SeqConversation* found = it != context.conversations.end() ? &it->second : nullptr;
+    if (found == nullptr) {
+        const char* error = target_fd == -1 ? "目标客户端未找到" : nullptr;
+        if (error == nullptr && (found = new_seq_conversation(context, sender, target)) == nullptr) {
+            error = "有序投递会话太多, 请等在途的消息送达后再试";
+        }
+        if (error != nullptr) {
+            queue_urgent(context, fd, "SEQ-ERROR " + std::string(target) + " " + std::to_string(seq) + " " + error + "\n");
+            return;
+        }
+    }
+    SeqConversation& conv = *found;
+    conv.used = ++context.seq_ticks;
+    uint32_t session = context.users.session[sender];
+    if (!conv.started || conv.session != session) {
+        uint32_t marks = conv.marks;  // 旧会话号的投递记录仍指向这里
+        uint64_t used = conv.used;
+        conv = SeqConversation{};
+        conv.sender = sender;
+        conv.target = target;
+        conv.session = session;
+        conv.marks = marks;
+        conv.used = used;
+    }
+    // 会话的第一条消息确定起点：服务器重启后 RESUME 的客户端从它最后确认的位置继续
+    if (!conv.started) {
+        conv.started = true;
+        conv.accepted = conv.delivered = seq - 1;
+    }
+    if (seq <= conv.delivered) {
+        seq_reply(context, conv, "SEQ-ACK", conv.delivered);
+        return;
+    }
+    if (seq <= conv.accepted) return;  // 已在途，送达时会确认
+    if (seq != conv.accepted + 1) {
+        if (conv.nacked != conv.accepted + 1) {
+            conv.nacked = conv.accepted + 1;
+            seq_reply(context, conv, "SEQ-NACK", conv.nacked);
+        }
+        return;
+    }
+
+    conv.accepted = seq;
+    const char* error = nullptr;
+    if (target_fd == -1) {
+        error = "目标客户端未找到";
+    } else if (remote && memchr(content, '\n', len) != nullptr) {
+        error = "多行消息不能发给其它节点上的客户端";  // 节点链路按行分隔，分帧连接发来的多行内容无法转发
+    }
+    if (error != nullptr) {
+        if (conv.delivered == seq - 1) conv.delivered = seq;
+        queue_urgent(context, fd, "SEQ-ERROR " + conv.target + " " + std::to_string(seq) + " " + error + "\n");
+        return;
+    }
+    if (!remote) {
+        queue_content(context, target_fd, context.clients.addr(fd), seq, content, len);
+    } else {
+        queue_output(context, target_fd, ">" + std::string(target) + ":" + std::string(content, len) + "\n");
+    }
+    ClientInfo& info = context.clients.info(target_fd);
+    ++conv.marks;
+    if (info.stream_from != -1) {
+        // 暂缓在 stream_hold 中，超长行送完、追加进写缓冲区时再换算送达位置
+        info.stream_marks.push_back({info.stream_hold.size(), &conv, seq, session});
+    } else {
+        info.seq_marks.push_back({info.out_written + info.write_pending(), &conv, seq, session});
+    }
+}
+
+/**
+ * @brief 写缓冲区有数据写出后调用（out_written 已更新）：标记已送达的有序消息，
+ * 每个有消息送达的会话只发一条累计确认。调用者需持有 clients_mutex
+ */
+void seq_written(ServerContext& context, ClientInfo& info) {
+    static thread_local std::vector<SeqConversation*> due;
+    while (info.seq_done < info.seq_marks.size() && info.seq_marks[info.seq_done].end <= info.out_written) {
+        const SeqMark& mark = info.seq_marks[info.seq_done++];
+        SeqConversation* conv = mark.conv;
+        --conv->marks;
+        if (mark.session != conv->session || mark.seq <= conv->delivered) continue;
+        conv->delivered = mark.seq;
+        if (!conv->ack_due) {
+            conv->ack_due = true;
+            due.push_back(conv);
+        }
+    }
+    if (info.seq_done == info.seq_marks.size()) {
+        info.seq_marks.clear();
+        info.seq_done = 0;
+    }
+    for (SeqConversation* conv : due) {
+        conv->ack_due = false;
+        seq_reply(context, *conv, "SEQ-ACK", conv->delivered);
+    }
+    due.clear();
+}
+
+/**
+ * @brief 目标连接断开时调用：写缓冲区里没送达的有序消息随连接丢失，
+ * 把各会话的已接收序号退回到第一条丢失的消息之前，并让发送方从那里重发。调用者需持有 clients_mutex
+ */
+void seq_rollback(ServerContext& context, ClientInfo& info) {
+    std::vector<SeqConversation*> lost;
+    for (size_t i = info.seq_done; i < info.seq_marks.size(); ++i) {
+        const SeqMark& mark = info.seq_marks[i];
+        SeqConversation* conv = mark.conv;
+        --conv->marks;
+        if (mark.session != conv->session || mark.seq <= conv->delivered || mark.seq > conv->accepted) continue;
+        conv->accepted = mark.seq - 1;
+        if (std::find(lost.begin(), lost.end(), conv) == lost.end()) lost.push_back(conv);
+    }
+    for (SeqConversation* conv : lost) {
+        conv->nacked = conv->accepted + 1;
+        seq_reply(context, *conv, "SEQ-NACK", conv->nacked);
+    }
+    info.seq_marks.clear();
+    info.seq_done = 0;
+}
+
+// --- 分帧协议 ---
+/* 与按行分隔的文本协议并存：客户端连接后发出的第一个字节为 FRAME_MAGIC 时，服务器回一个 FRAME_MAGIC 确认，
+ * 此后这个连接双向都按帧收发，telnet 等文本客户端不受影响。每帧为 24 字节定长帧头（见 FrameHeader）+ length 字节正文，
+ * 服务器直接从帧头取出长度、类型和目标，不扫描内容，正文到齐前按帧长一次预留好读缓冲区；内容可以包含换行等任意字节。
+ * 客户端发出：
+ *   MSG       target 为目标 IP:PORT（Addr48）或带 FRAME_TO_USER 时的用户 ID，seq 非 0 时按有序投递处理
+ *             （会话的目标记为 "IP:PORT" 或 "#ID"，确认照常以 TEXT 帧 "SEQ-ACK 目标 N" 等送回）；
+ *             带 FRAME_MULTI 时目标列表在正文开头，一帧发给多个目标（不支持有序投递）
+ *   TEXT      一行文本协议的内容：LOGIN、WHO、FILE、ACCEPT、PAIR 等命令，或 @NAME:MESSAGE 这样的消息
+ *   FILEDATA  target 为传输 ID，正文为文件数据，与 FILEDATA 命令一样直接 splice 进暂存文件，不经过读缓冲区
+ * 服务器发出：MSG（target 为发送方地址，来自其它节点时为 0；有序投递的 seq 为序号）、TEXT（回复与通知，不含换行）、
+ * FILEDATA（文件数据块，随后的正文由 sendfile 送出）。进入直连(PAIR)模式后两端之间原样转发字节流，不再分帧。
+ */
+static void put_be(char* out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i, value >>= 8) out[i] = (char)(value & 0xff);
+}
+static uint64_t get_be(const char* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) value = value << 8 | (unsigned char)in[i];
+    return value;
+}
+
+void encode_frame_header(char* out, const FrameHeader& header) {
+    put_be(out, header.length, 4);
+    out[4] = (char)header.type;
+    out[5] = (char)header.flags;
+    put_be(out + 6, 0, 2);
+    put_be(out + 8, header.target, 8);
+    put_be(out + 16, header.seq, 8);
+}
+
+FrameHeader decode_frame_header(const char* in) {
+    FrameHeader header;
+    header.length = get_be(in, 4);
+    header.type = in[4];
+    header.flags = in[5];
+    header.target = get_be(in + 8, 8);
+    header.seq = get_be(in + 16, 8);
+    return header;
+}
+
+// 处理一个正文已完整读入的 MSG/TEXT 帧（FILEDATA 帧在读到帧头时就交给 start_upload），调用者需持有 clients_mutex
+void handle_frame(ServerContext& context, int fd, const FrameHeader& header, const char* body) {
+    static thread_local std::string text;
+    switch (header.type) {
+    case FRAME_TEXT:
+        if (header.length == 0) return;
+        text.assign(body, header.length);
+        handle_client_line(context, fd, text);
+        return;
+    case FRAME_MSG: {
+        bool to_user = header.flags & FRAME_TO_USER;
+        if (header.flags & FRAME_MULTI) {
+            static thread_local std::vector<uint64_t> targets;
+            uint64_t count = header.length >= 4 ? get_be(body, 4) : UINT64_MAX;
+            if (header.seq != 0 || count > (header.length - 4) / 8) {
+                queue_output(context, fd, "FRAME-ERROR 无效的多目标消息\n");
+                return;
+            }
+            targets.clear();
+            for (uint64_t i = 0; i < count; ++i) targets.push_back(get_be(body + 4 + i * 8, 8));
+            size_t content_pos = 4 + count * 8;
+            route_to_many(context, fd, targets, to_user, body + content_pos, header.length - content_pos);
+        } else if (to_user && header.target > UINT32_MAX) {
+            queue_output(context, fd, "FRAME-ERROR 无效的用户 ID " + std::to_string(header.target) + "\n");
+        } else if (header.seq != 0) {
+            text = to_user ? "#" + std::to_string(header.target) : format_addr48(header.target);
+            deliver_seq(context, fd, header.seq, text, body, header.length);
+        } else if (to_user) {
+            route_to_user(context, fd, header.target, body, header.length);
+        } else {
+            route_to_addr(context, fd, header.target, body, header.length);
+        }
+        return;
+    }
+    default:
+        queue_output(context, fd, "FRAME-ERROR 未知的帧类型 " + std::to_string(header.type) + "\n");
+        return;
+    }
+}
+
+// --- 集群路由 ---
+/* 节点之间通过持久 TCP 链路交换按行分隔的消息：
+ *   +IP:PORT          该客户端已连接到发送方节点
+ *   -IP:PORT          该客户端已从发送方节点断开
+ *   >IP:PORT:MESSAGE  请接收方节点把消息投递给本地客户端 IP:PORT
+ * 链路建立时双方先发送各自全部本地客户端，之后只发送增量。
+ * 转发的消息直接追加到链路写缓冲区，不等待对方确认，多条消息在一次 write 中批量送出。
+ */
+
+// 主动连接配置中的所有节点。对方尚未启动时连接失败，等对方启动后由对方主动连接本节点
+void connect_to_peers(ServerContext& context, const ServerConfig& config) {
+    for (const std::string& peer : config.peers) {
+        Addr48 peer_addr;
+        if (!parse_addr48(peer.data(), peer.size(), peer_addr)) throw std::invalid_argument("无效的节点地址: " + peer);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), "socket");
+        set_non_blocking(fd);
+        tune_socket(context, fd);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(peer_addr & 0xffff);
+        addr.sin_addr.s_addr = htonl(peer_addr >> 16);
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+            std::cerr << "连接节点 " << peer << " 失败: " << strerror(errno) << std::endl;
+            close(fd);
+            continue;
+        }
+        // 连接完成前写入会返回 EAGAIN，数据留在写缓冲区，连接建立后由 EPOLLOUT 送出
+        add_fd_to_epoll(context.epoll_fd, fd, EPOLLIN | EPOLLOUT | EPOLLET);
+        pthread_mutex_lock(&context.clients_mutex);
+        context.clients.insert(fd, peer_addr, ConnKind::NodeLink);
+        context.node_links.push_back(fd);
+        announce_local_clients(context, fd);
+        pthread_mutex_unlock(&context.clients_mutex);
+        std::cout << "正在连接节点: " << peer << " (fd: " << fd << ")" << std::endl;
+        start_sessions(context, fd);
+    }
+}
+
+// 调用者需持有 clients_mutex
+void broadcast_to_nodes(ServerContext& context, const std::string& line) {
+    for (int link_fd : context.node_links) {
+        queue_urgent(context, link_fd, line);
+    }
+}
+
+// 把本节点全部客户端通告给新链路，调用者需持有 clients_mutex
+void announce_local_clients(ServerContext& context, int link_fd) {
+    std::string table;
+    context.clients.for_each([&](int fd) {
+        if (context.clients.kind(fd) == ConnKind::Client) {
+            table += "+" + format_addr48(context.clients.addr(fd)) + "\n";
+        }
+    });
+    if (!table.empty()) queue_urgent(context, link_fd, table);
+}
+
+// 处理来自其它节点的一行消息，调用者需持有 clients_mutex
+void handle_node_line(ServerContext& context, int link_fd, const std::string& line) {
+    Addr48 addr;
+    switch (line[0]) {
+    case '+':
+        if (parse_addr48(line.data() + 1, line.size() - 1, addr)) {
+            context.remote_clients[addr] = link_fd;
+            context.directory.set(addr, 0, std::string(), true);
+        }
+        break;
+    case '-': {
+        if (!parse_addr48(line.data() + 1, line.size() - 1, addr)) break;
+        auto it = context.remote_clients.find(addr);
+        if (it != context.remote_clients.end() && it->second == link_fd) {
+            context.remote_clients.erase(it);
+            context.directory.remove(addr);
+        }
+        break;
+    }
+    case '>': {
+        // 一个或多个本节点上的目标（多目标消息在发送方节点已按链路归组）
+        static thread_local std::vector<Addr48> targets;
+        size_t content_pos;
+        if (!parse_recipients(line.data() + 1, line.size() - 1, targets, content_pos)) break;
+        const char* content = line.data() + 1 + content_pos;
+        size_t len = line.size() - 1 - content_pos;
+        for (Addr48 target : targets) {
+            int target_fd = find_client_fd(context, target);
+            // 目标在转发途中已断开时静默丢弃；链路消息不带发送方地址，分帧的目标收到的来源为 0
+            if (target_fd != -1) queue_message(context, target_fd, 0, content, len);
+        }
+        break;
+    }
+    default:
+        std::cerr << "节点链路 fd " << link_fd << " 收到未知消息" << std::endl;
+        break;
+    }
+}
+
+// --- 直连(splice)转发 ---
+
+static const size_t RELAY_PIPE_SIZE = 1 << 20;
+
+// 建立直连：为每个方向创建一个非阻塞管道，调用者需持有 clients_mutex
+void establish_pair(ServerContext& context, int fd, int peer_fd) {
+    ClientInfo& a = context.clients.info(fd);
+    ClientInfo& b = context.clients.info(peer_fd);
+    auto pipe_a = std::make_shared<RelayPipe>();
+    auto pipe_b = std::make_shared<RelayPipe>();
+    if (pipe2(pipe_a->fds, O_NONBLOCK) == -1 || pipe2(pipe_b->fds, O_NONBLOCK) == -1) {
+        std::cerr << "创建直连管道失败: " << strerror(errno) << std::endl;
+        queue_output(context, fd, "直连建立失败\n");
+        return;
+    }
+    a.relay_pipe = std::move(pipe_a);
+    b.relay_pipe = std::move(pipe_b);
+    for (ClientInfo* c : {&a, &b}) {
+        // 扩大管道可减少 splice 次数；超过 pipe-max-size 时保持默认容量
+        fcntl(c->relay_pipe->fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+        int capacity = fcntl(c->relay_pipe->fds[1], F_GETPIPE_SZ);
+        c->relay_capacity = capacity > 0 ? capacity : 65536;
+        c->relay_pending = 0;
+        c->relay_stalled = false;
+        c->pair_request = 0;
+    }
+    a.pair_fd = peer_fd;
+    b.pair_fd = fd;
+    std::string a_addr = format_addr48(context.clients.addr(fd));
+    std::string b_addr = format_addr48(context.clients.addr(peer_fd));
+    std::cout << "直连建立: " << a_addr << " <-> " << b_addr << std::endl;
+    queue_output(context, fd, "已与 " + b_addr + " 建立直连\n");
+    queue_output(context, peer_fd, "已与 " + a_addr + " 建立直连\n");
+    // 对端读缓冲区中尚未成行的数据从此属于直连数据流
+    if (!b.read_buf.empty()) {
+        queue_output(context, fd, b.read_buf.data(), b.read_buf.size());
+        b.read_buf.clear();
+    }
+}
+
+/**
+ * @brief 退出直连模式，双方恢复按行解析路由
+ * @param deliver_pending 为 true 时把管道中残留的数据读出并放入对端写缓冲区（仅在模式切换时经过用户态）；
+ *                        对端断开时为 false，残留数据直接丢弃
+ * 调用者需持有 clients_mutex
+ */
+void release_pair(ServerContext& context, int fd, bool deliver_pending) {
+    int peer_fd = context.clients.info(fd).pair_fd;
+    for (int src : {fd, peer_fd}) {
+        ClientInfo* info = context.clients.info_if_present(src);
+        if (info == nullptr) continue;
+        ClientInfo& c = *info;
+        int dst = c.pair_fd;
+        if (deliver_pending && c.relay_pending > 0 && c.relay_pipe && context.clients.count(dst)) {
+            char buffer[4096];
+            ssize_t n;
+            while ((n = read(c.relay_pipe->fds[0], buffer, sizeof(buffer))) > 0) {
+                context.clients.info(dst).write_buf.append(buffer, n);
+            }
+        }
+        // 正在 splice 的线程还持有管道，由最后一个持有者关闭
+        c.relay_pipe.reset();
+        c.relay_pending = 0;
+        c.pair_fd = -1;
+        if (c.relay_stalled) {
+            c.relay_stalled = false;
+            watch_fd(context, src, EPOLLIN | EPOLLET);
+        }
+    }
+    if (context.clients.count(peer_fd)) {
+        queue_output(context, peer_fd, "直连已结束\n");
+    }
+    if (deliver_pending) {
+        queue_output(context, fd, "直连已结束\n");
+    }
+}
+
+/**
+ * @brief 直连模式下的读事件：socket -> 管道 -> 对端 socket，全程 splice，数据不经过用户态。
+ * 客户端发送一个带外字节（send(..., MSG_OOB)）退出直连：splice 只搬到紧急标记为止，
+ * 读到标记处时取走带外字节、结束直连，标记之后的数据回到按行解析
+ * @param budget 本次最多搬运的字节数，用完时置 *budget_spent 并返回，socket 中可能还有数据
+ * @return false 表示 fd 未处于直连模式（或刚刚退出），应继续走普通读流程
+ */
+bool relay_read_event(ServerContext& context, int fd, size_t budget, bool* budget_spent) {
+    pthread_mutex_lock(&context.clients_mutex);
+    ClientInfo* info = context.clients.info_if_present(fd);
+    if (info == nullptr || info->pair_fd == -1 || !info->relay_pipe) {
+        pthread_mutex_unlock(&context.clients_mutex);
+        return false;
+    }
+    int peer_fd = info->pair_fd;
+    std::shared_ptr<RelayPipe> pipe = info->relay_pipe;  // 持有到 splice 结束
+    pthread_mutex_unlock(&context.clients_mutex);
+
+    size_t moved_total = 0;
+    while (!context.pausing.load(std::memory_order_relaxed)) {
+        pthread_mutex_lock(&context.clients_mutex);
+        info = context.clients.info_if_present(fd);
+        if (info == nullptr || info->pair_fd != peer_fd || info->relay_pipe != pipe) {
+            pthread_mutex_unlock(&context.clients_mutex);
+            return true;
+        }
+        ClientInfo& self = *info;
+        // 管道按页计容量，字节计数可能略超标称容量
+        size_t room = self.relay_pending < self.relay_capacity ? self.relay_capacity - self.relay_pending : 0;
+        if (room == 0) {
+            // 管道已满：暂停读取，待对端可写、管道排空后由 flush_relay_pipe 恢复
+            self.relay_stalled = true;
+            watch_fd(context, peer_fd, EPOLLIN | EPOLLOUT | EPOLLET);
+            pthread_mutex_unlock(&context.clients_mutex);
+            return true;
+        }
+        pthread_mutex_unlock(&context.clients_mutex);
+
+        // 已读到紧急标记：标记前的数据都已转发，取走带外字节后退出直连
+        int at_mark = 0;
+        char oob;
+        if (ioctl(fd, SIOCATMARK, &at_mark) == 0 && at_mark && recv(fd, &oob, 1, MSG_OOB) == 1) {
+            pthread_mutex_lock(&context.clients_mutex);
+            info = context.clients.info_if_present(fd);
+            if (info != nullptr && info->pair_fd != -1) {
+                release_pair(context, fd, true);
+            }
+            pthread_mutex_unlock(&context.clients_mutex);
+            return false;
+        }
+
+        ssize_t moved = splice(fd, nullptr, pipe->fds[1], nullptr, room, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            pthread_mutex_lock(&context.clients_mutex);
+            info = context.clients.info_if_present(fd);
+            if (info != nullptr && info->relay_pipe == pipe) info->relay_pending += moved;
+            pthread_mutex_unlock(&context.clients_mutex);
+            flush_relay_pipe(context, fd, peer_fd);
+            moved_total += moved;
+            if (moved_total >= budget) {
+                if (budget_spent != nullptr) *budget_spent = true;
+                return true;
+            }
+        } else if (moved == 0) {
+            disconnect_client(context, fd);
+            return true;
+        } else {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // 管道按页计已满，由对端排空管道时重新触发读事件
+                pthread_mutex_lock(&context.clients_mutex);
+                info = context.clients.info_if_present(fd);
+                if (info != nullptr && info->relay_pending > 0) {
+                    info->relay_stalled = true;
+                }
+                pthread_mutex_unlock(&context.clients_mutex);
+                return true;
+            }
+            std::cerr << "fd " << fd << " splice 错误: " << strerror(errno) << std::endl;
+            disconnect_client(context, fd);
+            return true;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief 把 src 的中转管道中的数据 splice 到 dst。对端写缓冲区中的普通消息优先发送；
+ * 同一管道同一时刻只允许一个线程送出，避免字节乱序
+ */
+void flush_relay_pipe(ServerContext& context, int src_fd, int dst_fd) {
+    pthread_mutex_lock(&context.clients_mutex);
+    ClientInfo* src = context.clients.info_if_present(src_fd);
+    if (src == nullptr || !context.clients.count(dst_fd) || src->pair_fd != dst_fd || !src->relay_pipe) {
+        pthread_mutex_unlock(&context.clients_mutex);
+        return;
+    }
+    if (src->relay_flushing) {
+        src->relay_rerun = true;
+        pthread_mutex_unlock(&context.clients_mutex);
+        return;
+    }
+    const ClientInfo& dst = context.clients.info(dst_fd);
+    if (dst.has_output() || dst.chunk || dst.stream_from != -1) {
+        watch_fd(context, dst_fd, EPOLLIN | EPOLLOUT | EPOLLET);
+        pthread_mutex_unlock(&context.clients_mutex);
+        return;
+    }
+    src->relay_flushing = true;
+    std::shared_ptr<RelayPipe> pipe = src->relay_pipe;  // 持有到 splice 结束
+
+    bool blocked = false;
+    while (true) {
+        src->relay_rerun = false;
+        size_t pending = src->relay_pending;
+        if (pending == 0 || blocked) break;
+        pthread_mutex_unlock(&context.clients_mutex);
+        ssize_t moved = splice(pipe->fds[0], nullptr, dst_fd, nullptr, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        int err = errno;
+        pthread_mutex_lock(&context.clients_mutex);
+        // src 可能已在解锁期间断开或退出直连，重新确认
+        src = context.clients.info_if_present(src_fd);
+        if (src == nullptr || src->pair_fd != dst_fd || src->relay_pipe != pipe) {
+            pthread_mutex_unlock(&context.clients_mutex);
+            return;
+        }
+        if (moved > 0) {
+            src->relay_pending -= moved;
+            if (src->relay_stalled) {
+                // 管道腾出空间，重新关注 EPOLLIN 使边沿触发再次报告积压的数据
+                src->relay_stalled = false;
+                watch_fd(context, src_fd, EPOLLIN | EPOLLET);
+            }
+        } else if (moved < 0 && (err == EAGAIN || err == EWOULDBLOCK)) {
+            watch_fd(context, dst_fd, EPOLLIN | EPOLLOUT | EPOLLET);
+            blocked = !src->relay_rerun;
+        } else {
+            // 对端出错，由对端自身的读写事件完成断开清理
+            break;
+        }
+    }
+    src->relay_flushing = false;
+    pthread_mutex_unlock(&context.clients_mutex);
+}
+
+// --- 文件传输 ---
+/* 文件不经过按行解析的读写缓冲区，按块传输：
+ *   发送方: FILE IP:PORT SIZE NAME      目标收到 "FILE ID FROM SIZE NAME"，发送方收到 "FILE-ID ID"；
+ *                                       请求无效或目标不在线时发送方收到 "FILE-ERROR 原因"
+ *   接收方: ACCEPT ID / REJECT ID       发送方收到 "FILE-SEND ID" 或 "FILE-REJECT ID"
+ *   发送方: FILEDATA ID LEN + LEN 字节   收到 FILE-SEND 后按块上传，块与块之间仍可发送普通消息
+ *   接收方收到 "FILEDATA ID LEN" + LEN 字节的数据块，全部送达后双方收到 "FILE-DONE ID"；
+ *   任一方中途断开或暂存失败时另一方收到 "FILE-ABORT ID"。
+ * 上传的数据块经管道 splice 进暂存文件，再用 sendfile 从暂存文件送给接收方，内容始终不进入用户态。
+ * 暂存领先送达超过 SPOOL_WINDOW 时暂停读取发送方，由 TCP 流控让发送方等待接收方。
+ * 只支持同一节点上的客户端之间传输。
+ */
+
+static const uint64_t SPOOL_WINDOW = 64ULL << 20;
+static const uint64_t FILE_CHUNK_SIZE = 1 << 20;  // 发给接收方的每块最多字节数
+static const uint64_t SPOOL_RELEASE_STEP = 8 << 20;
+
+// 解析十进制无符号整数，整个字符串必须都是数字
+static bool parse_u64(const std::string& str, uint64_t& value) {
+    if (str.empty() || str.size() > 19 || str.find_first_not_of("0123456789") != std::string::npos) return false;
+    value = strtoull(str.c_str(), nullptr, 10);
+    return true;
+}
+
+// 调用者需持有 clients_mutex
+static std::shared_ptr<FileTransfer> find_transfer(ServerContext& context, uint64_t id) {
+    auto it = context.transfers.find(id);
+    return it != context.transfers.end() ? it->second : nullptr;
+}
+
+// 取消传输并通知仍在线的双方，调用者需持有 clients_mutex
+static void abort_transfer(ServerContext& context, uint64_t id) {
+    std::shared_ptr<FileTransfer> transfer = find_transfer(context, id);
+    if (!transfer) return;
+    context.transfers.erase(id);
+    std::string notice = "FILE-ABORT " + std::to_string(id) + "\n";
+    for (int fd : {transfer->src_fd, transfer->dst_fd}) {
+        if (context.clients.count(fd)) queue_output(context, fd, notice);
+    }
+}
+
+// 全部送达，调用者需持有 clients_mutex
+static void complete_transfer(ServerContext& context, uint64_t id) {
+    std::shared_ptr<FileTransfer> transfer = find_transfer(context, id);
+    if (!transfer) return;
+    context.transfers.erase(id);
+    std::cout << "文件传输完成: " << transfer->name << " (" << transfer->size << " 字节)" << std::endl;
+    std::string notice = "FILE-DONE " + std::to_string(id) + "\n";
+    for (int fd : {transfer->src_fd, transfer->dst_fd}) {
+        if (context.clients.count(fd)) queue_output(context, fd, notice);
+    }
+}
+
+// FILE IP:PORT SIZE NAME，调用者需持有 clients_mutex
+void handle_file_offer(ServerContext& context, int fd, const std::string& args) {
+    size_t sp1 = args.find(' ');
+    size_t sp2 = sp1 == std::string::npos ? std::string::npos : args.find(' ', sp1 + 1);
+    Addr48 target_addr;
+    uint64_t size;
+    if (sp2 == std::string::npos || !parse_addr48(args.data(), sp1, target_addr) ||
+        !parse_u64(args.substr(sp1 + 1, sp2 - sp1 - 1), size) || sp2 + 1 == args.size() || args.size() - sp2 - 1 > 255) {
+        queue_output(context, fd, "FILE-ERROR 无效的命令格式. 请使用: FILE IP:PORT SIZE NAME\n");
+        return;
+    }
+    int target_fd = find_client_fd(context, target_addr);
+    if (target_fd == -1 || target_fd == fd) {
+        queue_output(context, fd, "FILE-ERROR 目标客户端未找到\n");
+        return;
+    }
+    auto transfer = std::make_shared<FileTransfer>();
+    transfer->id = context.next_transfer_id++;
+    transfer->src_fd = fd;
+    transfer->dst_fd = target_fd;
+    transfer->size = size;
+    transfer->name = args.substr(sp2 + 1);
+    context.transfers[transfer->id] = transfer;
+    std::string id = std::to_string(transfer->id);
+    queue_output(context, target_fd, "FILE " + id + " " + format_addr48(context.clients.addr(fd)) + " " +
+                                         std::to_string(size) + " " + transfer->name + "\n");
+    queue_output(context, fd, "FILE-ID " + id + "\n");
+}
+
+// 为接收的文件创建暂存文件和中转管道，失败返回 false
+static bool open_spool(ServerContext& context, FileTransfer& transfer) {
+    std::string path = context.spool_dir + "/tcpchat-XXXXXX";
+    transfer.spool_fd = mkstemp(&path[0]);
+    if (transfer.spool_fd == -1) {
+        std::cerr << "创建暂存文件失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    // 只通过 fd 访问，立即删除目录项，进程退出或传输结束后空间自动回收
+    unlink(path.c_str());
+    if (pipe2(transfer.pipe, O_NONBLOCK) == -1) {
+        std::cerr << "创建文件传输管道失败: " << strerror(errno) << std::endl;
+        return false;
+    }
+    fcntl(transfer.pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    int capacity = fcntl(transfer.pipe[1], F_GETPIPE_SZ);
+    transfer.pipe_capacity = capacity > 0 ? capacity : 65536;
+    return true;
+}
+
+// ACCEPT ID / REJECT ID，调用者需持有 clients_mutex
+void handle_file_reply(ServerContext& context, int fd, const std::string& args, bool accept) {
+    uint64_t id;
+    std::shared_ptr<FileTransfer> transfer;
+    if (parse_u64(args, id)) transfer = find_transfer(context, id);
+    if (!transfer || transfer->dst_fd != fd || transfer->accepted) {
+        queue_output(context, fd, "无效的文件传输 ID\n");
+        return;
+    }
+    if (!accept) {
+        context.transfers.erase(id);
+        queue_output(context, transfer->src_fd, "FILE-REJECT " + std::to_string(id) + "\n");
+        return;
+    }
+    if (!open_spool(context, *transfer)) {
+        abort_transfer(context, id);
+        return;
+    }
+    transfer->accepted = true;
+    if (transfer->size == 0) {
+        complete_transfer(context, id);
+        return;
+    }
+    context.clients.info(fd).downloads.push_back(id);
+    queue_output(context, transfer->src_fd, "FILE-SEND " + std::to_string(id) + "\n");
+}
+
+/**
+ * @brief FILEDATA ID LEN：随后的 LEN 字节属于该传输。块头无效时同样按 LEN 跳过这些字节，保持数据流同步
+ * 调用者需持有 clients_mutex
+ */
+void handle_file_data(ServerContext& context, int fd, const std::string& args) {
+    size_t sp = args.find(' ');
+    uint64_t id, len;
+    if (sp == std::string::npos || !parse_u64(args.substr(0, sp), id) || !parse_u64(args.substr(sp + 1), len)) {
+        queue_output(context, fd, "无效的命令格式. 请使用: FILEDATA ID LEN\n");
+        return;
+    }
+    start_upload(context, fd, id, len);
+}
+
+// 开始接收一个 len 字节的文件数据块（文本协议的 FILEDATA 命令或分帧协议的 FILEDATA 帧），调用者需持有 clients_mutex
+void start_upload(ServerContext& context, int fd, uint64_t id, uint64_t len) {
+    ClientInfo& self = context.clients.info(fd);
+    self.upload_left = len;
+    self.upload_id = 0;
+    std::shared_ptr<FileTransfer> transfer = find_transfer(context, id);
+    if (!transfer || transfer->src_fd != fd || !transfer->accepted) {
+        queue_output(context, fd, "FILE-ABORT " + std::to_string(id) + "\n");
+    } else if (len > transfer->size - transfer->spooled) {
+        abort_transfer(context, id);
+    } else {
+        self.upload_id = id;
+    }
+}
+
+// 把 data 写入暂存文件末尾；只有发送方的读处理者写暂存文件，已暂存字节数即写入偏移
+static bool spool_write(FileTransfer& transfer, const char* data, size_t len) {
+    uint64_t offset = transfer.spooled;
+    while (len > 0) {
+        ssize_t n = pwrite(transfer.spool_fd, data, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            std::cerr << "写入暂存文件失败: " << strerror(errno) << std::endl;
+            return false;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// 把管道中刚搬入的 len 字节 splice 到暂存文件末尾
+static bool spool_from_pipe(FileTransfer& transfer, size_t len) {
+    loff_t offset = transfer.spooled;
+    while (len > 0) {
+        ssize_t n = splice(transfer.pipe[0], nullptr, transfer.spool_fd, &offset, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            std::cerr << "写入暂存文件失败: " << strerror(errno) << std::endl;
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+// 记录新暂存的字节并通知接收方，调用者需持有 clients_mutex
+static void spooled_more(ServerContext& context, FileTransfer& transfer, size_t len) {
+    transfer.spooled += len;
+    if (context.transfers.count(transfer.id) && context.clients.count(transfer.dst_fd)) {
+        request_write(context, transfer.dst_fd);
+    }
+}
+
+/**
+ * @brief 块头之后已经读进读缓冲区的数据直接写入暂存文件
+ * @return true 表示这一块已经完整，读缓冲区剩余部分继续按消息解析
+ * 调用者需持有 clients_mutex
+ */
+bool spool_buffered(ServerContext& context, int fd) {
+    ClientInfo& self = context.clients.info(fd);
+    size_t take = std::min<uint64_t>(self.upload_left, self.read_buf.size());
+    std::shared_ptr<FileTransfer> transfer = self.upload_id != 0 ? find_transfer(context, self.upload_id) : nullptr;
+    if (transfer && take > 0) {
+        if (spool_write(*transfer, self.read_buf.data(), take)) {
+            spooled_more(context, *transfer, take);
+        } else {
+            abort_transfer(context, transfer->id);
+        }
+    }
+    self.read_buf.erase(0, take);
+    self.upload_left -= take;
+    if (self.upload_left == 0) self.upload_id = 0;
+    return self.upload_left == 0;
+}
+
+/**
+ * @brief 连接断开时处理涉及它的传输：已上传完的文件照常送达接收方，其余取消并通知对方
+ * 调用者需持有 clients_mutex
+ */
+void drop_transfers(ServerContext& context, int fd) {
+    std::vector<uint64_t> aborted;
+    for (auto& entry : context.transfers) {
+        FileTransfer& transfer = *entry.second;
+        if (transfer.src_fd == fd && transfer.accepted && transfer.spooled == transfer.size) {
+            transfer.src_fd = -1;
+        } else if (transfer.src_fd == fd || transfer.dst_fd == fd) {
+            (transfer.src_fd == fd ? transfer.src_fd : transfer.dst_fd) = -1;
+            aborted.push_back(entry.first);
+        }
+    }
+    for (uint64_t id : aborted) abort_transfer(context, id);
+}
+
+/**
+ * @brief 上传块的读事件：socket -> 管道 -> 暂存文件，全程 splice；传输已取消时读出丢弃
+ * @param budget 本次最多搬运的字节数，用完时置 *budget_spent 并返回，socket 中可能还有数据
+ * @return false 表示 fd 没有未读完的上传块（或这一块刚好读完），应继续走普通读流程
+ */
+bool upload_read_event(ServerContext& context, int fd, size_t budget, bool* budget_spent) {
+    size_t moved_total = 0;
+    char discard[4096];
+    while (!context.pausing.load(std::memory_order_relaxed)) {
+        pthread_mutex_lock(&context.clients_mutex);
+        ClientInfo* info = context.clients.info_if_present(fd);
+        if (info == nullptr || info->upload_left == 0) {
+            pthread_mutex_unlock(&context.clients_mutex);
+            return info == nullptr && !context.clients.count(fd);
+        }
+        std::shared_ptr<FileTransfer> transfer = info->upload_id != 0 ? find_transfer(context, info->upload_id) : nullptr;
+        uint64_t want = info->upload_left;
+        if (transfer) {
+            uint64_t ahead = transfer->spooled - transfer->delivered;
+            if (ahead >= SPOOL_WINDOW) {
+                // 接收方跟不上：暂停读取，送达追上后由 send_file_chunk 恢复
+                transfer->upload_stalled = true;
+                pthread_mutex_unlock(&context.clients_mutex);
+                return true;
+            }
+            want = std::min<uint64_t>({want, SPOOL_WINDOW - ahead, transfer->pipe_capacity});
+        } else {
+            want = std::min<uint64_t>(want, sizeof(discard));
+        }
+        pthread_mutex_unlock(&context.clients_mutex);
+
+        ssize_t n;
+        bool spooled = true;
+        if (transfer) {
+            n = splice(fd, nullptr, transfer->pipe[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) spooled = spool_from_pipe(*transfer, n);
+        } else {
+            n = read(fd, discard, want);
+        }
+        if (n == 0) {
+            disconnect_client(context, fd);
+            return true;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            std::cerr << "fd " << fd << " 读取错误: " << strerror(errno) << std::endl;
+            disconnect_client(context, fd);
+            return true;
+        }
+
+        pthread_mutex_lock(&context.clients_mutex);
+        info = context.clients.info_if_present(fd);
+        if (info != nullptr) {
+            info->upload_left -= n;
+            if (info->upload_left == 0) info->upload_id = 0;
+        }
+        if (transfer) {
+            if (spooled) {
+                spooled_more(context, *transfer, n);
+            } else {
+                // 管道里残留的数据随传输一起丢弃，这一块的剩余部分按丢弃处理
+                abort_transfer(context, transfer->id);
+            }
+        }
+        pthread_mutex_unlock(&context.clients_mutex);
+        moved_total += n;
+        if (moved_total >= budget) {
+            if (budget_spent != nullptr) *budget_spent = true;
+            return true;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief 继续送出 fd 上正在送出的文件数据块：先写块头部，再用 sendfile 从暂存文件送出内容。
+ * 一块开始后必须完整送出，期间新到的消息留在写缓冲区，等这一块结束再送
+ * @return 1 没有正在送出的块或这一块已送完，0 socket 已写满（已重新关注可写事件），-1 写出错
+ */
+int send_file_chunk(ServerContext& context, int fd) {
+    pthread_mutex_lock(&context.clients_mutex);
+    ClientInfo* info = context.clients.info_if_present(fd);
+    if (info == nullptr || !info->chunk) {
+        pthread_mutex_unlock(&context.clients_mutex);
+        return 1;
+    }
+    std::shared_ptr<FileTransfer> transfer = info->chunk;
+    std::string header = info->chunk_header;
+    off_t offset = info->chunk_offset;
+    uint64_t left = info->chunk_left;
+    pthread_mutex_unlock(&context.clients_mutex);
+
+    int result = 1;
+    int err = 0;
+    size_t header_written = 0;
+    uint64_t sent = 0;
+    while (result == 1 && header_written < header.size()) {
+        ssize_t n = write(fd, header.data() + header_written, header.size() - header_written);
+        if (n > 0) {
+            header_written += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            err = errno;
+            result = n < 0 && (err == EAGAIN || err == EWOULDBLOCK) ? 0 : -1;
+        }
+    }
+    while (result == 1 && sent < left) {
+        ssize_t n = sendfile(fd, transfer->spool_fd, &offset, left - sent);
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            // n == 0 说明暂存文件比记录的短，同样按出错处理
+            err = n < 0 ? errno : EIO;
+            result = n < 0 && (err == EAGAIN || err == EWOULDBLOCK) ? 0 : -1;
+        }
+    }
+    if (result < 0) {
+        std::cerr << "fd " << fd << " 发送文件数据错误: " << strerror(err) << std::endl;
+        return -1;
+    }
+
+    pthread_mutex_lock(&context.clients_mutex);
+    info = context.clients.info_if_present(fd);
+    if (info != nullptr && info->chunk == transfer) {
+        info->chunk_header.erase(0, header_written);
+        info->chunk_offset = offset;
+        info->chunk_left -= sent;
+        transfer->delivered += sent;
+        bool live = context.transfers.count(transfer->id) > 0;
+        if (live && transfer->upload_stalled && transfer->spooled - transfer->delivered < SPOOL_WINDOW &&
+            context.clients.count(transfer->src_fd)) {
+            // 送达追上来了：恢复读取发送方，借 EPOLL_CTL_MOD 让边沿触发重新报告积压的数据
+            transfer->upload_stalled = false;
+            watch_fd(context, transfer->src_fd, EPOLLIN | EPOLLOUT | EPOLLET);
+        }
+        if (transfer->delivered - transfer->released >= SPOOL_RELEASE_STEP) {
+            // 已送达的部分不再需要，打洞归还磁盘空间，大文件的暂存占用保持在 SPOOL_WINDOW 左右；文件系统不支持时忽略
+            fallocate(transfer->spool_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, transfer->released,
+                      transfer->delivered - transfer->released);
+            transfer->released = transfer->delivered;
+        }
+        if (info->chunk_header.empty() && info->chunk_left == 0) {
+            info->chunk.reset();
+            if (live && transfer->delivered == transfer->size) complete_transfer(context, transfer->id);
+        }
+    }
+    if (result == 0) watch_fd(context, fd, EPOLLIN | EPOLLOUT | EPOLLET);
+    pthread_mutex_unlock(&context.clients_mutex);
+    return result;
+}
+
+/**
+ * @brief 写缓冲区清空后为 fd 准备下一个文件数据块，多个传输轮流各送一块
+ * @return true 表示已准备好，调用者应接着调用 send_file_chunk
+ * 调用者需持有 clients_mutex
+ */
+bool start_file_chunk(ServerContext& context, int fd) {
+    ClientInfo* info = context.clients.info_if_present(fd);
+    if (info == nullptr || info->chunk || info->stream_from != -1) return false;
+    for (size_t i = info->downloads.size(); i > 0; --i) {
+        uint64_t id = info->downloads.front();
+        info->downloads.pop_front();
+        std::shared_ptr<FileTransfer> transfer = find_transfer(context, id);
+        if (!transfer) continue;  // 已取消
+        uint64_t len = std::min(transfer->spooled - transfer->queued, FILE_CHUNK_SIZE);
+        if (len == 0) {
+            // 发送方的数据还没到，排到队尾
+            info->downloads.push_back(id);
+            continue;
+        }
+        info->chunk = transfer;
+        if (context.clients.framed(fd)) {
+            FrameHeader frame;
+            frame.length = len;
+            frame.type = FRAME_FILEDATA;
+            frame.target = id;
+            info->chunk_header.resize(FRAME_HEADER);
+            encode_frame_header(info->chunk_header.data(), frame);
+        } else {
+            info->chunk_header = "FILEDATA " + std::to_string(id) + " " + std::to_string(len) + "\n";
+        }
+        info->chunk_offset = transfer->queued;
+        info->chunk_left = len;
+        transfer->queued += len;
+        if (transfer->queued < transfer->size) info->downloads.push_back(id);
+        return true;
+    }
+    return false;
+}
+
+void handle_new_connection(int listen_fd, ServerContext& context, ConnKind kind) {
+    // 协程模式下读协程一启动就会处理已到达的数据，等这一批连接全部登记后再启动，
+    // 与线程池模式一致：先接入的连接引用同一批里后接入的连接时不会找不到目标
+    std::vector<int> accepted;
+    while (true) {
+        sockaddr_storage cli_addr{};
+        socklen_t cli_len = sizeof(cli_addr);
+        int conn_fd = accept(listen_fd, (struct sockaddr*)&cli_addr, &cli_len);
+        if (conn_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            std::cerr << "accept 错误: " << strerror(errno) << std::endl;
+            if ((errno == EMFILE || errno == ENFILE) && context.spare_fd != -1) {
+                close(context.spare_fd);
+                int rejected = accept(listen_fd, nullptr, nullptr);
+                if (rejected >= 0) close(rejected);
+                context.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (rejected >= 0) continue;
+            }
+            break;
+        }
+        // Unix socket 上的客户端与 TCP 客户端共用连接表和协议处理，只是地址由对端凭据生成，也不需要 TCP 选项
+        bool local = cli_addr.ss_family == AF_UNIX;
+        set_non_blocking(conn_fd);
+        if (!local) tune_socket(context, conn_fd);
+        add_fd_to_epoll(context.epoll_fd, conn_fd, conn_events(context));
+        pthread_mutex_lock(&context.clients_mutex);
+        Addr48 addr;
+        if (local) {
+            addr = unix_peer_addr(context, conn_fd);
+            if (addr == 0) {
+                pthread_mutex_unlock(&context.clients_mutex);
+                std::cerr << "Unix socket 客户端找不到空闲地址, 拒绝连接 (fd: " << conn_fd << ")" << std::endl;
+                close(conn_fd);
+                continue;
+            }
+        } else {
+            const sockaddr_in& in = reinterpret_cast<const sockaddr_in&>(cli_addr);
+            addr = make_addr48(ntohl(in.sin_addr.s_addr), ntohs(in.sin_port));
+        }
+        std::string addr_str = format_addr48(addr);
+        context.clients.insert(conn_fd, addr, kind);
+        if (local) context.clients.flags(conn_fd) |= ClientTable::LOCAL;
+        if (kind == ConnKind::NodeLink) {
+            context.node_links.push_back(conn_fd);
+            announce_local_clients(context, conn_fd);
+        } else {
+            broadcast_to_nodes(context, "+" + addr_str + "\n");
+            context.directory.set(addr, 0, std::string(), false);
+            capture.connect(addr);
+        }
+        pthread_mutex_unlock(&context.clients_mutex);
+        if (kind == ConnKind::NodeLink) {
+            std::cout << "节点链路接入: " << addr_str << " (fd: " << conn_fd << ")" << std::endl;
+        } else {
+            std::cout << (local ? "新客户端连接(Unix socket): " : "新客户端连接: ") << addr_str << " (fd: " << conn_fd << ")"
+                      << std::endl;
+        }
+        accepted.push_back(conn_fd);
+    }
+    for (int fd : accepted) start_sessions(context, fd);
+}
+
+/**
+ * @brief Unix socket 上的客户端没有 IP:PORT，用 SO_PEERCRED 取得的对端凭据生成它在连接表中的地址：
+ * 0.U.U.U:P，U 为 uid 的低 24 位，P 为 pid 的低 16 位；已被占用（同一进程的第二个连接、pid 低位相同）时端口依次加一。
+ * 0.0.0.0/8 不会是 TCP 对端的地址，不与 TCP 客户端冲突。同一进程重连后通常拿回同一个地址，
+ * 需要跨进程稳定的身份时用 LOGIN 用户名；客户端可以用 ADDR 命令查询自己的地址。
+ * 同一 uid 的 65536 个端口全被占用时返回 0，调用者应拒绝连接。调用者需持有 clients_mutex
+ */
+Addr48 unix_peer_addr(ServerContext& context, int fd) {
+    ucred cred{};
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        std::cerr << "fd " << fd << " 读取 SO_PEERCRED 失败: " << strerror(errno) << std::endl;
+    }
+    uint32_t ip = (uint32_t)cred.uid & 0xFFFFFF;
+    uint16_t port = (uint16_t)cred.pid;
+    for (uint32_t tries = 0; tries < 65536; ++tries, ++port) {
+        Addr48 addr = make_addr48(ip, port);
+        if (addr != 0 && context.clients.find(addr) == -1 && !context.remote_clients.count(addr)) return addr;
+    }
+    return 0;
+}
+
+/**
+ * @brief 尝试成为 fd 上该类事件的处理者。已有线程在处理时只留下标记，由那个线程补做一轮
+ */
+bool enter_handler(ServerContext& context, int fd, uint8_t busy, uint8_t again) {
+    pthread_mutex_lock(&context.clients_mutex);
+    bool entered = false;
+    if (context.clients.count(fd)) {
+        uint8_t& flags = context.clients.flags(fd);
+        if (flags & busy) {
+            flags |= again;
+        } else {
+            flags |= busy;
+            entered = true;
+        }
+    }
+    pthread_mutex_unlock(&context.clients_mutex);
+    return entered;
+}
+
+// 返回 true 表示处理期间又有新事件到达，需要再处理一轮；空闲连接的冷数据由定期清理释放
+bool leave_handler(ServerContext& context, int fd, uint8_t busy, uint8_t again) {
+    pthread_mutex_lock(&context.clients_mutex);
+    bool rerun = false;
+    if (context.clients.count(fd)) {
+        uint8_t& flags = context.clients.flags(fd);
+        if (flags & again) {
+            flags &= ~again;
+            rerun = true;
+        } else {
+            flags &= ~busy;
+        }
+    }
+    pthread_mutex_unlock(&context.clients_mutex);
+    return rerun;
+}
+
+void handle_read_event(ServerContext& context, int fd) {
+    if (!enter_handler(context, fd, ClientTable::READING, ClientTable::READ_AGAIN)) return;
+    continue_read(context, fd);
+}
+
+/**
+ * @brief 在持有 READING 状态时处理读事件。一轮额度用完时不释放 READING，
+ * 把后续处理作为新任务排到线程池队列末尾（低延迟模式下排进主线程的 resume_queue），先让排在前面的其它连接执行
+ */
+void continue_read(ServerContext& context, int fd) {
+    do {
+        if (process_read_event(context, fd)) {
+            if (context.low_latency) {
+                context.resume_queue.push_back(fd);
+            } else {
+                context.pool->add_task(std::make_unique<ReadTask>(context, fd, true));
+            }
+            return;
+        }
+    } while (leave_handler(context, fd, ClientTable::READING, ClientTable::READ_AGAIN));
+}
+
+void handle_write_event(ServerContext& context, int fd) {
+    if (!enter_handler(context, fd, ClientTable::WRITING, ClientTable::WRITE_AGAIN)) return;
+    do {
+        process_write_event(context, fd);
+    } while (leave_handler(context, fd, ClientTable::WRITING, ClientTable::WRITE_AGAIN));
+}
+
+// --- 公平调度 ---
+/* 每个连接每轮（线程池中的一个任务 / 读协程的一次恢复）最多读入 read_quantum 字节、处理 message_quantum 条消息，
+ * 用完后排到队尾（线程池任务队列 / 协程就绪队列，都是先进先出），其它连接各自轮到一次后再继续，
+ * 一个高速发送方因此不会长时间占住工作线程。
+ * 处理消息按差额轮询(DRR)记账：每轮给连接补充 read_quantum 字节的额度，每条消息按长度扣减（最多扣一整轮），
+ * 额度不够处理下一条时这条留到下一轮，未用完的额度留给下一轮；连接读空后额度清零，空闲连接不积攒额度。
+ */
+
+TurnBudget start_turn(ServerContext& context, int fd) {
+    TurnBudget turn;
+    turn.bytes = context.read_quantum;
+    turn.messages = context.message_quantum;
+    pthread_mutex_lock(&context.clients_mutex);
+    if (context.clients.count(fd) && context.read_quantum != SIZE_MAX) {
+        // 每条消息最多扣 read_quantum，剩余额度一定小于 read_quantum
+        size_t& deficit = context.clients.info(fd).deficit;
+        deficit = std::min(deficit, context.read_quantum - 1) + context.read_quantum;
+    }
+    pthread_mutex_unlock(&context.clients_mutex);
+    return turn;
+}
+
+// socket 已读空且缓冲区中没有完整消息：清零额度
+void end_turn(ServerContext& context, int fd) {
+    pthread_mutex_lock(&context.clients_mutex);
+    ClientInfo* info = context.clients.info_if_present(fd);
+    if (info != nullptr) info->deficit = 0;
+    pthread_mutex_unlock(&context.clients_mutex);
+}
+
+// 处理一条长度为 cost 的消息前记账，本轮额度不够时返回 false。调用者需持有 clients_mutex
+static bool charge_message(ServerContext& context, ClientInfo& self, TurnBudget* turn, size_t cost) {
+    if (turn == nullptr) return true;
+    if (turn->messages == 0) return false;
+    if (context.read_quantum != SIZE_MAX) {
+        cost = std::min(cost, context.read_quantum);
+        if (cost > self.deficit) return false;
+        self.deficit -= cost;
+    }
+    --turn->messages;
+    return true;
+}
+
+// --- 超长行直通转发 ---
+/* 文本行要等读到 '\n' 才处理，一条几百 MB 的行会整条积在读缓冲区里。读缓冲区中还没有行尾的数据超过
+ * STREAM_START_BYTES、且行头是发给本节点文本连接的 IP:PORT: 时，不再等行尾：行头先解析掉，
+ * 已到的内容直接追加到目标的写缓冲区，之后每读入一段就转发一段，直到行尾。
+ *   - 背压：目标写缓冲区中未写出的数据达到 STREAM_WINDOW 时发送方暂停读取，目标写到一半以下时恢复，
+ *     服务器为一条在途的超长行占用的内存不超过一轮读入加一个窗口，与行长无关；
+ *   - 转发期间发给同一目标的其它消息（含优先通道的控制消息）暂缓在 stream_hold 中，行尾送达后接着追加，
+ *     不会插进超长行中间；同一目标同一时刻只接收一条超长行，其它发送方的超长行照常整行缓冲；
+ *   - 目标中途断开时发送方收到通知，这一行的剩余内容读入后丢弃；发送方中途断开时目标只收到已转发的部分；
+ *   - 暂缓的输出超过 STREAM_HOLD_MAX，或超长行 STREAM_IDLE_MS 内没有任何进展时，提前结束这一行：目标收到已转发的部分
+ *     和暂缓的输出，发送方收到通知，剩余内容读入后丢弃；
+ *   - 分帧连接（帧头要先给出正文长度）、@NAME/#ID、多目标和其它节点上的目标仍按整行缓冲处理。 */
+static const size_t STREAM_START_BYTES = 64 * 1024;
+static const size_t STREAM_WINDOW = 256 * 1024;
+static const uint64_t STREAM_IDLE_MS = 10000;
+
+/**
+ * @brief 读缓冲区中的超长行（还没有行尾）发给本节点的文本连接时开始直通转发，行头从读缓冲区移除
+ * @return false 表示不满足条件，按整行缓冲处理。调用者需持有 clients_mutex
+ */
+static bool start_stream(ServerContext& context, int fd, ClientInfo& self) {
+    // 行头最长为 "255.255.255.255:65535:"
+    std::string head(self.read_buf.data(), std::min<size_t>(self.read_buf.size(), 24));
+    Addr48 target_addr;
+    size_t content_pos;
+    if (!parse_message(head, target_addr, content_pos)) return false;
+    int target_fd = find_client_fd(context, target_addr);
+    if (target_fd == -1 || target_fd == fd || context.clients.framed(target_fd)) return false;
+    ClientInfo& target = context.clients.info(target_fd);
+    if (target.stream_from != -1) return false;
+    // 超长行之前是一个消息边界，优先通道的数据可以在这里插队
+    if (!target.write_buf.empty()) target.cuts.push_back(target.out_written + target.write_pending());
+    target.stream_from = fd;
+    self.stream_to = target_fd;
+    self.stream_sent = 0;
+    self.stream_active_ns = Tracer::clock_ns();
+    self.read_buf.erase(0, content_pos);
+    return true;
+}
+
+/**
+ * @brief 结束 fd 正在进行的直通转发：目标恢复正常输出，暂缓的输出接着追加，有序消息换算成写缓冲区中的送达位置。
+ * 调用者需持有 clients_mutex
+ */
+void finish_stream(ServerContext& context, int fd) {
+    ClientInfo& self = context.clients.info(fd);
+    int target_fd = self.stream_to;
+    self.stream_to = -1;
+    self.stream_stalled = false;
+    ClientInfo* target = context.clients.info_if_present(target_fd);
+    if (target == nullptr || target->stream_from != fd) return;
+    capture.message(context.clients.addr(fd), context.clients.addr(target_fd), self.stream_sent);
+    target->stream_from = -1;
+    uint64_t base = target->out_written + target->write_pending();
+    if (!target->write_buf.empty() && !target->stream_hold.empty()) target->cuts.push_back(base);
+    target->write_buf.append(target->stream_hold.data(), target->stream_hold.size());
+    for (SeqMark& mark : target->stream_marks) {
+        mark.end += base;
+        target->seq_marks.push_back(mark);
+    }
+    Buffer().swap(target->stream_hold);
+    target->stream_marks.clear();
+    // 写缓冲区为空时也要唤醒一次写端：期间被挡住的文件数据块和直连管道数据接着送出
+    request_write(context, target_fd);
+}
+
+// 目标断开：发送方这一行的剩余内容改为丢弃，暂停的读取随之恢复；暂缓的有序消息交给 seq_rollback 一并回退。
+// 调用者需持有 clients_mutex
+void cancel_stream(ServerContext& context, ClientInfo& target, const char* reason) {
+    int src_fd = target.stream_from;
+    target.stream_from = -1;
+    target.seq_marks.insert(target.seq_marks.end(), target.stream_marks.begin(), target.stream_marks.end());
+    target.stream_marks.clear();
+    ClientInfo* src = context.clients.info_if_present(src_fd);
+    if (src == nullptr) return;
+    if (src->stream_stalled) watch_fd(context, src_fd, src->has_output() ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN | EPOLLET);
+    src->stream_to = -1;
+    src->stream_stalled = false;
+    src->stream_discard = true;
+    queue_output(context, src_fd, std::string(reason) + ", 超长消息的剩余部分已丢弃\n");
+}
+
+/**
+ * @brief 把读缓冲区中属于正在转发的超长行的内容交给目标（或丢弃），读到行尾时结束转发
+ * @return false 表示读缓冲区已处理完、目标积压过多（stream_stalled）或本轮额度用完（limited），应停止处理。
+ * 调用者需持有 clients_mutex
+ */
+static bool stream_buffered(ServerContext& context, int fd, ClientInfo& self, TurnBudget* turn, bool& limited) {
+    Buffer& read_buf = self.read_buf;
+    const char* data = read_buf.data();
+    const char* end = static_cast<const char*>(memchr(data, '\n', read_buf.size()));
+    size_t consumed = end != nullptr ? end - data + 1 : read_buf.size();
+    size_t len = end != nullptr ? consumed - 1 : consumed;
+    // 行尾的 '\r'（Telnet）不转发；它恰好是已到数据的最后一个字节时留到下一段再判断
+    if (len > 0 && data[len - 1] == '\r') {
+        --len;
+        if (end == nullptr) --consumed;
+    }
+    if (consumed == 0) return false;
+    ClientInfo* target = self.stream_discard ? nullptr : &context.clients.info(self.stream_to);
+    if (target != nullptr && target->write_pending() >= STREAM_WINDOW) {
+        self.stream_stalled = true;
+        return false;
+    }
+    if (!charge_message(context, self, turn, consumed)) {
+        limited = true;
+        return false;
+    }
+    if (target != nullptr && len > 0) {
+        target->write_buf.append(data, len);
+        self.stream_sent += len;
+        self.stream_active_ns = Tracer::clock_ns();
+        request_write(context, self.stream_to);
+    }
+    read_buf.erase(0, consumed);
+    if (end != nullptr) {
+        if (self.stream_discard) {
+            self.stream_discard = false;
+        } else {
+            finish_stream(context, fd);
+        }
+    }
+    return true;
+}
+
+// fd 正因目标积压暂停读取时返回 true，此时不再读入新数据，目标写出后由 stream_written 重新关注可读事件
+bool stream_stalled(ServerContext& context, int fd) {
+    pthread_mutex_lock(&context.clients_mutex);
+    ClientInfo* info = context.clients.info_if_present(fd);
+    bool stalled = info != nullptr && info->stream_stalled;
+    pthread_mutex_unlock(&context.clients_mutex);
+    return stalled;
+}
+
+// 正在接收超长行的目标写出数据后调用：积压降到窗口一半以下时恢复发送方的读取。调用者需持有 clients_mutex
+void stream_written(ServerContext& context, ClientInfo& info) {
+    ClientInfo* src = context.clients.info_if_present(info.stream_from);
+    if (src == nullptr || !src->stream_stalled || info.write_pending() >= STREAM_WINDOW / 2) return;
+    src->stream_stalled = false;
+    // 数据一直留在 socket 中，重新设置关注的事件使边沿触发再报告一次
+    watch_fd(context, info.stream_from, src->has_output() ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN | EPOLLET);
+}
+
+/**
+ * @brief 提前结束 src_fd 正在转发的超长行：目标收到已转发的部分和暂缓的输出，发送方这一行的剩余内容读入后丢弃。
+ * 调用者需持有 clients_mutex
+ */
+void interrupt_stream(ServerContext& context, int src_fd, const char* reason) {
+    ClientInfo& src = context.clients.info(src_fd);
+    bool stalled = src.stream_stalled;
+    finish_stream(context, src_fd);
+    src.stream_discard = true;
+    if (stalled) watch_fd(context, src_fd, src.has_output() ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN | EPOLLET);
+    queue_output(context, src_fd, std::string(reason) + ", 超长消息的剩余部分已丢弃\n");
+}
+
+// 交接前中断所有正在进行的直通转发，发送方这一行的剩余内容由新进程丢弃。调用者需持有 clients_mutex
+void abort_streams(ServerContext& context) {
+    context.clients.for_each([&](int fd) {
+        ClientInfo* info = context.clients.info_if_present(fd);
+        if (info != nullptr && info->stream_from != -1) interrupt_stream(context, info->stream_from, "服务器升级");
+    });
+}
+
+// 周期定时器到期：结束 STREAM_IDLE_MS 内没有任何进展的超长行，目标的其它输出不会被一直挡住
+void expire_streams(ServerContext& context, int timer_fd) {
+    uint64_t expirations;
+    while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+    }
+    uint64_t now = Tracer::clock_ns();
+    pthread_mutex_lock(&context.clients_mutex);
+    context.clients.for_each([&](int fd) {
+        ClientInfo* info = context.clients.info_if_present(fd);
+        if (info != nullptr && info->stream_to != -1 && now - info->stream_active_ns > STREAM_IDLE_MS * 1000000) {
+            interrupt_stream(context, fd, "超长消息长时间没有进展");
+        }
+    });
+    pthread_mutex_unlock(&context.clients_mutex);
+}
+
+// 普通读流程每读入这么多字节就先处理一次消息，读到直连确认或文件块头后剩余数据及时改走 splice
+static const size_t READ_ROUND_BYTES = 64 * 1024;
+
+/**
+ * @brief 处理读事件的一轮，包含半包和粘包处理逻辑
+ * @return true 表示本轮额度已用完而 socket 或读缓冲区中还有待处理的数据，需要稍后再来一轮
+ */
+bool process_read_event(ServerContext& context, int fd) {
+    char buffer[1024];
+    bool connection_closed = false;
+    bool drained = false;
+    TurnBudget turn = start_turn(context, fd);
+
+    // 0. 先处理上一轮额度不够而留下的完整消息，仍然处理不完就不再读入新数据
+    if (process_messages(context, fd, &turn)) {
+        return !context.pausing.load(std::memory_order_relaxed);
+    }
+
+    while (true) {
+        // 1. 直连模式下数据不经过用户态，直接 splice 给对端；文件数据块直接 splice 进暂存文件
+        bool budget_spent = false;
+        if (relay_read_event(context, fd, turn.bytes, &budget_spent) ||
+            upload_read_event(context, fd, turn.bytes, &budget_spent)) {
+            return budget_spent && !context.pausing.load(std::memory_order_relaxed);
+        }
+        if (drained || connection_closed || turn.bytes == 0) break;
+        // 直通转发的目标积压过多：暂停读取，数据留在 socket 中，目标写出后重新关注可读事件
+        if (stream_stalled(context, fd)) return false;
+
+        // 2. 从 socket 读取数据，直到读空、读满一轮或用完本轮额度
+        for (size_t round = 0; round < READ_ROUND_BYTES && turn.bytes > 0;) {
+            uint64_t read_start = tracer.now();
+            int n = read(fd, buffer, std::min(sizeof(buffer), turn.bytes));
+            tracer.note_read(read_start);
+            if (n > 0) {
+                // 将读取到的数据追加到对应客户端的读缓冲区
+                pthread_mutex_lock(&context.clients_mutex);
+                if (context.clients.count(fd)) {
+                    context.clients.info(fd).read_buf.append(buffer, n);
+                }
+                pthread_mutex_unlock(&context.clients_mutex);
+                round += n;
+                turn.bytes -= n;
+                if (context.pausing.load(std::memory_order_relaxed)) {
+                    drained = true;
+                    break;
+                }
+            } else if (n == 0) {
+                connection_closed = true;
+                break;
+            } else {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    drained = true;
+                    break;
+                }
+                //strerror(errno)根据errno 提供一个描述性字符串
+                std::cerr << "fd " << fd << " 读取错误: " << strerror(errno) << std::endl;
+                connection_closed = true;
+                break;
+            }
+        }
+
+        // 3. 处理读缓冲区中的完整消息，本轮额度不够时剩下的留到下一轮
+        if (process_messages(context, fd, &turn)) {
+            return !context.pausing.load(std::memory_order_relaxed);
+        }
+    }
+
+    // 4. 如果连接已关闭，则清理客户端资源
+    if (connection_closed) {
+        disconnect_client(context, fd);
+        return false;
+    }
+    // 额度用完时 socket 中可能还有数据，边沿触发不会再通知
+    if (!drained) return !context.pausing.load(std::memory_order_relaxed);
+    rearm_quickack(context, fd);
+    end_turn(context, fd);
+    return false;
+}
+
+// 不在 clients_mutex 内处理的命令：WHO / LIST 读目录快照，TRACE 写追踪文件
+static bool is_unlocked_command(const char* data, size_t len) {
+    std::string_view command(data, len);
+    return command == "WHO" || command == "LIST" || command == "TRACE";
+}
+
+// TRACE 的回复，导出追踪文件期间不持有 clients_mutex
+static std::string trace_reply() {
+    if (!tracer.enabled()) return "TRACE-ERROR 未开启消息追踪, 启动时使用 --trace-sample=N\n";
+    long count = tracer.dump();
+    if (count < 0) return "TRACE-ERROR 无法写入 " + tracer.path() + ": " + strerror(errno) + "\n";
+    return "TRACE " + std::to_string(count) + " " + tracer.path() + "\n";
+}
+
+/**
+ * @brief 回复 is_unlocked_command() 的命令：放开 clients_mutex 生成回复，重新加锁后只排队回复，
+ * 读目录、拼接在线列表和写追踪文件都不占全局锁。
+ * 返回 false 表示放锁期间连接已断开（fd 可能已被新连接复用），调用者不能再访问这个连接的 ClientInfo。
+ * 调用者需持有 clients_mutex，且连接正由调用者读取（清理线程不会在放锁期间释放它的冷数据）
+ */
+static bool answer_unlocked(ServerContext& context, int fd, std::string_view command) {
+    DirectoryEntry self{context.clients.addr(fd), context.clients.user_id(fd), false, std::string()};
+    if (self.user_id != 0) self.name = context.users.names[self.user_id];
+    uint64_t serial = context.clients.info_serial(fd);
+    pthread_mutex_unlock(&context.clients_mutex);
+    std::string reply = command == "TRACE" ? trace_reply() : who_reply(context.directory, self);
+    uint64_t lock_start = tracer.now();
+    pthread_mutex_lock(&context.clients_mutex);
+    tracer.note_lock(lock_start);
+    if (context.clients.info_serial(fd) != serial) return false;
+    queue_output(context, fd, reply);
+    return true;
+}
+
+/**
+ * @brief 处理读缓冲区中的完整消息，线程池模式和协程模式共用
+ * @param turn 本轮额度，为空表示不限
+ * @return true 表示因本轮额度用完而停止，缓冲区中可能还有完整消息
+ */
+bool process_messages(ServerContext& context, int fd, TurnBudget* turn) {
+    static thread_local std::string message;
+    bool limited = false;
+    uint64_t lock_start = tracer.now();
+    pthread_mutex_lock(&context.clients_mutex);
+    tracer.note_lock(lock_start);
+    if (context.clients.count(fd)) {
+        ClientInfo& self = context.clients.info(fd);
+        Buffer& read_buf = self.read_buf;
+        ConnKind kind = context.clients.kind(fd);
+        size_t pos;
+        // 交接期间未处理的消息随读缓冲区一起交给新进程
+        while (!read_buf.empty() && !context.pausing.load(std::memory_order_relaxed)) {
+            // 文件数据块：紧随块头已读进缓冲区的内容直接写入暂存文件，未到的部分由 upload_read_event 从 socket 搬运
+            if (self.upload_left > 0) {
+                if (!spool_buffered(context, fd)) break;
+                continue;
+            }
+
+            // 正在直通转发的超长行：到达的内容直接交给目标，读到行尾为止
+            if (self.stream_to != -1 || self.stream_discard) {
+                if (!stream_buffered(context, fd, self, turn, limited)) break;
+                continue;
+            }
+
+            // 分帧连接：定长帧头给出正文长度，不扫描内容
+            if (context.clients.framed(fd)) {
+                if (read_buf.size() < FRAME_HEADER) break;
+                FrameHeader header = decode_frame_header(read_buf.data());
+                if (header.type == FRAME_FILEDATA || header.length > FRAME_MAX_BODY) {
+                    // 文件数据块的正文由上面的 spool_buffered / upload_read_event 直接写入暂存文件；超长的帧按长度丢弃正文
+                    if (!charge_message(context, self, turn, FRAME_HEADER)) {
+                        limited = true;
+                        break;
+                    }
+                    read_buf.erase(0, FRAME_HEADER);
+                    if (header.type == FRAME_FILEDATA) {
+                        start_upload(context, fd, header.target, header.length);
+                    } else {
+                        queue_output(context, fd, "FRAME-ERROR 帧过长, 正文最多 " + std::to_string(FRAME_MAX_BODY) + " 字节\n");
+                        self.upload_left = header.length;
+                        self.upload_id = 0;
+                    }
+                    continue;
+                }
+                size_t frame_len = FRAME_HEADER + header.length;
+                if (read_buf.size() < frame_len) {
+                    // 正文还没到齐：按帧长一次预留好，之后读入的数据直接追加到位，不再随读入扩容搬移
+                    read_buf.reserve(frame_len);
+                    break;
+                }
+                if (!charge_message(context, self, turn, frame_len)) {
+                    limited = true;
+                    break;
+                }
+                TraceMessage trace(fd);
+                if (header.type == FRAME_TEXT && is_unlocked_command(read_buf.data() + FRAME_HEADER, header.length)) {
+                    message.assign(read_buf.data() + FRAME_HEADER, header.length);
+                    read_buf.erase(0, frame_len);
+                    if (!answer_unlocked(context, fd, message)) break;
+                    continue;
+                }
+                handle_frame(context, fd, header, read_buf.data() + FRAME_HEADER);
+                read_buf.erase(0, frame_len);
+                if (self.pair_fd != -1) {
+                    // 刚进入直连模式：缓冲区剩余数据直接交给对端，此后的数据走 splice
+                    if (!read_buf.empty()) {
+                        queue_output(context, self.pair_fd, read_buf.data(), read_buf.size());
+                        read_buf.clear();
+                    }
+                    break;
+                }
+                continue;
+            }
+
+            // 分帧协议的协商：只有客户端发出的第一个字节可以是魔数，回一个魔数确认，此后按帧收发。
+            // 之后行首的 0xFB（如 GBK 文字的首字节）是普通文本
+            uint8_t& flags = context.clients.flags(fd);
+            if (flags & ClientTable::MAGIC_ALLOWED) {
+                flags &= ~ClientTable::MAGIC_ALLOWED;
+                if (read_buf[0] == FRAME_MAGIC) {
+                    read_buf.erase(0, 1);
+                    flags |= ClientTable::FRAMED;
+                    queue_urgent(context, fd, &FRAME_MAGIC, 1);
+                    continue;
+                }
+            }
+
+            // 紧凑二进制消息：定长头部给出目标 ID 和长度，不扫描内容
+            if (read_buf[0] == COMPACT_MSG_MAGIC && kind == ConnKind::Client) {
+                if (read_buf.size() < COMPACT_MSG_HEADER) break;
+                const unsigned char* h = reinterpret_cast<const unsigned char*>(read_buf.data());
+                uint32_t user_id = (uint32_t)h[1] << 24 | (uint32_t)h[2] << 16 | (uint32_t)h[3] << 8 | h[4];
+                uint32_t len = (uint32_t)h[5] << 24 | (uint32_t)h[6] << 16 | (uint32_t)h[7] << 8 | h[8];
+                if (len > FRAME_MAX_BODY) {
+                    // 长度不可信：不为它扩大读缓冲区，关闭读方向后由读流程读到 EOF 断开连接
+                    std::cerr << "fd " << fd << " 紧凑消息长度 " << len << " 超过上限, 关闭连接" << std::endl;
+                    read_buf.clear();
+                    shutdown(fd, SHUT_RD);
+                    break;
+                }
+                if (read_buf.size() - COMPACT_MSG_HEADER < len) break;
+                if (!charge_message(context, self, turn, COMPACT_MSG_HEADER + len)) {
+                    limited = true;
+                    break;
+                }
+                TraceMessage trace(fd);
+                route_to_user(context, fd, user_id, read_buf.data() + COMPACT_MSG_HEADER, len);
+                read_buf.erase(0, COMPACT_MSG_HEADER + len);
+                continue;
+            }
+
+            // 只要能找到分隔符'\n'，就循环处理；还没有行尾的超长行满足条件时改为直通转发
+            if ((pos = read_buf.find('\n')) == Buffer::npos) {
+                if (read_buf.size() >= STREAM_START_BYTES && kind == ConnKind::Client && start_stream(context, fd, self)) continue;
+                break;
+            }
+            if (!charge_message(context, self, turn, pos + 1)) {
+                limited = true;
+                break;
+            }
+
+            // a. 提取一条完整的消息（复用线程内的临时字符串，不为每条消息分配内存）
+            TraceMessage trace(fd);
+            message.assign(read_buf.data(), pos);
+            // b. 从读缓冲区移除已提取的消息（包括'\n'）
+            read_buf.erase(0, pos + 1);
+
+            // c. 兼容Telnet，它会发送\r\n，移除\r
+            if (!message.empty() && message.back() == '\r') {
+                message.pop_back();
+            }
+
+            // 如果消息为空（例如只有一个回车），则忽略
+            if (message.empty()) {
+                continue;
+            }
+
+            // d. 来自其它节点的链路消息
+            if (kind == ConnKind::NodeLink) {
+                handle_node_line(context, fd, message);
+                continue;
+            }
+
+            // e. 在线列表和追踪导出在锁外处理，其余控制命令、按用户名/ID 寻址或 IP:PORT:MESSAGE
+            if (is_unlocked_command(message.data(), message.size())) {
+                if (!answer_unlocked(context, fd, message)) break;
+                continue;
+            }
+            handle_client_line(context, fd, message);
+            if (self.pair_fd != -1) {
+                // 刚进入直连模式：缓冲区剩余数据直接交给对端，此后的数据走 splice
+                if (!read_buf.empty()) {
+                    queue_output(context, self.pair_fd, read_buf.data(), read_buf.size());
+                    read_buf.clear();
+                }
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&context.clients_mutex);
+    // 偶尔出现的超长消息处理完后不长期占着内存
+    if (message.capacity() > SlabPool::MAX_BLOCK) std::string().swap(message);
+    return limited;
+}
+
+void process_write_event(ServerContext& context, int fd) {
+    while (true) {
+        // 正在送出的文件数据块优先，送完之前写缓冲区里的消息不能插进去
+        int chunk = send_file_chunk(context, fd);
+        if (chunk < 0) {
+            disconnect_client(context, fd);
+            return;
+        }
+        if (chunk == 0) return;
+
+        Buffer write_buf_copy;
+        bool urgent = false;
+        pthread_mutex_lock(&context.clients_mutex);
+        ClientInfo* info = context.clients.info_if_present(fd);
+        if (info == nullptr) {
+            // 没有冷数据说明既无待写数据也不在直连模式
+            pthread_mutex_unlock(&context.clients_mutex);
+            return;
+        }
+        // 每次最多拷出一段：积压很大时不必整块拷贝，每写完一段都能看到新到的优先通道数据
+        size_t len = std::min(next_output(*info, urgent), WRITE_SLICE);
+        write_buf_copy.assign(urgent ? info->urgent_buf.data() : info->write_buf.data() + info->write_pos, len);
+        uint64_t serial = context.clients.info_serial(fd);
+        pthread_mutex_unlock(&context.clients_mutex);
+        // 写期间其它线程可能继续向缓冲区追加数据，只能按实际写出的字节数从头部移除
+        size_t written = 0;
+        while (written < write_buf_copy.length()) {
+            int n = write(fd, write_buf_copy.c_str() + written, write_buf_copy.length() - written);
+            if (n > 0) {
+                written += n;
+            } else {
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                std::cerr << "fd " << fd << " 写入错误: " << strerror(errno) << std::endl;
+                disconnect_client(context, fd);
+                return;
+            }
+        }
+        int relay_src = -1;
+        bool more = false;  // 还有数据可以接着写：另一个通道、普通通道的下一段或下一个文件数据块
+        pthread_mutex_lock(&context.clients_mutex);
+        // 写期间连接可能已断开，fd 又被新连接复用：不能从新连接的写缓冲区里扣掉这次写出的字节
+        info = context.clients.info_serial(fd) == serial ? context.clients.info_if_present(fd) : nullptr;
+        if (info != nullptr) {
+            output_written(*info, urgent, written);
+            if (!urgent && info->trace_msg != 0) tracer.on_written(*info, fd, written);
+            if (!urgent && !info->seq_marks.empty()) seq_written(context, *info);
+            if (!urgent && info->stream_from != -1) stream_written(context, *info);
+            if (written == len && info->has_output()) {
+                more = true;
+            } else if (!info->has_output()) {
+                ClientInfo* peer = context.clients.info_if_present(info->pair_fd);
+                if (peer != nullptr && peer->relay_pending > 0) {
+                    relay_src = info->pair_fd;
+                } else if (start_file_chunk(context, fd)) {
+                    more = true;
+                } else {
+                    modify_fd_in_epoll(context.epoll_fd, fd, EPOLLIN | EPOLLPRI | EPOLLET);
+                }
+            }
+        }
+        pthread_mutex_unlock(&context.clients_mutex);
+        // 写缓冲区已清空，继续送出直连管道中的数据
+        if (relay_src != -1) {
+            flush_relay_pipe(context, relay_src, fd);
+        }
+        if (!more) return;
+    }
+}
+
+// --- 低延迟模式 ---
+/* --low-latency：事件不再经线程池的任务队列和条件变量交给工作线程，由主线程直接处理（一跳省去一次线程唤醒）；
+ * 主线程在 epoll_wait 阻塞前先以 0 超时轮询 --spin-us 微秒，期间到达的事件不必等内核唤醒；
+ * 连接关闭 Nagle、打开 TCP_QUICKACK 和 SO_BUSY_POLL，epoll 实例设置忙轮询参数（需要网卡驱动支持 NAPI，回环无效果）。
+ * 代价是空闲时也占满一个 CPU 的自旋时间，吞吐也只剩主线程一个核。 */
+
+// Linux 6.9 起的 epoll 忙轮询参数，旧头文件里没有
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+// 新连接（含集群链路）的 socket 选项
+void tune_socket(const ServerContext& context, int fd) {
+    // 限制内核发送队列里尚未发出的数据，积压留在用户态的写缓冲区，优先通道的数据才能插到前面
+    if (context.notsent_lowat > 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &context.notsent_lowat, sizeof(context.notsent_lowat));
+    }
+    if (!context.low_latency) return;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    // 超过 net.core.busy_read 的值需要 CAP_NET_ADMIN，失败只提示一次
+    static std::atomic<bool> busy_poll_warned{false};
+    if (context.busy_poll_us > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &context.busy_poll_us, sizeof(context.busy_poll_us)) < 0 &&
+        !busy_poll_warned.exchange(true)) {
+        std::cerr << "设置 SO_BUSY_POLL 失败: " << strerror(errno) << std::endl;
+    }
+}
+
+// TCP_QUICKACK 不是持久选项，内核在交互模式判断后会自动关闭，每次读空后重新打开；Unix socket 连接没有这个选项。
+// 低延迟模式下连接表只在主线程上访问，不加锁读状态位
+void rearm_quickack(ServerContext& context, int fd) {
+    if (!context.low_latency || (context.clients.flags(fd) & ClientTable::LOCAL)) return;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+}
+
+// epoll 实例的忙轮询参数，内核不支持时只提示
+void enable_epoll_busy_poll(int epoll_fd, int busy_poll_us) {
+    epoll_params params{};
+    params.busy_poll_usecs = busy_poll_us;
+    params.busy_poll_budget = 8;
+    params.prefer_busy_poll = 1;
+    if (ioctl(epoll_fd, EPIOCSPARAMS, &params) < 0) {
+        std::cerr << "设置 epoll 忙轮询参数失败: " << strerror(errno) << std::endl;
+    }
+}
+
+// 等待事件：spin_us 大于 0 时先以 0 超时轮询这么久，仍没有事件才按 timeout 阻塞
+int wait_events(int epoll_fd, epoll_event* events, int max_events, int timeout, int spin_us) {
+    if (spin_us > 0 && timeout != 0) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(spin_us);
+        do {
+            int n = epoll_wait(epoll_fd, events, max_events, 0);
+            if (n != 0) return n;
+        } while (std::chrono::steady_clock::now() < deadline);
+    }
+    return epoll_wait(epoll_fd, events, max_events, timeout);
+}
+
+// --- 分级流水线 ---
+/* --pipeline：另一种执行模型。线程池模式下同一个工作线程读 socket、切分消息、解析、在全局锁下路由并修改 epoll，
+ * 这里按阶段拆到不同线程上，阶段之间只经单生产者/单消费者环形队列整批传递：
+ *   I/O 线程（--pipeline-io 个）：主线程把新连接轮流分给它们，各自在自己的 epoll 上读 socket、按行切分，
+ *     一轮事件读到的消息攒成一批交给路由线程；
+ *   路由线程（1 个）：独占地址表和用户名表，不加锁；每轮从各 I/O 线程各取一批，把内容按目标连接分进各写线程的批次，
+ *     一轮结束才送出；
+ *   写线程（--pipeline-writers 个）：连接上线时由路由线程轮流分配，写线程负责这些连接的输出缓冲区，
+ *     收完一批后每个连接只 write 一次，写不完时在自己的 epoll 上等 EPOLLOUT。
+ * 用完的批次经反向的环送回生产者复用，稳定运行时不分配内存；消费者空闲时在 eventfd 上休眠，生产者只在对方声明要休眠时才写 eventfd。
+ * 环满时生产者原地等待，反压一级级传回 I/O 线程，I/O 线程不再读 socket。
+ * 连接的生命周期也沿队列传递：主线程 accept 后先经自己的环向路由线程报上线，再把连接交给 I/O 线程；I/O 线程读到断开时报下线，
+ * 路由线程处理每批输入前先取完上线通知，所以同一连接的上线总在下线之前；路由线程把下线转给写线程，由写线程最后 close，
+ * 在此之前 fd 号不会被复用。上线对其它连接是异步的：客户端 connect 返回后马上被别人当作目标时可能还找不到，
+ * 需要确定时先等它收到服务器的一条回复（如 ADDR）。
+ * 只支持文本协议的聊天消息（IP:PORT:MESSAGE、多目标、@NAME/#ID）和 LOGIN、ADDR、PIPE 命令；分帧协议、有序投递、文件、
+ * 直连、优先通道、公平调度、集群和热升级都建立在连接表和 clients_mutex 之上，这个模式下不可用 */
+
+/**
+ * @brief 单生产者/单消费者环形队列，容量 N 为 2 的幂。两端的下标分在不同缓存行，
+ * 各自缓存对方下标的旧值，只有看起来满/空时才重新读取对方的下标
+ */
+template <typename T, size_t N>
+class SpscRing {
+    static_assert((N & (N - 1)) == 0, "SpscRing 的容量必须是 2 的幂");
+
+public:
+    // 生产者调用，满时返回 false
+    bool push(const T& value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ == N) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ == N) return false;
+        }
+        slots_[tail & (N - 1)] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    // 消费者调用，空时返回 false
+    bool pop(T& value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_) return false;
+        }
+        value = slots_[head & (N - 1)];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    bool empty() const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
+
+private:
+    alignas(64) std::atomic<size_t> head_{0};  // 消费者推进
+    size_t tail_cache_ = 0;
+    alignas(64) std::atomic<size_t> tail_{0};  // 生产者推进
+    size_t head_cache_ = 0;
+    alignas(64) T slots_[N];
+};
+
+/**
+ * @brief 消费者的唤醒：消费者准备休眠时先置 sleeping、再检查一遍队列，然后在 epoll/poll 上等 fd（eventfd）。
+ * 生产者推入后经 seq_cst 栅栏读 sleeping，两边的栅栏保证至少一方看到对方的写入，不会丢失唤醒
+ */
+struct PipeWaker {
+    int fd = -1;
+    std::atomic<bool> sleeping{false};
+
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!sleeping.load(std::memory_order_relaxed)) return;
+        uint64_t one = 1;
+        ssize_t n = write(fd, &one, sizeof(one));
+        (void)n;  // 计数器已经非零时写入失败也不影响唤醒
+    }
+    // 消费者声明将要休眠；返回后调用者须再检查一遍队列
+    void prepare_sleep() {
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    void woke() { sleeping.store(false, std::memory_order_relaxed); }
+    // fd 报告可读时清零计数器
+    void drain() {
+        uint64_t count;
+        ssize_t n = read(fd, &count, sizeof(count));
+        (void)n;
+    }
+};
+
+// 批次中的一项：主线程 -> 路由线程为 CONNECT，I/O 线程 -> 路由线程为 DISCONNECT/LINE，路由线程 -> 写线程为 OUTPUT/CLOSE
+struct PipeItem {
+    enum Kind : uint8_t { CONNECT, DISCONNECT, LINE, OUTPUT, CLOSE };
+    Kind kind;
+    int fd;
+    uint32_t off;  // LINE/OUTPUT 的内容在批次 bytes 中的位置
+    uint32_t len;
+    Addr48 addr;   // CONNECT 的客户端地址
+};
+
+struct PipeBatch {
+    std::vector<PipeItem> items;
+    std::string bytes;
+};
+
+/**
+ * @brief 一个阶段边界：生产者往当前批次里追加，flush() 时整批推进 full 环；
+ * 消费者处理完的批次清空后经 spare 环送回生产者复用
+ */
+class PipeChannel {
+public:
+    static const size_t SLOTS = 64;
+    static const size_t BATCH_BYTES = 64 * 1024;  // 批次内容攒到这么多字节时不等本轮结束，先送出
+
+    explicit PipeChannel(PipeWaker* consumer) : consumer_(consumer) {}
+    PipeChannel(const PipeChannel&) = delete;
+    PipeChannel& operator=(const PipeChannel&) = delete;
+
+    // 生产者：追加一项
+    void put(PipeItem::Kind kind, int fd, const char* data = nullptr, size_t len = 0, Addr48 addr = 0) {
+        if (open_ == nullptr && !spare_.pop(open_)) open_ = new PipeBatch;
+        open_->items.push_back({kind, fd, (uint32_t)open_->bytes.size(), (uint32_t)len, addr});
+        open_->bytes.append(data, len);
+        if (open_->bytes.size() >= BATCH_BYTES) flush();
+    }
+    // 生产者：送出当前批次，环满时让出 CPU 等消费者跟上
+    void flush() {
+        if (open_ == nullptr || open_->items.empty()) return;
+        while (!full_.push(open_)) {
+            consumer_->wake();
+            sched_yield();
+        }
+        open_ = nullptr;
+        ++batches_;
+        consumer_->wake();
+    }
+    // 消费者
+    bool pop(PipeBatch*& batch) { return full_.pop(batch); }
+    void recycle(PipeBatch* batch) {
+        batch->items.clear();
+        batch->bytes.clear();
+        if (!spare_.push(batch)) delete batch;
+    }
+    bool empty() const { return full_.empty(); }
+    uint64_t batches() const { return batches_.load(std::memory_order_relaxed); }
+
+private:
+    PipeWaker* consumer_;
+    PipeBatch* open_ = nullptr;  // 生产者正在填充的批次
+    SpscRing<PipeBatch*, SLOTS> full_;
+    SpscRing<PipeBatch*, SLOTS> spare_;
+    std::atomic<uint64_t> batches_{0};  // 只由生产者递增
+};
+
+class Pipeline {
+public:
+    Pipeline(ServerContext& context, int io_threads, int writers);
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+    // 创建各阶段的 epoll/eventfd 并启动线程，失败抛异常。线程一直运行到进程退出
+    void start();
+    // 主线程：接受 listen_fd 上的全部新连接，按 fd 分给 I/O 线程
+    void accept_connections(int listen_fd);
+
+private:
+    static const size_t READ_CHUNK = 64 * 1024;  // I/O 线程每个连接每轮最多读入的字节数
+
+    struct IoStage {
+        Pipeline* owner;
+        int epoll_fd = -1;
+        PipeWaker waker;
+        SpscRing<int, 4096> accepted;                     // 主线程 -> 本线程的新连接
+        std::unique_ptr<PipeChannel> to_router;
+        std::vector<std::string> partial;                 // fd -> 尚未收到换行的半行
+        std::atomic<uint64_t> lines{0};
+        pthread_t thread;
+    };
+    struct Output {
+        std::string buf;
+        size_t pos = 0;        // buf 头部已写出的字节数
+        bool queued = false;   // 已在本轮待写列表中
+        bool waiting = false;  // 已在 epoll 上等 EPOLLOUT
+        bool dead = false;     // 写出错，丢弃后续输出直到 CLOSE
+    };
+    struct WriterStage {
+        Pipeline* owner;
+        int epoll_fd = -1;
+        PipeWaker waker;
+        std::unique_ptr<PipeChannel> from_router;
+        std::vector<Output> outputs;  // 按 fd 下标
+        std::vector<int> dirty;       // 本轮收到新输出的连接
+        size_t waiting = 0;           // 在等 EPOLLOUT 的连接数
+        std::atomic<uint64_t> writes{0};
+        std::atomic<uint64_t> messages{0};
+        pthread_t thread;
+    };
+
+    static void* io_entry(void* arg);
+    static void* router_entry(void* arg);
+    static void* writer_entry(void* arg);
+    void io_loop(IoStage& stage);
+    void read_connection(IoStage& stage, int fd);
+    void router_loop();
+    bool take_connections();
+    void route_line(int fd, const char* data, size_t len);
+    void login(int fd, const std::string& name);
+    void deliver(int fd, const char* data, size_t len) {
+        writers_[fd_writer_[fd]]->from_router->put(PipeItem::OUTPUT, fd, data, len);
+    }
+    void reply(int fd, const std::string& text) { deliver(fd, text.data(), text.size()); }
+    void writer_loop(WriterStage& stage);
+    void flush_output(WriterStage& stage, int fd);
+
+    ServerContext& context_;
+    std::vector<std::unique_ptr<IoStage>> io_;
+    std::vector<std::unique_ptr<WriterStage>> writers_;
+    PipeWaker router_waker_;
+    std::unique_ptr<PipeChannel> connections_;  // 主线程 -> 路由线程的上线通知
+    size_t next_io_ = 0;                        // 只由主线程访问
+    pthread_t router_thread_;
+
+    // 以下只由路由线程访问
+    AddrIndex addr_fd_;
+    std::vector<Addr48> fd_addr_;
+    UserRegistry users_;
+    std::vector<uint32_t> fd_user_;
+    std::vector<uint32_t> fd_writer_;
+    size_t next_writer_ = 0;
+    std::vector<Addr48> targets_;
+    std::vector<int> local_;
+};
+
+Pipeline::Pipeline(ServerContext& context, int io_threads, int writers)
+    : context_(context), connections_(std::make_unique<PipeChannel>(&router_waker_)) {
+    for (int i = 0; i < std::max(1, io_threads); ++i) {
+        io_.push_back(std::make_unique<IoStage>());
+        io_.back()->owner = this;
+        io_.back()->to_router = std::make_unique<PipeChannel>(&router_waker_);
+    }
+    for (int i = 0; i < std::max(1, writers); ++i) {
+        writers_.push_back(std::make_unique<WriterStage>());
+        WriterStage& stage = *writers_.back();
+        stage.owner = this;
+        stage.from_router = std::make_unique<PipeChannel>(&stage.waker);
+    }
+}
+
+void Pipeline::start() {
+    auto make_eventfd = [] {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), "eventfd");
+        return fd;
+    };
+    auto make_epoll = [](int waker_fd) {
+        int fd = epoll_create1(EPOLL_CLOEXEC);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), "epoll_create1");
+        add_fd_to_epoll(fd, waker_fd, EPOLLIN);
+        return fd;
+    };
+    router_waker_.fd = make_eventfd();
+    for (auto& stage : io_) {
+        stage->waker.fd = make_eventfd();
+        stage->epoll_fd = make_epoll(stage->waker.fd);
+    }
+    for (auto& stage : writers_) {
+        stage->waker.fd = make_eventfd();
+        stage->epoll_fd = make_epoll(stage->waker.fd);
+    }
+    for (auto& stage : writers_) {
+        if (pthread_create(&stage->thread, nullptr, writer_entry, stage.get()) != 0) {
+            throw std::runtime_error("创建流水线写线程失败");
+        }
+    }
+    if (pthread_create(&router_thread_, nullptr, router_entry, this) != 0) {
+        throw std::runtime_error("创建流水线路由线程失败");
+    }
+    for (auto& stage : io_) {
+        if (pthread_create(&stage->thread, nullptr, io_entry, stage.get()) != 0) {
+            throw std::runtime_error("创建流水线 I/O 线程失败");
+        }
+    }
+}
+
+void Pipeline::accept_connections(int listen_fd) {
+    std::vector<int> accepted;
+    while (true) {
+        sockaddr_in cli_addr{};
+        socklen_t cli_len = sizeof(cli_addr);
+        int conn_fd = accept(listen_fd, (struct sockaddr*)&cli_addr, &cli_len);
+        if (conn_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            std::cerr << "accept 错误: " << strerror(errno) << std::endl;
+            if ((errno == EMFILE || errno == ENFILE) && context_.spare_fd != -1) {
+                close(context_.spare_fd);
+                int rejected = accept(listen_fd, nullptr, nullptr);
+                if (rejected >= 0) close(rejected);
+                context_.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (rejected >= 0) continue;
+            }
+            break;
+        }
+        set_non_blocking(conn_fd);
+        tune_socket(context_, conn_fd);
+        Addr48 addr = make_addr48(ntohl(cli_addr.sin_addr.s_addr), ntohs(cli_addr.sin_port));
+        connections_->put(PipeItem::CONNECT, conn_fd, nullptr, 0, addr);
+        accepted.push_back(conn_fd);
+        std::cout << "新客户端连接: " << format_addr48(addr) << " (fd: " << conn_fd << ")" << std::endl;
+    }
+    // 这一批的上线通知先送到路由线程，连接才开始读：先接入的连接发给后接入的连接时不会找不到目标
+    connections_->flush();
+    for (int fd : accepted) {
+        IoStage& stage = *io_[next_io_++ % io_.size()];
+        while (!stage.accepted.push(fd)) {
+            stage.waker.wake();
+            sched_yield();
+        }
+        stage.waker.wake();
+    }
+}
+
+void* Pipeline::io_entry(void* arg) {
+    IoStage* stage = static_cast<IoStage*>(arg);
+    stage->owner->io_loop(*stage);
+    return nullptr;
+}
+
+void* Pipeline::router_entry(void* arg) {
+    static_cast<Pipeline*>(arg)->router_loop();
+    return nullptr;
+}
+
+void* Pipeline::writer_entry(void* arg) {
+    WriterStage* stage = static_cast<WriterStage*>(arg);
+    stage->owner->writer_loop(*stage);
+    return nullptr;
+}
+
+// 水平触发：每轮每个可读连接只读一次 READ_CHUNK，读不完的下一轮 epoll_wait 还会报告，连接之间自然轮流
+void Pipeline::io_loop(IoStage& stage) {
+    std::vector<epoll_event> events(256);
+    while (true) {
+        int fd;
+        while (stage.accepted.pop(fd)) {
+            if ((size_t)fd >= stage.partial.size()) stage.partial.resize(fd + 1);
+            stage.partial[fd].clear();
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (epoll_ctl(stage.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                std::cerr << "fd " << fd << " 加入 I/O 线程 epoll 失败: " << strerror(errno) << std::endl;
+                stage.to_router->put(PipeItem::DISCONNECT, fd);
+            }
+        }
+        // 上一轮读到的全部消息作为一批交给路由线程
+        stage.to_router->flush();
+
+        stage.waker.prepare_sleep();
+        int timeout = stage.accepted.empty() ? -1 : 0;
+        int n = epoll_wait(stage.epoll_fd, events.data(), events.size(), timeout);
+        stage.waker.woke();
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == stage.waker.fd) {
+                stage.waker.drain();
+            } else {
+                read_connection(stage, fd);
+            }
+        }
+    }
+}
+
+void Pipeline::read_connection(IoStage& stage, int fd) {
+    char buffer[READ_CHUNK];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    std::string& partial = stage.partial[fd];
+    if (n <= 0) {
+        // 只移出 epoll，不 close：路由线程和写线程可能还引用这个 fd，由写线程收到 CLOSE 后关闭
+        epoll_ctl(stage.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        std::string().swap(partial);
+        stage.to_router->put(PipeItem::DISCONNECT, fd);
+        return;
+    }
+    uint64_t lines = 0;
+    auto emit = [&](const char* data, size_t len) {
+        // 兼容 Telnet 的 \r\n，空行忽略
+        if (len > 0 && data[len - 1] == '\r') --len;
+        if (len == 0) return;
+        stage.to_router->put(PipeItem::LINE, fd, data, len);
+        ++lines;
+    };
+    const char* p = buffer;
+    const char* end = buffer + n;
+    while (const char* newline = static_cast<const char*>(memchr(p, '\n', end - p))) {
+        if (partial.empty()) {
+            emit(p, newline - p);
+        } else {
+            partial.append(p, newline - p);
+            emit(partial.data(), partial.size());
+            partial.clear();
+        }
+        p = newline + 1;
+    }
+    partial.append(p, end - p);
+    stage.lines.fetch_add(lines, std::memory_order_relaxed);
+}
+
+// 取完主线程送来的上线通知，返回是否取到
+bool Pipeline::take_connections() {
+    bool taken = false;
+    PipeBatch* batch;
+    while (connections_->pop(batch)) {
+        taken = true;
+        for (const PipeItem& item : batch->items) {
+            if ((size_t)item.fd >= fd_addr_.size()) {
+                fd_addr_.resize(item.fd + 1, 0);
+                fd_user_.resize(item.fd + 1, 0);
+                fd_writer_.resize(item.fd + 1, 0);
+            }
+            fd_addr_[item.fd] = item.addr;
+            fd_writer_[item.fd] = next_writer_++ % writers_.size();
+            addr_fd_.insert(item.addr, item.fd);
+        }
+        connections_->recycle(batch);
+    }
+    return taken;
+}
+
+// 每轮从每个 I/O 线程最多取一批，处理完整轮才把输出批次推给写线程：各 I/O 线程之间轮流，一轮的输出合成一批
+void Pipeline::router_loop() {
+    while (true) {
+        bool worked = take_connections();
+        for (auto& stage : io_) {
+            PipeBatch* batch;
+            if (!stage->to_router->pop(batch)) continue;
+            // 这批里的连接在 I/O 线程拿到它之前已经报过上线，先取上线通知再处理
+            take_connections();
+            worked = true;
+            for (const PipeItem& item : batch->items) {
+                int fd = item.fd;
+                switch (item.kind) {
+                case PipeItem::DISCONNECT:
+                    std::cout << "客户端断开: " << format_addr48(fd_addr_[fd]) << " (fd: " << fd << ")" << std::endl;
+                    addr_fd_.erase(fd_addr_[fd], fd);
+                    fd_addr_[fd] = 0;
+                    if (fd_user_[fd] != 0) users_.online_fd[fd_user_[fd]] = -1;
+                    fd_user_[fd] = 0;
+                    writers_[fd_writer_[fd]]->from_router->put(PipeItem::CLOSE, fd);
+                    break;
+                default:
+                    route_line(fd, batch->bytes.data() + item.off, item.len);
+                    break;
+                }
+            }
+            stage->to_router->recycle(batch);
+        }
+        for (auto& stage : writers_) stage->from_router->flush();
+        if (worked) continue;
+
+        router_waker_.prepare_sleep();
+        bool idle = connections_->empty();
+        for (auto& stage : io_) idle = idle && stage->to_router->empty();
+        if (idle) {
+            pollfd pfd{router_waker_.fd, POLLIN, 0};
+            if (poll(&pfd, 1, -1) > 0) router_waker_.drain();
+        }
+        router_waker_.woke();
+    }
+}
+
+void Pipeline::route_line(int fd, const char* data, size_t len) {
+    std::string_view line(data, len);
+    if (line == "ADDR") {
+        reply(fd, "ADDR " + format_addr48(fd_addr_[fd]) + "\n");
+        return;
+    }
+    if (line == "PIPE") {
+        uint64_t lines = 0, in_batches = 0, writes = 0, messages = 0, out_batches = 0;
+        for (auto& stage : io_) {
+            lines += stage->lines.load(std::memory_order_relaxed);
+            in_batches += stage->to_router->batches();
+        }
+        for (auto& stage : writers_) {
+            writes += stage->writes.load(std::memory_order_relaxed);
+            messages += stage->messages.load(std::memory_order_relaxed);
+            out_batches += stage->from_router->batches();
+        }
+        char text[256];
+        snprintf(text, sizeof(text),
+                 "PIPE io=%zu writers=%zu lines=%llu in_batches=%llu out_batches=%llu outputs=%llu writes=%llu\n",
+                 io_.size(), writers_.size(), (unsigned long long)lines, (unsigned long long)in_batches,
+                 (unsigned long long)out_batches, (unsigned long long)messages, (unsigned long long)writes);
+        reply(fd, text);
+        return;
+    }
+    if (line.substr(0, 6) == "LOGIN ") {
+        login(fd, std::string(line.substr(6)));
+        return;
+    }
+    if (data[0] == '@' || data[0] == '#') {
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos) {
+            reply(fd, "无效的消息格式. 请使用: @NAME:MESSAGE 或 #ID:MESSAGE\n");
+            return;
+        }
+        uint32_t user_id = 0;
+        if (data[0] == '@') {
+            auto it = users_.ids.find(std::string(line.substr(1, colon - 1)));
+            if (it != users_.ids.end()) user_id = it->second;
+        } else {
+            user_id = parse_user_id(line.substr(1, colon - 1));
+        }
+        int target_fd = users_.fd_of(user_id);
+        if (target_fd != -1) {
+            deliver(target_fd, data + colon + 1, len - colon - 1);
+        } else {
+            reply(fd, "目标客户端未找到\n");
+        }
+        return;
+    }
+    size_t content_pos;
+    if (!parse_recipients(data, len, targets_, content_pos)) {
+        // IP:PORT 中不会有空格：冒号之前有空格（或根本没有冒号）的是命令
+        size_t colon = line.find(':');
+        size_t space = line.find(' ');
+        if (colon == std::string_view::npos || space < colon) {
+            reply(fd, "流水线模式不支持该命令: " + std::string(line.substr(0, std::min(space, (size_t)32))) + "\n");
+        } else {
+            reply(fd, "无效的消息格式. 请使用: IP:PORT:MESSAGE 或 IP1:PORT1,IP2:PORT2,...:MESSAGE\n");
+        }
+        return;
+    }
+    std::string missing;
+    for (Addr48 target : targets_) {
+        int target_fd = addr_fd_.find(target);
+        if (target_fd != -1) {
+            local_.push_back(target_fd);
+        } else {
+            if (!missing.empty()) missing += ',';
+            missing += format_addr48(target);
+        }
+    }
+    std::sort(local_.begin(), local_.end());
+    local_.erase(std::unique(local_.begin(), local_.end()), local_.end());
+    for (int target_fd : local_) deliver(target_fd, data + content_pos, len - content_pos);
+    local_.clear();
+    if (!missing.empty()) reply(fd, targets_.size() == 1 ? "目标客户端未找到\n" : "目标客户端未找到: " + missing + "\n");
+}
+
+void Pipeline::login(int fd, const std::string& name) {
+    if (name.empty() || name.size() > 32 || name.find_first_of(": \t") != std::string::npos) {
+        reply(fd, "无效的用户名: 长度 1-32，不能包含冒号或空白\n");
+        return;
+    }
+    uint32_t id = users_.intern(name);
+    if (id == 0) {
+        reply(fd, "注册的用户名已达上限\n");
+        return;
+    }
+    int owner = users_.fd_of(id);
+    if (owner != -1 && owner != fd) {
+        reply(fd, "用户名已被占用\n");
+        return;
+    }
+    uint32_t old_id = fd_user_[fd];
+    if (old_id != 0 && old_id != id) users_.online_fd[old_id] = -1;
+    fd_user_[fd] = id;
+    users_.online_fd[id] = fd;
+    std::cout << "用户登录: " << name << " (ID: " << id << ", fd: " << fd << ")" << std::endl;
+    reply(fd, "OK " + std::to_string(id) + "\n");
+}
+
+// 收到的批次先全部追加进各连接的输出缓冲区，再对每个有新数据的连接 write 一次
+void Pipeline::writer_loop(WriterStage& stage) {
+    std::vector<epoll_event> events(256);
+    while (true) {
+        bool worked = false;
+        PipeBatch* batch;
+        while (stage.from_router->pop(batch)) {
+            worked = true;
+            for (const PipeItem& item : batch->items) {
+                int fd = item.fd;
+                if ((size_t)fd >= stage.outputs.size()) stage.outputs.resize(fd + 1);
+                Output& out = stage.outputs[fd];
+                if (item.kind == PipeItem::CLOSE) {
+                    if (out.waiting) {
+                        epoll_ctl(stage.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                        --stage.waiting;
+                    }
+                    close(fd);
+                    out = Output();
+                    continue;
+                }
+                if (out.dead) continue;
+                out.buf.append(batch->bytes, item.off, item.len);
+                if (!out.queued) {
+                    out.queued = true;
+                    stage.dirty.push_back(fd);
+                }
+            }
+            stage.messages.fetch_add(batch->items.size(), std::memory_order_relaxed);
+            stage.from_router->recycle(batch);
+        }
+        for (int fd : stage.dirty) {
+            Output& out = stage.outputs[fd];
+            if (!out.queued) continue;  // 本轮中途已关闭
+            out.queued = false;
+            if (!out.waiting) flush_output(stage, fd);
+        }
+        stage.dirty.clear();
+        // 忙的时候只在有连接等 EPOLLOUT 时才看一眼 epoll
+        if (worked && stage.waiting == 0) continue;
+
+        int timeout = 0;
+        if (!worked) {
+            stage.waker.prepare_sleep();
+            if (stage.from_router->empty()) timeout = -1;
+        }
+        int n = epoll_wait(stage.epoll_fd, events.data(), events.size(), timeout);
+        stage.waker.woke();
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == stage.waker.fd) {
+                stage.waker.drain();
+            } else {
+                flush_output(stage, fd);
+            }
+        }
+    }
+}
+
+void Pipeline::flush_output(WriterStage& stage, int fd) {
+    Output& out = stage.outputs[fd];
+    while (out.pos < out.buf.size()) {
+        ssize_t n = write(fd, out.buf.data() + out.pos, out.buf.size() - out.pos);
+        stage.writes.fetch_add(1, std::memory_order_relaxed);
+        if (n > 0) {
+            out.pos += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // 已写出的部分攒够一半再整体前移
+            if (out.pos > out.buf.size() / 2) {
+                out.buf.erase(0, out.pos);
+                out.pos = 0;
+            }
+            if (!out.waiting) {
+                epoll_event ev{};
+                ev.events = EPOLLOUT;
+                ev.data.fd = fd;
+                if (epoll_ctl(stage.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+                    out.waiting = true;
+                    ++stage.waiting;
+                }
+            }
+            return;
+        }
+        // 对端已断开：丢弃输出，等 I/O 线程读到断开后经路由线程送来 CLOSE
+        out.dead = true;
+        break;
+    }
+    if (out.dead) {
+        std::string().swap(out.buf);
+    } else {
+        out.buf.clear();
+    }
+    out.pos = 0;
+    if (out.waiting) {
+        epoll_ctl(stage.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        out.waiting = false;
+        --stage.waiting;
+    }
+}
+
+// --- 空闲连接回收 ---
+// 周期定时器：每个周期回收一次安静了一整个周期以上的连接的冷数据
+int create_sweep_timer(int interval_ms) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "timerfd_create");
+    itimerspec spec{};
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, nullptr) < 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "timerfd_settime");
+    }
+    return fd;
+}
+
+void sweep_idle_connections(ServerContext& context, int sweep_fd) {
+    uint64_t expirations;
+    while (read(sweep_fd, &expirations, sizeof(expirations)) > 0) {
+    }
+    pthread_mutex_lock(&context.clients_mutex);
+    context.clients.sweep_idle();
+    pthread_mutex_unlock(&context.clients_mutex);
+    // 池里空闲的大块还给堆后，再让 glibc 把空闲页还给内核，RSS 才会真正回落
+    if (SlabPool::trim() > 0) malloc_trim(0);
+}
+
+// 当前已分配的堆内存：brk 区已用字节 + 大块 mmap 字节
+static size_t heap_in_use() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+// --- 协程执行模型实现 ---
+FramePool frame_pool;
+
+void* FramePool::allocate(size_t n) {
+    size_t cls = (n + GRANULE - 1) / GRANULE;
+    if (cls >= free_.size()) return ::operator new(n);
+    FreeBlock* block = free_[cls];
+    if (block == nullptr) return ::operator new(cls * GRANULE);
+    free_[cls] = block->next;
+    return block;
+}
+void FramePool::deallocate(void* p, size_t n) {
+    size_t cls = (n + GRANULE - 1) / GRANULE;
+    if (cls >= free_.size()) {
+        ::operator delete(p);
+        return;
+    }
+    FreeBlock* block = static_cast<FreeBlock*>(p);
+    block->next = free_[cls];
+    free_[cls] = block;
+}
+
+CoConn* CoScheduler::attach(int fd) {
+    if ((size_t)fd >= conns_.size()) conns_.resize(std::max<size_t>(fd + 1, conns_.size() * 2), nullptr);
+    CoConn* conn = new (frame_pool.allocate(sizeof(CoConn))) CoConn();
+    conn->fd = fd;
+    conns_[fd] = conn;
+    return conn;
+}
+void CoScheduler::close(int fd) {
+    CoConn* conn = find(fd);
+    if (conn == nullptr) return;
+    conns_[fd] = nullptr;
+    conn->closed = true;
+    if (conn->reader) schedule(std::exchange(conn->reader, nullptr));
+    if (conn->writer) schedule(std::exchange(conn->writer, nullptr));
+}
+void CoScheduler::release(CoConn* conn) {
+    if (--conn->refs > 0) return;
+    conn->~CoConn();
+    frame_pool.deallocate(conn, sizeof(CoConn));
+}
+void CoScheduler::on_event(int fd, uint32_t events) {
+    CoConn* conn = find(fd);
+    if (conn != nullptr && (events & (EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP)) && conn->reader) {
+        std::exchange(conn->reader, nullptr).resume();
+        conn = find(fd);  // 读协程可能已断开连接
+    }
+    if (conn != nullptr && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        conn->write_wanted = true;
+        if (conn->writer) std::exchange(conn->writer, nullptr).resume();
+    }
+}
+void CoScheduler::wake_writer(int fd) {
+    CoConn* conn = find(fd);
+    if (conn == nullptr) return;
+    conn->write_wanted = true;
+    if (conn->writer) schedule(std::exchange(conn->writer, nullptr));
+}
+// 每次只运行当前已就绪的一批，期间新加入的（包括让出的协程）留到下一轮事件循环，保证 epoll 事件不被饿死
+void CoScheduler::run_ready() {
+    running_.swap(ready_);
+    for (std::coroutine_handle<> h : running_) h.resume();
+    running_.clear();
+}
+void CoScheduler::add_timer(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<> h) {
+    timers_.push({deadline, h});
+}
+void CoScheduler::run_timers() {
+    auto now = std::chrono::steady_clock::now();
+    while (!timers_.empty() && timers_.top().deadline <= now) {
+        std::coroutine_handle<> h = timers_.top().handle;
+        timers_.pop();
+        h.resume();
+    }
+}
+int CoScheduler::next_timeout_ms() const {
+    if (!ready_.empty()) return 0;
+    if (timers_.empty()) return -1;
+    auto left = timers_.top().deadline - std::chrono::steady_clock::now();
+    return std::max<long>(0, std::chrono::ceil<std::chrono::milliseconds>(left).count());
+}
+
+// 等待 fd 可读（调用者已读到 EAGAIN）
+struct ReadableAwaiter {
+    CoConn* conn;
+    bool await_ready() const noexcept { return conn->closed; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { conn->reader = h; }
+    void await_resume() const noexcept {}
+};
+
+// 等待 fd 可写或有新数据待写
+struct WriterAwaiter {
+    CoConn* conn;
+    bool await_ready() const noexcept { return conn->closed || conn->write_wanted; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { conn->writer = h; }
+    void await_resume() noexcept { conn->write_wanted = false; }
+};
+
+// 让出主线程：排到就绪队列末尾，下一轮事件循环再继续
+struct YieldAwaiter {
+    CoScheduler& scheduler;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) { scheduler.schedule(h); }
+    void await_resume() const noexcept {}
+};
+
+struct SleepAwaiter {
+    CoScheduler& scheduler;
+    std::chrono::milliseconds duration;
+    bool await_ready() const noexcept { return duration.count() <= 0; }
+    void await_suspend(std::coroutine_handle<> h) {
+        scheduler.add_timer(std::chrono::steady_clock::now() + duration, h);
+    }
+    void await_resume() const noexcept {}
+};
+
+SleepAwaiter co_sleep(CoScheduler& scheduler, std::chrono::milliseconds duration) {
+    return {scheduler, duration};
+}
+
+// 写出两个通道的全部内容（优先通道按 next_output() 在消息边界插队），写出的部分从头部移除，等待可写期间可以继续追加。
+// 成功返回 0，出错或连接已被关闭返回 -1（此时 info 可能已随连接释放，不能再访问）
+Co<int> write_all(ServerContext& context, CoConn* conn, ClientInfo& info) {
+    while (!conn->closed) {
+        if (!info.has_output()) co_return 0;
+        bool urgent;
+        size_t len = next_output(info, urgent);
+        ssize_t n = write(conn->fd, urgent ? info.urgent_buf.data() : info.write_buf.data() + info.write_pos, len);
+        if (n > 0) {
+            output_written(info, urgent, n);
+            if (urgent) continue;
+            if (info.trace_msg != 0) tracer.on_written(info, conn->fd, n);
+            if (!info.seq_marks.empty()) {
+                pthread_mutex_lock(&context.clients_mutex);
+                seq_written(context, info);
+                pthread_mutex_unlock(&context.clients_mutex);
+            }
+            if (info.stream_from != -1) {
+                pthread_mutex_lock(&context.clients_mutex);
+                stream_written(context, info);
+                pthread_mutex_unlock(&context.clients_mutex);
+            }
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn->write_wanted = false;
+            co_await WriterAwaiter{conn};
+        } else {
+            co_return -1;
+        }
+    }
+    co_return -1;
+}
+
+// 读协程：读取并处理消息；直连模式下在可读时把数据 splice 进中转管道。
+// 每轮额度用完后让出主线程排到就绪队列末尾（见“公平调度”），避免一个高速发送方占住事件循环
+Detached connection_reader(ServerContext& context, CoConn* conn) {
+    int fd = conn->fd;
+    // 读协程都在主线程上运行，读到的数据在下一次挂起前已经交出，共用一块缓冲区，不占协程帧
+    static char buffer[4096];
+    tracer.start_turn(tracer.last_poll());
+    TurnBudget turn = start_turn(context, fd);
+    // 热升级接管的连接可能带着旧进程没处理完的消息
+    bool limited = process_messages(context, fd, &turn);
+    while (!conn->closed) {
+        if (limited || turn.bytes == 0) {
+            uint64_t yielded = tracer.now();
+            co_await YieldAwaiter{*context.scheduler};
+            tracer.start_turn(yielded);
+            turn = start_turn(context, fd);
+            limited = process_messages(context, fd, &turn);
+            continue;
+        }
+        bool budget_spent = false;
+        if (relay_read_event(context, fd, turn.bytes, &budget_spent) ||
+            upload_read_event(context, fd, turn.bytes, &budget_spent)) {
+            if (budget_spent) {
+                turn.bytes = 0;
+            } else {
+                co_await ReadableAwaiter{conn};
+                tracer.start_turn(tracer.last_poll());
+                turn = start_turn(context, fd);
+            }
+            continue;
+        }
+        if (stream_stalled(context, fd)) {
+            co_await ReadableAwaiter{conn};
+            tracer.start_turn(tracer.last_poll());
+            turn = start_turn(context, fd);
+            continue;
+        }
+        uint64_t read_start = tracer.now();
+        ssize_t n = read(fd, buffer, std::min(sizeof(buffer), turn.bytes));
+        tracer.note_read(read_start);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            rearm_quickack(context, fd);
+            end_turn(context, fd);
+            co_await ReadableAwaiter{conn};
+            tracer.start_turn(tracer.last_poll());
+            turn = start_turn(context, fd);
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0 && !conn->closed) std::cerr << "fd " << fd << " 读取错误: " << strerror(errno) << std::endl;
+            if (!conn->closed) disconnect_client(context, fd);
+            break;
+        }
+        pthread_mutex_lock(&context.clients_mutex);
+        ClientInfo& info = context.clients.info(fd);
+        if (info.pair_fd != -1) {
+            // 等待期间对端确认了直连：这次读到的数据已在用户态，直接交给对端，此后走 splice
+            queue_output(context, info.pair_fd, buffer, n);
+            pthread_mutex_unlock(&context.clients_mutex);
+            continue;
+        }
+        info.read_buf.append(buffer, n);
+        pthread_mutex_unlock(&context.clients_mutex);
+        turn.bytes -= n;
+        limited = process_messages(context, fd, &turn);
+    }
+    context.scheduler->release(conn);
+}
+
+// 写协程：正在送出的文件数据块优先，其次写缓冲区，写空后送出对端中转管道里的数据或下一个文件数据块，然后等待下一次唤醒
+Detached connection_writer(ServerContext& context, CoConn* conn) {
+    int fd = conn->fd;
+    while (!conn->closed) {
+        // 正在送出的文件数据块优先，送完之前写缓冲区里的消息不能插进去
+        int chunk = send_file_chunk(context, fd);
+        if (chunk < 0) {
+            if (!conn->closed) disconnect_client(context, fd);
+            break;
+        }
+        if (chunk == 0) {
+            conn->write_wanted = false;
+            co_await WriterAwaiter{conn};
+            continue;
+        }
+        pthread_mutex_lock(&context.clients_mutex);
+        ClientInfo* info = context.clients.info_if_present(fd);
+        bool has_output = info != nullptr && info->has_output();
+        ClientInfo* peer = info != nullptr ? context.clients.info_if_present(info->pair_fd) : nullptr;
+        int relay_src = peer != nullptr && peer->relay_pending > 0 ? info->pair_fd : -1;
+        pthread_mutex_unlock(&context.clients_mutex);
+        if (has_output) {
+            if (co_await write_all(context, conn, *info) < 0) {
+                if (!conn->closed) disconnect_client(context, fd);
+                break;
+            }
+            continue;
+        }
+        // 管道送不完时 flush_relay_pipe 会重新关注可写事件，由下一次可写唤醒继续
+        if (relay_src != -1) {
+            flush_relay_pipe(context, relay_src, fd);
+        } else {
+            pthread_mutex_lock(&context.clients_mutex);
+            bool next_chunk = start_file_chunk(context, fd);
+            pthread_mutex_unlock(&context.clients_mutex);
+            if (next_chunk) continue;
+        }
+        co_await WriterAwaiter{conn};
+    }
+    context.scheduler->release(conn);
+}
+
+// 协程模式下为新登记的连接启动读写协程，线程池模式下什么也不做
+void start_sessions(ServerContext& context, int fd) {
+    if (context.scheduler == nullptr) return;
+    CoConn* conn = context.scheduler->attach(fd);
+    connection_reader(context, conn);
+    connection_writer(context, conn);
+}
+
+// 切换开销基准中用到的协程
+Detached bench_waiter(CoScheduler& scheduler, CoConn* conn, long& resumed) {
+    while (!conn->closed) {
+        co_await WriterAwaiter{conn};
+        ++resumed;
+    }
+    scheduler.release(conn);
+}
+Co<int> bench_child(int value) {
+    co_return value + 1;
+}
+Detached bench_caller(CoScheduler& scheduler, CoConn* conn, long rounds, long& sum) {
+    for (long i = 0; i < rounds; ++i) {
+        sum += co_await bench_child(i);
+    }
+    co_await WriterAwaiter{conn};
+    scheduler.release(conn);
+}
+Detached bench_sleeper(CoScheduler& scheduler, int rounds, double& overshoot_us) {
+    for (int i = 0; i < rounds; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        co_await co_sleep(scheduler, std::chrono::milliseconds(1));
+        overshoot_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() - 1000;
+    }
+}
+
+/**
+ * @brief 对比一次事件分发在两种执行模型下的开销：
+ * 任务模型：主线程 add_task，工作线程被唤醒执行（测单个任务的唤醒延迟，以及批量入队时的平均开销）；
+ * 协程模型：调度器恢复挂起的协程（直接恢复、经延迟队列恢复、子协程调用）。
+ */
+void run_switch_bench() {
+    using clock = std::chrono::steady_clock;
+    auto per_op_ns = [](clock::time_point start, long ops) {
+        return std::chrono::duration<double, std::nano>(clock::now() - start).count() / ops;
+    };
+
+    class StampTask : public Task {
+    public:
+        StampTask(std::atomic<long>& done, clock::time_point queued, double& latency_ns)
+            : done_(done), queued_(queued), latency_ns_(latency_ns) {}
+        void execute() override {
+            latency_ns_ += std::chrono::duration<double, std::nano>(clock::now() - queued_).count();
+            done_.fetch_add(1, std::memory_order_release);
+        }
+    private:
+        std::atomic<long>& done_;
+        clock::time_point queued_;
+        double& latency_ns_;
+    };
+
+    ThreadPool pool(4);
+    std::atomic<long> done{0};
+    double latency_ns = 0;
+    const long latency_rounds = 20000;
+    for (long i = 0; i < latency_rounds; ++i) {
+        pool.add_task(std::make_unique<StampTask>(done, clock::now(), latency_ns));
+        while (done.load(std::memory_order_acquire) <= i) {
+        }
+    }
+    std::cout << "任务模型: 入队到开始执行 " << latency_ns / latency_rounds << " ns/次 (工作线程空闲等待时)" << std::endl;
+
+    const long batch_rounds = 1000000;
+    double unused = 0;
+    done = 0;
+    auto start = clock::now();
+    for (long i = 0; i < batch_rounds; ++i) {
+        pool.add_task(std::make_unique<StampTask>(done, start, unused));
+    }
+    pool.wait_idle();
+    std::cout << "任务模型: 连续入队并执行 " << per_op_ns(start, batch_rounds) << " ns/个" << std::endl;
+
+    CoScheduler scheduler;
+    const long co_rounds = 10000000;
+    long resumed = 0;
+    CoConn* conn = scheduler.attach(0);
+    conn->refs = 1;
+    bench_waiter(scheduler, conn, resumed);
+    start = clock::now();
+    for (long i = 0; i < co_rounds; ++i) {
+        scheduler.on_event(0, EPOLLOUT);
+    }
+    std::cout << "协程模型: 事件循环直接恢复 " << per_op_ns(start, co_rounds) << " ns/次" << std::endl;
+    start = clock::now();
+    for (long i = 0; i < co_rounds; ++i) {
+        scheduler.wake_writer(0);
+        scheduler.run_ready();
+    }
+    std::cout << "协程模型: 经延迟队列恢复 " << per_op_ns(start, co_rounds) << " ns/次" << std::endl;
+    scheduler.close(0);
+    scheduler.run_ready();
+
+    long sum = 0;
+    conn = scheduler.attach(0);
+    conn->refs = 1;
+    start = clock::now();
+    bench_caller(scheduler, conn, co_rounds, sum);
+    std::cout << "协程模型: co_await 子协程（帧来自内存池） " << per_op_ns(start, co_rounds) << " ns/次" << std::endl;
+    scheduler.close(0);
+    scheduler.run_ready();
+
+    double overshoot_us = 0;
+    const int sleep_rounds = 200;
+    bench_sleeper(scheduler, sleep_rounds, overshoot_us);
+    while (scheduler.next_timeout_ms() != -1) {
+        usleep(scheduler.next_timeout_ms() * 1000);
+        scheduler.run_timers();
+    }
+    std::cout << "协程模型: sleep(1ms) 平均超出 " << overshoot_us / sleep_rounds << " us (毫秒级定时器)" << std::endl;
+}
+
+// 进程常驻内存，单位 KiB：field 为 "VmRSS"（当前）或 "VmHWM"（峰值）
+static size_t rss_kb(const char* field = "VmRSS") {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f == nullptr) return 0;
+    char line[256];
+    size_t kb = 0;
+    size_t len = strlen(field);
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            kb = strtoul(line + len + 1, nullptr, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+// 把峰值 RSS 重置为当前值
+static void reset_peak_rss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) return;
+    if (write(fd, "5", 1) < 0) {
+    }
+    close(fd);
+}
+
+// 分配器基准中的一条连接：与 ClientInfo 同样大小的记录 + 读写缓冲区
+template <typename Str>
+struct BenchConn {
+    char record[sizeof(ClientInfo)];
+    Str read_buf;
+    Str write_buf;
+};
+
+/**
+ * @brief 模拟连接的创建与销毁：每个线程维持 WINDOW 条存活连接，轮流替换最旧的一条；
+ * 新连接先收几条长短不一的消息（读缓冲区增长后消费掉），再排一条回复。返回每条连接的平均耗时(ns)
+ */
+template <typename Str, bool POOLED>
+double churn_connections(int threads, long conns_per_thread) {
+    const size_t WINDOW = 2048;
+    auto worker = [conns_per_thread]() {
+        std::vector<BenchConn<Str>*> live(WINDOW, nullptr);
+        uint32_t seed = 12345;
+        std::string message(8192, 'x');
+        for (long i = 0; i < conns_per_thread; ++i) {
+            BenchConn<Str>*& slot = live[i % WINDOW];
+            if (slot != nullptr) {
+                slot->~BenchConn<Str>();
+                if (POOLED) SlabPool::deallocate(slot, sizeof(BenchConn<Str>));
+                else ::operator delete(slot);
+            }
+            void* memory = POOLED ? SlabPool::allocate(sizeof(BenchConn<Str>)) : ::operator new(sizeof(BenchConn<Str>));
+            slot = new (memory) BenchConn<Str>();
+            for (int m = 0; m < 4; ++m) {
+                seed = seed * 1103515245 + 12345;
+                slot->read_buf.append(message.data(), 32 + (seed >> 16) % 4096);
+            }
+            slot->read_buf.erase(0, slot->read_buf.size() / 2);
+            slot->write_buf.append(message.data(), 64 + (seed >> 8) % 512);
+        }
+        for (BenchConn<Str>* conn : live) {
+            if (conn == nullptr) continue;
+            conn->~BenchConn<Str>();
+            if (POOLED) SlabPool::deallocate(conn, sizeof(BenchConn<Str>));
+            else ::operator delete(conn);
+        }
+    };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<pthread_t> tids(threads);
+    for (pthread_t& tid : tids) {
+        pthread_create(&tid, nullptr, [](void* arg) -> void* {
+            (*static_cast<decltype(worker)*>(arg))();
+            return nullptr;
+        }, &worker);
+    }
+    for (pthread_t tid : tids) pthread_join(tid, nullptr);
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+           (threads * conns_per_thread);
+}
+
+/**
+ * @brief 对比内存池与默认堆：4 个线程各自创建/销毁连接（记录 + 读写缓冲区），
+ * 输出每条连接的分配开销，以及结束后、归还空闲内存后的 RSS
+ */
+void run_alloc_bench() {
+    const int threads = 4;
+    const long conns = 500000;
+    size_t base_kb = rss_kb();
+    reset_peak_rss();
+    double heap_ns = churn_connections<std::string, false>(threads, conns);
+    size_t peak_kb = rss_kb("VmHWM");
+    size_t end_kb = rss_kb();
+    malloc_trim(0);
+    std::cout << "默认堆: " << heap_ns << " ns/连接, 峰值 RSS +" << peak_kb - base_kb << " KiB, 结束时 +"
+              << end_kb - base_kb << " KiB, malloc_trim 后 +" << rss_kb() - base_kb << " KiB" << std::endl;
+
+    base_kb = rss_kb();
+    reset_peak_rss();
+    double pool_ns = churn_connections<Buffer, true>(threads, conns);
+    peak_kb = rss_kb("VmHWM");
+    end_kb = rss_kb();
+    SlabPool::trim();
+    malloc_trim(0);
+    std::cout << "内存池: " << pool_ns << " ns/连接, 峰值 RSS +" << peak_kb - base_kb << " KiB, 结束时 +"
+              << end_kb - base_kb << " KiB, trim 后 +" << rss_kb() - base_kb << " KiB" << std::endl;
 }
-void remove_fd_from_epoll(int epoll_fd, int fd) {
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr) == -1) {
-        if (errno != EBADF) std::cerr << "从 epoll 移除 fd 失败: " << strerror(errno) << std::endl;
+
+// 在 threads 个线程上各运行一次 fn(线程序号)，等全部结束
+template <typename F>
+void run_threads(int threads, F fn) {
+    struct Arg {
+        F* fn;
+        int index;
+    };
+    std::vector<Arg> args(threads);
+    std::vector<pthread_t> tids(threads);
+    for (int i = 0; i < threads; ++i) {
+        args[i] = {&fn, i};
+        pthread_create(&tids[i], nullptr, [](void* p) -> void* {
+            Arg* arg = static_cast<Arg*>(p);
+            (*arg->fn)(arg->index);
+            return nullptr;
+        }, &args[i]);
     }
+    for (pthread_t tid : tids) pthread_join(tid, nullptr);
 }
-void disconnect_client(ServerContext& context, int fd) {
-    pthread_mutex_lock(&context.clients_mutex);
-    if (context.clients.count(fd)) {
-        const auto& client = context.clients.at(fd);
-        std::cout << "客户端断开: " << client.ip << ":" << client.port << " (fd: " << fd << ")" << std::endl;
-        remove_fd_from_epoll(context.epoll_fd, fd);
-        close(fd);
-        context.clients.erase(fd);
+
+/**
+ * @brief 在 READERS 个读线程不停查询、一个线程不停上线/下线（连接抖动）的情况下运行 SECONDS 秒，
+ * 输出查询吞吐和抖动速率。lookup(地址) 返回是否在线，churn(i) 让第 i 个客户端下线、第 i + PREFILL 个上线
+ */
+template <typename Lookup, typename Churn>
+void measure_directory(const char* title, int readers, uint32_t prefill, double seconds, Lookup lookup, Churn churn) {
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> lookups{0}, hits{0}, churned{0};
+    auto start = std::chrono::steady_clock::now();
+    run_threads(readers + 1, [&](int index) {
+        if (index == readers) {
+            uint32_t i = 0;
+            while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < seconds) {
+                churn(i++);
+            }
+            churned = i;
+            stop = true;
+            return;
+        }
+        uint32_t seed = 2463534242u + index;
+        uint64_t n = 0, found = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            for (int k = 0; k < 256; ++k) {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                found += lookup(seed % (2 * prefill));
+            }
+            n += 256;
+        }
+        lookups += n;
+        hits += found;
+    });
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << title << ": " << readers << " 个读线程共 " << lookups.load() / elapsed / 1e6 << " 百万次查询/秒（命中 "
+              << 100.0 * hits.load() / std::max<uint64_t>(1, lookups.load()) << "%），同时上线+下线 "
+              << churned.load() / elapsed << " 次/秒" << std::endl;
+}
+
+/**
+ * @brief 对比在线目录快照与当前路由使用的“clients_mutex + 地址哈希索引”：预置 PREFILL 个在线客户端，
+ * 16 个读线程按地址随机查询，一个线程同时制造连接抖动
+ */
+void run_directory_bench() {
+    const int readers = 16;
+    const uint32_t prefill = 100000;
+    const double seconds = 2;
+    auto addr_of = [](uint32_t i) { return make_addr48(0x7f000001 + (i >> 16), (i & 0xffff) + 1); };
+
+    {
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        AddrIndex index;
+        for (uint32_t i = 0; i < prefill; ++i) index.insert(addr_of(i), i + 1);
+        measure_directory("互斥锁 + 哈希索引", readers, prefill, seconds,
+            [&](uint32_t i) {
+                pthread_mutex_lock(&mutex);
+                bool online = index.find(addr_of(i)) != -1;
+                pthread_mutex_unlock(&mutex);
+                return online;
+            },
+            [&](uint32_t i) {
+                pthread_mutex_lock(&mutex);
+                index.erase(addr_of(i % (2 * prefill)), i % (2 * prefill) + 1);
+                index.insert(addr_of((i + prefill) % (2 * prefill)), (i + prefill) % (2 * prefill) + 1);
+                pthread_mutex_unlock(&mutex);
+            });
+    }
+    {
+        Directory directory;
+        for (uint32_t i = 0; i < prefill; ++i) directory.set(addr_of(i), 0, std::string(), false);
+        directory.start();
+        usleep(200 * 1000);
+        uint64_t before = directory.publishes();
+        measure_directory("在线目录快照", readers, prefill, seconds,
+            [&](uint32_t i) {
+                Directory::ReadGuard snapshot = directory.read();
+                return snapshot->find(addr_of(i)) != nullptr;
+            },
+            [&](uint32_t i) {
+                directory.remove(addr_of(i % (2 * prefill)));
+                directory.set(addr_of((i + prefill) % (2 * prefill)), 0, std::string(), false);
+            });
+        std::cout << "  期间发布快照 " << directory.publishes() - before << " 次" << std::endl;
     }
-    pthread_mutex_unlock(&context.clients_mutex);
 }
-bool parse_message(const std::string& raw_buf, std::string& target_ip, int& target_port, std::string& msg_content) {
-    size_t first_colon = raw_buf.find(':');
-    if (first_colon == std::string::npos) return false;
-    size_t second_colon = raw_buf.find(':', first_colon + 1);
-    if (second_colon == std::string::npos) return false;
-    target_ip = raw_buf.substr(0, first_colon);
-    try {
-        target_port = std::stoi(raw_buf.substr(first_colon + 1, second_colon - first_colon - 1));
-    } catch (...) {
-        return false;
+
+/**
+ * @brief 阶跃负载下对比固定 4 线程与弹性线程池：每个任务阻塞 TASK_US 微秒（模拟写暂存文件等阻塞操作），
+ * 提交速率从低跳到高再跳回低，每 250 毫秒打印一行线程数和该时段提交的任务的排队时间，
+ * 最后汇总高负载阶段的排队时间、阶跃后平均排队回落到 5 毫秒以内所用的时间，以及扩缩容次数
+ */
+void run_pool_bench() {
+    using clock = std::chrono::steady_clock;
+    const int task_us = 200;
+    const int bucket_ms = 250;
+    const double recovered_us = 5000;
+    struct Phase {
+        int ms;
+        int rate;  // 每秒提交的任务数
+    };
+    const Phase phases[] = {{1000, 2000}, {2000, 30000}, {4000, 2000}};
+    int total_ms = 0;
+    for (const Phase& phase : phases) total_ms += phase.ms;
+    const int step_ms = phases[0].ms;
+    const size_t buckets = total_ms / bucket_ms;
+
+    struct Bucket {
+        std::atomic<uint64_t> wait_ns{0}, max_ns{0}, count{0};
+        size_t threads = 0;
+        int rate = 0;
+    };
+    class BlockingTask : public Task {
+    public:
+        BlockingTask(Bucket& bucket, clock::time_point queued, int task_us)
+            : bucket_(bucket), queued_(queued), task_us_(task_us) {}
+        void execute() override {
+            uint64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - queued_).count();
+            bucket_.wait_ns.fetch_add(wait, std::memory_order_relaxed);
+            bucket_.count.fetch_add(1, std::memory_order_relaxed);
+            uint64_t max = bucket_.max_ns.load(std::memory_order_relaxed);
+            while (wait > max && !bucket_.max_ns.compare_exchange_weak(max, wait, std::memory_order_relaxed)) {
+            }
+            usleep(task_us_);
+        }
+    private:
+        Bucket& bucket_;
+        clock::time_point queued_;
+        int task_us_;
+    };
+
+    auto measure = [&](const char* title, size_t min_threads, size_t max_threads) {
+        std::vector<Bucket> stats(buckets);
+        ThreadPool pool(min_threads, max_threads);
+        auto start = clock::now();
+        double owed = 0;
+        int elapsed_ms = 0;
+        for (const Phase& phase : phases) {
+            for (int ms = 0; ms < phase.ms; ++ms, ++elapsed_ms) {
+                Bucket& bucket = stats[std::min<size_t>(elapsed_ms / bucket_ms, buckets - 1)];
+                bucket.rate = phase.rate;
+                bucket.threads = std::max(bucket.threads, pool.stats().threads);
+                for (owed += phase.rate / 1000.0; owed >= 1; owed -= 1) {
+                    pool.add_task(std::make_unique<BlockingTask>(bucket, clock::now(), task_us));
+                }
+                auto remaining = start + std::chrono::milliseconds(elapsed_ms + 1) - clock::now();
+                if (remaining.count() > 0) usleep(std::chrono::duration_cast<std::chrono::microseconds>(remaining).count());
+            }
+        }
+        pool.wait_idle();
+        ThreadPool::Stats end = pool.stats();
+
+        std::cout << title << ":" << std::endl;
+        double high_wait_ns = 0, high_count = 0, high_max_ns = 0;
+        int recovered_ms = -1;
+        for (size_t i = 0; i < buckets; ++i) {
+            const Bucket& b = stats[i];
+            double avg_us = b.count != 0 ? b.wait_ns / 1000.0 / b.count : 0;
+            std::cout << "  " << (i + 1) * bucket_ms / 1000.0 << "s 速率 " << b.rate << "/s 线程 " << b.threads
+                      << " 排队 平均 " << avg_us << "us 最大 " << b.max_ns / 1000.0 << "us" << std::endl;
+            int bucket_start = i * bucket_ms;
+            if (bucket_start >= step_ms && bucket_start < step_ms + phases[1].ms) {
+                high_wait_ns += b.wait_ns;
+                high_count += b.count;
+                high_max_ns = std::max<double>(high_max_ns, b.max_ns);
+                if (recovered_ms < 0 && avg_us < recovered_us) recovered_ms = bucket_start + bucket_ms - step_ms;
+            }
+        }
+        std::cout << "  高负载阶段排队: 平均 " << (high_count != 0 ? high_wait_ns / 1000 / high_count : 0) << "us 最大 "
+                  << high_max_ns / 1000 << "us; 阶跃后平均排队回落到 " << recovered_us / 1000 << "ms 以内: "
+                  << (recovered_ms >= 0 ? std::to_string(recovered_ms) + "ms 内" : std::string("未回落"))
+                  << "; 扩容 " << end.grows << " 次, 缩容 " << end.shrinks << " 次, 结束时 " << end.threads << " 个线程"
+                  << std::endl;
+    };
+    std::cout << "任务阻塞 " << task_us << "us, 速率 " << phases[0].rate << " -> " << phases[1].rate << " -> "
+              << phases[2].rate << " 个/秒" << std::endl;
+    measure("固定 4 线程", 4, 4);
+    measure("弹性 2-16 线程", 2, 16);
+}
+
+/**
+ * @brief 消息搜索的规模测试：USERS 个用户各与固定的一批联系人随机聊天，向 dir 灌入 messages 条合成消息
+ * （单词按 Zipf 分布取自 5 万词的词表，三成消息夹带一段中文），等索引写完、合并停下后按四类查询各测 QUERIES 次：
+ * 罕见词、常见词、两个常见词、中文二元词。查询路径与 SEARCH 命令相同（提交给索引线程、从 notify_fd() 取回），
+ * 打印建索引速度、段数与磁盘占用和各类查询的 p50/p99/最大延迟。dir 中原有的段文件会先删除
+ */
+void run_search_bench(const std::string& dir, uint64_t messages) {
+    const uint32_t USERS = 10000;
+    const uint32_t CONTACTS = 20;
+    const uint32_t VOCABULARY = 50000;
+    const int QUERIES = 200;
+    static const char CJK[] = "的一是在不了有和人这中大为上个国我以要他时来用们生到作地于出就分对成会可主发年动同工也能下过子说产种面"
+                              "而方后多定行学法所民得经十三之进着等部度家电力里如水化高自二理起小物现实加量都两体制机当使点从业本去把"
+                              "性好应开它合还因由其些然前外天政四日那社义事平形相全表间样与关各重新线内数正心反你明看原又么利比或但质"
+                              "气第向道命此变条只没结解问意建月公无系军很情者最立代想已通并提直题党程展五果料象员革位入常文总次品式活";
+    const uint32_t cjk_chars = (sizeof(CJK) - 1) / 3;
+    using clock = std::chrono::steady_clock;
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) throw std::system_error(errno, std::generic_category(), "mkdir " + dir);
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* entry = readdir(d)) {
+            if (strncmp(entry->d_name, "seg-", 4) == 0) unlink((dir + "/" + entry->d_name).c_str());
+        }
+        closedir(d);
+    }
+    uint64_t rng = 88172645463325252ULL;
+    auto next = [&]() {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return rng;
+    };
+    auto make_zipf = [](uint32_t n) {
+        std::vector<double> cdf(n);
+        double sum = 0;
+        for (uint32_t i = 0; i < n; ++i) cdf[i] = sum += 1.0 / (i + 1);
+        for (double& c : cdf) c /= sum;
+        return cdf;
+    };
+    std::vector<double> word_cdf = make_zipf(VOCABULARY);
+    std::vector<double> cjk_cdf = make_zipf(cjk_chars);
+    auto zipf = [&](const std::vector<double>& cdf) {
+        double u = (next() >> 11) * (1.0 / 9007199254740992.0);
+        return (uint32_t)std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), cdf.size() - 1);
+    };
+    auto word = [](uint32_t rank) {
+        std::string w;
+        for (uint32_t v = rank + 26; v != 0; v /= 26) w += (char)('a' + v % 26);
+        return w;
+    };
+    auto cjk = [&](uint32_t rank) { return std::string(CJK + rank * 3, 3); };
+    auto user = [](uint32_t u) { return "@u" + std::to_string(u); };
+
+    SearchIndex index;
+    index.configure(dir);
+    index.start();
+    std::cout << "向 " << dir << " 灌入 " << messages << " 条消息 (" << USERS << " 个用户, 词表 " << VOCABULARY << " 词)..."
+              << std::endl;
+    auto start = clock::now();
+    std::string text;
+    for (uint64_t i = 0; i < messages; ++i) {
+        uint32_t sender = next() % USERS;
+        uint32_t recipient = (sender + 1 + next() % CONTACTS) % USERS;
+        text.clear();
+        for (int n = 6 + next() % 9; n > 0; --n) {
+            text += word(zipf(word_cdf));
+            text += ' ';
+        }
+        if (next() % 10 < 3) {
+            for (int n = 4 + next() % 5; n > 0; --n) text += cjk(zipf(cjk_cdf));
+        }
+        index.add(user(sender), user(recipient), text.data(), text.size());
+        if (i % 4096 == 0) {
+            while (index.stats().backlog > (16 << 20)) usleep(1000);
+        }
+    }
+    // 等队列排空、合并停下（连续两次检查都没有合并在进行）
+    for (int quiet = 0; quiet < 2;) {
+        usleep(100 * 1000);
+        SearchIndex::Stats stats = index.stats();
+        quiet = stats.backlog == 0 && !stats.merging ? quiet + 1 : 0;
+    }
+    double build_s = std::chrono::duration<double>(clock::now() - start).count();
+    SearchIndex::Stats stats = index.stats();
+    std::cout << "建索引: " << stats.docs << " 条, " << build_s << " 秒 (" << stats.docs / build_s << " 条/秒), " << stats.segments
+              << " 个段 + 内存段, 磁盘 " << stats.disk_bytes / (1 << 20) << " MB, 合并 " << stats.merges << " 次, 丢弃 "
+              << stats.dropped << " 条" << std::endl;
+
+    struct Kind {
+        const char* title;
+        std::function<std::string()> words;
+    };
+    const Kind kinds[] = {
+        {"罕见词", [&]() { return word(20000 + next() % (VOCABULARY - 20000)); }},
+        {"常见词", [&]() { return word(next() % 20); }},
+        {"两个常见词", [&]() { return word(next() % 100) + " " + word(next() % 100); }},
+        {"中文二元词", [&]() { return cjk(next() % 30) + cjk(next() % 30); }},
+    };
+    pollfd pfd{index.notify_fd(), POLLIN, 0};
+    for (const Kind& kind : kinds) {
+        std::vector<uint64_t> micros;
+        uint64_t hits = 0;
+        for (int q = 0; q < QUERIES; ++q) {
+            index.query(-1, 0, user(next() % USERS), kind.words());
+            std::vector<SearchIndex::Result> results;
+            while (results.empty()) {
+                poll(&pfd, 1, -1);
+                results = index.take_results();
+            }
+            micros.push_back(results[0].micros);
+            hits += results[0].hits.size();
+        }
+        std::sort(micros.begin(), micros.end());
+        std::cout << "  " << kind.title << ": p50 " << micros[micros.size() / 2] << "us p99 " << micros[micros.size() * 99 / 100]
+                  << "us 最大 " << micros.back() << "us, 平均返回 " << (double)hits / QUERIES << " 条" << std::endl;
+    }
+    index.stop();
+}
+
+// --- 热升级 ---
+/*交接流程：
+1.新进程以 --takeover 启动，连接旧进程的升级 socket。
+2.旧进程停止分发事件，等线程池里的任务全部结束，此后连接状态不再变化。
+3.旧进程把监听 socket、全部连接的 fd（直连模式还有中转管道）和对应状态分批发给新进程，fd 经 SCM_RIGHTS 复制过去。
+4.新进程重建连接表并注册到自己的 epoll，回复确认；旧进程收到确认后直接退出，不关闭、不 shutdown 任何连接。
+内核缓冲区里尚未读取的数据留在 socket 上，由新进程的 epoll 在注册时立即报告，客户端感知不到切换。
+新进程在确认前失败时，旧进程继续服务。*/
+
+// 状态流由若干批次组成：8 字节长度 + 若干条记录，批内记录用到的 fd 随同一次 sendmsg 发送
+static const size_t HANDOFF_MAX_FDS = 250;  // 内核限制单条消息最多携带 253 个 fd
+
+enum HandoffRecord : char {
+    HANDOFF_LISTEN = 'L',  // 监听 socket：角色(1，0 客户端 TCP / 1 集群链路 / 2 客户端 Unix socket) + 1 个 fd
+    HANDOFF_USER = 'U',    // 用户名和有序投递会话号，按 ID 顺序
+    HANDOFF_SEQ = 'Q',     // 有序投递会话：发送方 ID、目标、会话号、序号状态
+    HANDOFF_FILE = 'F',    // 文件传输：双方旧 fd、进度、是否仍登记在传输表中 + 暂存文件和中转管道共 0~3 个 fd
+    HANDOFF_CONN = 'C',    // 连接：旧 fd、类型、地址、用户 ID、是否分帧、缓冲区（含优先通道和消息边界）、直连状态、文件块状态、超长行是否丢弃到行尾、待送达的有序消息 + 1 或 3 个 fd
+    HANDOFF_REMOTE = 'R',  // 集群路由：远端客户端地址 + 链路的旧 fd
+    HANDOFF_SUB = 'S',     // 主题订阅：连接的旧 fd + 模式
+    HANDOFF_END = 'E',
+};
+
+class HandoffWriter {
+public:
+    explicit HandoffWriter(int sock) : sock_(sock) {}
+    template <typename T>
+    void put(T value) { batch_.append(reinterpret_cast<const char*>(&value), sizeof(value)); }
+    void put_str(std::string_view str) {
+        put<uint64_t>(str.size());
+        batch_ += str;
+    }
+    // 写入带 n 个 fd 的记录前调用，超出单批上限时先发出当前批次
+    bool reserve_fds(size_t n) { return fds_.size() + n <= HANDOFF_MAX_FDS || flush(); }
+    void add_fd(int fd) { fds_.push_back(fd); }
+    bool flush();
+
+private:
+    int sock_;
+    std::string batch_;
+    std::vector<int> fds_;
+};
+
+bool HandoffWriter::flush() {
+    if (batch_.empty()) return true;
+    uint64_t len = batch_.size();
+    iovec iov[2] = {{&len, sizeof(len)}, {&batch_[0], batch_.size()}};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS));
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (!fds_.empty()) {
+        msg.msg_control = control.data();
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds_.size());
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_.size());
+        memcpy(CMSG_DATA(cmsg), fds_.data(), sizeof(int) * fds_.size());
+    }
+    size_t total = sizeof(len) + batch_.size();
+    size_t sent = 0;
+    while (sent < total) {
+        ssize_t n = sendmsg(sock_, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "热升级: 发送状态失败: " << strerror(errno) << std::endl;
+            return false;
+        }
+        sent += n;
+        // fd 已随第一段数据送出，剩余部分只发数据
+        msg.msg_control = nullptr;
+        msg.msg_controllen = 0;
+        while (n > 0 && msg.msg_iovlen > 0) {
+            size_t step = std::min<size_t>(n, msg.msg_iov->iov_len);
+            msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + step;
+            msg.msg_iov->iov_len -= step;
+            n -= step;
+            if (msg.msg_iov->iov_len == 0) {
+                ++msg.msg_iov;
+                --msg.msg_iovlen;
+            }
+        }
     }
-    msg_content = raw_buf.substr(second_colon + 1) ;
+    batch_.clear();
+    fds_.clear();
     return true;
 }
-void handle_new_connection(int listen_fd, ServerContext& context) {
-    while (true) {
-        sockaddr_in cli_addr{};
-        socklen_t cli_len = sizeof(cli_addr);
-        int conn_fd = accept(listen_fd, (struct sockaddr*)&cli_addr, &cli_len);
-        if (conn_fd < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            std::cerr << "accept 错误: " << strerror(errno) << std::endl;
-            break;
+
+// 接收端在初始化阶段运行，出错直接抛异常
+class HandoffReader {
+public:
+    explicit HandoffReader(int sock) : sock_(sock) {}
+    // 读入下一批记录
+    void next_batch() {
+        uint64_t len;
+        recv_exact(reinterpret_cast<char*>(&len), sizeof(len));
+        batch_.resize(len);
+        recv_exact(&batch_[0], len);
+        pos_ = 0;
+    }
+    bool batch_done() const { return pos_ == batch_.size(); }
+    template <typename T>
+    T get() {
+        T value;
+        take(reinterpret_cast<char*>(&value), sizeof(value));
+        return value;
+    }
+    template <typename S = std::string>
+    S get_str() {
+        S str(get<uint64_t>(), '\0');
+        take(&str[0], str.size());
+        return str;
+    }
+    int take_fd() {
+        if (fds_.empty()) throw std::runtime_error("热升级: 状态流中缺少 fd");
+        int fd = fds_.front();
+        fds_.pop_front();
+        return fd;
+    }
+
+private:
+    void take(char* out, size_t n) {
+        if (batch_.size() - pos_ < n) throw std::runtime_error("热升级: 状态记录不完整");
+        memcpy(out, batch_.data() + pos_, n);
+        pos_ += n;
+    }
+    void recv_exact(char* buf, size_t n);
+
+    int sock_;
+    std::string batch_;
+    size_t pos_ = 0;
+    std::deque<int> fds_;
+};
+
+void HandoffReader::recv_exact(char* buf, size_t n) {
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS));
+    while (n > 0) {
+        iovec iov = {buf, n};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        ssize_t r = recvmsg(sock_, &msg, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) throw std::system_error(errno, std::generic_category(), "热升级 recvmsg");
+        if (r == 0) throw std::runtime_error("热升级: 旧进程提前关闭了连接");
+        if (msg.msg_flags & MSG_CTRUNC) throw std::runtime_error("热升级: fd 被截断");
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            fds_.insert(fds_.end(), fds, fds + count);
         }
-        set_non_blocking(conn_fd);
-        add_fd_to_epoll(context.epoll_fd, conn_fd, EPOLLIN | EPOLLET);
-        ClientInfo new_client;
-        char client_ip_str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &cli_addr.sin_addr, client_ip_str, INET_ADDRSTRLEN);
-        new_client.ip = client_ip_str;
-        new_client.port = ntohs(cli_addr.sin_port);
-        pthread_mutex_lock(&context.clients_mutex);
-        context.clients[conn_fd] = new_client;
-        pthread_mutex_unlock(&context.clients_mutex);
-        std::cout << "新客户端连接: " << new_client.ip << ":" << new_client.port << " (fd: " << conn_fd << ")" << std::endl;
+        buf += r;
+        n -= r;
+    }
+}
+
+int create_upgrade_socket(const std::string& path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) throw std::invalid_argument("升级 socket 路径过长: " + path);
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "socket(AF_UNIX)");
+    // 路径可能残留自上一个进程（包括刚交接完、尚未退出的旧进程），直接替换
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "bind/listen " + path);
     }
+    set_non_blocking(fd);
+    return fd;
 }
 
 /**
- * @brief 处理读事件，包含半包和粘包处理逻辑
+ * @brief 旧进程：把监听 socket 和全部连接交给连上升级 socket 的新进程。
+ * @return true 表示新进程已确认接管，调用者应立即退出事件循环；false 表示交接失败，继续服务
  */
-void handle_read_event(ServerContext& context, int fd) {
-    char buffer[1024];
-    bool connection_closed = false;
+bool hand_off_state(ServerContext& context, ThreadPool& pool, int upgrade_fd, int listen_fd, int node_listen_fd, int unix_listen_fd) {
+    int sock = accept(upgrade_fd, nullptr, nullptr);
+    if (sock < 0) return false;
+    auto start = std::chrono::steady_clock::now();
+    std::cout << "收到热升级请求，停止处理事件并交接连接..." << std::endl;
+    // 主线程是唯一的任务来源，等待已分发的任务结束后连接状态即冻结
+    context.pausing = true;
+    pool.wait_idle();
 
-    // 1. 从 socket 尽可能多地读取数据
-    while (true) {
-        int n = read(fd, buffer, sizeof(buffer));
-        if (n > 0) {
-            // 将读取到的数据追加到对应客户端的读缓冲区
-            pthread_mutex_lock(&context.clients_mutex);
-            if (context.clients.count(fd)) {
-                context.clients[fd].read_buf.append(buffer, n);
+    pthread_mutex_lock(&context.clients_mutex);
+    abort_streams(context);
+    // 索引线程答完已收到的查询、把内存段写成段文件后停止，新进程从同一目录加载；查询结果随写缓冲区一起交接
+    if (context.search.enabled()) {
+        context.search.stop();
+        deliver_search_results(context);
+    }
+    HandoffWriter writer(sock);
+    bool ok = true;
+    const int listen_fds[] = {listen_fd, node_listen_fd, unix_listen_fd};  // 下标即角色
+    for (uint8_t role = 0; role < 3; ++role) {
+        if (listen_fds[role] == -1) continue;
+        writer.reserve_fds(1);
+        writer.put(HANDOFF_LISTEN);
+        writer.put(role);
+        writer.add_fd(listen_fds[role]);
+    }
+    for (size_t id = 1; id < context.users.names.size(); ++id) {
+        writer.put(HANDOFF_USER);
+        writer.put_str(context.users.names[id]);
+        writer.put(context.users.session[id]);
+    }
+    for (const auto& entry : context.conversations) {
+        const SeqConversation& conv = entry.second;
+        writer.put(HANDOFF_SEQ);
+        writer.put(conv.sender);
+        writer.put_str(conv.target);
+        writer.put(conv.session);
+        writer.put<uint8_t>(conv.started);
+        writer.put(conv.accepted);
+        writer.put(conv.delivered);
+        writer.put(conv.nacked);
+    }
+    // 已取消、但还有数据块正在送给接收方的传输不在传输表里，随持有它的连接一起发送
+    auto put_transfer = [&](const FileTransfer& t, bool live) {
+        bool has_pipe = t.pipe[0] != -1;
+        if (!ok || !(ok = writer.reserve_fds(has_pipe ? 3 : 1))) return;
+        writer.put(HANDOFF_FILE);
+        writer.put(t.id);
+        writer.put<int32_t>(t.src_fd);
+        writer.put<int32_t>(t.dst_fd);
+        writer.put(t.size);
+        writer.put_str(t.name);
+        writer.put<uint8_t>(t.accepted);
+        writer.put(t.spooled);
+        writer.put(t.queued);
+        writer.put(t.delivered);
+        writer.put<uint8_t>(t.upload_stalled);
+        writer.put<uint8_t>(live);
+        writer.put<uint8_t>(t.spool_fd != -1);
+        writer.put<uint8_t>(has_pipe);
+        if (t.spool_fd != -1) writer.add_fd(t.spool_fd);
+        if (has_pipe) {
+            writer.add_fd(t.pipe[0]);
+            writer.add_fd(t.pipe[1]);
+        }
+    };
+    for (const auto& entry : context.transfers) put_transfer(*entry.second, true);
+    size_t conn_count = 0;
+    const ClientInfo empty;
+    context.clients.for_each([&](int fd) {
+        ClientInfo* info = context.clients.info_if_present(fd);
+        if (info != nullptr && info->chunk && !context.transfers.count(info->chunk->id)) put_transfer(*info->chunk, false);
+        bool has_pipe = info != nullptr && info->relay_pipe;
+        if (!ok || !(ok = writer.reserve_fds(has_pipe ? 3 : 1))) return;
+        writer.put(HANDOFF_CONN);
+        writer.put<int32_t>(fd);
+        writer.put(context.clients.kind(fd));
+        writer.put(context.clients.addr(fd));
+        writer.put(context.clients.user_id(fd));
+        // 协议状态：位 0 为已协商分帧，位 1 为还能协商
+        writer.put<uint8_t>(context.clients.framed(fd) | ((context.clients.flags(fd) & ClientTable::MAGIC_ALLOWED) ? 2 : 0));
+        const ClientInfo& cold = info != nullptr ? *info : empty;
+        writer.put_str(cold.read_buf);
+        writer.put_str(std::string_view(cold.write_buf).substr(cold.write_pos));
+        writer.put_str(cold.urgent_buf);
+        writer.put<uint8_t>(cold.mid_message);
+        writer.put<uint32_t>(cold.cuts.size() - cold.cut_done);
+        for (size_t i = cold.cut_done; i < cold.cuts.size(); ++i) writer.put(cold.cuts[i] - cold.out_written);
+        writer.put<int32_t>(cold.pair_fd);
+        writer.put(cold.pair_request);
+        writer.put<uint64_t>(cold.relay_pending);
+        writer.put<uint64_t>(cold.relay_capacity);
+        writer.put<uint8_t>(has_pipe);
+        writer.put(cold.upload_id);
+        writer.put(cold.upload_left);
+        writer.put<uint32_t>(cold.downloads.size());
+        for (uint64_t id : cold.downloads) writer.put(id);
+        writer.put<uint64_t>(cold.chunk ? cold.chunk->id : 0);
+        writer.put_str(cold.chunk_header);
+        writer.put(cold.chunk_offset);
+        writer.put(cold.chunk_left);
+        writer.put<uint8_t>(cold.stream_discard);
+        // 有序消息按距写缓冲区头部的字节数发送，由会话的键找回会话
+        writer.put<uint32_t>(cold.seq_marks.size() - cold.seq_done);
+        for (size_t i = cold.seq_done; i < cold.seq_marks.size(); ++i) {
+            const SeqMark& mark = cold.seq_marks[i];
+            writer.put_str(seq_key(mark.conv->sender, mark.conv->target));
+            writer.put(mark.end - cold.out_written);
+            writer.put(mark.seq);
+            writer.put(mark.session);
+        }
+        writer.add_fd(fd);
+        if (has_pipe) {
+            writer.add_fd(cold.relay_pipe->fds[0]);
+            writer.add_fd(cold.relay_pipe->fds[1]);
+        }
+        ++conn_count;
+    });
+    for (const auto& entry : context.remote_clients) {
+        writer.put(HANDOFF_REMOTE);
+        writer.put(entry.first);
+        writer.put<int32_t>(entry.second);
+    }
+    for (const auto& entry : context.topics.patterns()) {
+        for (const std::string& pattern : entry.second) {
+            writer.put(HANDOFF_SUB);
+            writer.put<int32_t>(entry.first);
+            writer.put_str(pattern);
+        }
+    }
+    writer.put(HANDOFF_END);
+    ok = ok && writer.flush();
+    pthread_mutex_unlock(&context.clients_mutex);
+
+    char ack = 0;
+    ok = ok && read(sock, &ack, 1) == 1 && ack == 'K';
+    close(sock);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (!ok) {
+        // 暂停期间可能有 socket 未读空，边沿触发不会再通知，重新注册一遍让 epoll 报告当前状态
+        std::cerr << "热升级交接失败，继续由本进程服务" << std::endl;
+        context.pausing = false;
+        pthread_mutex_lock(&context.clients_mutex);
+        context.clients.for_each([&](int fd) {
+            modify_fd_in_epoll(context.epoll_fd, fd, EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLET);
+        });
+        if (context.search.enabled()) {
+            try {
+                context.search.start();
+            } catch (const std::exception& e) {
+                std::cerr << "消息搜索无法恢复, 已关闭: " << e.what() << std::endl;
+                context.search.configure("");
             }
-            pthread_mutex_unlock(&context.clients_mutex);
-        } else if (n == 0) {
-            connection_closed = true;
-            break;
-        } else {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            //strerror(errno)根据errno 提供一个描述性字符串
-            std::cerr << "fd " << fd << " 读取错误: " << strerror(errno) << std::endl;
-            connection_closed = true;
-            break;
         }
+        pthread_mutex_unlock(&context.clients_mutex);
+        return false;
     }
+    std::cout << "热升级交接完成: " << conn_count << " 个连接, 用时 " << ms << " ms，旧进程退出" << std::endl;
+    return true;
+}
 
-    // 2. 循环处理读缓冲区中的完整消息
-    pthread_mutex_lock(&context.clients_mutex);
-    if (context.clients.count(fd)) {
-        std::string& read_buf = context.clients.at(fd).read_buf;
-        size_t pos;
-        // 只要能找到分隔符'\n'，就循环处理
-        while ((pos = read_buf.find('\n')) != std::string::npos) {
-            // a. 提取一条完整的消息
-            std::string message = read_buf.substr(0, pos);
-            // b. 从读缓冲区移除已提取的消息（包括'\n'）
-            read_buf.erase(0, pos + 1);
+/**
+ * @brief 新进程：从旧进程接管监听 socket 和全部连接，重建连接表并注册到 epoll。
+ * 在启动阶段调用（线程池尚未收到任何任务），失败时抛异常。
+ */
+void take_over_state(ServerContext& context, ThreadPool& pool, const std::string& path, int& listen_fd, int& node_listen_fd,
+                     int& unix_listen_fd) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) throw std::invalid_argument("升级 socket 路径过长: " + path);
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) throw std::system_error(errno, std::generic_category(), "socket(AF_UNIX)");
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(sock);
+        throw std::system_error(err, std::generic_category(), "connect " + path);
+    }
+    auto start = std::chrono::steady_clock::now();
 
-            // c. 兼容Telnet，它会发送\r\n，移除\r
-            if (!message.empty() && message.back() == '\r') {
-                message.pop_back();
+    HandoffReader reader(sock);
+    std::unordered_map<int, int> fd_map;  // 旧 fd -> 新 fd
+    std::vector<int> conns;
+    std::vector<std::pair<Addr48, int>> remotes;
+    std::vector<std::pair<int, std::string>> subs;  // (旧 fd, 模式)
+    std::unordered_map<uint64_t, std::shared_ptr<FileTransfer>> files;  // 含已取消、只剩数据块在途的传输
+    bool done = false;
+    while (!done) {
+        reader.next_batch();
+        while (!done && !reader.batch_done()) {
+            switch (reader.get<char>()) {
+            case HANDOFF_LISTEN: {
+                uint8_t role = reader.get<uint8_t>();
+                (role == 0 ? listen_fd : role == 1 ? node_listen_fd : unix_listen_fd) = reader.take_fd();
+                break;
             }
-
-            // 如果消息为空（例如只有一个回车），则忽略
-            if (message.empty()) {
-                continue;
+            case HANDOFF_USER: {
+                uint32_t id = context.users.intern(reader.get_str());
+                context.users.session[id] = reader.get<uint32_t>();
+                break;
             }
-
-            // d. 解析并处理这条完整的消息
-            std::string target_ip, msg_content;
-            int target_port;
-            if (!parse_message(message, target_ip, target_port, msg_content)) {
-                context.clients[fd].write_buf += "无效的消息格式. 请使用: IP:PORT:MESSAGE\n";
-                modify_fd_in_epoll(context.epoll_fd, fd, EPOLLIN | EPOLLOUT | EPOLLET);
-                continue;
+            case HANDOFF_SEQ: {
+                uint32_t sender = reader.get<uint32_t>();
+                std::string target = reader.get_str();
+                SeqConversation& conv = *new_seq_conversation(context, sender, target);
+                conv.session = reader.get<uint32_t>();
+                conv.started = reader.get<uint8_t>();
+                conv.accepted = reader.get<uint64_t>();
+                conv.delivered = reader.get<uint64_t>();
+                conv.nacked = reader.get<uint64_t>();
+                break;
             }
-            
-            int target_fd = -1;
-            for (const auto& pair : context.clients) {
-                if (pair.second.ip == target_ip && pair.second.port == target_port) {
-                    target_fd = pair.first;
-                    break;
+            case HANDOFF_FILE: {
+                auto t = std::make_shared<FileTransfer>();
+                t->id = reader.get<uint64_t>();
+                t->src_fd = reader.get<int32_t>();  // 暂存旧 fd，全部接收后再换算
+                t->dst_fd = reader.get<int32_t>();
+                t->size = reader.get<uint64_t>();
+                t->name = reader.get_str();
+                t->accepted = reader.get<uint8_t>();
+                t->spooled = reader.get<uint64_t>();
+                t->queued = reader.get<uint64_t>();
+                t->delivered = reader.get<uint64_t>();
+                t->upload_stalled = reader.get<uint8_t>();
+                bool live = reader.get<uint8_t>();
+                bool has_spool = reader.get<uint8_t>();
+                bool has_pipe = reader.get<uint8_t>();
+                if (has_spool) t->spool_fd = reader.take_fd();
+                if (has_pipe) {
+                    t->pipe[0] = reader.take_fd();
+                    t->pipe[1] = reader.take_fd();
+                    int capacity = fcntl(t->pipe[1], F_GETPIPE_SZ);
+                    t->pipe_capacity = capacity > 0 ? capacity : 65536;
                 }
+                context.next_transfer_id = std::max(context.next_transfer_id, t->id + 1);
+                if (live) context.transfers[t->id] = t;
+                files[t->id] = t;
+                break;
             }
-            
-            if (target_fd != -1 && context.clients.count(target_fd)) {
-                context.clients[target_fd].write_buf += msg_content;
-                modify_fd_in_epoll(context.epoll_fd, target_fd, EPOLLIN | EPOLLOUT | EPOLLET);
-            } else {
-                context.clients[fd].write_buf += "目标客户端未找到\n";
-                modify_fd_in_epoll(context.epoll_fd, fd, EPOLLIN | EPOLLOUT | EPOLLET);
+            case HANDOFF_CONN: {
+                int old_fd = reader.get<int32_t>();
+                ConnKind kind = reader.get<ConnKind>();
+                Addr48 conn_addr = reader.get<Addr48>();
+                uint32_t user_id = reader.get<uint32_t>();
+                uint8_t protocol = reader.get<uint8_t>();
+                ClientInfo cold;
+                cold.read_buf = reader.get_str<Buffer>();
+                cold.write_buf = reader.get_str<Buffer>();
+                cold.urgent_buf = reader.get_str<Buffer>();
+                cold.mid_message = reader.get<uint8_t>();
+                for (uint32_t n = reader.get<uint32_t>(); n > 0; --n) cold.cuts.push_back(reader.get<uint64_t>());
+                cold.pair_fd = reader.get<int32_t>();  // 暂存旧 fd，全部接收后再换算
+                cold.pair_request = reader.get<Addr48>();
+                cold.relay_pending = reader.get<uint64_t>();
+                cold.relay_capacity = reader.get<uint64_t>();
+                bool has_pipe = reader.get<uint8_t>();
+                cold.upload_id = reader.get<uint64_t>();
+                cold.upload_left = reader.get<uint64_t>();
+                for (uint32_t n = reader.get<uint32_t>(); n > 0; --n) cold.downloads.push_back(reader.get<uint64_t>());
+                uint64_t chunk_id = reader.get<uint64_t>();
+                if (chunk_id != 0) cold.chunk = files.at(chunk_id);
+                cold.chunk_header = reader.get_str();
+                cold.chunk_offset = reader.get<uint64_t>();
+                cold.chunk_left = reader.get<uint64_t>();
+                cold.stream_discard = reader.get<uint8_t>();
+                for (uint32_t n = reader.get<uint32_t>(); n > 0; --n) {
+                    SeqMark mark;
+                    mark.conv = &context.conversations.at(reader.get_str());
+                    ++mark.conv->marks;
+                    mark.end = reader.get<uint64_t>();
+                    mark.seq = reader.get<uint64_t>();
+                    mark.session = reader.get<uint32_t>();
+                    cold.seq_marks.push_back(mark);
+                }
+                int fd = reader.take_fd();
+                if (has_pipe) {
+                    cold.relay_pipe = std::make_shared<RelayPipe>();
+                    cold.relay_pipe->fds[0] = reader.take_fd();
+                    cold.relay_pipe->fds[1] = reader.take_fd();
+                }
+                pthread_mutex_lock(&context.clients_mutex);
+                context.clients.insert(fd, conn_addr, kind);
+                context.clients.flags(fd) = (protocol & 1 ? ClientTable::FRAMED : 0) | (protocol & 2 ? ClientTable::MAGIC_ALLOWED : 0);
+                sockaddr_storage local_addr{};
+                socklen_t local_len = sizeof(local_addr);
+                if (getsockname(fd, (sockaddr*)&local_addr, &local_len) == 0 && local_addr.ss_family == AF_UNIX) {
+                    context.clients.flags(fd) |= ClientTable::LOCAL;
+                }
+                if (kind == ConnKind::NodeLink) context.node_links.push_back(fd);
+                if (user_id != 0) {
+                    context.clients.set_user_id(fd, user_id);
+                    context.users.online_fd[user_id] = fd;
+                }
+                if (kind == ConnKind::Client) {
+                    context.directory.set(conn_addr, user_id, context.users.names[user_id], false);
+                    capture.connect(conn_addr);
+                }
+                if (!cold.read_buf.empty() || cold.has_output() || cold.pair_fd != -1 || cold.pair_request != 0 ||
+                    cold.upload_left != 0 || !cold.downloads.empty() || cold.chunk || cold.stream_discard) {
+                    context.clients.info(fd) = std::move(cold);
+                }
+                pthread_mutex_unlock(&context.clients_mutex);
+                fd_map[old_fd] = fd;
+                conns.push_back(fd);
+                break;
+            }
+            case HANDOFF_REMOTE: {
+                Addr48 remote_addr = reader.get<Addr48>();
+                remotes.emplace_back(remote_addr, reader.get<int32_t>());
+                break;
+            }
+            case HANDOFF_SUB: {
+                int old_fd = reader.get<int32_t>();
+                subs.emplace_back(old_fd, reader.get_str());
+                break;
+            }
+            case HANDOFF_END:
+                done = true;
+                break;
+            default:
+                throw std::runtime_error("热升级: 未知的状态记录");
+            }
+        }
+    }
+
+    pthread_mutex_lock(&context.clients_mutex);
+    for (int fd : conns) {
+        ClientInfo* info = context.clients.info_if_present(fd);
+        if (info != nullptr && info->pair_fd != -1) info->pair_fd = fd_map.at(info->pair_fd);
+    }
+    for (const auto& remote : remotes) {
+        context.remote_clients[remote.first] = fd_map.at(remote.second);
+        context.directory.set(remote.first, 0, std::string(), true);
+    }
+    for (const auto& sub : subs) context.topics.subscribe(fd_map.at(sub.first), sub.second);
+    // 已取消的传输可能引用早已断开的连接
+    for (auto& entry : files) {
+        for (int* end : {&entry.second->src_fd, &entry.second->dst_fd}) {
+            auto it = fd_map.find(*end);
+            *end = it != fd_map.end() ? it->second : -1;
+        }
+    }
+    // 有待写数据，或对端的中转管道里有数据要送来的连接，需要同时关注可写事件；
+    // 读缓冲区里还有旧进程没处理完的消息时，socket 未必还有新数据触发读事件，直接安排一次读任务
+    std::vector<int> pending_reads;
+    for (int fd : conns) {
+        uint32_t events = conn_events(context);
+        ClientInfo* info = context.clients.info_if_present(fd);
+        if (info != nullptr) {
+            ClientInfo* peer = context.clients.info_if_present(info->pair_fd);
+            if (info->has_output() || (peer != nullptr && peer->relay_pending > 0) || info->chunk ||
+                !info->downloads.empty()) {
+                events |= EPOLLOUT;
             }
+            if (!info->read_buf.empty()) pending_reads.push_back(fd);
         }
+        add_fd_to_epoll(context.epoll_fd, fd, events);
     }
     pthread_mutex_unlock(&context.clients_mutex);
+    if (listen_fd == -1) throw std::runtime_error("热升级: 没有收到客户端监听 socket");
+    add_fd_to_epoll(context.epoll_fd, listen_fd, EPOLLIN | EPOLLET);
+    if (node_listen_fd != -1) add_fd_to_epoll(context.epoll_fd, node_listen_fd, EPOLLIN | EPOLLET);
+    if (unix_listen_fd != -1) add_fd_to_epoll(context.epoll_fd, unix_listen_fd, EPOLLIN | EPOLLET);
 
-    // 3. 如果连接已关闭，则清理客户端资源
-    if (connection_closed) {
-        disconnect_client(context, fd);
+    if (write(sock, "K", 1) != 1) {
+        int err = errno;
+        close(sock);
+        throw std::system_error(err, std::generic_category(), "热升级确认");
     }
+    close(sock);
+    if (context.scheduler != nullptr) {
+        // 协程模式：读协程启动时先处理读缓冲区中的剩余消息
+        for (int fd : conns) start_sessions(context, fd);
+    } else {
+        for (int fd : pending_reads) pool.add_task(std::make_unique<ReadTask>(context, fd));
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "热升级接管完成: " << conns.size() << " 个连接, 用时 " << ms << " ms" << std::endl;
 }
 
-void handle_write_event(ServerContext& context, int fd) {
-    std::string write_buf_copy;
-    pthread_mutex_lock(&context.clients_mutex);
-    if (context.clients.find(fd) == context.clients.end()) {
-        pthread_mutex_unlock(&context.clients_mutex);
-        return;
+/**
+ * @brief 对比 N 个空闲连接在新旧连接表中的堆内存占用（mallinfo2 统计的已分配字节差值）。
+ * 旧表即改造前的 unordered_map<int, ClientInfo>，每个连接带 IP 字符串和两个空缓冲区。
+ */
+void report_idle_memory() {
+    struct LegacyClientInfo {
+        std::string ip;
+        int port;
+        std::string read_buf;
+        std::string write_buf;
+    };
+    for (size_t n : {100000, 1000000}) {
+        size_t before = heap_in_use();
+        size_t table_bytes;
+        {
+            ClientTable table;
+            for (size_t fd = 0; fd < n; ++fd) {
+                table.insert(fd, make_addr48(0x0A000000 | (fd >> 16), fd & 0xffff), ConnKind::Client);
+            }
+            table_bytes = heap_in_use() - before;
+            std::cout << n << " 个空闲连接, 新连接表: " << (double)table_bytes / n << " 字节/连接 (自身统计 "
+                      << (double)table.memory_usage() / n << ")" << std::endl;
+        }
+        before = heap_in_use();
+        {
+            std::unordered_map<int, LegacyClientInfo> legacy;
+            for (size_t fd = 0; fd < n; ++fd) {
+                LegacyClientInfo info;
+                info.ip = format_addr48(make_addr48(0x0A000000 | (fd >> 16), 0));
+                info.ip.resize(info.ip.find(':'));
+                info.port = fd & 0xffff;
+                legacy[fd] = std::move(info);
+            }
+            size_t legacy_bytes = heap_in_use() - before;
+            std::cout << n << " 个空闲连接, 旧 unordered_map: " << (double)legacy_bytes / n << " 字节/连接, 是新表的 "
+                      << (double)legacy_bytes / table_bytes << " 倍" << std::endl;
+        }
     }
-    write_buf_copy = context.clients.at(fd).write_buf;
-    pthread_mutex_unlock(&context.clients_mutex);
-    if (write_buf_copy.empty()) return;
-    while (!write_buf_copy.empty()) {
-        int n = write(fd, write_buf_copy.c_str(), write_buf_copy.length());
-        if (n > 0) {
-            write_buf_copy.erase(0, n);
+}
+
+/**
+ * @brief 解析启动参数：
+ *   --memory-report         打印 10 万 / 100 万空闲连接的内存占用后退出
+ *   --port=PORT             客户端监听端口，默认 8888
+ *   --node-port=PORT        集群链路监听端口，不设置则以单机模式运行
+ *   --peers=IP:PORT,...     其它节点的集群链路地址
+ *   --upgrade-socket=PATH   在该 Unix socket 上等待热升级请求
+ *   --unix-socket=PATH      同时在该 Unix socket 上接受客户端连接，见 unix_peer_addr()
+ *   --takeover              启动时经 --upgrade-socket 从正在运行的旧进程接管全部连接
+ *   --coroutines            连接由主线程上的协程驱动，不使用线程池
+ *   --switch-bench          对比任务模型与协程模型的切换开销后退出
+ *   --spool-dir=DIR         文件传输的暂存目录，默认 /tmp
+ *   --read-quantum=BYTES    公平调度：每个连接每轮最多读入/处理的字节数，默认 65536，0 表示不限
+ *   --message-quantum=N     公平调度：每个连接每轮最多处理的消息数，默认 64，0 表示不限
+ *   --trace-sample=N        每 N 条消息追踪一条，用 TRACE 命令导出为 Chrome trace JSON，默认 0 表示关闭
+ *   --trace-file=PATH       追踪记录的导出文件，默认 /tmp/tcpchat-trace.json
+ *   --capture-file=PATH     把连接上下线和消息投递录进该文件，用 bench replay 重放，见 Capture
+ *   --idle-release-ms=MS    连接安静 MS 到 2*MS 毫秒后释放其缓冲区和冷数据，默认 1000，0 表示不释放
+ *   --alloc-bench           对比内存池与默认堆在连接创建/销毁、缓冲区增长下的开销后退出
+ *   --directory-bench       16 个读线程在连接抖动下查询在线目录快照 / 加锁哈希索引的吞吐对比后退出
+ *   --no-priority           关闭优先通道，所有消息按到达顺序写出
+ *   --notsent-lowat=BYTES   新连接的 TCP_NOTSENT_LOWAT，默认 131072，0 表示使用内核默认
+ *   --low-latency           低延迟模式：事件在主线程上直接处理，见“低延迟模式”一节
+ *   --spin-us=US            低延迟模式下 epoll_wait 阻塞前先轮询的微秒数，默认 100，0 表示不自旋
+ *   --busy-poll-us=US       低延迟模式下的 SO_BUSY_POLL 和 epoll 忙轮询时长，默认 50，0 表示不设置
+ *   --listen-backlog=N      监听 socket 的全连接队列长度，默认 4096
+ *   --event-batch=N         每次 epoll_wait 最多取回的事件数，默认 128
+ *   --workers=N             线程池固定为 N 个线程（等同于 --min-workers=N --max-workers=N）
+ *   --min-workers=N         弹性线程池的最少线程数，默认 4
+ *   --max-workers=N         弹性线程池的最多线程数，默认 max(16, 2 * CPU 数)
+ *   --pool-wait-us=US       任务平均排队超过 US 微秒且线程忙时扩容，默认 500，见 ThreadPool
+ *   --pool-bench            阶跃负载下对比固定线程池与弹性线程池的排队时间和线程数变化后退出
+ *   --pipeline              分级流水线模式：I/O 线程、路由线程和写线程之间用 SPSC 环形队列传递批次，见 Pipeline
+ *   --pipeline-io=N         流水线模式的 I/O 线程数，默认 2
+ *   --pipeline-writers=N    流水线模式的写线程数，默认 2
+ *   --search-dir=DIR        开启消息搜索，索引段文件存放在 DIR，见 SearchIndex
+ *   --search-bench=N        向 --search-dir（默认 /tmp/tcpchat-search-bench）灌入 N 条合成消息，测量查询延迟后退出
+ */
+void parse_args(int argc, char* argv[], ServerConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--memory-report") {
+            config.memory_report = true;
+        } else if (key == "--port") {
+            config.port = std::stoi(value);
+        } else if (key == "--node-port") {
+            config.node_port = std::stoi(value);
+        } else if (key == "--upgrade-socket") {
+            config.upgrade_socket = value;
+        } else if (key == "--unix-socket") {
+            config.unix_socket = value;
+        } else if (key == "--takeover") {
+            config.takeover = true;
+        } else if (key == "--coroutines") {
+            config.coroutines = true;
+        } else if (key == "--switch-bench") {
+            config.switch_bench = true;
+        } else if (key == "--spool-dir") {
+            config.spool_dir = value;
+        } else if (key == "--read-quantum") {
+            config.read_quantum = std::stoul(value);
+        } else if (key == "--message-quantum") {
+            config.message_quantum = std::stoul(value);
+        } else if (key == "--trace-sample") {
+            config.trace_sample = std::stoul(value);
+        } else if (key == "--trace-file") {
+            config.trace_file = value;
+        } else if (key == "--capture-file") {
+            config.capture_file = value;
+        } else if (key == "--idle-release-ms") {
+            config.idle_release_ms = std::stoi(value);
+        } else if (key == "--alloc-bench") {
+            config.alloc_bench = true;
+        } else if (key == "--directory-bench") {
+            config.directory_bench = true;
+        } else if (key == "--no-priority") {
+            config.priority_lanes = false;
+        } else if (key == "--notsent-lowat") {
+            config.notsent_lowat = std::stoi(value);
+        } else if (key == "--low-latency") {
+            config.low_latency = true;
+        } else if (key == "--spin-us") {
+            config.spin_us = std::stoi(value);
+        } else if (key == "--busy-poll-us") {
+            config.busy_poll_us = std::stoi(value);
+        } else if (key == "--listen-backlog") {
+            config.listen_backlog = std::stoi(value);
+        } else if (key == "--event-batch") {
+            config.event_batch = std::stoi(value);
+        } else if (key == "--workers") {
+            config.min_workers = config.max_workers = std::stoul(value);
+        } else if (key == "--min-workers") {
+            config.min_workers = std::stoul(value);
+        } else if (key == "--max-workers") {
+            config.max_workers = std::stoul(value);
+        } else if (key == "--pool-wait-us") {
+            config.pool_wait_us = std::stoul(value);
+        } else if (key == "--pool-bench") {
+            config.pool_bench = true;
+        } else if (key == "--pipeline") {
+            config.pipeline = true;
+        } else if (key == "--pipeline-io") {
+            config.pipeline_io = std::stoi(value);
+        } else if (key == "--pipeline-writers") {
+            config.pipeline_writers = std::stoi(value);
+        } else if (key == "--search-dir") {
+            config.search_dir = value;
+        } else if (key == "--search-bench") {
+            config.search_bench = std::stoull(value);
+        } else if (key == "--peers") {
+            size_t start = 0;
+            while (start < value.size()) {
+                size_t comma = value.find(',', start);
+                if (comma == std::string::npos) comma = value.size();
+                if (comma > start) config.peers.push_back(value.substr(start, comma - start));
+                start = comma + 1;
+            }
         } else {
-            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
-            std::cerr << "fd " << fd << " 写入错误: " << strerror(errno) << std::endl;
-            disconnect_client(context, fd);
-            return;
+            throw std::invalid_argument("未知参数: " + arg);
         }
     }
-    pthread_mutex_lock(&context.clients_mutex);
-    if (context.clients.count(fd)) {
-        auto& original_buf = context.clients.at(fd).write_buf;
-        original_buf.erase(0, original_buf.length() - write_buf_copy.length());
-        if (original_buf.empty()) {
-            modify_fd_in_epoll(context.epoll_fd, fd, EPOLLIN | EPOLLET);
-        }
+}
+
+// 把打开文件数的软上限提到硬上限，返回提升后的软上限
+rlim_t raise_fd_limit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) return 0;
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) getrlimit(RLIMIT_NOFILE, &limit);
     }
-    pthread_mutex_unlock(&context.clients_mutex);
+    return limit.rlim_cur;
+}
+
+// 创建非阻塞监听 socket
+int create_listen_socket(int port, int backlog) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    /*std::system_error( int ec, const std::error_category& cat, const std::string& what_arg )
+     	参数一：错误码，
+    	参数2：std::generic_category() 就是一本“errno 整数翻译成人类可读字符串”的字典
+    	参数3：由程序员提供的自定义上下文信息*/
+    if (listen_fd < 0) throw std::system_error(errno, std::generic_category(), "socket");
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    sockaddr_in serv_addr{};
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        int err = errno;
+        close(listen_fd);
+        throw std::system_error(err, std::generic_category(), "bind");
+    }
+    if (listen(listen_fd, backlog) < 0) {
+        int err = errno;
+        close(listen_fd);
+        throw std::system_error(err, std::generic_category(), "listen");
+    }
+    set_non_blocking(listen_fd);
+    return listen_fd;
+}
+
+// 创建同机客户端使用的非阻塞 Unix socket 监听 socket，残留的旧路径直接替换
+int create_unix_listen_socket(const std::string& path, int backlog) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) throw std::invalid_argument("Unix socket 路径过长: " + path);
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) throw std::system_error(errno, std::generic_category(), "socket(AF_UNIX)");
+    unlink(path.c_str());
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, backlog) < 0) {
+        int err = errno;
+        close(listen_fd);
+        throw std::system_error(err, std::generic_category(), "bind/listen " + path);
+    }
+    set_non_blocking(listen_fd);
+    return listen_fd;
 }
 
 // --- 程序入口 main 函数 ---
@@ -352,37 +8232,147 @@ void handle_write_event(ServerContext& context, int fd) {
 描述：这类错误发生在服务器运行过程中，通常与客户端的I/O操作有关。例如，客户端突然断开连接、读/写时内核缓冲区暂时已满 (EAGAIN/EWOULDBLOCK)。这些是高并发服务器的正常现象，不应该导致整个服务器崩溃。
 处理方式：检查函数返回值和 errno，并采取相应措施（例如，忽略 EAGAIN、关闭断开的连接、打印错误日志等），但不抛出异常。
 */
-int main() {
+int main(int argc, char* argv[]) {
     int listen_fd = -1;
+    int node_listen_fd = -1;
+    int unix_listen_fd = -1;
+    int upgrade_fd = -1;
+    int sweep_fd = -1;
+    int stream_timer_fd = -1;
+    int search_fd = -1;  // 属于 context.search，不单独关闭
     ServerContext context;
     context.epoll_fd = -1;
     pthread_mutex_init(&context.clients_mutex, nullptr);
+    // 对端已关闭时 write/sendfile 返回 EPIPE 按写错误处理，而不是让整个进程被 SIGPIPE 终止
+    signal(SIGPIPE, SIG_IGN);
 
     try {
-        ThreadPool pool(4);
-        const int port = 8888;
-        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-        /*std::system_error( int ec, const std::error_category& cat, const std::string& what_arg )
-         	参数一：错误码，
-        	参数2：std::generic_category() 就是一本“errno 整数翻译成人类可读字符串”的字典
-        	参数3：由程序员提供的自定义上下文信息*/
-        if (listen_fd < 0) throw std::system_error(errno, std::generic_category(), "socket");
-        int opt = 1;
-        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        sockaddr_in serv_addr{};
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        serv_addr.sin_port = htons(port);
-        if (bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) throw std::system_error(errno, std::generic_category(), "bind");
-        if (listen(listen_fd, 128) < 0) throw std::system_error(errno, std::generic_category(), "listen");
-        set_non_blocking(listen_fd);
+        ServerConfig config;
+        parse_args(argc, argv, config);
+        if (config.memory_report) {
+            report_idle_memory();
+            return 0;
+        }
+        if (config.switch_bench) {
+            run_switch_bench();
+            return 0;
+        }
+        if (config.alloc_bench) {
+            run_alloc_bench();
+            return 0;
+        }
+        if (config.directory_bench) {
+            run_directory_bench();
+            return 0;
+        }
+        if (config.pool_bench) {
+            run_pool_bench();
+            return 0;
+        }
+        if (config.search_bench != 0) {
+            run_search_bench(config.search_dir.empty() ? "/tmp/tcpchat-search-bench" : config.search_dir, config.search_bench);
+            return 0;
+        }
+        if (config.takeover && config.upgrade_socket.empty()) {
+            throw std::invalid_argument("--takeover 需要同时指定 --upgrade-socket");
+        }
+        std::cout << "文件描述符上限: " << raise_fd_limit() << std::endl;
+        context.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        context.directory.start();
+        size_t max_workers = config.max_workers != 0 ? config.max_workers
+                                                     : std::max<size_t>(16, 2 * sysconf(_SC_NPROCESSORS_ONLN));
+        ThreadPool pool(config.min_workers, std::max(config.min_workers, max_workers), config.pool_wait_us);
+        ThreadPool::Stats pool_stats = pool.stats();
+        std::cout << "线程池: " << pool_stats.min_threads << "-" << pool_stats.max_threads << " 个线程" << std::endl;
         context.epoll_fd = epoll_create1(0);
         if (context.epoll_fd == -1) throw std::system_error(errno, std::generic_category(), "epoll_create1");
-        add_fd_to_epoll(context.epoll_fd, listen_fd, EPOLLIN | EPOLLET);
-        std::cout << "服务器已启动，端口号: " << port << std::endl;
-        std::vector<epoll_event> events(128);
-        while (true) {
-            int n_fds = epoll_wait(context.epoll_fd, events.data(), 128, -1);
+        context.spool_dir = config.spool_dir;
+        context.pool = &pool;
+        context.read_quantum = config.read_quantum != 0 ? config.read_quantum : SIZE_MAX;
+        context.message_quantum = config.message_quantum != 0 ? config.message_quantum : SIZE_MAX;
+        context.priority_lanes = config.priority_lanes;
+        context.notsent_lowat = config.notsent_lowat;
+        if (config.low_latency) {
+            if (config.coroutines) throw std::invalid_argument("--low-latency 与 --coroutines 不能同时使用");
+            context.low_latency = true;
+            context.busy_poll_us = config.busy_poll_us;
+            if (config.busy_poll_us > 0) enable_epoll_busy_poll(context.epoll_fd, config.busy_poll_us);
+            std::cout << "低延迟模式：事件在主线程上处理，阻塞前自旋 " << config.spin_us << " 微秒" << std::endl;
+        }
+        tracer.configure(config.trace_sample, config.trace_file);
+        if (tracer.enabled()) std::cout << "消息追踪：每 " << config.trace_sample << " 条消息采样一条" << std::endl;
+        if (!config.capture_file.empty()) {
+            capture.start(config.capture_file);
+            std::cout << "流量录制: " << config.capture_file << std::endl;
+        }
+        std::unique_ptr<Pipeline> pipeline;
+        if (config.pipeline) {
+            if (config.coroutines || config.low_latency || config.takeover || config.node_port != 0 ||
+                !config.upgrade_socket.empty() || !config.unix_socket.empty() || !config.capture_file.empty() ||
+                !config.search_dir.empty()) {
+                throw std::invalid_argument(
+                    "--pipeline 不能与 --coroutines、--low-latency、集群、热升级、--unix-socket、--capture-file、--search-dir 同时使用");
+            }
+            pipeline = std::make_unique<Pipeline>(context, config.pipeline_io, config.pipeline_writers);
+            pipeline->start();
+            std::cout << "流水线模式: " << std::max(1, config.pipeline_io) << " 个 I/O 线程, 1 个路由线程, "
+                      << std::max(1, config.pipeline_writers) << " 个写线程" << std::endl;
+        }
+        CoScheduler scheduler;
+        if (config.coroutines) {
+            context.scheduler = &scheduler;
+            std::cout << "协程模式：连接由主线程上的协程驱动" << std::endl;
+        }
+        // 先开始排队，接管连接时就投递的消息也进索引；旧进程交接前才写出最后一段，所以接管之后才加载目录
+        context.search.configure(config.search_dir);
+        if (config.takeover) {
+            // 监听 socket、集群链路都来自旧进程，端口和节点参数不再生效
+            take_over_state(context, pool, config.upgrade_socket, listen_fd, node_listen_fd, unix_listen_fd);
+        } else {
+            listen_fd = create_listen_socket(config.port, config.listen_backlog);
+            add_fd_to_epoll(context.epoll_fd, listen_fd, EPOLLIN | EPOLLET);
+            std::cout << "服务器已启动，端口号: " << config.port << std::endl;
+            if (config.node_port != 0) {
+                node_listen_fd = create_listen_socket(config.node_port, config.listen_backlog);
+                add_fd_to_epoll(context.epoll_fd, node_listen_fd, EPOLLIN | EPOLLET);
+                std::cout << "集群模式，节点链路端口: " << config.node_port << std::endl;
+                connect_to_peers(context, config);
+            }
+            if (!config.unix_socket.empty()) {
+                unix_listen_fd = create_unix_listen_socket(config.unix_socket, config.listen_backlog);
+                add_fd_to_epoll(context.epoll_fd, unix_listen_fd, EPOLLIN | EPOLLET);
+                std::cout << "同机客户端 Unix socket: " << config.unix_socket << std::endl;
+            }
+        }
+        if (context.search.enabled()) {
+            context.search.start();
+            search_fd = context.search.notify_fd();
+            add_fd_to_epoll(context.epoll_fd, search_fd, EPOLLIN | EPOLLET);
+            SearchIndex::Stats stats = context.search.stats();
+            std::cout << "消息搜索: 索引目录 " << config.search_dir << ", 已有 " << stats.docs << " 条消息, " << stats.segments
+                      << " 个段" << std::endl;
+        }
+        if (!config.upgrade_socket.empty()) {
+            upgrade_fd = create_upgrade_socket(config.upgrade_socket);
+            add_fd_to_epoll(context.epoll_fd, upgrade_fd, EPOLLIN | EPOLLET);
+            std::cout << "热升级 socket: " << config.upgrade_socket << std::endl;
+        }
+        if (config.idle_release_ms > 0) {
+            sweep_fd = create_sweep_timer(config.idle_release_ms);
+            add_fd_to_epoll(context.epoll_fd, sweep_fd, EPOLLIN | EPOLLET);
+        }
+        if (pipeline == nullptr) {
+            stream_timer_fd = create_sweep_timer(1000);
+            add_fd_to_epoll(context.epoll_fd, stream_timer_fd, EPOLLIN | EPOLLET);
+        }
+        std::vector<epoll_event> events(std::max(1, config.event_batch));
+        bool upgraded = false;
+        int spin_us = context.low_latency ? config.spin_us : 0;
+        while (!upgraded) {
+            int timeout = context.scheduler != nullptr ? context.scheduler->next_timeout_ms() : -1;
+            if (!context.resume_queue.empty()) timeout = 0;
+            int n_fds = wait_events(context.epoll_fd, events.data(), events.size(), timeout, spin_us);
+            tracer.mark_poll();
             if (n_fds < 0) {
                 if (errno == EINTR) continue;
                 std::cerr << "epoll_wait 失败: " << strerror(errno) << std::endl;
@@ -390,10 +8380,34 @@ int main() {
             }
             for (int i = 0; i < n_fds; ++i) {
                 int fd = events[i].data.fd;
-                if (fd == listen_fd) {
-                    handle_new_connection(listen_fd, context);
+                if (fd == listen_fd && pipeline != nullptr) {
+                    pipeline->accept_connections(listen_fd);
+                } else if (fd == listen_fd || fd == unix_listen_fd) {
+                    handle_new_connection(fd, context, ConnKind::Client);
+                } else if (fd == node_listen_fd) {
+                    handle_new_connection(node_listen_fd, context, ConnKind::NodeLink);
+                } else if (fd == sweep_fd) {
+                    sweep_idle_connections(context, sweep_fd);
+                } else if (fd == stream_timer_fd) {
+                    expire_streams(context, stream_timer_fd);
+                } else if (fd == search_fd) {
+                    pthread_mutex_lock(&context.clients_mutex);
+                    deliver_search_results(context);
+                    pthread_mutex_unlock(&context.clients_mutex);
+                } else if (fd == upgrade_fd) {
+                    if (hand_off_state(context, pool, upgrade_fd, listen_fd, node_listen_fd, unix_listen_fd)) {
+                        upgraded = true;
+                        break;
+                    }
+                } else if (context.scheduler != nullptr) {
+                    context.scheduler->on_event(fd, events[i].events);
+                } else if (context.low_latency) {
+                    // 与线程池模式的任务相同，只是直接在主线程上执行
+                    if (events[i].events & (EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP)) ReadTask(context, fd).execute();
+                    if (events[i].events & EPOLLOUT) WriteTask(context, fd).execute();
                 } else {
-                    if (events[i].events & EPOLLIN) {
+                    // 出错/挂断（如节点链路连接被拒绝）交给读任务，由 read 的返回值完成清理；带外字节同样由读任务处理
+                    if (events[i].events & (EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP)) {
                         pool.add_task(std::make_unique<ReadTask>(context, fd));
                     }
                     if (events[i].events & EPOLLOUT) {
@@ -401,6 +8415,17 @@ int main() {
                     }
                 }
             }
+            // 协程模式：本轮事件中产生的唤醒（如向其它连接排队的消息）在这里统一恢复
+            if (context.scheduler != nullptr && !upgraded) {
+                context.scheduler->run_timers();
+                context.scheduler->run_ready();
+            }
+            // 低延迟模式：上一轮额度用完的连接各继续一轮，本轮新排进来的留到下一轮
+            for (size_t n = context.resume_queue.size(); n > 0 && !upgraded; --n) {
+                int fd = context.resume_queue.front();
+                context.resume_queue.pop_front();
+                ReadTask(context, fd, true).execute();
+            }
         }
         /*what()
         virtual const char* what() const noexcept
@@ -426,7 +8451,16 @@ int main() {
         std::cerr << "主函数中未捕获的异常: " << e.what() << std::endl;
     }
     if (listen_fd != -1) close(listen_fd);
+    if (node_listen_fd != -1) close(node_listen_fd);
+    if (unix_listen_fd != -1) close(unix_listen_fd);
+    // 不 unlink 升级 socket 和客户端 Unix socket 的路径：交接后它已属于新进程
+    if (upgrade_fd != -1) close(upgrade_fd);
+    if (sweep_fd != -1) close(sweep_fd);
+    if (stream_timer_fd != -1) close(stream_timer_fd);
     if (context.epoll_fd != -1) close(context.epoll_fd);
+    if (context.spare_fd != -1) close(context.spare_fd);
+    context.search.stop();
+    capture.stop();
     pthread_mutex_destroy(&context.clients_mutex);
     return 0;
 }